@@ -1,7 +1,52 @@
 #include <iostream>         // cout, cerr
 #include <cstdlib>          // EXIT_FAILURE
+#include <cstdio>           // sscanf
+#include <cstring>          // strcmp
+#include <cmath>            // ceil
+#include <vector>           // frame time samples
+#include <algorithm>        // sort
+#include <chrono>           // steady_clock
+#include <string>           // submesh names, OBJ parsing
+#include <fstream>          // mesh file writing, OBJ reading
+#include <sstream>          // OBJ line parsing
+#include <unordered_map>    // OBJ vertex deduplication
+#include <cstdint>          // fixed width mesh file fields
+#include <cstddef>          // offsetof
+#include <thread>           // texture loader workers
+#include <mutex>
+#include <condition_variable>   // worker pool
+#include <atomic>
+#include <functional>       // image kernel benchmark
+#include <limits>           // numeric_limits
+#include <cstdarg>          // log message formatting
+#include <cassert>          // stream region reservations
+#include <random>           // point light placement
 #include <GL/glew.h>        // GLEW library
 #include <GLFW/glfw3.h>     // GLFW library
+#ifdef __linux__
+#include <EGL/egl.h>        // Surfaceless context for headless rendering
+#include <EGL/eglext.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>      // SSE2 / SSSE3 / AVX2 image kernels and frustum tests
+#define USE_SSE2
+#endif
+#if defined(USE_SSE2) && (defined(__GNUC__) || defined(__clang__))
+#define USE_AVX2_KERNELS    // Software raster kernels built for AVX2 whatever the compiler flags, picked at run time
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+#elif defined(__AVX2__)
+#define USE_AVX2_KERNELS
+#define AVX2_TARGET
+#endif
+#ifdef _WIN32
+#include <windows.h>        // CreateFileMapping / MapViewOfFile
+#include <direct.h>         // _mkdir
+#else
+#include <fcntl.h>          // open
+#include <sys/mman.h>       // mmap
+#include <sys/stat.h>       // fstat, mkdir
+#include <unistd.h>         // close, getpid
+#endif
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>      // Image loading Utility functions
 
@@ -19,6 +64,39 @@ using namespace std; // Standard namespace
 #define GLSL(Version, Source) "#version " #Version " core \n" #Source
 #endif
 
+/* Log statements below LOG_LEVEL are compiled out, arguments and all (build with -DLOG_LEVEL=0 for debug messages).
+ * Enabled statements only format into a per-thread ring; a background thread does the writing.
+ */
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR 3
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define ULOG_DEBUG(...) ULogWrite(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define ULOG_DEBUG(...) ((void)0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define ULOG_INFO(...) ULogWrite(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define ULOG_INFO(...) ((void)0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_WARNING
+#define ULOG_WARNING(...) ULogWrite(LOG_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define ULOG_WARNING(...) ((void)0)
+#endif
+#define ULOG_ERROR(...) ULogWrite(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+/*Shader source without a #version line, for shaders whose header is picked at startup*/
+#ifndef GLSL_BODY
+#define GLSL_BODY(Source) #Source
+#endif
+
 // Unnamed namespace
 namespace
 {
@@ -28,6 +106,33 @@ namespace
     const int WINDOW_WIDTH = 800;
     const int WINDOW_HEIGHT = 600;
 
+    // Current render target size (window framebuffer, or the offscreen FBO when headless)
+    int gWindowWidth = WINDOW_WIDTH;
+    int gWindowHeight = WINDOW_HEIGHT;
+
+    // Range of indices belonging to one scene object inside a mesh
+    struct GLSubmesh
+    {
+        string name;
+        GLuint firstIndex;
+        GLuint indexCount;
+        glm::vec3 boundsMin;    // Object space bounding box, filled in by UComputeSubmeshBounds
+        glm::vec3 boundsMax;
+        GLuint lodCount = 1;    // Levels of detail, stored as this and the following submeshes (0 on those)
+        GLuint material;        // MaterialIndex of all its vertices, or MATERIAL_FROM_VERTEX when they differ (UComputeSubmeshBounds)
+        GLuint lightmapWidth = 0;   // Lightmap rectangle in texels, set on level 0 by UGenerateLightmapUvs (0: no lightmap)
+        GLuint lightmapHeight = 0;
+        uint64_t lightmapHash = 0;  // Of the surface and UVs the lightmap is baked from
+    };
+
+    // Vertex stream layouts a mesh can be uploaded in (--vertex-format)
+    enum VertexFormat
+    {
+        VERTEX_FORMAT_FLOAT,    // Vertex as is
+        VERTEX_FORMAT_HALF,     // PackedVertex with half float positions
+        VERTEX_FORMAT_UNORM16   // PackedVertex with 16-bit positions normalized to the mesh bounds
+    };
+
     // Stores the GL data relative to a given mesh
     struct GLMesh
     {
@@ -36,992 +141,8975 @@ namespace
         GLuint nVertices;    // Number of indices of the mesh
         GLuint vbos[2];
         GLuint nIndices;
+        GLenum indexType;   // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+        vector<GLSubmesh> submeshes;
+        VertexFormat vertexFormat;
+        glm::vec3 positionScale;    // Object space position = position attribute * positionScale + positionOffset
+        glm::vec3 positionOffset;
+        GLuint lightmapVbo;     // Lightmap UVs, 0 when the mesh has none
     };
 
-    // Main GLFW window
-    GLFWwindow* gWindow = nullptr;
-    // Triangle mesh data
-    GLMesh gMesh;
-    // Texture
-    GLuint gTextureId;
-    GLuint gTextureIdDesk;
-    GLuint gTextureIdMonitor;
-    GLuint gTextureIdStand;
-    GLuint gTextureIdKeyboard;
-    glm::vec2 gUVScale(5.0f, 5.0f);
-    GLint gTexWrapMode = GL_REPEAT;
+    // One placed object: a submesh of the scene mesh with its own transform and material
+    struct SceneObject
+    {
+        GLuint submesh;     // Index into GLMesh::submeshes
+        glm::mat4 model;
+        GLuint material;    // MaterialIndex, or MATERIAL_FROM_VERTEX to keep the mesh's own materials
+        GLuint lod;         // Level of detail drawn, kept between frames for the hysteresis of USelectLods
+        glm::vec3 boundsMin;    // World space bounding box, follows the model matrix
+        glm::vec3 boundsMax;
+    };
 
-    // Shader programs
-    GLuint gCubeProgramId;
-    GLuint gLampProgramId;
+    // Node of the bounding volume hierarchy over the scene objects, stored depth first
+    struct BvhNode
+    {
+        glm::vec3 boundsMin;
+        glm::vec3 boundsMax;
+        GLuint firstObject;     // Objects of the subtree are a contiguous range of gBvhObjects
+        GLuint objectCount;
+        GLuint rightChild;      // 0 for leaves; the left child is always the next node
+    };
 
-    // camera
-    Camera gCamera(glm::vec3(0.0f, 0.0f, 7.0f));
-    float gLastX = WINDOW_WIDTH / 2.0f;
-    float gLastY = WINDOW_HEIGHT / 2.0f;
-    bool gFirstMouse = true;
+    // Objects per BVH leaf
+    const GLuint BVH_LEAF_SIZE = 4;
 
-    // timing
-    float gDeltaTime = 0.0f; // time between current frame and last frame
-    float gLastFrame = 0.0f;
+    // Six frustum planes (plus two that never reject) laid out for four-wide plane tests
+    struct FrustumPlanes
+    {
+        alignas(16) float nx[8];
+        alignas(16) float ny[8];
+        alignas(16) float nz[8];
+        alignas(16) float d[8];
+    };
 
-    // Subject position and scale
-    glm::vec3 gCubePosition(0.0f, 0.0f, 0.0f);
-    glm::vec3 gCubeScale(2.0f);
+    // Entry of the Objects storage buffer; std430 pads the struct to a multiple of 16 bytes
+    struct ObjectData
+    {
+        GLfloat model[16];                  // Column major
+        GLfloat modelViewProjection[16];
+        GLfloat normalMatrix[12];           // mat3 with its columns padded to vec4, only written for SHADER_NORMAL_MATRIX draws
+        GLuint material;
+        GLuint padding[3];
+        GLfloat lightmapRect[4];            // Lightmap UV scale and offset into the atlas
+    };
 
-    // Cube and light color
-    //m::vec3 gObjectColor(0.6f, 0.5f, 0.75f);
-    glm::vec3 gObjectColor(1.f, 0.2f, 0.0f);
-    glm::vec3 gLightColor(1.0f, 1.0f, 1.0f);
+    // Command layout read by glMultiDrawElementsIndirect, one per submesh with visible objects
+    struct DrawElementsIndirectCommand
+    {
+        GLuint count;
+        GLuint instanceCount;   // Visible objects using the submesh
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;    // First ObjectData of the draw
+    };
 
-    // Light position and scale
-    glm::vec3 gLightPosition(1.0f, 0.5f, 1.0f);
-    glm::vec3 gLightScale(10.0f);
+    // Consecutive draw commands sharing a shader variant, submitted in one multi-draw call
+    struct DrawBatch
+    {
+        GLuint features;        // ShaderFeature bits of the variant
+        GLuint firstCommand;
+        GLuint commandCount;
+    };
 
-    // Lamp animation
-    bool gIsLampOrbiting = true;
-}
+    // Buffers the scene is drawn from
+    // The ObjectData, Draws and indirect commands of a frame are streamed through gStream instead
+    struct GLDrawBuffers
+    {
+        GLuint objectIndices;   // 0, 1, 2, ... read as an instanced attribute when gl_DrawIDARB is unavailable
+        GLintptr commandsOffset;    // Of this frame's DrawElementsIndirectCommand array in the stream buffer
+    };
 
-/* User-defined Function prototypes to:
- * initialize the program, set the window size,
- * redraw graphics on the window when resized,
- * and render graphics on the screen
- */
-bool UInitialize(int, char* [], GLFWwindow** window);
-void UResizeWindow(GLFWwindow* window, int width, int height);
-void UProcessInput(GLFWwindow* window);
-void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
-void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
-void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
-void UCreateMesh(GLMesh& mesh);
-void UDestroyMesh(GLMesh& mesh);
-bool UCreateTexture(const char* filename, GLuint& textureId);
-void UDestroyTexture(GLuint textureId);
-void URender();
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
-void UDestroyShaderProgram(GLuint programId);
+    // Instance material that defers to the per-vertex material attribute
+    const GLuint MATERIAL_FROM_VERTEX = 0xFFFFFFFFu;
 
+    // Materials, in texture array layer order. A vertex's material index selects its layer.
+    enum MaterialIndex : GLuint
+    {
+        MATERIAL_MOUSE = 0,
+        MATERIAL_DESK,
+        MATERIAL_MONITOR,
+        MATERIAL_STAND,
+        MATERIAL_KEYBOARD,
+        MATERIAL_COUNT
+    };
 
-/* Cube Vertex Shader Source Code*/
-const GLchar* cubeVertexShaderSource = GLSL(440,
+    // Compile-time features of the scene's shader programs; every combination in use is built as its own variant
+    enum ShaderFeature : GLuint
+    {
+        SHADER_TEXTURED = 1u << 0,          // Sample the material texture, else objectColor
+        SHADER_SPECULAR = 1u << 1,          // Phong specular term
+        SHADER_NORMAL_MATRIX = 1u << 2,     // Inverse transpose normal matrix from ObjectData, else mat3(model) (rotations and uniform scales)
+        SHADER_POINT_LIGHTS = 1u << 3,      // Clustered point light loop
+        SHADER_GBUFFER = 1u << 4,           // Cube program writes the G-buffer instead of lit color
+        SHADER_DEFERRED_LIGHTING = 1u << 5, // Fullscreen lighting pass of the deferred renderer instead of the cube program
+        SHADER_LIGHTMAP = 1u << 6           // Ambient term scaled by the baked lightmap
+    };
 
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
-layout(location = 1) in vec3 normal; // VAP position 1 for normals
-layout(location = 2) in vec2 textureCoordinate;
-layout(location = 3) in float textureType;
+    // Features chosen per object (by its material and transform); the others are the same for the whole frame
+    const GLuint SHADER_OBJECT_FEATURES = SHADER_TEXTURED | SHADER_SPECULAR | SHADER_NORMAL_MATRIX;
+    const GLuint SHADER_OBJECT_VARIANTS = SHADER_OBJECT_FEATURES + 1;
+
+    // What each material is shaded with, by MaterialIndex; the desk plane is matte.
+    // A material whose texture fails to load loses SHADER_TEXTURED.
+    GLuint gMaterialFeatures[MATERIAL_COUNT] = {
+        SHADER_TEXTURED | SHADER_SPECULAR,  // MATERIAL_MOUSE
+        SHADER_TEXTURED,                    // MATERIAL_DESK
+        SHADER_TEXTURED | SHADER_SPECULAR,  // MATERIAL_MONITOR
+        SHADER_TEXTURED | SHADER_SPECULAR,  // MATERIAL_STAND
+        SHADER_TEXTURED | SHADER_SPECULAR,  // MATERIAL_KEYBOARD
+    };
 
-out vec3 vertexNormal; // For outgoing normals to fragment shader
-out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
-out vec2 vertexTextureCoordinate;
-out float vertexTextureType;
+    // Source image of each material's texture, by MaterialIndex
+    const char* const MATERIAL_TEXTURE_FILES[MATERIAL_COUNT] = {
+        "../../resources/textures/mouse.jpg",
+        "../../resources/textures/desk.jpg", // Adjust the path as necessary
+        "../../resources/textures/display.png",
+        "../../resources/textures/stand.jpg",
+        "../../resources/textures/keyboard.jpg",
+    };
 
-//Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+    // Width and height every material texture is resampled to so they fit one texture array
+    const GLsizei TEXTURE_ARRAY_SIZE = 1024;
+    const int TEXTURE_ARRAY_SIZE_LOG2 = 10;
 
-void main()
-{
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+    /* Compressed texture cache: one file per source image, named after the hash of its content.
+     * Layout: TextureCacheHeader followed by the BC1 blocks of every mip level, largest first.
+     * BC1 is enough because the shaders only read the color channels.
+     */
+    const char* const TEXTURE_CACHE_DIR = "texture_cache";
+    const char TEXTURE_CACHE_MAGIC[4] = { 'U', 'T', 'E', 'X' };
+    const uint32_t TEXTURE_CACHE_VERSION = 1;
+    const GLenum COMPRESSED_TEXTURE_FORMAT = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
 
-    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
+    struct TextureCacheHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t format;        // GL internal format of the blocks
+        uint32_t size;          // Width and height of level 0
+        uint32_t levels;
+        uint32_t reserved;
+        uint64_t sourceHash;    // UHashBytes of the source image file
+        uint64_t dataSize;      // Bytes of block data following the header
+    };
 
-    vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
-    vertexTextureCoordinate = textureCoordinate;
-    vertexTextureType = textureType;
-}
-);
+    const uint64_t HASH_SEED = 14695981039346656037ull; // FNV-1a offset basis
 
+    /* Shader program binary cache: one file per program, named after the hash of its sources and the driver strings.
+     * Layout: ShaderCacheHeader followed by the glGetProgramBinary blob. A driver update changes the key,
+     * so stale binaries are never handed to a different driver.
+     */
+    const char* const SHADER_CACHE_DIR = "shader_cache";
+    const char SHADER_CACHE_MAGIC[4] = { 'U', 'S', 'H', 'B' };
+    const uint32_t SHADER_CACHE_VERSION = 1;
 
-/* Cube Fragment Shader Source Code*/
-const GLchar* cubeFragmentShaderSource = GLSL(440,
+    struct ShaderCacheHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t binaryFormat;  // Driver specific format from glGetProgramBinary
+        uint32_t binarySize;    // Bytes of program binary following the header
+        uint64_t key;           // UShaderCacheKey of the program
+    };
 
-    in vec3 vertexNormal; // For incoming normals
-in vec3 vertexFragmentPos; // For incoming fragment position
-in vec2 vertexTextureCoordinate;
-in float vertexTextureType;
+    // Vertex layout shared by the built-in scene, mesh files and the GL vertex attributes
+    struct Vertex
+    {
+        GLfloat position[3];
+        GLfloat normal[3];
+        GLfloat uv[2];
+        GLuint material;    // MaterialIndex, read as an integer attribute
+    };
 
-out vec4 fragmentColor; // For outgoing cube color to the GPU
+    // Compact GPU copy of a Vertex: 16 bytes instead of 36
+    struct PackedVertex
+    {
+        GLushort position[3];   // Half floats, or unorm16 within the mesh bounds
+        GLushort material;      // MaterialIndex
+        GLuint normal;          // Signed normalized GL_INT_2_10_10_10_REV
+        GLushort uv[2];         // Half floats, the UVs tile well outside [0, 1]
+    };
 
-// Uniform / Global variables for object color, light color, light position, and camera/view position
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 lightPos;
-uniform vec3 viewPosition;
-uniform sampler2D uTexture; // Useful when working with multiple textures
-uniform sampler2D uTextureDesk; // New texture sampler
-uniform sampler2D uTextureMonitor; // New texture sampler
-uniform sampler2D uTextureStand;
-uniform sampler2D uTextureKeyboard;
-uniform vec2 uvScale;
+    VertexFormat gVertexFormat = VERTEX_FORMAT_FLOAT;
 
-void main()
-{
-    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
+    // CPU side copy of a mesh (built-in scene, OBJ import) before it is uploaded or written to disk
+    struct MeshData
+    {
+        vector<Vertex> vertices;
+        vector<GLuint> indices;
+        vector<GLSubmesh> submeshes;
+        vector<glm::vec2> lightmapUvs;  // Per vertex, in texels of the submesh's lightmap; empty until UGenerateLightmapUvs
+    };
 
-    //Calculate Ambient lighting*/
-    float ambientStrength = 0.7f; // Set ambient or global lighting strength
-    vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
+    // Shapes UAppendPrimitive generates, centered on the origin before their placement
+    enum PrimitiveShape
+    {
+        PRIMITIVE_BOX,          // size: edge lengths
+        PRIMITIVE_ROUNDED_BOX,  // size: edge lengths, radius: rounding of the edges
+        PRIMITIVE_CYLINDER,     // Along y; size.x: diameter, size.y: height
+        PRIMITIVE_CAPSULE,      // Along y; size.x: diameter, size.y: height including the caps
+        PRIMITIVE_SPHERE        // size.x: diameter
+    };
 
-    //Calculate Diffuse lighting*/
-    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
-    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-    vec3 diffuse = impact * lightColor; // Generate diffuse light color
+    struct PrimitiveDesc
+    {
+        string name;
+        PrimitiveShape shape;
+        glm::vec3 size;
+        float radius;
+        glm::mat4 placement;    // Rotation and translation only, a scale would distort the rounded parts
+        GLuint material;
+    };
 
-    //Calculate Specular lighting*/
-    float specularIntensity = 1.0f; // Set specular light strength
-    float highlightSize = 10.0f; // Set specular highlight size
-    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
-    //Calculate specular component
-    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-    vec3 specular = specularIntensity * specularComponent * lightColor;
+    // Curved primitives are generated at every level, boxes only at level 0
+    const int PRIMITIVE_LOD_COUNT = 3;
+    const int PRIMITIVE_SEGMENTS[PRIMITIVE_LOD_COUNT] = { 32, 16, 8 };   // Segments around a full circle
+    // Projected diameter in pixels below which the next coarser level is drawn
+    const float LOD_SCREEN_SIZES[PRIMITIVE_LOD_COUNT - 1] = { 150.0f, 50.0f };
+    const float LOD_HYSTERESIS = 0.15f;     // Fraction a size has to pass a threshold by before the level changes
+
+    // Mesh processing (UProcessMesh)
+    const size_t VERTEX_CACHE_SIZE = 32;    // Post-transform cache entries assumed by the index optimizer and the ACMR report
+    const float MESH_CREASE_ANGLE = 40.0f;  // Degrees; faces meeting at a sharper angle keep separate (hard) normals
+
+    /* Binary mesh file (.umsh) layout, all fields little endian:
+     *   MeshFileHeader
+     *   MeshFileSubmesh[submeshCount]   at submeshOffset
+     *   vertex data                     at vertexOffset (vertexCount * vertexStride bytes)
+     *   index data                      at indexOffset  (indexCount * indexSize bytes)
+     * Sections are 16 byte aligned so the mapped file can be handed to the GL as is.
+     */
+    const char MESH_FILE_MAGIC[4] = { 'U', 'M', 'S', 'H' };
+    const uint32_t MESH_FILE_VERSION = 3; // 2: integer material index instead of float texture type, 3: submesh LOD count
+
+    struct MeshFileHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t vertexStride;      // Bytes per vertex, must match the current vertex layout
+        uint32_t vertexCount;
+        uint32_t indexSize;         // 2 or 4 bytes per index
+        uint32_t indexCount;
+        uint32_t submeshCount;
+        uint32_t reserved;
+        uint64_t submeshOffset;
+        uint64_t vertexOffset;
+        uint64_t indexOffset;
+    };
 
-    // Texture holds the color to be used for all three components
-    vec4 textureColor;
+    struct MeshFileSubmesh
+    {
+        char name[32];
+        uint32_t firstIndex;
+        uint32_t indexCount;
+        uint32_t lodCount;
+        uint32_t reserved;
+    };
 
-    if (vertexTextureType == 0)
+    // Read-only memory mapping of a whole file
+    struct MappedFile
     {
-        textureColor = texture(uTextureDesk, vertexTextureCoordinate * uvScale);
-    }
-    else if (vertexTextureType == 0.1)
+        const unsigned char* data = nullptr;
+        size_t size = 0;
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = NULL;
+#endif
+    };
+
+    // Main GLFW window
+    GLFWwindow* gWindow = nullptr;
+    // Triangle mesh data
+    GLMesh gMesh;
+    // Texture
+    GLuint gTextureArrayId;     // One layer per MaterialIndex
+    GLsizei gTextureLevels;     // Mip levels of the texture array
+    bool gUseTextureCache = true;   // --no-texture-cache disables compression and the cache
+    bool gCompressTextures = false; // Texture array holds BC1 blocks from the cache
+    bool gUseShaderCache = true;    // --no-shader-cache always compiles the GLSL sources
+
+    // One texture array layer being decoded by the texture loader
+    struct TextureLoadJob
     {
-        textureColor = texture(uTextureMonitor, vertexTextureCoordinate * uvScale);
-    }
-    else if (vertexTextureType == 0.2)
+        string filename;
+        GLint layer;
+        GLuint pbo;                 // Pixel unpack buffer the decoded layer is written into
+        unsigned char* pixels;      // Mapped PBO memory, written by a worker thread
+        bool succeeded;
+    };
+
+    // Decodes textures on worker threads while the GL thread keeps rendering
+    struct TextureLoader
     {
-        textureColor = texture(uTextureStand, vertexTextureCoordinate * uvScale);
-    }
-    else if (vertexTextureType == 0.3)
+        vector<TextureLoadJob> jobs;
+        vector<thread> workers;
+        atomic<size_t> nextJob;
+        mutex doneMutex;
+        vector<size_t> done;        // Decoded jobs waiting for their upload, guarded by doneMutex
+        size_t uploaded;            // Jobs uploaded (or failed) on the GL thread
+        chrono::steady_clock::time_point start;
+    };
+    TextureLoader gTextureLoader;
+    glm::vec2 gUVScale(5.0f, 5.0f);
+    GLint gTexWrapMode = GL_REPEAT;
+
+    // Uniform locations of a shader program, resolved once after linking
+    struct GLProgramUniforms
     {
-        textureColor = texture(uTextureKeyboard, vertexTextureCoordinate * uvScale);
-    }
-    else {
-        textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
-    }
+        GLint modelViewProjection;
+        GLint objectColor;
+        GLint uvScale;
+        GLint positionScale;
+        GLint positionOffset;
+        GLint inverseViewProjection;
+        GLint firstDraw;
+    };
 
-    // Calculate phong result
-    vec3 phong = (ambient + diffuse + specular) * textureColor.xyz;
+    // Per-frame camera and light data shared by every program through a std140 uniform block.
+    // vec3 members are stored as vec4 to match std140 alignment.
+    struct GLFrameUniforms
+    {
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::vec4 viewPosition;
+        glm::vec4 lightPosition;
+        glm::vec4 lightColor;
+        GLuint clusterGrid[4];      // Clusters along x, y and z, point light count
+        glm::vec4 clusterParams;    // Tile width and height in pixels, depth slice scale and bias
+    };
 
-    fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
-}
-);
+    // Binding point of the FrameData uniform block (matches the shaders' layout qualifier)
+    const GLuint FRAME_UNIFORM_BINDING = 0;
+    // Binding points of the Objects and Draws storage buffers
+    const GLuint OBJECT_BUFFER_BINDING = 1;
+    const GLuint DRAW_BUFFER_BINDING = 2;
+    // Binding points of the Lights, Clusters and ClusterLights storage buffers
+    const GLuint LIGHT_BUFFER_BINDING = 3;
+    const GLuint CLUSTER_BUFFER_BINDING = 4;
+    const GLuint CLUSTER_LIGHT_BUFFER_BINDING = 5;
 
+    // Shader programs
+    GLuint gLampProgramId;
+    GLProgramUniforms gLampUniforms;
 
-/* Lamp Shader Source Code*/
-const GLchar* lampVertexShaderSource = GLSL(440,
+    // A program built for one combination of ShaderFeature bits
+    struct ShaderVariant
+    {
+        GLuint programId;
+        GLProgramUniforms uniforms;
+    };
 
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+    unordered_map<GLuint, ShaderVariant> gShaderVariants;  // By feature bits; built at startup, or on first use
 
-//Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+    // Frames the stream buffer is split into: the CPU fills one while the GPU may still read the others
+    const int STREAM_REGIONS = 3;
+    const GLsizeiptr STREAM_INITIAL_REGION_SIZE = 256 * 1024;
 
-void main()
-{
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
-}
-);
+    /* Persistently mapped buffer every per-frame upload is written to, in place.
+     * Each frame allocates from its own region; a fence after the frame's draws tells when the region is free again.
+     */
+    struct GLStreamBuffer
+    {
+        GLuint buffer;
+        GLubyte* mapped;            // The whole buffer, mapped for its lifetime (coherent, no flushes needed)
+        GLsizeiptr regionSize;
+        GLsync fences[STREAM_REGIONS];
+        int region;                 // Region of the current frame
+        GLsizeiptr used;            // Bytes allocated from it so far
+        GLsizeiptr reserved;        // Bytes UBeginStreamFrame reserved for the frame
+        GLsizeiptr alignment;       // Offset alignment of uniform and storage buffer ranges
+        GLuint stalls;              // Frames that found their region still in use by the GPU
+    };
 
+    GLStreamBuffer gStream = {};
 
-/* Fragment Shader Source Code*/
-const GLchar* lampFragmentShaderSource = GLSL(440,
+    // A shader program between UBeginShaderProgram and UFinishShaderProgram
+    struct GLShaderBuild
+    {
+        GLuint programId;
+        GLuint vertexShaderId;      // 0 when the program was loaded from the binary cache
+        GLuint fragmentShaderId;
+        uint64_t cacheKey;
+    };
 
-    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
+    // camera, owned by the simulation (see UStartSimulation)
+    Camera gCamera(glm::vec3(0.0f, 0.0f, 7.0f));
+    float gLastX = WINDOW_WIDTH / 2.0f;
+    float gLastY = WINDOW_HEIGHT / 2.0f;
+    bool gFirstMouse = true;
 
-void main()
-{
-    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
-}
-);
+    // Input gathered on the main thread (GLFW only allows that) and consumed once per simulation tick
+    struct InputState
+    {
+        unsigned movementKeys = 0;  // Bit per Camera_Movement held down
+        float mouseX = 0.0f;        // Mouse movement and scrolling accumulated since the last tick
+        float mouseY = 0.0f;
+        float scroll = 0.0f;
+        bool lampOrbiting = true;
+    };
 
+    InputState gInput;
+    mutex gInputMutex;
 
-// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
-void flipImageVertically(unsigned char* image, int width, int height, int channels)
-{
-    for (int j = 0; j < height / 2; ++j)
+    // What the renderer needs from one simulation tick
+    struct SimulationPose
     {
-        int index1 = j * width * channels;
-        int index2 = (height - 1 - j) * width * channels;
+        glm::vec3 cameraPosition;
+        glm::vec3 cameraFront;
+        glm::vec3 cameraUp;
+        float cameraZoom;
+        glm::vec3 lightPosition;
+        float objectSlide;          // Offset of the moving objects along x (--move-objects)
+    };
 
-        for (int i = width * channels; i > 0; --i)
-        {
-            unsigned char tmp = image[index1];
-            image[index1] = image[index2];
-            image[index2] = tmp;
-            ++index1;
-            ++index2;
-        }
-    }
-}
+    // Immutable once published: the last two ticks, so the renderer can interpolate between them
+    struct SimulationSnapshot
+    {
+        uint64_t tick;
+        double time;                // Simulation clock time of the current tick, in seconds
+        SimulationPose previous;
+        SimulationPose current;
+    };
 
+    // Fixed simulation rate; rendering interpolates and may run faster or slower
+    const double SIMULATION_TICK = 1.0 / 60.0;
+    const int SIMULATION_MAX_CATCH_UP = 5;     // Ticks run back to back after a stall before the rest are skipped
 
-int main(int argc, char* argv[])
-{
-    if (!UInitialize(argc, argv, &gWindow))
-        return EXIT_FAILURE;
+    // Triple buffer slot exchanged through middleSlot; the flag marks a snapshot the reader has not taken yet
+    const unsigned SNAPSHOT_SLOT_MASK = 3;
+    const unsigned SNAPSHOT_FRESH = 4;
 
-    // Create the mesh
-    UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
+    struct Simulation
+    {
+        chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+        SimulationSnapshot snapshots[3];
+        unsigned backSlot = 0;              // Written by the simulation
+        atomic<unsigned> middleSlot{ 1 };
+        unsigned frontSlot = 2;             // Read by the renderer
+        uint64_t tick = 0;
+        SimulationPose lastPose;
+        atomic<bool> running{ false };
+        thread worker;
+    };
 
-    // Create the shader programs
-    if (!UCreateShaderProgram(cubeVertexShaderSource, cubeFragmentShaderSource, gCubeProgramId))
-        return EXIT_FAILURE;
+    Simulation gSimulation;
 
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgramId))
-        return EXIT_FAILURE;
+    // Logging: one single producer / single consumer ring per thread, emptied by the drain thread
+    const size_t LOG_RING_SIZE = 256;           // Records per thread
+    const unsigned LOG_MAX_THREADS = 32;        // Threads beyond this are not logged
+    const int LOG_DRAIN_INTERVAL_MS = 5;
 
-    // Load texture
-    const char* texFilename = "../../resources/textures/mouse.jpg";
-    if (!UCreateTexture(texFilename, gTextureId))
+    struct LogRecord
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
+        int64_t timeUs;
+        int level;
+        char text[240];     // Longer messages are truncated
+    };
 
-    // Load the desk texture
-    texFilename = "../../resources/textures/desk.jpg"; // Adjust the path as necessary
-    if (!UCreateTexture(texFilename, gTextureIdDesk))
+    struct LogRing
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
+        LogRecord records[LOG_RING_SIZE];
+        atomic<size_t> head{ 0 };           // Next record the owning thread writes
+        atomic<size_t> tail{ 0 };           // Next record the drain thread reads
+        atomic<uint64_t> dropped{ 0 };      // Messages lost to a full ring
+    };
 
-    // Load the desk texture
-    texFilename = "../../resources/textures/display.png"; // Adjust the path as necessary
-    if (!UCreateTexture(texFilename, gTextureIdMonitor))
+    struct Logger
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
+        chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+        atomic<LogRing*> rings[LOG_MAX_THREADS] = {};
+        atomic<unsigned> ringCount{ 0 };
+        atomic<uint64_t> ringlessDropped{ 0 };  // Messages of threads past LOG_MAX_THREADS, which get no ring
+        FILE* output = stderr;
+        atomic<bool> running{ false };
+        thread drainer;
+    };
 
-    // Load the desk texture
-    texFilename = "../../resources/textures/stand.jpg"; // Adjust the path as necessary
-    if (!UCreateTexture(texFilename, gTextureIdStand))
+    Logger gLogger;
+    string gLogFile;    // --log FILE, stderr otherwise
+
+    // Profiler: nested CPU scopes and sequential GPU timer passes
+    struct ProfileScopeEntry
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
+        const char* name;
+        int64_t startUs;
+    };
 
-    // Load the desk texture
-    texFilename = "../../resources/textures/keyboard.jpg"; // Adjust the path as necessary
-    if (!UCreateTexture(texFilename, gTextureIdKeyboard))
+    struct ProfileStat
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
+        const char* name;
+        bool gpu;
+        double windowTotal;     // Milliseconds in the current summary window
+        int windowSamples;
+        double runTotal;        // Milliseconds since startup
+        int runSamples;
+    };
 
+    struct TraceEvent
+    {
+        const char* name;
+        int64_t startUs;
+        int64_t durationUs;
+        int track;              // Trace thread id: 1 CPU, 2 GPU
+    };
 
-    // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
-    glUseProgram(gCubeProgramId);
-    // We set the texture as texture unit 0
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uTexture"), 0);
-    // We set the desk texture as texture unit 1
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uTextureDesk"), 1);
-    // We set the desk texture as texture unit 2
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uTextureMonitor"), 2);
-    // We set the desk texture as texture unit 3
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uTextureStand"), 3);
-    // We set the desk texture as texture unit 4
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uTextureKeyboard"), 4);
+    // A GL_TIME_ELAPSED query per frame parity, so results are read two frames after they were issued
+    struct GpuTimer
+    {
+        const char* name;
+        GLuint queries[2];
+        int64_t startUs[2];
+        bool pending[2];
+    };
 
-    // Sets the background color of the window to black (it will be implicitely used by glClear)
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    struct Profiler
+    {
+        chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+        vector<ProfileScopeEntry> stack;
+        vector<ProfileStat> stats;
+        vector<GpuTimer> gpuTimers;
+        int activeGpuTimer = -1;
+        unsigned frame = 0;
+        int64_t windowStartUs = 0;
+        int windowFrames = 0;
+        string summary;
+        bool tracing = false;
+        vector<TraceEvent> trace;
+    };
 
-    // render loop
-    // -----------
-    while (!glfwWindowShouldClose(gWindow))
+    Profiler gProfiler;
+    string gTraceFile;      // --trace FILE writes a Chrome trace when the program exits
+
+    const int64_t PROFILER_SUMMARY_INTERVAL_US = 1000000;
+    const size_t PROFILER_TRACE_LIMIT = 1 << 20;   // Events kept for the trace, about 32 MB
+
+    // Times a CPU scope until the end of the enclosing block
+    struct ProfileScope
     {
-        // per-frame timing
-        // --------------------
-        float currentFrame = glfwGetTime();
-        gDeltaTime = currentFrame - gLastFrame;
-        gLastFrame = currentFrame;
+        ProfileScope(const char* name);
+        ~ProfileScope();
+    };
 
-        // input
-        // -----
-        UProcessInput(gWindow);
+    // Subject position and scale
+    glm::vec3 gCubePosition(0.0f, 0.0f, 0.0f);
+    glm::vec3 gCubeScale(2.0f);
 
-        // Render this frame
-        URender();
+    // Placed objects (one per submesh and desk) and the instanced draws rendering them
+    int gDeskCount = 1;             // --desks N lays out N copies of the scene in a grid
+    vector<SceneObject> gSceneObjects;
+    GLDrawBuffers gDrawBuffers;
+    vector<DrawElementsIndirectCommand> gDrawCommands;
+    vector<DrawBatch> gDrawBatches;
+    vector<GLuint> gDrawFirstObject;
+    bool gUseDrawParameters = true;     // gl_DrawIDARB available and not disabled with --no-draw-id
+
+    // Frustum culling
+    vector<BvhNode> gBvhNodes;
+    vector<GLuint> gBvhObjects;     // Scene object indices in BVH leaf order
+    bool gBvhDirty = false;         // An object moved, node bounds need a refit
+    bool gFrustumCulling = true;    // --no-culling submits every object
+    vector<GLuint> gVisibleObjects; // Objects that passed culling this frame
 
-        glfwPollEvents();
-    }
+    // Cube and light color
+    //m::vec3 gObjectColor(0.6f, 0.5f, 0.75f);
+    glm::vec3 gObjectColor(1.f, 0.2f, 0.0f);
+    glm::vec3 gLightColor(1.0f, 1.0f, 1.0f);
 
-    // Release mesh data
-    UDestroyMesh(gMesh);
+    // Light position and scale; the position is owned by the simulation
+    glm::vec3 gLightPosition(1.0f, 0.5f, 1.0f);
+    glm::vec3 gLightScale(0.3f);
+
+    // Sphere drawn at the light position with the lamp program
+    GLMesh gLampMesh;
+
+    // Clip planes of the projection, the depth slices of the light clusters span the same range
+    const float NEAR_PLANE = 0.1f;
+    const float FAR_PLANE = 100.0f;
+
+    // Clustered forward lighting: the view frustum is cut into a grid of clusters, each listing the point lights reaching into it
+    const GLuint CLUSTER_GRID_X = 16;
+    const GLuint CLUSTER_GRID_Y = 9;
+    const GLuint CLUSTER_GRID_Z = 24;       // Exponential depth slices
+    const GLuint CLUSTER_COUNT = CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z;
+    const float CLUSTER_NEAR = NEAR_PLANE;
+    const float CLUSTER_FAR = FAR_PLANE;
+    const GLuint CLUSTER_LIGHT_CHUNK = 256;     // Lights per job when UAssignLights bounds them
+    const float POINT_LIGHT_MAX_RADIUS = 4.0f;
+    const float POINT_LIGHTS_PER_POINT = 8.0f;  // Lights reaching an average point, the radius shrinks as lights are added
+    const float POINT_LIGHT_INTENSITY = 0.6f;
+
+    // Point light in the std430 Lights buffer
+    struct PointLight
+    {
+        glm::vec4 positionRadius;   // World position, radius of influence in w
+        glm::vec4 color;
+    };
 
-    // Release texture
-    UDestroyTexture(gTextureId);
-    UDestroyTexture(gTextureIdDesk);
-    UDestroyTexture(gTextureIdMonitor);
-    UDestroyTexture(gTextureIdStand);
-    UDestroyTexture(gTextureIdKeyboard);
+    vector<PointLight> gPointLights;
+    vector<GLuint> gClusters;       // Per-frame cluster assignment, kept to avoid reallocating
+    vector<GLuint> gClusterLights;
+    int gPointLightCount = 0;       // --lights N
+    bool gLightSweep = false;       // --light-sweep
 
-    // Release shader programs
-    UDestroyShaderProgram(gCubeProgramId);
-    UDestroyShaderProgram(gLampProgramId);
+    // Render paths selected with --renderer
+    enum RendererMode
+    {
+        RENDERER_FORWARD,   // Lights every fragment while the scene is drawn
+        RENDERER_DEFERRED,  // Draws the scene into a G-buffer, then lights every pixel once
+        RENDERER_SOFTWARE   // Rasterizes on the CPU, in screen tiles spread over worker threads (no GL context)
+    };
+    const char* const RENDERER_NAMES[] = { "forward", "deferred", "software" };
 
-    exit(EXIT_SUCCESS); // Terminates the program successfully
-}
+    RendererMode gRenderer = RENDERER_FORWARD;
 
+    // Deferred shading targets, the size of the render target
+    struct GLGBuffer
+    {
+        GLuint fbo;
+        GLuint albedo;      // RGBA8 texture color
+        GLuint normal;      // RGBA16F world space normal
+        GLuint depth;       // DEPTH24_STENCIL8, world positions are reconstructed from it
+        int width;
+        int height;
+    };
 
-// Initialize GLFW, GLEW, and create a windowdddddddddddddddddddd
-bool UInitialize(int argc, char* argv[], GLFWwindow** window)
+    GLGBuffer gGBuffer = {};
+    GLuint gFullscreenVao = 0;      // Attribute-less VAO the fullscreen pass triangles are drawn with
+    // Texture units the lighting pass reads the G-buffer from, unit 0 holds the material textures
+    const GLint GBUFFER_ALBEDO_UNIT = 1;
+    const GLint GBUFFER_NORMAL_UNIT = 2;
+    const GLint GBUFFER_DEPTH_UNIT = 3;
+
+    // Hierarchical-Z occlusion culling: objects are tested against the depth of a frame drawn a few frames ago,
+    // read back without stalling, with the camera of that frame
+    const int HIZ_FOOTPRINT = 8;            // Render target pixels per side reduced into one texel of the base level
+    const int HIZ_READBACK_SLOTS = 2;       // Readbacks in flight; each gets this many frames before its slot is reused
+    const GLint HIZ_DEPTH_UNIT = 4;
+
+    struct GLHiZ
+    {
+        GLuint depthFbo;        // Copy of the scene depth, the forward renderer's depth buffer cannot be sampled
+        GLuint depth;
+        GLuint reduceFbo;       // Base level of the pyramid, the farthest depth of every footprint
+        GLuint reduced;
+        GLuint pbos[HIZ_READBACK_SLOTS];
+        GLsync fences[HIZ_READBACK_SLOTS];              // Readback in flight, 0 when the slot is free
+        glm::mat4 viewProjections[HIZ_READBACK_SLOTS];  // Camera each readback was drawn with
+        glm::vec3 cameraPositions[HIZ_READBACK_SLOTS];
+        uint64_t generations[HIZ_READBACK_SLOTS];       // gSceneGeneration each readback was drawn at
+        unsigned frame;         // Captures so far, selects the slot
+        int width;              // Render target size
+        int height;
+        int baseWidth;
+        int baseHeight;
+    };
+
+    struct HiZLevel
+    {
+        int width;
+        int height;
+        size_t offset;          // First texel in HiZPyramid::depths
+    };
+
+    // Depth pyramid on the CPU, level 0 first; every texel holds the farthest window depth below it
+    struct HiZPyramid
+    {
+        vector<HiZLevel> levels;
+        vector<float> depths;
+        glm::mat4 viewProjection;
+        glm::vec3 cameraPosition;
+        int width;              // Render target size the pyramid was reduced from
+        int height;
+        bool valid = false;
+    };
+
+    GLHiZ gHiZ = {};
+    HiZPyramid gHiZPyramid;
+    GLuint gHiZProgramId = 0;
+    bool gOcclusionCulling = true;  // --no-occlusion-culling
+    GLuint gOcclusionCulled = 0;    // Objects the pyramid rejected this frame
+    uint64_t gSceneGeneration = 0;  // Bumped when an object moves, depth drawn before then is no longer trusted
+
+    /* Baked lighting of the static scene: each object's ambient occlusion and one bounce of sky light, path traced on
+     * the CPU (--bake-lightmaps) into one lightmap per object. Cached on disk per object, keyed by everything its
+     * bake depends on, so only objects whose surroundings changed are baked again. Without a cache directory the
+     * lightmap UVs are not generated at all.
+     * Layout: LightmapCacheHeader followed by width * height 8-bit texels.
+     */
+    const char* const LIGHTMAP_CACHE_DIR = "lightmap_cache";
+    const char LIGHTMAP_CACHE_MAGIC[4] = { 'U', 'L', 'M', 'P' };
+    const uint32_t LIGHTMAP_CACHE_VERSION = 1;         // Bump when the bake itself changes
+    const float LIGHTMAP_TEXELS_PER_UNIT = 16.0f;       // In object space
+    const int LIGHTMAP_PADDING = 2;                     // Texels around every chart, filled by dilation
+    const float LIGHTMAP_CHART_ANGLE_COS = 0.7071f;     // Faces join a chart within 45 degrees of its first face
+    const int LIGHTMAP_SAMPLE_GRID = 8;                 // Stratified rays per texel, per side
+    const float LIGHTMAP_RAY_DISTANCE = 4.0f;           // World units; geometry farther away counts as open sky
+    const float LIGHTMAP_BOUNCE_ALBEDO = 0.5f;
+    const size_t LIGHTMAP_BAKE_CHUNK = 256;             // Texels a bake thread takes at a time
+    const int LIGHTMAP_ATLAS_WIDTH = 2048;
+    const int LIGHTMAP_WHITE_SIZE = 4;                  // Block of 1s at the atlas origin, for objects without a bake
+    const GLuint LIGHTMAP_UV_ATTRIBUTE = 5;
+    const GLint LIGHTMAP_UNIT = 5;
+
+    struct LightmapCacheHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint64_t key;       // ULightmapKeys of the object
+    };
+
+    // Faces of a submesh sharing one planar projection, and where they land in the submesh's lightmap
+    struct LightmapChart
+    {
+        glm::vec3 normal;       // Projection plane
+        glm::vec3 tangent;
+        glm::vec3 bitangent;
+        vector<GLuint> triangles;
+        glm::vec2 boundsMin;    // Projected extent
+        glm::vec2 boundsMax;
+        int x;                  // Placement in texels, gutter included
+        int y;
+        int width;
+        int height;
+    };
+
+    // Texel center on a surface being baked
+    struct LightmapTexel
+    {
+        GLuint slot;            // Lightmap being baked
+        GLuint texel;
+        glm::vec3 position;     // World space
+        glm::vec3 normal;
+    };
+
+    struct BakeTriangle
+    {
+        glm::vec3 vertices[3];
+        glm::vec3 centroid;
+    };
+
+    // Four-wide BVH the baker traces rays through: a node holds the boxes of its four children side by side,
+    // so one SIMD slab test covers them all, and a leaf is a packet of four triangles tested at once
+    const int32_t BAKE_BVH_EMPTY = numeric_limits<int32_t>::min();  // Unused child slot
+    const int BAKE_STACK_SIZE = 64;
+    const float BAKE_RAY_EPSILON = 1e-4f;       // Closest hit distance accepted
+    const float BAKE_RAY_OFFSET = 1e-3f;        // Ray origins are moved off their surface by this much
+
+    struct BakeBvhNode
+    {
+        alignas(16) float boundsMin[3][4];  // [axis][child]
+        alignas(16) float boundsMax[3][4];
+        int32_t children[4];    // Node index, ~packet index for leaves, or BAKE_BVH_EMPTY
+    };
+
+    // Triangles as a vertex and two edges, [axis][lane]; unused lanes are degenerate
+    struct BakeTrianglePacket
+    {
+        alignas(16) float v0[3][4];
+        alignas(16) float e1[3][4];
+        alignas(16) float e2[3][4];
+    };
+
+    struct BakeScene
+    {
+        vector<BakeBvhNode> nodes;
+        vector<BakeTrianglePacket> packets;
+        int32_t root = BAKE_BVH_EMPTY;
+    };
+
+    // Lightmaps of the scene objects packed into one texture
+    struct GLLightmap
+    {
+        GLuint texture = 0;         // R8, 0 when no object has a bake
+        int width = 0;
+        int height = 0;
+        vector<glm::vec4> rects;    // Per object: lightmap UV scale (xy) and offset (zw) into the atlas
+        vector<vector<GLuint>> neighbours;  // Per object: the objects its bake traced rays past, whose bakes include it too
+    };
+
+    GLLightmap gLightmap;
+    bool gUseLightmaps = true;      // --no-lightmaps
+    bool gBakeLightmaps = false;    // --bake-lightmaps
+
+    /* Software renderer (--renderer software): the built-in scene drawn on the CPU with the lamp light of the
+     * cube fragment shader. Triangles are set up and binned into SOFTWARE_TILE_SIZE square tiles by chunks of
+     * SOFTWARE_SETUP_CHUNK in parallel, then each tile is rasterized and shaded by one worker, eight pixels at a
+     * time with AVX2 when the CPU supports it.
+     */
+    const int SOFTWARE_TILE_SIZE = 64;
+    const GLuint SOFTWARE_SETUP_CHUNK = 1024;
+    const float SOFTWARE_GUARD_BAND = 4.0f;     // Triangles are clipped at this many viewports; the rest is scissored
+    const int SOFTWARE_CLIP_PLANES = 5;         // Near plane and the four guard band planes
+    const int SOFTWARE_ATTRIBUTES = 8;          // World position, normal, texture coordinate
+    const float SOFTWARE_AMBIENT_STRENGTH = 0.7f;
+    const GLuint SOFTWARE_UNLIT = 1u << 31;     // Feature bit of the lamp, drawn white
+
+    struct SoftwareVertex
+    {
+        glm::vec4 clip;
+        float attributes[SOFTWARE_ATTRIBUTES];
+    };
+
+    // Screen space triangle; an edge function is A * x + B * y + C, positive inside
+    struct SoftwareTriangle
+    {
+        float edgeA[3], edgeB[3], edgeC[3];     // Edge i is opposite vertex i, so it weighs that vertex
+        float inverseArea;
+        float z[3];                             // Window depth
+        float inverseW[3];
+        float attributes[SOFTWARE_ATTRIBUTES][3];   // Divided by w, for perspective correct interpolation
+        int minX, minY, maxX, maxY;             // Pixels whose centers may be covered, within the viewport
+        GLuint material;
+        GLuint features;                        // SHADER_TEXTURED, SHADER_SPECULAR, SOFTWARE_UNLIT
+    };
+
+    // Triangles of one setup chunk and, per tile, the ones touching it. Kept across frames, so binning reuses the storage.
+    struct SoftwareBin
+    {
+        vector<SoftwareTriangle> triangles;
+        vector<GLuint> tileStarts;      // Tile t uses tileTriangles[tileStarts[t], tileStarts[t + 1])
+        vector<GLuint> tileTriangles;
+        vector<GLuint> cursors;         // Fill position per tile
+    };
+
+    struct SoftwareDraw
+    {
+        const MeshData* mesh;
+        GLuint firstIndex;
+        GLuint triangleCount;
+        GLuint frameTriangle;   // Of its first triangle among all the triangles of the frame
+        glm::mat4 model;
+        glm::mat3 normalMatrix;
+        GLuint material;        // MaterialIndex, or MATERIAL_FROM_VERTEX
+        GLuint features;
+        float depth;            // Squared distance to the camera, for front to back order
+    };
+
+    // What shade() reads from the frame uniforms
+    struct SoftwareFrame
+    {
+        glm::vec3 lightPosition;
+        glm::vec3 lightColor;
+        glm::vec3 viewPosition;
+        glm::vec3 objectColor;
+        glm::vec2 uvScale;
+    };
+
+    struct SoftwareRenderer
+    {
+        int width = 0;
+        int height = 0;
+        int tilesX = 0;
+        int tilesY = 0;
+        vector<uint32_t> color;     // RGBA8, bottom row first like GL
+        vector<uint32_t> textures;  // RGBA8 material textures, TEXTURE_ARRAY_SIZE squared each
+        MeshData mesh;
+        MeshData lamp;
+        vector<SoftwareDraw> draws;
+        vector<SoftwareBin> bins;
+        size_t triangles = 0;       // Set up in the last frame, after clipping
+        bool avx2 = false;          // Spans rasterized with the AVX2 kernel, when the CPU has it
+    };
+
+    SoftwareRenderer gSoftware;
+    unsigned gWorkerThreads = 0;    // --threads N, 0 for one per hardware thread
+
+    // Threads URunParallel hands its jobs to, started on first use and kept until UStopWorkerPool.
+    // A job is published under the mutex as a new generation; busy counts the workers that have not finished it yet.
+    struct WorkerPool
+    {
+        vector<thread> threads;         // The calling thread is one more worker
+        mutex access;
+        condition_variable wake;        // A new generation, or stopping
+        condition_variable finished;    // busy reached 0
+        const function<void(size_t)>* job = nullptr;
+        size_t count = 0;
+        atomic<size_t> next{ 0 };       // Next job index to run
+        unsigned busy = 0;
+        uint64_t generation = 0;
+        bool stopping = false;
+    };
+
+    WorkerPool gWorkerPool;
+    string gFrameOutput;            // --frame-output FILE
+
+    // Render passes in execution order, the most significant field of a sort key
+    enum RenderPass : GLuint
+    {
+        RENDER_PASS_SCENE,      // Forward shading, or the G-buffer fill of the deferred renderer
+        RENDER_PASS_LIGHTING,   // Deferred lighting
+        RENDER_PASS_LAMP,
+    };
+
+    // Texture sets and vertex arrays a draw binds, as small ids for the sort key
+    enum RenderTextures : GLuint { RENDER_TEXTURES_NONE, RENDER_TEXTURES_MATERIALS, RENDER_TEXTURES_GBUFFER };
+    enum RenderVertexArray : GLuint { RENDER_VAO_SCENE, RENDER_VAO_FULLSCREEN, RENDER_VAO_LAMP };
+
+    /* Sort key fields, most significant first: pass | program | textures | vertex array | submesh | depth.
+     * Sorting puts draws sharing state next to each other, and front to back among those.
+     */
+    const int SORT_KEY_DEPTH_BITS = 28;     // Top bits of the float distance, which order like the floats
+    const int SORT_KEY_SUBMESH_BITS = 16;
+    const int SORT_KEY_VAO_BITS = 4;
+    const int SORT_KEY_TEXTURES_BITS = 4;
+    const int SORT_KEY_PROGRAM_BITS = 8;    // ShaderFeature bits of the variant
+    const int SORT_KEY_SUBMESH_SHIFT = SORT_KEY_DEPTH_BITS;
+    const int SORT_KEY_VAO_SHIFT = SORT_KEY_SUBMESH_SHIFT + SORT_KEY_SUBMESH_BITS;
+    const int SORT_KEY_TEXTURES_SHIFT = SORT_KEY_VAO_SHIFT + SORT_KEY_VAO_BITS;
+    const int SORT_KEY_PROGRAM_SHIFT = SORT_KEY_TEXTURES_SHIFT + SORT_KEY_TEXTURES_BITS;
+    const int SORT_KEY_PASS_SHIFT = SORT_KEY_PROGRAM_SHIFT + SORT_KEY_PROGRAM_BITS;
+
+    // Draws of a frame as sort keys and payloads (the scene object drawn), radix sorted before they run
+    struct RenderQueue
+    {
+        vector<uint64_t> keys;
+        vector<GLuint> values;
+        vector<uint64_t> sortKeys;      // Radix sort scratch, kept to avoid reallocating
+        vector<GLuint> sortValues;
+    };
+
+    RenderQueue gRenderQueue;
+
+    // GL state last set through the UState* functions, so calls that would change nothing are skipped
+    const GLuint STATE_UNKNOWN = 0xFFFFFFFFu;
+    const int STATE_TEXTURE_UNITS = LIGHTMAP_UNIT + 1;   // Material array, G-buffer albedo, normal and depth, Hi-Z source, lightmap
+    struct GLStateCache
+    {
+        GLuint program;
+        GLuint vertexArray;
+        GLuint framebuffer;
+        GLuint activeTexture;
+        GLuint textures[STATE_TEXTURE_UNITS];
+        GLenum textureTargets[STATE_TEXTURE_UNITS];
+        GLuint depthTest;
+        GLenum depthFunc;
+        GLfloat clearColor[4];
+        GLuint changes;         // Calls made this frame
+        GLuint avoided;         // Calls skipped this frame, the state was already in effect
+        GLuint frameChanges;    // Counters of the last finished frame
+        GLuint frameAvoided;
+        GLuint mismatches;      // --check-state: differences found between the cache and GL
+    };
+
+    GLStateCache gStateCache = {};
+    bool gCheckState = false;   // --check-state
+
+    // Lamp animation
+    bool gIsLampOrbiting = true;
+
+    // Object animation (--move-objects): the mouse of every desk slides back and forth, so the BVH is refit
+    // and earlier depth is invalidated while the scene renders
+    bool gMoveObjects = false;
+    const float OBJECT_SLIDE_DISTANCE = 0.5f;   // World units either side of the placement
+    const float OBJECT_SLIDE_SPEED = 2.0f;      // Radians of the slide cycle per second
+    float gObjectSlidePhase = 0.0f;
+    float gAppliedObjectSlide = 0.0f;           // Slide the objects were last moved to
+    vector<glm::mat4> gSceneRestModels;         // Placement of every scene object before any slide
+
+    // Scene geometry file (--scene), the built-in desk scene is used when empty
+    string gSceneFile;
+    // Offline conversion (--convert in.obj out.umsh, --export-scene out.umsh)
+    string gConvertInput;
+    string gConvertOutput;
+    // Image kernel throughput benchmark (--image-bench)
+    bool gImageBenchmark = false;
+
+    // Headless benchmark mode (selected with --headless on the command line)
+    bool gHeadless = false;
+    int gBenchmarkFrames = 300;     // Frames timed by the benchmark
+    int gBenchmarkWarmup = 10;      // Frames rendered before timing starts
+    GLuint gOffscreenFbo = 0;       // Render target used instead of the window's back buffer
+    GLuint gOffscreenColor = 0;
+    GLuint gOffscreenDepth = 0;
+#ifdef __linux__
+    EGLDisplay gEglDisplay = EGL_NO_DISPLAY;
+    EGLContext gEglContext = EGL_NO_CONTEXT;
+#endif
+}
+
+/* User-defined Function prototypes to:
+ * initialize the program, set the window size,
+ * redraw graphics on the window when resized,
+ * and render graphics on the screen
+ */
+bool UInitialize(int, char* [], GLFWwindow** window);
+bool UParseArguments(int argc, char* argv[]);
+bool UCreateHeadlessContext();
+bool UCreateOffscreenTarget(int width, int height);
+void UDestroyHeadless();
+void URunBenchmark();
+void UResizeWindow(GLFWwindow* window, int width, int height);
+void UProcessInput(GLFWwindow* window);
+void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
+void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
+void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
+bool UCreateMesh(GLMesh& mesh);
+void UDestroyMesh(GLMesh& mesh);
+void UBuildDefaultMesh(MeshData& data);
+void UProcessMesh(MeshData& data, bool lightmapUvs = false);
+void UAppendPrimitive(MeshData& data, const PrimitiveDesc& primitive);
+void USelectLods(const GLMesh& mesh, const glm::vec3& cameraPosition, float fieldOfView, int viewportHeight, const vector<GLuint>& visible, vector<SceneObject>& objects);
+void UGenerateNormals(MeshData& data, float creaseAngle);
+void UDeduplicateVertices(MeshData& data);
+float UComputeAcmr(const GLuint* indices, size_t indexCount);
+void UOptimizeVertexCache(GLuint* indices, size_t indexCount);
+void UOptimizeOverdraw(const vector<Vertex>& vertices, GLuint* indices, size_t indexCount);
+void UOptimizeVertexFetch(MeshData& data);
+void UComputeSubmeshBounds(const Vertex* vertices, const void* indices, GLenum indexType, vector<GLSubmesh>& submeshes);
+void UTransformBounds(const glm::mat4& model, const glm::vec3& localMin, const glm::vec3& localMax, glm::vec3& worldMin, glm::vec3& worldMax);
+void UBuildScene(const GLMesh& mesh, int deskCount, vector<SceneObject>& objects);
+void UMoveSceneObject(GLuint objectIndex, const glm::mat4& model);
+void UAnimateSceneObjects(float slide);
+void UBuildBvh(const vector<SceneObject>& objects, vector<BvhNode>& nodes, vector<GLuint>& order);
+void URefitBvh(const vector<SceneObject>& objects, vector<BvhNode>& nodes, const vector<GLuint>& order);
+void UExtractFrustumPlanes(const glm::mat4& viewProjection, FrustumPlanes& planes);
+int UClassifyBox(const FrustumPlanes& planes, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+void UCullScene(const FrustumPlanes& planes, vector<GLuint>& visible);
+void UCreateDrawBuffers(const GLMesh& mesh, size_t objectCapacity, GLDrawBuffers& buffers);
+GLuint ULightShaderFeatures();
+GLuint UFrameShaderFeatures();
+GLuint UObjectShaderFeatures(const GLMesh& mesh, const SceneObject& object);
+uint64_t URenderSortKey(GLuint pass, GLuint program, GLuint textures, GLuint vertexArray, GLuint submesh, float depth);
+GLuint URenderKeyField(uint64_t key, int shift, int bits);
+void UClearRenderQueue(RenderQueue& queue);
+void USubmitDraw(RenderQueue& queue, uint64_t key, GLuint value);
+void USortRenderQueue(RenderQueue& queue);
+void UQueueSceneObjects(const GLMesh& mesh, const vector<SceneObject>& objects, const vector<GLuint>& visible, const glm::vec3& cameraPosition, GLuint frameFeatures, RenderQueue& queue);
+GLsizeiptr UDrawCommandsSpan(const GLStreamBuffer& stream, const GLMesh& mesh, const RenderQueue& queue);
+size_t UWriteDrawCommands(const GLMesh& mesh, const vector<SceneObject>& objects, const RenderQueue& queue, const glm::mat4& viewProjection, GLStreamBuffer& stream, GLDrawBuffers& buffers, vector<DrawElementsIndirectCommand>& commands, vector<DrawBatch>& batches);
+void UDestroyDrawBuffers(GLDrawBuffers& buffers);
+void UBuildPointLights(int count, vector<PointLight>& lights);
+void UAssignLights(const glm::mat4& view, const glm::mat4& projection, const vector<PointLight>& lights, vector<GLuint>& clusters, vector<GLuint>& clusterLights);
+void UClusterBufferSizes(const vector<PointLight>& lights, const vector<GLuint>& clusters, const vector<GLuint>& clusterLights, GLsizeiptr sizes[3]);
+GLsizeiptr UClusterBuffersSpan(const GLStreamBuffer& stream, const vector<PointLight>& lights, const vector<GLuint>& clusters, const vector<GLuint>& clusterLights);
+void UWriteClusterBuffers(GLStreamBuffer& stream, const vector<PointLight>& lights, const vector<GLuint>& clusters, const vector<GLuint>& clusterLights);
+void URunLightSweep();
+bool UCreateGBuffer(int width, int height, GLGBuffer& gbuffer);
+void UDestroyGBuffer(GLGBuffer& gbuffer);
+GLenum UQueryDepthFormat(GLuint fbo);
+bool UCreateHiZ(int width, int height, GLHiZ& hiz);
+void UCaptureHiZ(GLHiZ& hiz, GLuint sourceFbo, GLuint sourceDepth, const glm::mat4& viewProjection, const glm::vec3& cameraPosition);
+void UCollectHiZ(GLHiZ& hiz, HiZPyramid& pyramid);
+bool UIsOccluded(const HiZPyramid& pyramid, const glm::vec3& cameraPosition, const glm::vec3& objectMin, const glm::vec3& objectMax);
+GLuint UOcclusionCull(const HiZPyramid& pyramid, const glm::vec3& cameraPosition, vector<GLuint>& visible);
+void UDestroyHiZ(GLHiZ& hiz);
+void UUploadMesh(GLMesh& mesh, const Vertex* vertices, GLuint vertexCount, const void* indices, GLuint indexCount, GLenum indexType);
+GLushort UFloatToHalf(float value);
+GLuint UPackNormal(const GLfloat normal[3]);
+void UPackVertices(const Vertex* vertices, GLuint vertexCount, VertexFormat format, const glm::vec3& boundsMin, const glm::vec3& boundsMax, vector<PackedVertex>& packed);
+void USetVertexLayout(VertexFormat format);
+bool UMapFile(const char* filename, MappedFile& file);
+void UUnmapFile(MappedFile& file);
+bool ULoadMeshFile(const char* filename, GLMesh& mesh);
+bool UWriteMeshFile(const char* filename, const MeshData& data);
+bool ULoadObj(const char* filename, MeshData& data);
+bool URunConversion();
+void UGenerateLightmapUvs(MeshData& data);
+void UUploadLightmapUvs(GLMesh& mesh, const vector<glm::vec2>& uvs);
+void UBuildBakeScene(const MeshData& data, const vector<SceneObject>& objects, BakeScene& scene);
+bool UTraceBakeRay(const BakeScene& scene, const glm::vec3& origin, const glm::vec3& direction, float tMax, bool anyHit, float& distance, glm::vec3& normal);
+void ULightmapNeighbours(const vector<SceneObject>& objects, vector<vector<GLuint>>& neighbours);
+void ULightmapKeys(const vector<GLSubmesh>& submeshes, const vector<SceneObject>& objects, vector<uint64_t>& keys, vector<vector<GLuint>>& neighbours);
+string ULightmapCachePath(uint64_t key);
+bool UReadLightmapCache(uint64_t key, GLuint width, GLuint height, vector<unsigned char>& texels);
+void UWriteLightmapCache(uint64_t key, GLuint width, GLuint height, const vector<unsigned char>& texels);
+bool UBakeLightmaps(const MeshData& data, const vector<SceneObject>& objects);
+bool URunLightmapBake();
+void UCreateLightmapAtlas(const GLMesh& mesh, const vector<SceneObject>& objects, GLLightmap& lightmap);
+void UDestroyLightmap(GLLightmap& lightmap);
+unsigned UWorkerThreadCount();
+void URunParallel(size_t count, const function<void(size_t)>& job);
+void UStopWorkerPool();
+bool UWriteImagePpm(const string& filename, int width, int height, const uint32_t* pixels);
+bool USaveFrame(const string& filename);
+bool UPrepareTextureLayer(unsigned char* image, int width, int height, int channels, vector<unsigned char>& rgba);
+void ULoadSoftwareTextures(SoftwareRenderer& renderer);
+void USetupSoftwareTriangles(const SoftwareRenderer& renderer, GLuint first, GLuint count, const glm::mat4& viewProjection, SoftwareBin& bin);
+void URasterizeSoftwareTile(SoftwareRenderer& renderer, size_t tile, const SoftwareFrame& frame);
+void UCreateSoftwareRenderer(int width, int height, SoftwareRenderer& renderer);
+void URenderSoftware(SoftwareRenderer& renderer);
+bool URunSoftwareRenderer();
+void UExpandRgbToRgba(const unsigned char* src, unsigned char* dst, size_t pixels);
+void UExpandGrayToRgba(const unsigned char* src, unsigned char* dst, size_t pixels);
+void UExpandGrayAlphaToRgba(const unsigned char* src, unsigned char* dst, size_t pixels);
+void UPremultiplyAlpha(unsigned char* pixels, size_t count);
+void UDownsampleRgbaSrgb(const unsigned char* src, int srcWidth, int srcHeight, unsigned char* dst);
+bool UConvertToRgba(const unsigned char* src, int channels, size_t pixels, unsigned char* dst);
+bool URunImageBenchmark();
+bool UCheckBakePacketKernel();
+void UResampleImage(const unsigned char* src, int srcWidth, int srcHeight, int channels, unsigned char* dst, int dstWidth, int dstHeight);
+void UCreateTextureArray(GLuint& textureId, GLsizei layers);
+uint64_t UHashBytes(const void* data, size_t size, uint64_t hash = HASH_SEED);
+bool UReadFile(const string& filename, vector<unsigned char>& bytes);
+size_t UCompressedLevelSize(GLsizei size, GLint level);
+size_t UCompressedLayerSize();
+size_t UUncompressedLayerSize();
+void UCompressBC1Block(const float texels[16][3], unsigned char* out);
+void UCompressTextureLayer(const unsigned char* image, unsigned char* out);
+string UTextureCachePath(uint64_t sourceHash);
+bool UReadTextureCache(TextureLoadJob& job, uint64_t sourceHash);
+void UWriteTextureCache(const vector<unsigned char>& data, uint64_t sourceHash);
+void UDecodeTextureJob(TextureLoadJob& job);
+void UStartTextureLoads(const char* const* filenames, GLint count, GLuint textureId);
+bool UPollTextureLoads(GLuint textureId);
+void UFinishTextureLoads(GLuint textureId);
+void UDestroyTexture(GLuint textureId);
+double USimulationNow();
+void USimulationStep();
+void UPublishSnapshot(double time);
+SimulationPose UAcquirePose(double time);
+void USimulationThread();
+void UStartSimulation(bool threaded);
+void UStopSimulation();
+void ULogWrite(int level, const char* format, ...);
+bool ULogStart(const char* filename);
+void ULogStop();
+void URender();
+void UInvalidateStateCache();
+void UStateUseProgram(GLuint program);
+void UStateBindVertexArray(GLuint vertexArray);
+void UStateBindFramebuffer(GLuint framebuffer);
+void UStateActiveTexture(GLuint unit);
+void UStateBindTexture(GLuint unit, GLenum target, GLuint texture);
+void UStateEditTexture(GLenum target, GLuint texture);
+void UCheckStateCache();
+void USetTextureWrapMode(GLint mode);
+void UStateDepthTest(bool enabled);
+void UStateDepthFunc(GLenum func);
+void UStateClearColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a);
+void UStateFrameEnd();
+int64_t UProfileNow();
+void UProfileBegin(const char* name);
+void UProfileEnd();
+void UGpuTimerBegin(const char* name);
+void UGpuTimerEnd();
+void UProfileFrameEnd();
+void UProfileReset();
+void UPrintProfile();
+bool UWriteTrace(const char* filename);
+void UDestroyProfiler();
+void UMakeDirectory(const char* path);
+bool UDirectoryExists(const char* path);
+string UTemporaryPath(const string& path);
+uint64_t UShaderCacheKey(const char* vtxShaderSource, const char* fragShaderSource);
+string UShaderCachePath(uint64_t key);
+bool ULoadProgramBinary(GLuint programId, uint64_t key);
+void USaveProgramBinary(GLuint programId, uint64_t key);
+void UBeginShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLShaderBuild& build);
+bool UFinishShaderProgram(GLShaderBuild& build, GLuint& programId, GLProgramUniforms& uniforms);
+void UDestroyShaderProgram(GLuint programId);
+void UBuildShaderSources(GLuint features, string& vertexSource, string& fragmentSource);
+bool UBuildShaderVariants(const vector<GLuint>& featureSets);
+const ShaderVariant* UShaderVariant(GLuint features);
+void UDestroyShaderVariants();
+bool UCreateStreamBuffer(GLsizeiptr regionSize, GLStreamBuffer& stream);
+void UBeginStreamFrame(GLStreamBuffer& stream, GLsizeiptr bytes);
+GLsizeiptr UStreamSpan(const GLStreamBuffer& stream, GLsizeiptr size);
+void* UStreamAllocate(GLStreamBuffer& stream, GLsizeiptr size, GLintptr& offset);
+GLintptr UStreamWrite(GLStreamBuffer& stream, const void* data, GLsizeiptr size, GLsizeiptr allocationSize = 0);
+void UEndStreamFrame(GLStreamBuffer& stream);
+void UDestroyStreamBuffer(GLStreamBuffer& stream);
+
+
+/* Shader permutations. Every program of the scene is built from the bodies below behind a header
+ * defining each ShaderFeature as 0 or 1 (see UBuildShaderSources). The bodies test the features in
+ * constant conditions, so the compiler drops the code of disabled features from the variant.
+ */
+const GLchar* shaderVersionHeader = "#version 440 core\n";
+
+/* Cube Vertex Shader headers. OBJECT_INDEX locates the object being drawn in the Objects buffer:
+ * through the draw's entry in the Draws buffer when gl_DrawIDARB exists, else through an instanced attribute.
+ * A variant is drawn with one multi-draw per batch, firstDraw is the batch's first entry in the Draws buffer.
+ */
+const GLchar* cubeVertexHeaderDrawId =
+    "#extension GL_ARB_shader_draw_parameters : require\n"
+    "#define OBJECT_INDEX (drawFirstObject[firstDraw + uint(gl_DrawIDARB)] + uint(gl_InstanceID))\n";
+const GLchar* cubeVertexHeaderAttribute =
+    "#define OBJECT_INDEX instanceObject\n";
+
+/* Cube Vertex Shader Source Code*/
+const GLchar* cubeVertexShaderBody = GLSL_BODY(
+
+    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+layout(location = 1) in vec3 normal; // VAP position 1 for normals
+layout(location = 2) in vec2 textureCoordinate;
+layout(location = 3) in uint materialIndex; // Texture array layer
+layout(location = 4) in uint instanceObject; // baseInstance + gl_InstanceID
+layout(location = 5) in vec2 lightmapCoordinate; // In texels of the object's lightmap
+
+// Undoes the position quantization of compact vertex formats
+uniform vec3 positionScale;
+uniform vec3 positionOffset;
+uniform uint firstDraw;
+
+// Per-object matrices and material override, grouped by draw. The matrices are computed on the CPU.
+struct ObjectData
+{
+    mat4 model;
+    mat4 modelViewProjection;
+    mat3 normalMatrix; // Inverse transpose of the model matrix, only written for NORMAL_MATRIX draws
+    uint material;
+    vec4 lightmapRect; // Scale and offset of the object's lightmap in the atlas
+};
+
+layout(std430, binding = 1) readonly buffer Objects
+{
+    ObjectData objects[];
+};
+
+// First object of every draw of the multi-draw
+layout(std430, binding = 2) readonly buffer Draws
+{
+    uint drawFirstObject[];
+};
+
+out vec3 vertexNormal; // For outgoing normals to fragment shader
+out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
+out vec2 vertexTextureCoordinate;
+flat out uint vertexMaterial;
+out vec2 vertexLightmapCoordinate;
+
+void main()
+{
+    uint material = objects[OBJECT_INDEX].material;
+
+    vec4 objectPosition = vec4(position * positionScale + positionOffset, 1.0f);
+
+    gl_Position = objects[OBJECT_INDEX].modelViewProjection * objectPosition; // Transforms vertices into clip coordinates
+
+    vertexFragmentPos = vec3(objects[OBJECT_INDEX].model * objectPosition); // Gets fragment / pixel position in world space only (exclude view and projection)
+
+    // Normals to world space; without a non-uniform scale the model matrix itself does, the fragment shader renormalizes
+    mat3 normalMatrix = NORMAL_MATRIX != 0 ? objects[OBJECT_INDEX].normalMatrix : mat3(objects[OBJECT_INDEX].model);
+    vertexNormal = normalMatrix * normal;
+    vertexTextureCoordinate = textureCoordinate;
+    vertexMaterial = material == 0xFFFFFFFFu ? materialIndex : material; // MATERIAL_FROM_VERTEX
+    vertexLightmapCoordinate = lightmapCoordinate * objects[OBJECT_INDEX].lightmapRect.xy + objects[OBJECT_INDEX].lightmapRect.zw;
+}
+);
+
+
+/* Lighting shared by the forward cube fragment shader and the deferred lighting pass.
+ * Both shade a surface point through shade(), placed after the variant header and before their own main().
+ */
+const GLchar* lightingShaderBody = GLSL_BODY(
+
+    // Camera and light data, updated once per frame
+    layout(std140, binding = 0) uniform FrameData
+{
+    mat4 view;
+    mat4 projection;
+    vec4 viewPosition;
+    vec4 lightPos;
+    vec4 lightColor;
+    uvec4 clusterGrid; // Clusters along x, y and z, point light count
+    vec4 clusterParams; // Tile size in pixels, depth slice scale and bias
+} frame;
+
+// Point lights, and the lights reaching into each cluster of the view frustum
+struct PointLight
+{
+    vec4 positionRadius;
+    vec4 color;
+};
+
+layout(std430, binding = 3) readonly buffer Lights
+{
+    PointLight lights[];
+};
+
+layout(std430, binding = 4) readonly buffer Clusters
+{
+    uvec2 clusters[]; // First entry in clusterLights, light count
+};
+
+layout(std430, binding = 5) readonly buffer ClusterLights
+{
+    uint clusterLights[];
+};
+
+// Phong lighting of a world space point with a normalized normal, returns the lit color.
+// bakedAmbient is the sky the point sees (lightmap), 1 when nothing was baked.
+vec3 shade(vec3 fragmentPos, vec3 norm, vec3 albedo, float specularIntensity, float bakedAmbient)
+{
+    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
+
+    vec3 lightColor = frame.lightColor.xyz;
+    vec3 lightPos = frame.lightPos.xyz;
+    vec3 viewPosition = frame.viewPosition.xyz;
+
+    //Calculate Ambient lighting*/
+    float ambientStrength = 0.7f; // Set ambient or global lighting strength
+    vec3 ambient = ambientStrength * bakedAmbient * lightColor; // Generate ambient light color, occluded by the static scene
+
+    //Calculate Diffuse lighting*/
+    vec3 lightDirection = normalize(lightPos - fragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
+    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
+    vec3 diffuse = impact * lightColor; // Generate diffuse light color
+
+    //Calculate Specular lighting*/ (matte materials are built without it)
+    float highlightSize = 10.0f; // Set specular highlight size
+    vec3 viewDir = normalize(viewPosition - fragmentPos); // Calculate view direction
+    vec3 specular = vec3(0.0f);
+    if (SPECULAR != 0)
+    {
+        vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
+        //Calculate specular component
+        float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
+        specular = specularIntensity * specularComponent * lightColor;
+    }
+
+    // Point lights: only those assigned to this fragment's cluster (no lookup at all without lights)
+    vec3 pointLighting = vec3(0.0f);
+    if (POINT_LIGHTS != 0 && frame.clusterGrid.w > 0u)
+    {
+        float viewDepth = -(frame.view * vec4(fragmentPos, 1.0f)).z;
+        uvec3 cluster = uvec3(vec3(gl_FragCoord.xy / frame.clusterParams.xy, max(log(viewDepth) * frame.clusterParams.z + frame.clusterParams.w, 0.0f)));
+        cluster = min(cluster, frame.clusterGrid.xyz - 1u);
+        uvec2 clusterRange = clusters[(cluster.z * frame.clusterGrid.y + cluster.y) * frame.clusterGrid.x + cluster.x];
+
+        for (uint i = 0u; i < clusterRange.y; ++i)
+        {
+            PointLight light = lights[clusterLights[clusterRange.x + i]];
+            vec3 toLight = light.positionRadius.xyz - fragmentPos;
+            float lightDistance = length(toLight);
+
+            // Smooth falloff reaching zero at the radius the light was binned with
+            float falloff = clamp(1.0f - (lightDistance * lightDistance) / (light.positionRadius.w * light.positionRadius.w), 0.0f, 1.0f);
+            falloff *= falloff;
+
+            vec3 pointDirection = toLight / max(lightDistance, 0.0001f);
+            float pointLight = max(dot(norm, pointDirection), 0.0f);
+            if (SPECULAR != 0)
+                pointLight += specularIntensity * pow(max(dot(viewDir, reflect(-pointDirection, norm)), 0.0f), highlightSize);
+            pointLighting += pointLight * falloff * light.color.rgb;
+        }
+    }
+
+    // Calculate phong result
+    return (ambient + diffuse + specular + pointLighting) * albedo;
+}
+);
+
+
+/* Cube Fragment Shader Source Code, forward renderer: lights every fragment as it is drawn*/
+const GLchar* cubeFragmentShaderBody = GLSL_BODY(
+
+    in vec3 vertexNormal; // For incoming normals
+in vec3 vertexFragmentPos; // For incoming fragment position
+in vec2 vertexTextureCoordinate;
+flat in uint vertexMaterial;
+in vec2 vertexLightmapCoordinate;
+
+out vec4 fragmentColor; // For outgoing cube color to the GPU
+
+// Uniform / Global variables for object color and textures
+uniform vec3 objectColor; // Color of untextured materials
+uniform sampler2DArray uTextures; // All material textures, one layer per material
+uniform vec2 uvScale;
+uniform sampler2D uLightmap; // Baked ambient of the static scene
+
+void main()
+{
+    // Texture holds the color to be used for all three components
+    vec3 albedo = TEXTURED != 0 ? texture(uTextures, vec3(vertexTextureCoordinate * uvScale, float(vertexMaterial))).xyz : objectColor;
+
+    float bakedAmbient = LIGHTMAP != 0 ? texture(uLightmap, vertexLightmapCoordinate).r : 1.0f;
+
+    fragmentColor = vec4(shade(vertexFragmentPos, normalize(vertexNormal), albedo, 1.0f, bakedAmbient), 1.0); // Send lighting results to GPU
+}
+);
+
+
+/* G-buffer Fragment Shader Source Code, deferred renderer: stores the surface for the lighting pass*/
+const GLchar* gBufferFragmentShaderBody = GLSL_BODY(
+
+    in vec3 vertexNormal;
+in vec3 vertexFragmentPos;
+in vec2 vertexTextureCoordinate;
+flat in uint vertexMaterial;
+in vec2 vertexLightmapCoordinate;
+
+layout(location = 0) out vec4 gAlbedo;
+layout(location = 1) out vec4 gNormal;
+
+uniform vec3 objectColor;
+uniform sampler2DArray uTextures;
+uniform vec2 uvScale;
+uniform sampler2D uLightmap;
+
+void main()
+{
+    vec3 albedo = TEXTURED != 0 ? texture(uTextures, vec3(vertexTextureCoordinate * uvScale, float(vertexMaterial))).rgb : objectColor;
+    gAlbedo = vec4(albedo, SPECULAR != 0 ? 1.0f : 0.0f); // Specular intensity in alpha
+    float bakedAmbient = LIGHTMAP != 0 ? texture(uLightmap, vertexLightmapCoordinate).r : 1.0f;
+    gNormal = vec4(normalize(vertexNormal), bakedAmbient); // World space, the position comes back from the depth buffer
+}
+);
+
+
+/* Fullscreen passes (deferred lighting, Hi-Z reduction): one triangle covering the target, no vertex buffer*/
+const GLchar* fullscreenVertexShaderSource = GLSL(440,
+
+    void main()
+{
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(corner * 2.0f - 1.0f, 0.0f, 1.0f);
+}
+);
+
+const GLchar* deferredFragmentShaderBody = GLSL_BODY(
+
+    uniform sampler2D gAlbedo;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+uniform mat4 inverseViewProjection;
+
+out vec4 fragmentColor;
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gDepth, pixel, 0).r;
+    if (depth == 1.0f)
+        discard; // Nothing drawn here, keep the clear color
+
+    // World position from the window coordinates and the stored depth
+    vec4 ndc = vec4(vec3(gl_FragCoord.xy / vec2(textureSize(gDepth, 0)), depth) * 2.0f - 1.0f, 1.0f);
+    vec4 world = inverseViewProjection * ndc;
+
+    // Forward the scene depth so the lamp drawn afterwards is still hidden behind the scene
+    gl_FragDepth = depth;
+    vec4 albedo = texelFetch(gAlbedo, pixel, 0);
+    vec4 normal = texelFetch(gNormal, pixel, 0);
+    fragmentColor = vec4(shade(world.xyz / world.w, normalize(normal.xyz), albedo.rgb, albedo.a, normal.a), 1.0f);
+}
+);
+
+
+/* Hi-Z reduction: the farthest scene depth of every footprint x footprint square of pixels*/
+const GLchar* hiZFragmentShaderSource = GLSL(440,
+
+    uniform sampler2D sceneDepth;
+uniform int footprint;
+
+out float farthestDepth;
+
+void main()
+{
+    ivec2 first = ivec2(gl_FragCoord.xy) * footprint;
+    ivec2 last = min(first + footprint, textureSize(sceneDepth, 0)) - 1;
+
+    float depth = 0.0f;
+    for (int y = first.y; y <= last.y; ++y)
+        for (int x = first.x; x <= last.x; ++x)
+            depth = max(depth, texelFetch(sceneDepth, ivec2(x, y), 0).r);
+    farthestDepth = depth;
+}
+);
+
+
+/* Lamp Shader Source Code*/
+const GLchar* lampVertexShaderSource = GLSL(440,
+
+    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+
+//Uniform / Global variables for the  transform matrices, multiplied on the CPU
+uniform mat4 modelViewProjection;
+
+// Undoes the position quantization of compact vertex formats
+uniform vec3 positionScale;
+uniform vec3 positionOffset;
+
+void main()
+{
+    gl_Position = modelViewProjection * vec4(position * positionScale + positionOffset, 1.0f); // Transforms vertices into clip coordinates
+}
+);
+
+
+/* Fragment Shader Source Code*/
+const GLchar* lampFragmentShaderSource = GLSL(440,
+
+    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
+
+void main()
+{
+    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
+}
+);
+
+
+/* Image processing kernels used by the texture loader.
+ * Each kernel has a scalar version (used for leftovers and as reference) and is vectorized with
+ * SSE2, or AVX2 / SSSE3 where byte shuffles or wider registers help, when the compiler targets them.
+ */
+
+// Swaps two rows of bytes
+static void USwapRowsScalar(unsigned char* a, unsigned char* b, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; ++i)
+    {
+        unsigned char tmp = a[i];
+        a[i] = b[i];
+        b[i] = tmp;
+    }
+}
+
+
+static void USwapRows(unsigned char* a, unsigned char* b, size_t bytes)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= bytes; i += 32)
+    {
+        const __m256i rowA = _mm256_loadu_si256((const __m256i*)(a + i));
+        const __m256i rowB = _mm256_loadu_si256((const __m256i*)(b + i));
+        _mm256_storeu_si256((__m256i*)(a + i), rowB);
+        _mm256_storeu_si256((__m256i*)(b + i), rowA);
+    }
+#elif defined(USE_SSE2)
+    for (; i + 16 <= bytes; i += 16)
+    {
+        const __m128i rowA = _mm_loadu_si128((const __m128i*)(a + i));
+        const __m128i rowB = _mm_loadu_si128((const __m128i*)(b + i));
+        _mm_storeu_si128((__m128i*)(a + i), rowB);
+        _mm_storeu_si128((__m128i*)(b + i), rowA);
+    }
+#endif
+    USwapRowsScalar(a + i, b + i, bytes - i);
+}
+
+
+// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
+void flipImageVertically(unsigned char* image, int width, int height, int channels)
+{
+    const size_t rowBytes = (size_t)width * channels;
+    for (int j = 0; j < height / 2; ++j)
+        USwapRows(image + j * rowBytes, image + (height - 1 - j) * rowBytes, rowBytes);
+}
+
+
+// RGB -> RGBA with opaque alpha
+static void UExpandRgbToRgbaScalar(const unsigned char* src, unsigned char* dst, size_t pixels)
+{
+    for (size_t i = 0; i < pixels; ++i)
+    {
+        dst[i * 4 + 0] = src[i * 3 + 0];
+        dst[i * 4 + 1] = src[i * 3 + 1];
+        dst[i * 4 + 2] = src[i * 3 + 2];
+        dst[i * 4 + 3] = 255;
+    }
+}
+
+
+void UExpandRgbToRgba(const unsigned char* src, unsigned char* dst, size_t pixels)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    // Each 128-bit lane turns 4 RGB pixels (12 of the 16 loaded bytes) into 4 RGBA pixels
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+    for (; i * 3 + 28 <= pixels * 3; i += 8)
+    {
+        const __m128i low = _mm_loadu_si128((const __m128i*)(src + i * 3));
+        const __m128i high = _mm_loadu_si128((const __m128i*)(src + i * 3 + 12));
+        const __m256i rgb = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_or_si256(_mm256_shuffle_epi8(rgb, shuffle), alpha));
+    }
+#elif defined(__SSSE3__)
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    for (; i * 3 + 16 <= pixels * 3; i += 4)
+    {
+        const __m128i rgb = _mm_loadu_si128((const __m128i*)(src + i * 3));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_shuffle_epi8(rgb, shuffle), alpha));
+    }
+#endif
+    UExpandRgbToRgbaScalar(src + i * 3, dst + i * 4, pixels - i);
+}
+
+
+// Gray -> RGBA with opaque alpha
+static void UExpandGrayToRgbaScalar(const unsigned char* src, unsigned char* dst, size_t pixels)
+{
+    for (size_t i = 0; i < pixels; ++i)
+    {
+        dst[i * 4 + 0] = dst[i * 4 + 1] = dst[i * 4 + 2] = src[i];
+        dst[i * 4 + 3] = 255;
+    }
+}
+
+
+void UExpandGrayToRgba(const unsigned char* src, unsigned char* dst, size_t pixels)
+{
+    size_t i = 0;
+#if defined(USE_SSE2)
+    const __m128i opaque = _mm_set1_epi8((char)0xFF);
+    for (; i + 16 <= pixels; i += 16)
+    {
+        const __m128i gray = _mm_loadu_si128((const __m128i*)(src + i));
+        const __m128i grayGrayLow = _mm_unpacklo_epi8(gray, gray);
+        const __m128i grayGrayHigh = _mm_unpackhi_epi8(gray, gray);
+        const __m128i grayAlphaLow = _mm_unpacklo_epi8(gray, opaque);
+        const __m128i grayAlphaHigh = _mm_unpackhi_epi8(gray, opaque);
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_unpacklo_epi16(grayGrayLow, grayAlphaLow));
+        _mm_storeu_si128((__m128i*)(dst + i * 4 + 16), _mm_unpackhi_epi16(grayGrayLow, grayAlphaLow));
+        _mm_storeu_si128((__m128i*)(dst + i * 4 + 32), _mm_unpacklo_epi16(grayGrayHigh, grayAlphaHigh));
+        _mm_storeu_si128((__m128i*)(dst + i * 4 + 48), _mm_unpackhi_epi16(grayGrayHigh, grayAlphaHigh));
+    }
+#endif
+    UExpandGrayToRgbaScalar(src + i, dst + i * 4, pixels - i);
+}
+
+
+// Gray + alpha -> RGBA
+static void UExpandGrayAlphaToRgbaScalar(const unsigned char* src, unsigned char* dst, size_t pixels)
+{
+    for (size_t i = 0; i < pixels; ++i)
+    {
+        dst[i * 4 + 0] = dst[i * 4 + 1] = dst[i * 4 + 2] = src[i * 2];
+        dst[i * 4 + 3] = src[i * 2 + 1];
+    }
+}
+
+
+void UExpandGrayAlphaToRgba(const unsigned char* src, unsigned char* dst, size_t pixels)
+{
+    size_t i = 0;
+#if defined(USE_SSE2)
+    const __m128i lowByte = _mm_set1_epi16(0x00FF);
+    for (; i + 8 <= pixels; i += 8)
+    {
+        const __m128i grayAlpha = _mm_loadu_si128((const __m128i*)(src + i * 2));
+        const __m128i gray = _mm_and_si128(grayAlpha, lowByte);
+        const __m128i grayGray = _mm_or_si128(gray, _mm_slli_epi16(gray, 8));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_unpacklo_epi16(grayGray, grayAlpha));
+        _mm_storeu_si128((__m128i*)(dst + i * 4 + 16), _mm_unpackhi_epi16(grayGray, grayAlpha));
+    }
+#endif
+    UExpandGrayAlphaToRgbaScalar(src + i * 2, dst + i * 4, pixels - i);
+}
+
+
+// Multiplies RGB by alpha in place, rounding like x * a / 255
+static void UPremultiplyAlphaScalar(unsigned char* pixels, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        const unsigned alpha = pixels[i * 4 + 3];
+        for (int c = 0; c < 3; ++c)
+        {
+            const unsigned t = pixels[i * 4 + c] * alpha + 128;
+            pixels[i * 4 + c] = (unsigned char)((t + (t >> 8)) >> 8);
+        }
+    }
+}
+
+
+void UPremultiplyAlpha(unsigned char* pixels, size_t count)
+{
+    size_t i = 0;
+#if defined(USE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i colorLanes = _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0);
+    const __m128i alphaLanes = _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255); // Alpha is multiplied by 255/255
+    const __m128i half = _mm_set1_epi16(128);
+
+    auto premultiply = [&](__m128i values)
+    {
+        // Broadcast each pixel's alpha to its four 16-bit lanes
+        __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(values, 0xFF), 0xFF);
+        alpha = _mm_or_si128(_mm_and_si128(alpha, colorLanes), alphaLanes);
+        const __m128i t = _mm_add_epi16(_mm_mullo_epi16(values, alpha), half);
+        return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    };
+
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128i rgba = _mm_loadu_si128((const __m128i*)(pixels + i * 4));
+        const __m128i low = premultiply(_mm_unpacklo_epi8(rgba, zero));
+        const __m128i high = premultiply(_mm_unpackhi_epi8(rgba, zero));
+        _mm_storeu_si128((__m128i*)(pixels + i * 4), _mm_packus_epi16(low, high));
+    }
+#endif
+    UPremultiplyAlphaScalar(pixels + i * 4, count - i);
+}
+
+
+// sRGB <-> linear conversion tables for gamma correct filtering
+struct SrgbTables
+{
+    float toLinear[256];
+    unsigned char fromLinear[4096];     // Indexed by linear value * 4095
+};
+
+
+static const SrgbTables& USrgbTables()
+{
+    static const SrgbTables tables = []()
+    {
+        SrgbTables t;
+        for (int i = 0; i < 256; ++i)
+        {
+            const float c = i / 255.0f;
+            t.toLinear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+        }
+        for (int i = 0; i < 4096; ++i)
+        {
+            const float l = i / 4095.0f;
+            const float c = l <= 0.0031308f ? l * 12.92f : 1.055f * powf(l, 1.0f / 2.4f) - 0.055f;
+            t.fromLinear[i] = (unsigned char)(c * 255.0f + 0.5f);
+        }
+        return t;
+    }();
+    return tables;
+}
+
+
+// Halves an RGBA image with a 2x2 box filter, averaging color in linear light and alpha as is
+static void UDownsampleRgbaSrgbScalar(const unsigned char* src, int srcWidth, int srcHeight, unsigned char* dst, int y, int xBegin)
+{
+    const SrgbTables& tables = USrgbTables();
+    const int dstWidth = max(1, srcWidth / 2);
+    const unsigned char* row0 = src + (size_t)min(2 * y, srcHeight - 1) * srcWidth * 4;
+    const unsigned char* row1 = src + (size_t)min(2 * y + 1, srcHeight - 1) * srcWidth * 4;
+
+    for (int x = xBegin; x < dstWidth; ++x)
+    {
+        const int x0 = min(2 * x, srcWidth - 1) * 4;
+        const int x1 = min(2 * x + 1, srcWidth - 1) * 4;
+        unsigned char* out = dst + ((size_t)y * dstWidth + x) * 4;
+        for (int c = 0; c < 3; ++c)
+        {
+            const float sum = tables.toLinear[row0[x0 + c]] + tables.toLinear[row0[x1 + c]] + tables.toLinear[row1[x0 + c]] + tables.toLinear[row1[x1 + c]];
+            out[c] = tables.fromLinear[(int)(sum * 0.25f * 4095.0f + 0.5f)];
+        }
+        out[3] = (unsigned char)((row0[x0 + 3] + row0[x1 + 3] + row1[x0 + 3] + row1[x1 + 3] + 2) / 4);
+    }
+}
+
+
+void UDownsampleRgbaSrgb(const unsigned char* src, int srcWidth, int srcHeight, unsigned char* dst)
+{
+    const int dstWidth = max(1, srcWidth / 2);
+    const int dstHeight = max(1, srcHeight / 2);
+
+    for (int y = 0; y < dstHeight; ++y)
+    {
+        int x = 0;
+#if defined(USE_SSE2)
+        // Table lookups stay scalar, the color sums, scaling and rounding run as one vector
+        if (srcWidth >= 2 && srcHeight >= 2)
+        {
+            const float* toLinear = USrgbTables().toLinear;
+            const unsigned char* fromLinear = USrgbTables().fromLinear;
+            const unsigned char* row0 = src + (size_t)(2 * y) * srcWidth * 4;
+            const unsigned char* row1 = row0 + (size_t)srcWidth * 4;
+            const __m128 quarter = _mm_set1_ps(0.25f);
+            const __m128 range = _mm_set1_ps(4095.0f);
+            const __m128 half = _mm_set1_ps(0.5f);
+
+            auto decode = [toLinear](const unsigned char* p)
+            {
+                return _mm_setr_ps(toLinear[p[0]], toLinear[p[1]], toLinear[p[2]], 0.0f);
+            };
+
+            for (; x < dstWidth; ++x)
+            {
+                const unsigned char* p = row0 + x * 8;
+                const unsigned char* q = row1 + x * 8;
+                const __m128 sum = _mm_add_ps(_mm_add_ps(_mm_add_ps(decode(p), decode(p + 4)), decode(q)), decode(q + 4));
+                alignas(16) int32_t values[4];
+                _mm_store_si128((__m128i*)values, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(sum, quarter), range), half)));
+
+                unsigned char* out = dst + ((size_t)y * dstWidth + x) * 4;
+                out[0] = fromLinear[values[0]];
+                out[1] = fromLinear[values[1]];
+                out[2] = fromLinear[values[2]];
+                out[3] = (unsigned char)((p[3] + p[7] + q[3] + q[7] + 2) / 4);
+            }
+        }
+#endif
+        UDownsampleRgbaSrgbScalar(src, srcWidth, srcHeight, dst, y, x);
+    }
+}
+
+
+// Converts a decoded image with 1 to 4 channels to RGBA, returns false for unsupported layouts
+bool UConvertToRgba(const unsigned char* src, int channels, size_t pixels, unsigned char* dst)
+{
+    switch (channels)
+    {
+    case 1: UExpandGrayToRgba(src, dst, pixels); return true;
+    case 2: UExpandGrayAlphaToRgba(src, dst, pixels); return true;
+    case 3: UExpandRgbToRgba(src, dst, pixels); return true;
+    case 4: memcpy(dst, src, pixels * 4); return true;
+    default: return false;
+    }
+}
+
+
+// Measures kernel throughput on a 2048x2048 image and checks the vector paths against the scalar ones,
+// along with the lightmap baker's ray packet test
+bool URunImageBenchmark()
+{
+    const int size = 2048;
+    const size_t pixels = (size_t)size * size;
+    vector<unsigned char> rgba(pixels * 4), rgb(pixels * 3), gray(pixels), grayAlpha(pixels * 2);
+    vector<unsigned char> out(pixels * 4), reference(pixels * 4);
+
+    uint32_t seed = 12345;
+    auto next = [&seed]() { seed = seed * 1664525u + 1013904223u; return (unsigned char)(seed >> 24); };
+    for (unsigned char& v : rgba) v = next();
+    for (unsigned char& v : rgb) v = next();
+    for (unsigned char& v : gray) v = next();
+    for (unsigned char& v : grayAlpha) v = next();
+
+    bool allMatch = true;
+    auto report = [&allMatch](const char* name, size_t bytes, const function<void()>& kernel, bool matches)
+    {
+        // Repeat until at least 200 ms have been measured
+        int runs = 0;
+        const auto start = chrono::steady_clock::now();
+        double seconds = 0.0;
+        do
+        {
+            kernel();
+            ++runs;
+            seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        } while (seconds < 0.2);
+
+        cout << "IMAGE: " << name << ": " << (double)bytes * runs / seconds / (1024.0 * 1024.0) << " MB/s"
+            << (matches ? "" : "  MISMATCH with scalar reference") << endl;
+        allMatch = allMatch && matches;
+    };
+
+    auto same = [&out, &reference](size_t bytes) { return memcmp(out.data(), reference.data(), bytes) == 0; };
+
+    UExpandRgbToRgba(rgb.data(), out.data(), pixels);
+    UExpandRgbToRgbaScalar(rgb.data(), reference.data(), pixels);
+    report("rgb -> rgba", rgb.size(), [&]() { UExpandRgbToRgba(rgb.data(), out.data(), pixels); }, same(pixels * 4));
+
+    UExpandGrayToRgba(gray.data(), out.data(), pixels);
+    UExpandGrayToRgbaScalar(gray.data(), reference.data(), pixels);
+    report("gray -> rgba", gray.size(), [&]() { UExpandGrayToRgba(gray.data(), out.data(), pixels); }, same(pixels * 4));
+
+    UExpandGrayAlphaToRgba(grayAlpha.data(), out.data(), pixels);
+    UExpandGrayAlphaToRgbaScalar(grayAlpha.data(), reference.data(), pixels);
+    report("gray alpha -> rgba", grayAlpha.size(), [&]() { UExpandGrayAlphaToRgba(grayAlpha.data(), out.data(), pixels); }, same(pixels * 4));
+
+    out = rgba;
+    reference = rgba;
+    UPremultiplyAlpha(out.data(), pixels);
+    UPremultiplyAlphaScalar(reference.data(), pixels);
+    const bool premultiplyMatches = same(pixels * 4);
+    report("premultiply alpha", rgba.size(), [&]() { memcpy(out.data(), rgba.data(), rgba.size()); UPremultiplyAlpha(out.data(), pixels); }, premultiplyMatches);
+
+    out = rgba;
+    reference = rgba;
+    flipImageVertically(out.data(), size, size, 4);
+    for (int y = 0; y < size / 2; ++y)
+        USwapRowsScalar(&reference[(size_t)y * size * 4], &reference[(size_t)(size - 1 - y) * size * 4], (size_t)size * 4);
+    report("flip rows", rgba.size(), [&]() { flipImageVertically(out.data(), size, size, 4); }, same(pixels * 4));
+
+    // Floating point contraction may differ between the two paths, allow one step of difference
+    UDownsampleRgbaSrgb(rgba.data(), size, size, out.data());
+    for (int y = 0; y < size / 2; ++y)
+        UDownsampleRgbaSrgbScalar(rgba.data(), size, size, reference.data(), y, 0);
+    bool downsampleMatches = true;
+    for (size_t i = 0; i < pixels; ++i)
+        downsampleMatches = downsampleMatches && abs(out[i] - reference[i]) <= 1;
+    report("srgb mip downsample", rgba.size(), [&]() { UDownsampleRgbaSrgb(rgba.data(), size, size, out.data()); }, downsampleMatches);
+
+    allMatch = UCheckBakePacketKernel() && allMatch;
+    return allMatch;
+}
+
+
+int main(int argc, char* argv[])
+{
+    if (!UParseArguments(argc, argv))
+        return EXIT_FAILURE;
+
+    if (!ULogStart(gLogFile.c_str()))
+        return EXIT_FAILURE;
+
+    // Offline mesh conversion does not need a GL context
+    if (!gConvertOutput.empty())
+        return URunConversion() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    // Neither does the image kernel benchmark
+    if (gImageBenchmark)
+        return URunImageBenchmark() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    // Nor lightmap baking
+    if (gBakeLightmaps)
+    {
+        const bool baked = URunLightmapBake();
+        UStopWorkerPool();
+        return baked ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Nor the software renderer
+    if (gRenderer == RENDERER_SOFTWARE)
+    {
+        const bool rendered = URunSoftwareRenderer();
+        UStopWorkerPool();
+        return rendered ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (!UInitialize(argc, argv, &gWindow))
+        return EXIT_FAILURE;
+
+#ifdef GL_KHR_parallel_shader_compile
+    // Let the driver compile shader programs on its own threads
+    if (GLEW_KHR_parallel_shader_compile)
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+#endif
+
+    // gl_DrawIDARB lets the cube vertex shader find the objects of each draw of the multi-draw
+    gUseDrawParameters = gUseDrawParameters && GLEW_ARB_shader_draw_parameters;
+
+    // Start building the fixed shader programs; the driver works on them while the mesh and textures are set up
+    GLShaderBuild lampBuild, hiZBuild;
+    UBeginShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, lampBuild);
+    if (gOcclusionCulling)
+        UBeginShaderProgram(fullscreenVertexShaderSource, hiZFragmentShaderSource, hiZBuild);
+
+    // Create the mesh
+    if (!UCreateMesh(gMesh)) // Calls the function to create the Vertex Buffer Object
+        return EXIT_FAILURE;
+
+    // Place the scene objects and build the hierarchy they are culled with
+    UBuildScene(gMesh, gDeskCount, gSceneObjects);
+    UBuildBvh(gSceneObjects, gBvhNodes, gBvhObjects);
+    UCreateDrawBuffers(gMesh, gSceneObjects.size(), gDrawBuffers);
+    cout << "INFO: Scene: " << gSceneObjects.size() << " objects, " << gBvhNodes.size() << " BVH nodes" << endl;
+
+    // Baked ambient of the static scene, from the lightmap cache
+    if (gUseLightmaps)
+        UCreateLightmapAtlas(gMesh, gSceneObjects, gLightmap);
+
+    // Lamp: a unit sphere, scaled by gLightScale when drawn
+    MeshData lampData;
+    UAppendPrimitive(lampData, { "lamp", PRIMITIVE_SPHERE, glm::vec3(1.0f), 0.0f, glm::mat4(1.0f), 0 });
+    vector<GLushort> lampIndices(lampData.indices.begin(), lampData.indices.end());
+    UUploadMesh(gLampMesh, lampData.vertices.data(), (GLuint)lampData.vertices.size(), lampIndices.data(), (GLuint)lampIndices.size(), GL_UNSIGNED_SHORT);
+    gLampMesh.submeshes = lampData.submeshes;
+
+    // Point lights spread over the scene, binned into clusters every frame
+    UBuildPointLights(gPointLightCount, gPointLights);
+
+    // Per-frame camera, light and draw data is streamed through one persistently mapped buffer
+    if (!UCreateStreamBuffer(STREAM_INITIAL_REGION_SIZE, gStream))
+        return EXIT_FAILURE;
+
+    // Load the material textures into the layers of one texture array.
+    // They are decoded in the background, the first frames show placeholders.
+    // Compressed textures come from the on-disk cache (or are compressed into it on a miss)
+    gCompressTextures = gUseTextureCache && GLEW_EXT_texture_compression_s3tc;
+
+    UCreateTextureArray(gTextureArrayId, MATERIAL_COUNT);
+    UStartTextureLoads(MATERIAL_TEXTURE_FILES, MATERIAL_COUNT, gTextureArrayId);
+
+    // Build every shader variant the frame can switch to, so none is compiled mid-frame: the features of every object
+    // under those of the frame, also untextured in case its textures fail to load, and the deferred lighting pass.
+    // The light sweep turns the point light loop off and on.
+    const GLuint frameFeatures = UFrameShaderFeatures() & ~SHADER_POINT_LIGHTS;
+    vector<GLuint> lightFeatures = { ULightShaderFeatures() };
+    if (gLightSweep)
+        lightFeatures = { 0, SHADER_POINT_LIGHTS };
+
+    vector<GLuint> variants;
+    for (GLuint lights : lightFeatures)
+    {
+        for (const SceneObject& object : gSceneObjects)
+        {
+            GLuint features = UObjectShaderFeatures(gMesh, object) | frameFeatures;
+            if (gRenderer == RENDERER_FORWARD)
+                features |= lights;
+            variants.push_back(features);
+            variants.push_back(features & ~SHADER_TEXTURED);
+        }
+        if (gRenderer == RENDERER_DEFERRED)
+            variants.push_back(SHADER_DEFERRED_LIGHTING | SHADER_SPECULAR | lights);
+    }
+    sort(variants.begin(), variants.end());
+    variants.erase(unique(variants.begin(), variants.end()), variants.end());
+
+    if (!UBuildShaderVariants(variants))
+        return EXIT_FAILURE;
+    cout << "INFO: Built " << variants.size() << " shader variants" << endl;
+
+    // Wait for the fixed shader programs
+    if (!UFinishShaderProgram(lampBuild, gLampProgramId, gLampUniforms))
+        return EXIT_FAILURE;
+
+    // Fullscreen passes draw a triangle from gl_VertexID alone
+    glGenVertexArrays(1, &gFullscreenVao);
+
+    // Deferred renderer: G-buffer
+    if (gRenderer == RENDERER_DEFERRED && !UCreateGBuffer(gWindowWidth, gWindowHeight, gGBuffer))
+        return EXIT_FAILURE;
+
+    // Occlusion culling: depth reduction program, reduction targets and readback buffers
+    if (gOcclusionCulling)
+    {
+        GLProgramUniforms hiZUniforms;
+        if (!UFinishShaderProgram(hiZBuild, gHiZProgramId, hiZUniforms))
+            return EXIT_FAILURE;
+        glUniform1i(glGetUniformLocation(gHiZProgramId, "sceneDepth"), HIZ_DEPTH_UNIT);
+        glUniform1i(glGetUniformLocation(gHiZProgramId, "footprint"), HIZ_FOOTPRINT);
+
+        if (!UCreateHiZ(gWindowWidth, gWindowHeight, gHiZ))
+            return EXIT_FAILURE;
+    }
+
+    // Setup bound objects without going through the state cache, it starts from unknown state
+    UInvalidateStateCache();
+
+    // Sets the background color of the window to black (it will be implicitely used by glClear)
+    UStateClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+
+    // Camera and lamp advance at a fixed rate, on their own thread when there is a window
+    UStartSimulation(!gHeadless);
+
+    // Headless: render a fixed number of frames offscreen and report timings
+    if (gHeadless)
+    {
+        URunBenchmark();
+
+        if (!gFrameOutput.empty())
+            USaveFrame(gFrameOutput);
+
+        if (gLightSweep)
+            URunLightSweep();
+    }
+
+    // render loop
+    // -----------
+    while (!gHeadless && !glfwWindowShouldClose(gWindow))
+    {
+        UProfileBegin("frame");
+
+        // input
+        // -----
+        UProfileBegin("input");
+        UProcessInput(gWindow);
+        glfwPollEvents();
+        UProfileEnd();
+
+        // Upload any textures that finished decoding
+        UProfileBegin("texture uploads");
+        UPollTextureLoads(gTextureArrayId);
+        UProfileEnd();
+
+        // Render this frame. A minimized window has a 0x0 framebuffer, with nothing to draw into and no aspect ratio
+        // to project with: sleep until an event (the restore resizes it) instead.
+        if (gWindowWidth > 0 && gWindowHeight > 0)
+        {
+            URender();
+            if (gCheckState)
+                UCheckStateCache();
+        }
+        else
+            glfwWaitEvents();
+
+        UProfileEnd();
+        UProfileFrameEnd();
+    }
+
+    UStopSimulation();
+
+    // Let the texture loader finish before its buffers and texture go away
+    UFinishTextureLoads(gTextureArrayId);
+
+    UDestroyProfiler();
+
+    // Release mesh data
+    UDestroyDrawBuffers(gDrawBuffers);
+    UDestroyStreamBuffer(gStream);
+    UDestroyMesh(gMesh);
+    UDestroyMesh(gLampMesh);
+
+    // Release texture
+    UDestroyTexture(gTextureArrayId);
+    UDestroyLightmap(gLightmap);
+
+    // Release shader programs
+    UDestroyShaderVariants();
+    UDestroyShaderProgram(gLampProgramId);
+
+    if (gRenderer == RENDERER_DEFERRED)
+        UDestroyGBuffer(gGBuffer);
+
+    if (gOcclusionCulling)
+    {
+        UDestroyShaderProgram(gHiZProgramId);
+        UDestroyHiZ(gHiZ);
+    }
+    glDeleteVertexArrays(1, &gFullscreenVao);
+
+    if (gHeadless)
+        UDestroyHeadless();
+
+    UStopWorkerPool();
+    ULogStop();
+
+    exit(EXIT_SUCCESS); // Terminates the program successfully
+}
+
+
+// Initialize GLFW, GLEW, and create a windowdddddddddddddddddddd
+bool UInitialize(int argc, char* argv[], GLFWwindow** window)
+{
+    if (gHeadless)
+    {
+        if (!UCreateHeadlessContext())
+            return false;
+
+        // Displays GPU OpenGL version
+        cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
+        cout << "INFO: OpenGL Renderer: " << glGetString(GL_RENDERER) << endl;
+
+        return UCreateOffscreenTarget(gWindowWidth, gWindowHeight);
+    }
+
+    // GLFW: initialize and configure
+    // ------------------------------
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+
+    // GLFW: window creation
+    // ---------------------
+    * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+    if (*window == NULL)
+    {
+        std::cout << "Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return false;
+    }
+    glfwMakeContextCurrent(*window);
+    glfwSetFramebufferSizeCallback(*window, UResizeWindow);
+    glfwSetCursorPosCallback(*window, UMousePositionCallback);
+    glfwSetScrollCallback(*window, UMouseScrollCallback);
+    glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+
+    // tell GLFW to capture our mouse
+    glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+
+    // GLEW: initialize
+    // ----------------
+    // Note: if using GLEW version 1.13 or earlier
+    glewExperimental = GL_TRUE;
+    GLenum GlewInitResult = glewInit();
+
+    if (GLEW_OK != GlewInitResult)
+    {
+        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
+        return false;
+    }
+
+    // Displays GPU OpenGL version
+    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
+
+    return true;
+}
+
+
+// Reads the command line options:
+//   --headless        render offscreen (no window, works without a display or GPU)
+//   --frames N        number of timed frames in headless mode
+//   --warmup N        frames rendered before timing starts
+//   --size WxH        offscreen render resolution
+//   --no-texture-cache   decode JPEG/PNG every launch and keep textures uncompressed
+//   --no-shader-cache    compile the shaders every launch instead of loading cached program binaries
+//   --scene FILE      load scene geometry from a binary .umsh mesh file
+//   --desks N         render N copies of the scene laid out in a grid
+//   --no-culling      submit every object instead of only those in the view frustum
+//   --no-occlusion-culling   keep objects hidden behind others in an earlier frame's depth
+//   --no-draw-id      find per-object data through an instanced attribute instead of gl_DrawIDARB
+//   --vertex-format F float (36 bytes per vertex), or half / unorm16 positions with packed normals and UVs (16 bytes)
+//   --lights N        add N point lights spread over the scene (clustered forward shading)
+//   --light-sweep     after the headless benchmark, time the scene with 0 to 4096 point lights
+//   --move-objects    slide the mouse of every desk back and forth (BVH refit, Hi-Z invalidation)
+//   --check-state     compare the GL state cache with glGet queries after every frame; headless, stream textures
+//                     in during the warmup and cycle the wrap modes like the window does
+//   --renderer R      forward (light while drawing), deferred (G-buffer pass, then one lighting pass per pixel)
+//                     or software (CPU tile rasterizer, headless, built-in scene only)
+//   --threads N       worker threads of the software renderer and the lightmap baker (default: one per hardware thread)
+//   --frame-output FILE   write the last headless frame as a binary PPM image
+//   --trace FILE      record CPU scopes and GPU passes and write them as a Chrome trace on exit
+//   --log FILE        write log messages to FILE instead of stderr
+//   --convert IN OUT  convert an OBJ file to a .umsh mesh file and exit
+//   --export-scene OUT   write the built-in desk scene to a .umsh mesh file and exit
+//   --image-bench     measure the image processing kernels, check them and the bake's ray test, and exit
+//   --bake-lightmaps  bake the lightmaps of the built-in scene (--desks applies) that are missing or stale, and exit
+//   --no-lightmaps    light the ambient term without the baked lightmaps
+bool UParseArguments(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+
+        if (strcmp(arg, "--headless") == 0)
+            gHeadless = true;
+        else if (strcmp(arg, "--frames") == 0 && hasValue)
+            gBenchmarkFrames = atoi(argv[++i]);
+        else if (strcmp(arg, "--warmup") == 0 && hasValue)
+            gBenchmarkWarmup = atoi(argv[++i]);
+        else if (strcmp(arg, "--no-texture-cache") == 0)
+            gUseTextureCache = false;
+        else if (strcmp(arg, "--no-shader-cache") == 0)
+            gUseShaderCache = false;
+        else if (strcmp(arg, "--scene") == 0 && hasValue)
+            gSceneFile = argv[++i];
+        else if (strcmp(arg, "--desks") == 0 && hasValue)
+            gDeskCount = atoi(argv[++i]);
+        else if (strcmp(arg, "--no-culling") == 0)
+            gFrustumCulling = false;
+        else if (strcmp(arg, "--no-occlusion-culling") == 0)
+            gOcclusionCulling = false;
+        else if (strcmp(arg, "--no-draw-id") == 0)
+            gUseDrawParameters = false;
+        else if (strcmp(arg, "--vertex-format") == 0 && hasValue)
+        {
+            const char* format = argv[++i];
+            if (strcmp(format, "float") == 0)
+                gVertexFormat = VERTEX_FORMAT_FLOAT;
+            else if (strcmp(format, "half") == 0)
+                gVertexFormat = VERTEX_FORMAT_HALF;
+            else if (strcmp(format, "unorm16") == 0)
+                gVertexFormat = VERTEX_FORMAT_UNORM16;
+            else
+            {
+                cerr << "Invalid --vertex-format, expected float, half or unorm16: " << format << endl;
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--trace") == 0 && hasValue)
+        {
+            gTraceFile = argv[++i];
+            gProfiler.tracing = true;
+        }
+        else if (strcmp(arg, "--log") == 0 && hasValue)
+            gLogFile = argv[++i];
+        else if (strcmp(arg, "--convert") == 0 && i + 2 < argc)
+        {
+            gConvertInput = argv[++i];
+            gConvertOutput = argv[++i];
+        }
+        else if (strcmp(arg, "--export-scene") == 0 && hasValue)
+            gConvertOutput = argv[++i];
+        else if (strcmp(arg, "--lights") == 0 && hasValue)
+            gPointLightCount = atoi(argv[++i]);
+        else if (strcmp(arg, "--light-sweep") == 0)
+            gLightSweep = true;
+        else if (strcmp(arg, "--move-objects") == 0)
+            gMoveObjects = true;
+        else if (strcmp(arg, "--check-state") == 0)
+            gCheckState = true;
+        else if (strcmp(arg, "--bake-lightmaps") == 0)
+            gBakeLightmaps = true;
+        else if (strcmp(arg, "--no-lightmaps") == 0)
+            gUseLightmaps = false;
+        else if (strcmp(arg, "--renderer") == 0 && hasValue)
+        {
+            const char* renderer = argv[++i];
+            if (strcmp(renderer, "forward") == 0)
+                gRenderer = RENDERER_FORWARD;
+            else if (strcmp(renderer, "deferred") == 0)
+                gRenderer = RENDERER_DEFERRED;
+            else if (strcmp(renderer, "software") == 0)
+                gRenderer = RENDERER_SOFTWARE;
+            else
+            {
+                cerr << "Invalid --renderer, expected forward, deferred or software: " << renderer << endl;
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--image-bench") == 0)
+            gImageBenchmark = true;
+        else if (strcmp(arg, "--threads") == 0 && hasValue)
+            gWorkerThreads = (unsigned)max(0, atoi(argv[++i]));
+        else if (strcmp(arg, "--frame-output") == 0 && hasValue)
+            gFrameOutput = argv[++i];
+        else if (strcmp(arg, "--size") == 0 && hasValue)
+        {
+            if (sscanf(argv[++i], "%dx%d", &gWindowWidth, &gWindowHeight) != 2)
+            {
+                cerr << "Invalid --size, expected WIDTHxHEIGHT: " << argv[i] << endl;
+                return false;
+            }
+        }
+        else
+        {
+            cerr << "Unknown or incomplete argument: " << arg << endl;
+            cerr << "Usage: " << argv[0] << " [--headless] [--frames N] [--warmup N] [--size WxH] [--scene FILE.umsh] [--desks N] [--no-culling] [--no-occlusion-culling] [--no-draw-id] [--vertex-format float|half|unorm16] [--lights N] [--light-sweep] [--move-objects] [--check-state] [--renderer forward|deferred|software] [--threads N] [--frame-output FILE.ppm] [--trace FILE.json] [--log FILE] [--no-texture-cache] [--no-shader-cache] [--no-lightmaps]" << endl;
+            cerr << "       " << argv[0] << " --convert IN.obj OUT.umsh | --export-scene OUT.umsh | --image-bench | --bake-lightmaps [--desks N]" << endl;
+            return false;
+        }
+    }
+
+    if (gBenchmarkFrames < 1 || gBenchmarkWarmup < 0 || gWindowWidth < 1 || gWindowHeight < 1 || gDeskCount < 1)
+    {
+        cerr << "Frame counts, desk count and render size must be positive" << endl;
+        return false;
+    }
+
+    // Without frustum culling every object is submitted, hidden or not
+    gOcclusionCulling = gOcclusionCulling && gFrustumCulling;
+
+    return true;
+}
+
+
+// Creates an OpenGL 4.4 core context that has no window attached to it
+bool UCreateHeadlessContext()
+{
+#ifdef __linux__
+    // Prefer Mesa's surfaceless platform so no X11/Wayland display is needed
+    PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (eglGetPlatformDisplayEXT)
+        gEglDisplay = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (gEglDisplay == EGL_NO_DISPLAY)
+        gEglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    if (gEglDisplay == EGL_NO_DISPLAY || !eglInitialize(gEglDisplay, NULL, NULL))
+    {
+        cerr << "Failed to initialize EGL display" << endl;
+        return false;
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+    {
+        cerr << "EGL does not support desktop OpenGL" << endl;
+        return false;
+    }
+
+    // We never render to an EGL surface, so any OpenGL capable config will do
+    const EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config = NULL;
+    EGLint numConfigs = 0;
+    eglChooseConfig(gEglDisplay, configAttribs, &config, 1, &numConfigs);
+
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 4,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    gEglContext = eglCreateContext(gEglDisplay, numConfigs > 0 ? config : EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, contextAttribs);
+    if (gEglContext == EGL_NO_CONTEXT || !eglMakeCurrent(gEglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, gEglContext))
+    {
+        cerr << "Failed to create a surfaceless OpenGL 4.4 context" << endl;
+        return false;
+    }
+#else
+    // Elsewhere fall back to a hidden GLFW window, we only ever draw into the FBO
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+
+    gWindow = glfwCreateWindow(1, 1, WINDOW_TITLE, NULL, NULL);
+    if (gWindow == NULL)
+    {
+        cerr << "Failed to create hidden GLFW window" << endl;
+        glfwTerminate();
+        return false;
+    }
+    glfwMakeContextCurrent(gWindow);
+#endif
+
+    glewExperimental = GL_TRUE;
+    GLenum GlewInitResult = glewInit();
+
+    // GLEW built for GLX reports a missing GLX display on EGL contexts, the GL entry points are loaded regardless
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    if (GlewInitResult == GLEW_ERROR_NO_GLX_DISPLAY)
+        GlewInitResult = GLEW_OK;
+#endif
+    if (GLEW_OK != GlewInitResult)
+    {
+        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+// Creates the framebuffer object the headless frames are rendered into
+bool UCreateOffscreenTarget(int width, int height)
+{
+    glGenFramebuffers(1, &gOffscreenFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gOffscreenFbo);
+
+    glGenRenderbuffers(1, &gOffscreenColor);
+    glBindRenderbuffer(GL_RENDERBUFFER, gOffscreenColor);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, gOffscreenColor);
+
+    glGenRenderbuffers(1, &gOffscreenDepth);
+    glBindRenderbuffer(GL_RENDERBUFFER, gOffscreenDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, gOffscreenDepth);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cerr << "Offscreen framebuffer is incomplete" << endl;
+        return false;
+    }
+
+    glViewport(0, 0, width, height);
+    return true;
+}
+
+
+void UDestroyHeadless()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteRenderbuffers(1, &gOffscreenColor);
+    glDeleteRenderbuffers(1, &gOffscreenDepth);
+    glDeleteFramebuffers(1, &gOffscreenFbo);
+
+#ifdef __linux__
+    eglMakeCurrent(gEglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(gEglDisplay, gEglContext);
+    eglTerminate(gEglDisplay);
+#else
+    glfwDestroyWindow(gWindow);
+    glfwTerminate();
+#endif
+}
+
+
+// Renders gBenchmarkFrames frames offscreen and prints frame time statistics
+void URunBenchmark()
+{
+    // Time the scene with its real textures, not the placeholders. State checks stream them in during the
+    // warmup like the window does, from the second frame on when earlier passes have left other texture units
+    // active, while the wrap mode keys are cycled, and compare the state cache with GL after every frame.
+    if (!gCheckState)
+        UFinishTextureLoads(gTextureArrayId);
+
+    // One simulation tick per frame, on this thread, so every run animates the lamp identically
+    const GLint wrapModes[] = { GL_MIRRORED_REPEAT, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_BORDER, GL_REPEAT };
+    for (int i = 0; i < gBenchmarkWarmup; ++i)
+    {
+        if (gCheckState)
+        {
+            USetTextureWrapMode(wrapModes[i % 4]);
+            if (i > 0)
+                UPollTextureLoads(gTextureArrayId);
+        }
+        USimulationStep();
+        UPublishSnapshot(USimulationNow());
+        URender();
+        if (gCheckState)
+            UCheckStateCache();
+    }
+    if (gCheckState)
+    {
+        USetTextureWrapMode(GL_REPEAT);
+        UFinishTextureLoads(gTextureArrayId);
+    }
+    glFinish();
+
+    // Only the timed frames go into the profile
+    UProfileReset();
+
+    vector<double> frameTimes;
+    frameTimes.reserve(gBenchmarkFrames);
+
+    for (int i = 0; i < gBenchmarkFrames; ++i)
+    {
+        const auto start = chrono::steady_clock::now();
+        UProfileBegin("frame");
+
+        UProfileBegin("update");
+        USimulationStep();
+        UPublishSnapshot(USimulationNow());
+        UProfileEnd();
+
+        URender();
+        if (gCheckState)
+            UCheckStateCache();
+
+        UProfileBegin("finish");
+        glFinish(); // Wait for the GPU (or the software rasterizer) so the frame cost is fully counted
+        UProfileEnd();
+
+        UProfileEnd();
+        UProfileFrameEnd();
+        const auto end = chrono::steady_clock::now();
+        frameTimes.push_back(chrono::duration<double, milli>(end - start).count());
+    }
+
+    double total = 0.0;
+    for (double t : frameTimes)
+        total += t;
+
+    sort(frameTimes.begin(), frameTimes.end());
+    const double mean = total / frameTimes.size();
+    const size_t p99Index = (size_t)ceil(0.99 * frameTimes.size()) - 1;
+
+    cout << "BENCHMARK: " << gWindowWidth << "x" << gWindowHeight << ", " << RENDERER_NAMES[gRenderer] << " renderer, " << frameTimes.size() << " frames" << endl;
+    cout << "BENCHMARK: min " << frameTimes.front() << " ms, mean " << mean << " ms, p99 " << frameTimes[p99Index] << " ms" << endl;
+    cout << "BENCHMARK: " << 1000.0 / mean << " fps" << endl;
+    cout << "BENCHMARK: " << gSceneObjects.size() << " objects, " << gVisibleObjects.size() << " visible, "
+        << gSceneObjects.size() - gVisibleObjects.size() - gOcclusionCulled << " frustum culled, " << gOcclusionCulled << " occlusion culled, "
+        << gDrawCommands.size() << " draws in " << gDrawBatches.size() << " multi-draw calls (one per shader variant)" << endl;
+    cout << "BENCHMARK: state changes per frame: " << gStateCache.frameChanges << " made, " << gStateCache.frameAvoided << " skipped by the state cache" << endl;
+    if (gCheckState)
+        cout << "BENCHMARK: state check: " << gStateCache.mismatches << " differences between the state cache and GL over " << gBenchmarkWarmup + gBenchmarkFrames << " frames" << endl;
+    cout << "BENCHMARK: stream buffer: " << STREAM_REGIONS << " regions of " << gStream.regionSize / 1024 << " KB, "
+        << gStream.stalls << " frames waited for the GPU to release their region" << endl;
+
+    GLuint lodObjects[PRIMITIVE_LOD_COUNT] = {};
+    for (GLuint objectIndex : gVisibleObjects)
+        ++lodObjects[min(gSceneObjects[objectIndex].lod, (GLuint)PRIMITIVE_LOD_COUNT - 1)];
+    cout << "BENCHMARK: visible objects per level of detail:";
+    for (int level = 0; level < PRIMITIVE_LOD_COUNT; ++level)
+        cout << " " << lodObjects[level];
+    cout << endl;
+    UPrintProfile();
+}
+
+
+// --light-sweep: frame time of the scene as the number of point lights grows
+void URunLightSweep()
+{
+    const int lightCounts[] = { 0, 16, 64, 256, 1024, 4096 };
+
+    // CPU milliseconds spent in UAssignLights so far
+    auto assignment = []()
+    {
+        for (const ProfileStat& stat : gProfiler.stats)
+        {
+            if (!stat.gpu && strcmp(stat.name, "light assignment") == 0)
+                return stat.runTotal;
+        }
+        return 0.0;
+    };
+
+    for (int count : lightCounts)
+    {
+        UBuildPointLights(count, gPointLights);
+        for (int i = 0; i < gBenchmarkWarmup; ++i)
+            URender();
+        glFinish();
+
+        const double assignmentStart = assignment();
+        const auto start = chrono::steady_clock::now();
+        for (int i = 0; i < gBenchmarkFrames; ++i)
+            URender();
+        glFinish();
+        const double mean = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / max(gBenchmarkFrames, 1);
+        const double assignmentMean = (assignment() - assignmentStart) / max(gBenchmarkFrames, 1);
+
+        cout << "BENCHMARK: " << RENDERER_NAMES[gRenderer] << ", " << count << " point lights: mean " << mean << " ms, "
+            << gClusterLights.size() << " cluster light references, assigned in " << assignmentMean << " ms on " << UWorkerThreadCount() << " threads" << endl;
+    }
+}
+
+
+// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
+void UProcessInput(GLFWwindow* window)
+{
+    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+        glfwSetWindowShouldClose(window, true);
+
+    // Camera movement keys are handed to the simulation, which moves by a fixed step per tick
+    // Q and E move up and down
+    const int movementKeys[][2] = {
+        { GLFW_KEY_W, FORWARD }, { GLFW_KEY_S, BACKWARD }, { GLFW_KEY_A, LEFT },
+        { GLFW_KEY_D, RIGHT }, { GLFW_KEY_Q, UPWARD }, { GLFW_KEY_E, DOWNWARD },
+    };
+    unsigned heldKeys = 0;
+    for (const auto& key : movementKeys)
+    {
+        if (glfwGetKey(window, key[0]) == GLFW_PRESS)
+            heldKeys |= 1u << key[1];
+    }
+
+    if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS && gTexWrapMode != GL_REPEAT)
+    {
+        USetTextureWrapMode(GL_REPEAT);
+        ULOG_INFO("Current Texture Wrapping Mode: REPEAT");
+    }
+    else if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS && gTexWrapMode != GL_MIRRORED_REPEAT)
+    {
+        USetTextureWrapMode(GL_MIRRORED_REPEAT);
+        ULOG_INFO("Current Texture Wrapping Mode: MIRRORED REPEAT");
+    }
+    else if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_EDGE)
+    {
+        USetTextureWrapMode(GL_CLAMP_TO_EDGE);
+        ULOG_INFO("Current Texture Wrapping Mode: CLAMP TO EDGE");
+    }
+    else if (glfwGetKey(window, GLFW_KEY_4) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_BORDER)
+    {
+        USetTextureWrapMode(GL_CLAMP_TO_BORDER);
+        ULOG_INFO("Current Texture Wrapping Mode: CLAMP TO BORDER");
+    }
+
+    if (glfwGetKey(window, GLFW_KEY_RIGHT_BRACKET) == GLFW_PRESS)
+    {
+        gUVScale += 0.1f;
+        ULOG_INFO("Current scale (%g, %g)", gUVScale[0], gUVScale[1]);
+    }
+    else if (glfwGetKey(window, GLFW_KEY_LEFT_BRACKET) == GLFW_PRESS)
+    {
+        gUVScale -= 0.1f;
+        ULOG_INFO("Current scale (%g, %g)", gUVScale[0], gUVScale[1]);
+    }
+
+    lock_guard<mutex> lock(gInputMutex);
+    gInput.movementKeys = heldKeys;
+
+    // Pause and resume lamp orbiting
+    if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS)
+        gInput.lampOrbiting = true;
+    else if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS)
+        gInput.lampOrbiting = false;
+}
+
+
+// Wrap mode of the material textures (keys 1 to 4); the border color shows where clamping starts
+void USetTextureWrapMode(GLint mode)
+{
+    const float borderColor[] = { 1.0f, 0.0f, 1.0f, 1.0f };
+
+    UStateEditTexture(GL_TEXTURE_2D_ARRAY, gTextureArrayId);
+    if (mode == GL_CLAMP_TO_BORDER)
+        glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, borderColor);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, mode);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, mode);
+    gTexWrapMode = mode;
+}
+
+
+// glfw: whenever the window size changed (by OS or user resize) this callback function executes
+void UResizeWindow(GLFWwindow* window, int width, int height)
+{
+    gWindowWidth = width;
+    gWindowHeight = height;
+    glViewport(0, 0, width, height);
+}
+
+
+// glfw: whenever the mouse moves, this callback is called
+// -------------------------------------------------------
+void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+{
+    if (gFirstMouse)
+    {
+        gLastX = xpos;
+        gLastY = ypos;
+        gFirstMouse = false;
+    }
+
+    float xoffset = xpos - gLastX;
+    float yoffset = gLastY - ypos; // reversed since y-coordinates go from bottom to top
+
+    gLastX = xpos;
+    gLastY = ypos;
+
+    lock_guard<mutex> lock(gInputMutex);
+    gInput.mouseX += xoffset;
+    gInput.mouseY += yoffset;
+}
+
+
+// glfw: whenever the mouse scroll wheel scrolls, this callback is called
+// ----------------------------------------------------------------------
+void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
+{
+    lock_guard<mutex> lock(gInputMutex);
+    gInput.scroll += (float)yoffset;
+}
+
+// glfw: handle mouse button events
+// --------------------------------
+void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+{
+    switch (button)
+    {
+    case GLFW_MOUSE_BUTTON_LEFT:
+    {
+        if (action == GLFW_PRESS)
+            ULOG_DEBUG("Left mouse button pressed");
+        else
+            ULOG_DEBUG("Left mouse button released");
+    }
+    break;
+
+    case GLFW_MOUSE_BUTTON_MIDDLE:
+    {
+        if (action == GLFW_PRESS)
+            ULOG_DEBUG("Middle mouse button pressed");
+        else
+            ULOG_DEBUG("Middle mouse button released");
+    }
+    break;
+
+    case GLFW_MOUSE_BUTTON_RIGHT:
+    {
+        if (action == GLFW_PRESS)
+            ULOG_DEBUG("Right mouse button pressed");
+        else
+            ULOG_DEBUG("Right mouse button released");
+    }
+    break;
+
+    default:
+        ULOG_DEBUG("Unhandled mouse button event");
+        break;
+    }
+}
+
+
+// Formats a message into the calling thread's ring; drops it if the ring is full instead of waiting
+void ULogWrite(int level, const char* format, ...)
+{
+    // A thread looks for a ring once; without one, its messages are only counted
+    thread_local LogRing* ring = nullptr;
+    thread_local bool ringless = false;
+    if (!ring)
+    {
+        if (!ringless)
+        {
+            const unsigned index = gLogger.ringCount.fetch_add(1);
+            if (index < LOG_MAX_THREADS)
+            {
+                ring = new LogRing();
+                gLogger.rings[index].store(ring, memory_order_release);
+            }
+            ringless = !ring;
+        }
+        if (ringless)
+        {
+            gLogger.ringlessDropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    const size_t head = ring->head.load(memory_order_relaxed);
+    if (head - ring->tail.load(memory_order_acquire) >= LOG_RING_SIZE)
+    {
+        ring->dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    LogRecord& record = ring->records[head % LOG_RING_SIZE];
+    record.timeUs = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - gLogger.origin).count();
+    record.level = level;
+
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(record.text, sizeof(record.text), format, arguments);
+    va_end(arguments);
+
+    ring->head.store(head + 1, memory_order_release);
+}
+
+
+// Writes out everything queued so far; only called by the drain thread (or after it stopped)
+static bool ULogDrain()
+{
+    static const char* const levelNames[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+    bool wroteAny = false;
+    const unsigned ringCount = min(gLogger.ringCount.load(), LOG_MAX_THREADS);
+    for (unsigned i = 0; i < ringCount; ++i)
+    {
+        LogRing* ring = gLogger.rings[i].load(memory_order_acquire);
+        if (!ring)
+            continue;
+
+        size_t tail = ring->tail.load(memory_order_relaxed);
+        const size_t head = ring->head.load(memory_order_acquire);
+        for (; tail != head; ++tail)
+        {
+            const LogRecord& record = ring->records[tail % LOG_RING_SIZE];
+            fprintf(gLogger.output, "[%10.3f] %-5s %s\n", record.timeUs / 1e6, levelNames[record.level], record.text);
+            wroteAny = true;
+        }
+        ring->tail.store(tail, memory_order_release);
+
+        const uint64_t dropped = ring->dropped.exchange(0, memory_order_relaxed);
+        if (dropped > 0)
+            fprintf(gLogger.output, "[%10s] %-5s %llu log messages dropped\n", "", "WARN", (unsigned long long)dropped);
+    }
+
+    const uint64_t ringlessDropped = gLogger.ringlessDropped.exchange(0, memory_order_relaxed);
+    if (ringlessDropped > 0)
+        fprintf(gLogger.output, "[%10s] %-5s %llu log messages dropped from threads past %u\n", "", "WARN", (unsigned long long)ringlessDropped, LOG_MAX_THREADS);
+
+    if (wroteAny)
+        fflush(gLogger.output);
+    return wroteAny;
+}
+
+
+// Starts the drain thread; messages go to the given file, or stderr without one
+bool ULogStart(const char* filename)
+{
+    gLogger.output = stderr;
+    if (filename && *filename)
+    {
+        gLogger.output = fopen(filename, "w");
+        if (!gLogger.output)
+        {
+            cerr << "Failed to open log file " << filename << endl;
+            gLogger.output = stderr;
+            return false;
+        }
+    }
+
+    gLogger.running = true;
+    gLogger.drainer = thread([]()
+        {
+            while (gLogger.running.load(memory_order_relaxed))
+            {
+                if (!ULogDrain())
+                    this_thread::sleep_for(chrono::milliseconds(LOG_DRAIN_INTERVAL_MS));
+            }
+        });
+
+    // Also flush on early returns from main
+    atexit(ULogStop);
+    return true;
+}
+
+
+// Stops the drain thread after it wrote out what is queued
+void ULogStop()
+{
+    if (!gLogger.drainer.joinable())
+        return;
+
+    gLogger.running = false;
+    gLogger.drainer.join();
+    ULogDrain();
+
+    if (gLogger.output != stderr)
+        fclose(gLogger.output);
+    gLogger.output = stderr;
+}
+
+
+// Seconds on the simulation clock (steady, shared by both threads)
+double USimulationNow()
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - gSimulation.origin).count();
+}
+
+
+// Renderer facing state of the simulation at the current tick
+static SimulationPose UCapturePose()
+{
+    SimulationPose pose;
+    pose.cameraPosition = gCamera.Position;
+    pose.cameraFront = gCamera.Front;
+    pose.cameraUp = gCamera.Up;
+    pose.cameraZoom = gCamera.Zoom;
+    pose.lightPosition = gLightPosition;
+    pose.objectSlide = OBJECT_SLIDE_DISTANCE * sin(gObjectSlidePhase);
+    return pose;
+}
+
+
+// Advances camera and lamp by one fixed tick, consuming the input gathered since the previous tick
+void USimulationStep()
+{
+    InputState input;
+    {
+        lock_guard<mutex> lock(gInputMutex);
+        input = gInput;
+        gInput.mouseX = gInput.mouseY = gInput.scroll = 0.0f;
+    }
+
+    const float dt = (float)SIMULATION_TICK;
+
+    const Camera_Movement movements[] = { FORWARD, BACKWARD, LEFT, RIGHT, UPWARD, DOWNWARD };
+    for (Camera_Movement movement : movements)
+    {
+        if (input.movementKeys & (1u << movement))
+            gCamera.ProcessKeyboard(movement, dt);
+    }
+    if (input.mouseX != 0.0f || input.mouseY != 0.0f)
+        gCamera.ProcessMouseMovement(input.mouseX, input.mouseY);
+    if (input.scroll != 0.0f)
+        gCamera.ProcessMouseScroll(input.scroll);
+
+    // Lamp orbits around the origin
+    gIsLampOrbiting = input.lampOrbiting;
+    const float angularVelocity = glm::radians(45.0f);
+    if (gIsLampOrbiting)
+    {
+        glm::vec4 newPosition = glm::rotate(angularVelocity * dt, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(gLightPosition, 3.0f);
+        gLightPosition.x = newPosition.x;
+        gLightPosition.y = newPosition.y;
+        gLightPosition.z = newPosition.z;
+    }
+
+    if (gMoveObjects)
+        gObjectSlidePhase += OBJECT_SLIDE_SPEED * dt;
+}
+
+
+/* Publishes the state of the tick that just ran. The writer fills its private slot and swaps it
+ * with the shared middle slot; the reader swaps the middle slot with its own when it is marked fresh.
+ * Neither side ever waits, and a slot is never written while the other thread reads it.
+ */
+void UPublishSnapshot(double time)
+{
+    SimulationSnapshot& snapshot = gSimulation.snapshots[gSimulation.backSlot];
+    snapshot.tick = ++gSimulation.tick;
+    snapshot.time = time;
+    snapshot.previous = gSimulation.lastPose;
+    snapshot.current = UCapturePose();
+    gSimulation.lastPose = snapshot.current;
+
+    const unsigned previousMiddle = gSimulation.middleSlot.exchange(gSimulation.backSlot | SNAPSHOT_FRESH, memory_order_acq_rel);
+    gSimulation.backSlot = previousMiddle & SNAPSHOT_SLOT_MASK;
+}
+
+
+// Latest published state, interpolated between its two ticks for the given time
+SimulationPose UAcquirePose(double time)
+{
+    if (gSimulation.middleSlot.load(memory_order_acquire) & SNAPSHOT_FRESH)
+    {
+        const unsigned previousMiddle = gSimulation.middleSlot.exchange(gSimulation.frontSlot, memory_order_acq_rel);
+        gSimulation.frontSlot = previousMiddle & SNAPSHOT_SLOT_MASK;
+    }
+
+    const SimulationSnapshot& snapshot = gSimulation.snapshots[gSimulation.frontSlot];
+
+    // Rendering runs a tick behind: the previous tick is shown at the current tick's time and
+    // blended towards the current one over the following tick
+    const float alpha = (float)glm::clamp((time - snapshot.time) / SIMULATION_TICK, 0.0, 1.0);
+    const SimulationPose& a = snapshot.previous;
+    const SimulationPose& b = snapshot.current;
+
+    SimulationPose pose;
+    pose.cameraPosition = glm::mix(a.cameraPosition, b.cameraPosition, alpha);
+    pose.cameraFront = glm::normalize(glm::mix(a.cameraFront, b.cameraFront, alpha));
+    pose.cameraUp = glm::normalize(glm::mix(a.cameraUp, b.cameraUp, alpha));
+    pose.cameraZoom = glm::mix(a.cameraZoom, b.cameraZoom, alpha);
+    pose.lightPosition = glm::mix(a.lightPosition, b.lightPosition, alpha);
+    pose.objectSlide = glm::mix(a.objectSlide, b.objectSlide, alpha);
+    return pose;
+}
+
+
+// Runs the simulation at SIMULATION_TICK intervals until UStopSimulation
+void USimulationThread()
+{
+    const auto tickDuration = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(SIMULATION_TICK));
+    auto nextTick = chrono::steady_clock::now() + tickDuration;
+
+    while (gSimulation.running.load(memory_order_relaxed))
+    {
+        this_thread::sleep_until(nextTick);
+
+        USimulationStep();
+        UPublishSnapshot(chrono::duration<double>(nextTick - gSimulation.origin).count());
+        nextTick += tickDuration;
+
+        // After a long stall (debugger, suspended laptop) skip the missed ticks instead of racing through them
+        const auto now = chrono::steady_clock::now();
+        if (now - nextTick > tickDuration * SIMULATION_MAX_CATCH_UP)
+            nextTick = now + tickDuration;
+    }
+}
+
+
+// Publishes the initial state; windowed runs then simulate on their own thread
+void UStartSimulation(bool threaded)
+{
+    gSimulation.lastPose = UCapturePose();
+    UPublishSnapshot(USimulationNow());
+
+    if (threaded)
+    {
+        gSimulation.running = true;
+        gSimulation.worker = thread(USimulationThread);
+    }
+}
+
+
+void UStopSimulation()
+{
+    if (!gSimulation.worker.joinable())
+        return;
+
+    gSimulation.running = false;
+    gSimulation.worker.join();
+}
+
+
+// Functioned called to render a frame
+void URender()
+{
+    ProfileScope renderScope("render");
+
+    // Deferred: the scene pass only stores surfaces in the G-buffer, the lighting pass shades each pixel once
+    const bool deferred = gRenderer == RENDERER_DEFERRED;
+    const GLuint targetFbo = gHeadless ? gOffscreenFbo : 0;
+
+    if (deferred)
+    {
+        // Follow window resizes
+        if ((gGBuffer.width != gWindowWidth || gGBuffer.height != gWindowHeight) && gWindowWidth > 0 && gWindowHeight > 0)
+        {
+            UDestroyGBuffer(gGBuffer);
+            UCreateGBuffer(gWindowWidth, gWindowHeight, gGBuffer);
+            UInvalidateStateCache();
+        }
+    }
+
+    if (gOcclusionCulling && (gHiZ.width != gWindowWidth || gHiZ.height != gWindowHeight) && gWindowWidth > 0 && gWindowHeight > 0)
+    {
+        UDestroyHiZ(gHiZ);
+        UCreateHiZ(gWindowWidth, gWindowHeight, gHiZ);
+        UInvalidateStateCache();
+        gHiZPyramid.valid = false;
+    }
+    UStateBindFramebuffer(deferred ? gGBuffer.fbo : targetFbo);
+
+    // Enable z-depth; like every state below, set through the state cache, which skips what is already in effect
+    UStateDepthTest(true);
+
+    // Clear the frame and z buffers
+    UGpuTimerBegin("clear");
+    UStateClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    UGpuTimerEnd();
+
+    // Simulation state blended between its last two ticks; headless frames show the latest tick as is
+    const SimulationPose pose = UAcquirePose(gHeadless ? numeric_limits<double>::max() : USimulationNow());
+
+    // camera/view transformation
+    glm::mat4 view = glm::lookAt(pose.cameraPosition, pose.cameraPosition + pose.cameraFront, pose.cameraUp);
+
+    // Creates a perspective projection
+    glm::mat4 projection = glm::perspective(glm::radians(pose.cameraZoom), (GLfloat)gWindowWidth / (GLfloat)gWindowHeight, NEAR_PLANE, FAR_PLANE);
+
+    // Upload camera and light data for all programs in a single buffer update
+    GLFrameUniforms frameUniforms;
+    frameUniforms.view = view;
+    frameUniforms.projection = projection;
+    frameUniforms.viewPosition = glm::vec4(pose.cameraPosition, 1.0f);
+    frameUniforms.lightPosition = glm::vec4(pose.lightPosition, 1.0f);
+    frameUniforms.lightColor = glm::vec4(gLightColor, 1.0f);
+
+    // Slice of a view depth d: log(d) * scale + bias = log(d / near) * CLUSTER_GRID_Z / log(far / near)
+    const float sliceScale = CLUSTER_GRID_Z / log(CLUSTER_FAR / CLUSTER_NEAR);
+    frameUniforms.clusterGrid[0] = CLUSTER_GRID_X;
+    frameUniforms.clusterGrid[1] = CLUSTER_GRID_Y;
+    frameUniforms.clusterGrid[2] = CLUSTER_GRID_Z;
+    frameUniforms.clusterGrid[3] = (GLuint)gPointLights.size();
+    frameUniforms.clusterParams = glm::vec4((float)gWindowWidth / CLUSTER_GRID_X, (float)gWindowHeight / CLUSTER_GRID_Y,
+        sliceScale, -log(CLUSTER_NEAR) * sliceScale);
+
+    // Moving objects are placed for this frame before anything is culled against them
+    if (gMoveObjects)
+        UAnimateSceneObjects(pose.objectSlide);
+
+    // Only objects in the view frustum are sent to the GPU
+    UProfileBegin("cull");
+    if (gBvhDirty)
+    {
+        URefitBvh(gSceneObjects, gBvhNodes, gBvhObjects);
+        gBvhDirty = false;
+    }
+
+    if (gFrustumCulling)
+    {
+        FrustumPlanes planes;
+        UExtractFrustumPlanes(projection * view, planes);
+        UCullScene(planes, gVisibleObjects);
+    }
+    else
+    {
+        gVisibleObjects = gBvhObjects;
+    }
+    UProfileEnd();
+
+    // Of those, drop the ones hidden behind the depth of an earlier frame
+    gOcclusionCulled = 0;
+    if (gOcclusionCulling)
+    {
+        UProfileBegin("occlusion cull");
+        UCollectHiZ(gHiZ, gHiZPyramid);
+        gOcclusionCulled = UOcclusionCull(gHiZPyramid, pose.cameraPosition, gVisibleObjects);
+        UProfileEnd();
+    }
+
+    UProfileBegin("light assignment");
+    UAssignLights(view, projection, gPointLights, gClusters, gClusterLights);
+    UProfileEnd();
+
+    UProfileBegin("lod");
+    USelectLods(gMesh, pose.cameraPosition, pose.cameraZoom, gWindowHeight, gVisibleObjects, gSceneObjects);
+    UProfileEnd();
+
+    // Every draw of the frame goes through the render queue, sorted by pass, then state, then front to back
+    const GLuint frameFeatures = UFrameShaderFeatures();
+    const GLuint lightingFeatures = SHADER_DEFERRED_LIGHTING | SHADER_SPECULAR | ULightShaderFeatures();
+    const glm::vec3 toLamp = pose.lightPosition - pose.cameraPosition;
+    UProfileBegin("render queue");
+    UClearRenderQueue(gRenderQueue);
+    UQueueSceneObjects(gMesh, gSceneObjects, gVisibleObjects, pose.cameraPosition, frameFeatures, gRenderQueue);
+    if (deferred)
+        USubmitDraw(gRenderQueue, URenderSortKey(RENDER_PASS_LIGHTING, lightingFeatures, RENDER_TEXTURES_GBUFFER, RENDER_VAO_FULLSCREEN, 0, 0.0f), 0);
+    USubmitDraw(gRenderQueue, URenderSortKey(RENDER_PASS_LAMP, 0, RENDER_TEXTURES_NONE, RENDER_VAO_LAMP, 0, glm::dot(toLamp, toLamp)), 0);
+    USortRenderQueue(gRenderQueue);
+    UProfileEnd();
+
+    // Everything the frame uploads is reserved in one region of the stream buffer, then written in place:
+    // frame uniforms, lights, clusters and their light lists, ObjectData, Draws and the indirect commands
+    UProfileBegin("stream upload");
+    UBeginStreamFrame(gStream, UStreamSpan(gStream, sizeof(GLFrameUniforms)) + UClusterBuffersSpan(gStream, gPointLights, gClusters, gClusterLights)
+        + UDrawCommandsSpan(gStream, gMesh, gRenderQueue));
+
+    const GLintptr frameOffset = UStreamWrite(gStream, &frameUniforms, sizeof(frameUniforms));
+    glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_UNIFORM_BINDING, gStream.buffer, frameOffset, sizeof(frameUniforms));
+    UWriteClusterBuffers(gStream, gPointLights, gClusters, gClusterLights);
+    const size_t sceneItems = UWriteDrawCommands(gMesh, gSceneObjects, gRenderQueue, projection * view, gStream, gDrawBuffers, gDrawCommands, gDrawBatches);
+    UProfileEnd();
+
+    // CUBE: draw cube
+    //----------------
+    // The scene pass leads the queue: one multi-draw per batch of commands sharing a shader variant,
+    // each material only runs the code it needs
+    const char* const scenePass = deferred ? "gbuffer pass" : "scene pass";
+    UProfileBegin(scenePass);
+    UGpuTimerBegin(scenePass);
+    for (const DrawBatch& batch : gDrawBatches)
+    {
+        const ShaderVariant* variant = UShaderVariant(batch.features);
+        if (!variant)
+            continue;
+
+        // Pass the per-program data through the locations cached at link time, per-object data comes from the storage buffers
+        UStateUseProgram(variant->programId);
+        glUniform3f(variant->uniforms.objectColor, gObjectColor.r, gObjectColor.g, gObjectColor.b);
+        glUniform2fv(variant->uniforms.uvScale, 1, glm::value_ptr(gUVScale));
+        glUniform3fv(variant->uniforms.positionScale, 1, glm::value_ptr(gMesh.positionScale));
+        glUniform3fv(variant->uniforms.positionOffset, 1, glm::value_ptr(gMesh.positionOffset));
+        glUniform1ui(variant->uniforms.firstDraw, batch.firstCommand);
+
+        // Activate the VBOs contained within the mesh's VAO, and the material texture array (every material is a layer of it)
+        UStateBindVertexArray(gMesh.vao);
+        UStateBindTexture(0, GL_TEXTURE_2D_ARRAY, gTextureArrayId);
+        if (batch.features & SHADER_LIGHTMAP)
+            UStateBindTexture(LIGHTMAP_UNIT, GL_TEXTURE_2D, gLightmap.texture);
+
+        glMultiDrawElementsIndirect(GL_TRIANGLES, gMesh.indexType, (const void*)(gDrawBuffers.commandsOffset + sizeof(DrawElementsIndirectCommand) * batch.firstCommand), (GLsizei)batch.commandCount, 0);
+    }
+    UGpuTimerEnd();
+    UProfileEnd();
+
+    // Reduce this frame's depth for the occlusion tests of the frames after it
+    if (gOcclusionCulling)
+    {
+        UProfileBegin("hi-z capture");
+        UGpuTimerBegin("hi-z capture");
+        UCaptureHiZ(gHiZ, deferred ? gGBuffer.fbo : targetFbo, deferred ? gGBuffer.depth : 0, projection * view, pose.cameraPosition);
+        UGpuTimerEnd();
+        UProfileEnd();
+    }
+
+    // The draws of the later passes, in key order
+    for (size_t item = sceneItems; item < gRenderQueue.keys.size(); ++item)
+    {
+        const uint64_t key = gRenderQueue.keys[item];
+        switch (URenderKeyField(key, SORT_KEY_PASS_SHIFT, 64 - SORT_KEY_PASS_SHIFT))
+        {
+        case RENDER_PASS_LIGHTING:
+        {
+            // Deferred lighting: a fullscreen triangle shading the G-buffer into the render target
+            const ShaderVariant* lighting = UShaderVariant(URenderKeyField(key, SORT_KEY_PROGRAM_SHIFT, SORT_KEY_PROGRAM_BITS));
+            if (!lighting)
+                break;
+
+            UProfileBegin("lighting pass");
+            UGpuTimerBegin("lighting pass");
+            UStateBindFramebuffer(targetFbo);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+            UStateUseProgram(lighting->programId);
+            const glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+            glUniformMatrix4fv(lighting->uniforms.inverseViewProjection, 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+
+            UStateBindTexture(GBUFFER_ALBEDO_UNIT, GL_TEXTURE_2D, gGBuffer.albedo);
+            UStateBindTexture(GBUFFER_NORMAL_UNIT, GL_TEXTURE_2D, gGBuffer.normal);
+            UStateBindTexture(GBUFFER_DEPTH_UNIT, GL_TEXTURE_2D, gGBuffer.depth);
+
+            // The pass writes the G-buffer depth through gl_FragDepth, whatever the cleared depth says
+            UStateDepthFunc(GL_ALWAYS);
+            UStateBindVertexArray(gFullscreenVao);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            UStateDepthFunc(GL_LESS);
+
+            UGpuTimerEnd();
+            UProfileEnd();
+            break;
+        }
+
+        case RENDER_PASS_LAMP:
+        {
+            // LAMP: draw a sphere at the light position
+            //----------------
+            UStateUseProgram(gLampProgramId);
+            const glm::mat4 lampModel = glm::translate(pose.lightPosition) * glm::scale(gLightScale);
+            const glm::mat4 lampModelViewProjection = projection * view * lampModel;
+            glUniformMatrix4fv(gLampUniforms.modelViewProjection, 1, GL_FALSE, glm::value_ptr(lampModelViewProjection));
+            glUniform3fv(gLampUniforms.positionScale, 1, glm::value_ptr(gLampMesh.positionScale));
+            glUniform3fv(gLampUniforms.positionOffset, 1, glm::value_ptr(gLampMesh.positionOffset));
+
+            UStateBindVertexArray(gLampMesh.vao);
+            glDrawElements(GL_TRIANGLES, gLampMesh.submeshes[0].indexCount, gLampMesh.indexType, (void*)(sizeof(GLushort) * gLampMesh.submeshes[0].firstIndex));
+            break;
+        }
+        }
+    }
+
+    // The region is free for writing again once the GPU has passed this point
+    UEndStreamFrame(gStream);
+
+    // Bindings stay in place for the next frame, which mostly needs the same ones
+    UStateFrameEnd();
+
+    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+    // Headless frames stay in the offscreen FBO, there is nothing to present
+    if (!gHeadless)
+    {
+        UProfileBegin("swap");
+        glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
+        UProfileEnd();
+    }
+}
+
+
+// Forgets the cached state, after GL calls made around the cache; the next call of every kind goes through
+void UInvalidateStateCache()
+{
+    GLStateCache& cache = gStateCache;
+    cache.program = STATE_UNKNOWN;
+    cache.vertexArray = STATE_UNKNOWN;
+    cache.framebuffer = STATE_UNKNOWN;
+    cache.activeTexture = STATE_UNKNOWN;
+    for (int unit = 0; unit < STATE_TEXTURE_UNITS; ++unit)
+    {
+        cache.textures[unit] = STATE_UNKNOWN;
+        cache.textureTargets[unit] = GL_NONE;
+    }
+    cache.depthTest = STATE_UNKNOWN;
+    cache.depthFunc = GL_NONE;
+    cache.clearColor[0] = -1.0f; // Not a color
+}
+
+
+// Records a state value, true when it differs from the cached one and the GL call has to be made
+static bool UStateChanged(GLuint& cached, GLuint value)
+{
+    if (cached == value)
+    {
+        ++gStateCache.avoided;
+        return false;
+    }
+
+    cached = value;
+    ++gStateCache.changes;
+    return true;
+}
+
+
+void UStateUseProgram(GLuint program)
+{
+    if (UStateChanged(gStateCache.program, program))
+        glUseProgram(program);
+}
+
+
+void UStateBindVertexArray(GLuint vertexArray)
+{
+    if (UStateChanged(gStateCache.vertexArray, vertexArray))
+        glBindVertexArray(vertexArray);
+}
+
+
+void UStateBindFramebuffer(GLuint framebuffer)
+{
+    if (UStateChanged(gStateCache.framebuffer, framebuffer))
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+}
+
+
+// Makes unit the one glActiveTexture selects
+void UStateActiveTexture(GLuint unit)
+{
+    if (UStateChanged(gStateCache.activeTexture, unit))
+        glActiveTexture(GL_TEXTURE0 + unit);
+}
+
+
+// Units beyond the cached ones are bound every time
+void UStateBindTexture(GLuint unit, GLenum target, GLuint texture)
+{
+    GLStateCache& cache = gStateCache;
+    if (unit < (GLuint)STATE_TEXTURE_UNITS && cache.textures[unit] == texture && cache.textureTargets[unit] == target)
+    {
+        ++cache.avoided;
+        return;
+    }
+
+    UStateActiveTexture(unit);
+    glBindTexture(target, texture);
+    ++cache.changes;
+
+    if (unit < (GLuint)STATE_TEXTURE_UNITS)
+    {
+        cache.textures[unit] = texture;
+        cache.textureTargets[unit] = target;
+    }
+}
+
+
+// Binds a texture for glTex* calls, which act on the active unit. A cached UStateBindTexture leaves the active
+// unit alone, so it is selected explicitly.
+void UStateEditTexture(GLenum target, GLuint texture)
+{
+    UStateActiveTexture(0);
+    UStateBindTexture(0, target, texture);
+
+    if (gCheckState)
+    {
+        GLint activeTexture, bound;
+        glGetIntegerv(GL_ACTIVE_TEXTURE, &activeTexture);
+        glGetIntegerv(target == GL_TEXTURE_2D_ARRAY ? GL_TEXTURE_BINDING_2D_ARRAY : GL_TEXTURE_BINDING_2D, &bound);
+        if (activeTexture != GL_TEXTURE0 || (GLuint)bound != texture)
+        {
+            ULOG_ERROR("State cache: texture %u edited through unit %d, which has %d bound", texture, activeTexture - GL_TEXTURE0, bound);
+            ++gStateCache.mismatches;
+        }
+    }
+}
+
+
+// --check-state: compares the cached state with what GL reports, counting differences in gStateCache.mismatches
+void UCheckStateCache()
+{
+    GLStateCache& cache = gStateCache;
+    auto check = [&cache](const char* name, GLuint cached, GLint actual)
+    {
+        if (cached == STATE_UNKNOWN || cached == (GLuint)actual)
+            return;
+        ULOG_ERROR("State cache: %s is %d, cached %u", name, actual, cached);
+        ++cache.mismatches;
+    };
+
+    GLint value;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &value);
+    check("program", cache.program, value);
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &value);
+    check("vertex array", cache.vertexArray, value);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &value);
+    check("framebuffer", cache.framebuffer, value);
+
+    GLint activeTexture;
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &activeTexture);
+    check("active texture unit", cache.activeTexture, activeTexture - GL_TEXTURE0);
+    for (int unit = 0; unit < STATE_TEXTURE_UNITS; ++unit)
+    {
+        if (cache.textures[unit] == STATE_UNKNOWN)
+            continue;
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glGetIntegerv(cache.textureTargets[unit] == GL_TEXTURE_2D_ARRAY ? GL_TEXTURE_BINDING_2D_ARRAY : GL_TEXTURE_BINDING_2D, &value);
+        check("texture unit binding", cache.textures[unit], value);
+    }
+    glActiveTexture(activeTexture);
+}
+
+
+void UStateDepthTest(bool enabled)
+{
+    if (UStateChanged(gStateCache.depthTest, enabled ? 1 : 0))
+    {
+        if (enabled)
+            glEnable(GL_DEPTH_TEST);
+        else
+            glDisable(GL_DEPTH_TEST);
+    }
+}
+
+
+void UStateDepthFunc(GLenum func)
+{
+    if (UStateChanged(gStateCache.depthFunc, func))
+        glDepthFunc(func);
+}
+
+
+void UStateClearColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a)
+{
+    GLfloat* cached = gStateCache.clearColor;
+    if (cached[0] == r && cached[1] == g && cached[2] == b && cached[3] == a)
+    {
+        ++gStateCache.avoided;
+        return;
+    }
+
+    cached[0] = r;
+    cached[1] = g;
+    cached[2] = b;
+    cached[3] = a;
+    ++gStateCache.changes;
+    glClearColor(r, g, b, a);
+}
+
+
+// Publishes the counters of the frame that just ended and starts the next one at zero
+void UStateFrameEnd()
+{
+    gStateCache.frameChanges = gStateCache.changes;
+    gStateCache.frameAvoided = gStateCache.avoided;
+    gStateCache.changes = 0;
+    gStateCache.avoided = 0;
+}
+
+
+ProfileScope::ProfileScope(const char* name)
+{
+    UProfileBegin(name);
+}
+
+
+ProfileScope::~ProfileScope()
+{
+    UProfileEnd();
+}
+
+
+// Microseconds since the profiler started, on the monotonic clock
+int64_t UProfileNow()
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - gProfiler.origin).count();
+}
+
+
+// Finds the statistics of a scope, creating them on first use. Scope names are string literals.
+static ProfileStat& UProfileStat(const char* name, bool gpu)
+{
+    for (ProfileStat& stat : gProfiler.stats)
+    {
+        if (stat.gpu == gpu && strcmp(stat.name, name) == 0)
+            return stat;
+    }
+
+    ProfileStat stat = {};
+    stat.name = name;
+    stat.gpu = gpu;
+    gProfiler.stats.push_back(stat);
+    return gProfiler.stats.back();
+}
+
+
+static void UProfileRecord(const char* name, bool gpu, int64_t startUs, int64_t durationUs)
+{
+    ProfileStat& stat = UProfileStat(name, gpu);
+    const double ms = durationUs / 1000.0;
+    stat.windowTotal += ms;
+    stat.runTotal += ms;
+    ++stat.windowSamples;
+    ++stat.runSamples;
+
+    if (gProfiler.tracing && gProfiler.trace.size() < PROFILER_TRACE_LIMIT)
+        gProfiler.trace.push_back({ name, startUs, durationUs, gpu ? 2 : 1 });
+}
+
+
+// Opens a CPU scope; scopes nest and must be closed in reverse order
+void UProfileBegin(const char* name)
+{
+    gProfiler.stack.push_back({ name, UProfileNow() });
+}
+
+
+void UProfileEnd()
+{
+    const ProfileScopeEntry scope = gProfiler.stack.back();
+    gProfiler.stack.pop_back();
+    UProfileRecord(scope.name, false, scope.startUs, UProfileNow() - scope.startUs);
+}
+
+
+// Reads a finished query of a GPU timer; false while the GPU has not got there yet
+static bool UCollectGpuTimer(GpuTimer& timer, int slot, bool wait)
+{
+    if (!timer.pending[slot])
+        return true;
+
+    GLint available = 0;
+    if (!wait)
+        glGetQueryObjectiv(timer.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!wait && !available)
+        return false;
+
+    GLuint64 elapsedNs = 0;
+    glGetQueryObjectui64v(timer.queries[slot], GL_QUERY_RESULT, &elapsedNs);
+    UProfileRecord(timer.name, true, timer.startUs[slot], (int64_t)(elapsedNs / 1000));
+    timer.pending[slot] = false;
+    return true;
+}
+
+
+/* Starts timing GPU work. GL_TIME_ELAPSED queries cannot nest, so GPU timers are sequential passes.
+ * Every timer owns a query per frame parity; the one reused this frame was issued two frames ago and is
+ * normally finished. If it is not, this frame goes untimed rather than stalling the pipeline.
+ */
+void UGpuTimerBegin(const char* name)
+{
+    GpuTimer* timer = nullptr;
+    for (GpuTimer& candidate : gProfiler.gpuTimers)
+    {
+        if (strcmp(candidate.name, name) == 0)
+            timer = &candidate;
+    }
+    if (!timer)
+    {
+        GpuTimer created = {};
+        created.name = name;
+        glGenQueries(2, created.queries);
+        gProfiler.gpuTimers.push_back(created);
+        timer = &gProfiler.gpuTimers.back();
+    }
+
+    const int slot = gProfiler.frame & 1;
+    gProfiler.activeGpuTimer = -1;
+    if (!UCollectGpuTimer(*timer, slot, false))
+        return;
+
+    glBeginQuery(GL_TIME_ELAPSED, timer->queries[slot]);
+    timer->startUs[slot] = UProfileNow();
+    gProfiler.activeGpuTimer = (int)(timer - gProfiler.gpuTimers.data());
+}
+
+
+void UGpuTimerEnd()
+{
+    if (gProfiler.activeGpuTimer < 0)
+        return;
+
+    glEndQuery(GL_TIME_ELAPSED);
+    gProfiler.gpuTimers[gProfiler.activeGpuTimer].pending[gProfiler.frame & 1] = true;
+    gProfiler.activeGpuTimer = -1;
+}
+
+
+// Closes a frame; about once a second the averages of the last window become the rolling summary
+void UProfileFrameEnd()
+{
+    ++gProfiler.frame;
+    ++gProfiler.windowFrames;
+
+    const int64_t now = UProfileNow();
+    if (now - gProfiler.windowStartUs < PROFILER_SUMMARY_INTERVAL_US)
+        return;
+
+    ostringstream summary;
+    summary.setf(ios::fixed);
+    summary.precision(2);
+    summary << 1e6 * gProfiler.windowFrames / (now - gProfiler.windowStartUs) << " fps";
+    summary << " | state changes " << gStateCache.frameChanges << " (" << gStateCache.frameAvoided << " skipped)";
+    for (ProfileStat& stat : gProfiler.stats)
+    {
+        if (stat.windowSamples > 0)
+            summary << " | " << (stat.gpu ? "gpu " : "") << stat.name << " " << stat.windowTotal / gProfiler.windowFrames << " ms";
+        stat.windowTotal = 0.0;
+        stat.windowSamples = 0;
+    }
+    gProfiler.summary = summary.str();
+    gProfiler.windowStartUs = now;
+    gProfiler.windowFrames = 0;
+
+    if (!gHeadless)
+    {
+        ULOG_INFO("PROFILE: %s", gProfiler.summary.c_str());
+        glfwSetWindowTitle(gWindow, (string(WINDOW_TITLE) + " | " + gProfiler.summary).c_str());
+    }
+}
+
+
+// Waits for the GPU timings still in flight
+static void UCollectAllGpuTimers()
+{
+    for (GpuTimer& timer : gProfiler.gpuTimers)
+    {
+        UCollectGpuTimer(timer, 0, true);
+        UCollectGpuTimer(timer, 1, true);
+    }
+}
+
+
+// Drops everything measured so far, including GPU timings still in flight
+void UProfileReset()
+{
+    UCollectAllGpuTimers();
+    gProfiler.stats.clear();
+    gProfiler.trace.clear();
+    gProfiler.windowStartUs = UProfileNow();
+    gProfiler.windowFrames = 0;
+}
+
+
+// Prints the per-frame averages of the whole run
+void UPrintProfile()
+{
+    UCollectAllGpuTimers();
+    for (const ProfileStat& stat : gProfiler.stats)
+    {
+        if (stat.runSamples > 0)
+            cout << "PROFILE: " << (stat.gpu ? "gpu " : "cpu ") << stat.name << " " << stat.runTotal / stat.runSamples << " ms" << endl;
+    }
+}
+
+
+// Writes the recorded scopes in the Chrome trace event format (chrome://tracing, Perfetto)
+bool UWriteTrace(const char* filename)
+{
+    ofstream out(filename);
+    if (!out)
+    {
+        cout << "Failed to write trace file " << filename << endl;
+        return false;
+    }
+
+    out << "{\"traceEvents\":[\n";
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n";
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}";
+    for (const TraceEvent& event : gProfiler.trace)
+    {
+        // GPU events are placed at the time their commands were issued
+        out << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.track
+            << ",\"ts\":" << event.startUs << ",\"dur\":" << event.durationUs << "}";
+    }
+    out << "\n]}\n";
+
+    cout << "INFO: Wrote " << gProfiler.trace.size() << " trace events to " << filename << endl;
+    return (bool)out;
+}
+
+
+// Collects the outstanding GPU timings, writes the trace if requested and releases the queries
+void UDestroyProfiler()
+{
+    UCollectAllGpuTimers();
+    for (GpuTimer& timer : gProfiler.gpuTimers)
+        glDeleteQueries(2, timer.queries);
+    gProfiler.gpuTimers.clear();
+
+    if (!gTraceFile.empty())
+        UWriteTrace(gTraceFile.c_str());
+}
+
+
+// Implements the UCreateMesh function
+bool UCreateMesh(GLMesh& mesh)
+{
+    // Scene files are mapped and uploaded without any parsing
+    if (!gSceneFile.empty())
+    {
+        return ULoadMeshFile(gSceneFile.c_str(), mesh);
+    }
+
+    // Lightmap UVs only matter once something was baked, which creates the cache directory
+    MeshData data;
+    UBuildDefaultMesh(data);
+    UProcessMesh(data, gUseLightmaps && UDirectoryExists(LIGHTMAP_CACHE_DIR));
+
+    // The built-in scene fits 16-bit indices
+    if (data.vertices.size() > 65536)
+    {
+        cout << "Built-in scene has too many vertices for 16-bit indices" << endl;
+        return false;
+    }
+    vector<GLushort> indices(data.indices.begin(), data.indices.end());
+    UUploadMesh(mesh, data.vertices.data(), (GLuint)data.vertices.size(),
+        indices.data(), (GLuint)indices.size(), GL_UNSIGNED_SHORT);
+    mesh.submeshes = data.submeshes;
+    UComputeSubmeshBounds(data.vertices.data(), indices.data(), GL_UNSIGNED_SHORT, mesh.submeshes);
+    if (!data.lightmapUvs.empty())
+        UUploadLightmapUvs(mesh, data.lightmapUvs);
+
+    return true;
+}
+
+
+// Builds the desk scene from generated primitives
+void UBuildDefaultMesh(MeshData& data)
+{
+    // Cylinders and capsules are generated along y, the scroll wheel and the light bar lie along x
+    const glm::mat4 alongX = glm::rotate(glm::radians(90.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+
+    const PrimitiveDesc primitives[] = {
+        { "mouse", PRIMITIVE_ROUNDED_BOX, glm::vec3(1.0f, 0.4f, 0.6f), 0.12f, glm::mat4(1.0f), MATERIAL_MOUSE },
+        { "scroll_wheel", PRIMITIVE_CYLINDER, glm::vec3(0.16f, 0.08f, 0.16f), 0.0f, glm::translate(glm::vec3(0.3f, 0.2f, 0.05f)) * alongX, MATERIAL_MOUSE },
+        { "left_button", PRIMITIVE_BOX, glm::vec3(0.2f, 0.15f, 0.02f), 0.0f, glm::translate(glm::vec3(-0.05f, 0.075f, 0.34f)), MATERIAL_MOUSE },
+        { "right_button", PRIMITIVE_BOX, glm::vec3(0.2f, 0.15f, 0.02f), 0.0f, glm::translate(glm::vec3(0.2f, 0.075f, 0.34f)), MATERIAL_MOUSE },
+        { "plane", PRIMITIVE_BOX, glm::vec3(7.0f, 0.02f, 6.6f), 0.0f, glm::translate(glm::vec3(0.0f, -0.26f, 0.0f)), MATERIAL_DESK },
+        { "monitor", PRIMITIVE_ROUNDED_BOX, glm::vec3(5.0f, 2.3f, 0.5f), 0.05f, glm::translate(glm::vec3(0.0f, 1.45f, -1.25f)), MATERIAL_MONITOR },
+        { "stand", PRIMITIVE_BOX, glm::vec3(1.0f, 0.6f, 0.5f), 0.0f, glm::translate(glm::vec3(0.0f, 0.0f, -1.25f)), MATERIAL_STAND },
+        { "keyboard", PRIMITIVE_ROUNDED_BOX, glm::vec3(2.0f, 0.3f, 1.0f), 0.05f, glm::translate(glm::vec3(0.0f, -0.15f, 1.5f)), MATERIAL_KEYBOARD },
+        { "lightbar", PRIMITIVE_CAPSULE, glm::vec3(0.2f, 3.6f, 0.2f), 0.0f, glm::translate(glm::vec3(0.0f, 2.6f, -0.9f)) * alongX, MATERIAL_STAND },
+    };
+
+    for (const PrimitiveDesc& primitive : primitives)
+        UAppendPrimitive(data, primitive);
+}
+
+
+// Appends a vertex placed by the primitive's rotation and translation
+static GLuint UAppendPrimitiveVertex(MeshData& data, const glm::mat4& placement, const glm::vec3& position, const glm::vec3& normal, const glm::vec2& uv, GLuint material)
+{
+    const glm::vec3 placed = glm::vec3(placement * glm::vec4(position, 1.0f));
+    const glm::vec3 placedNormal = glm::normalize(glm::mat3(placement) * normal);
+
+    data.vertices.push_back({ { placed.x, placed.y, placed.z }, { placedNormal.x, placedNormal.y, placedNormal.z }, { uv.x, uv.y }, material });
+    return (GLuint)data.vertices.size() - 1;
+}
+
+
+// Appends a counter-clockwise triangle unless it has no area (collapsed grid cells of the rounded shapes)
+static void UAppendPrimitiveTriangle(MeshData& data, GLuint a, GLuint b, GLuint c)
+{
+    const glm::vec3 pa = glm::make_vec3(data.vertices[a].position);
+    const glm::vec3 pb = glm::make_vec3(data.vertices[b].position);
+    const glm::vec3 pc = glm::make_vec3(data.vertices[c].position);
+    if (glm::length(glm::cross(pb - pa, pc - pa)) <= 1e-10f)
+        return;
+
+    const GLuint triangle[] = { a, b, c };
+    data.indices.insert(data.indices.end(), triangle, triangle + 3);
+}
+
+
+/* Boxes, rounded boxes, capsules and spheres: a sphere of the rounding radius cut into octants, each pushed out
+ * to its corner of the box. Rows and columns are duplicated at the octant boundaries; the cells between the
+ * duplicates stretch into the flat faces and the caps close the top and bottom. A radius of 0 gives a plain box,
+ * a radius equal to the half size a sphere. steps is the number of cells per quarter circle.
+ */
+static void UAppendRoundedShape(MeshData& data, const glm::vec3& halfSize, float radius, int steps, const glm::mat4& placement, GLuint material)
+{
+    const glm::vec3 core = glm::max(halfSize - glm::vec3(radius), glm::vec3(0.0f));
+    const int perQuadrant = steps + 1;
+    const int columns = 4 * perQuadrant;
+    const int rows = 2 * perQuadrant;
+    const GLuint first = (GLuint)data.vertices.size();
+
+    for (int row = 0; row < rows; ++row)
+    {
+        const int hemisphere = row / perQuadrant;
+        const float latitude = glm::radians(90.0f * (hemisphere - 1) + 90.0f * (row % perQuadrant) / steps);
+        const float offsetY = hemisphere ? core.y : -core.y;
+
+        for (int column = 0; column < columns; ++column)
+        {
+            const int quadrant = column / perQuadrant;
+            const float longitude = glm::radians(90.0f * quadrant + 90.0f * (column % perQuadrant) / steps);
+            const float offsetX = (quadrant == 0 || quadrant == 3) ? core.x : -core.x;
+            const float offsetZ = quadrant < 2 ? core.z : -core.z;
+
+            const glm::vec3 direction(cos(latitude) * cos(longitude), sin(latitude), cos(latitude) * sin(longitude));
+            const glm::vec3 position = direction * radius + glm::vec3(offsetX, offsetY, offsetZ);
+
+            // Box projection on the face the normal points at most
+            const glm::vec3 magnitude = glm::abs(direction);
+            const glm::vec3 relative = position / (2.0f * halfSize) + 0.5f;
+            glm::vec2 uv(relative.x, relative.y);
+            if (magnitude.y >= magnitude.x && magnitude.y >= magnitude.z)
+                uv = glm::vec2(relative.x, relative.z);
+            else if (magnitude.x >= magnitude.z)
+                uv = glm::vec2(relative.z, relative.y);
+
+            UAppendPrimitiveVertex(data, placement, position, direction, uv, material);
+        }
+    }
+
+    auto vertex = [&](int row, int column) { return first + (GLuint)(row * columns + column % columns); };
+    for (int row = 0; row + 1 < rows; ++row)
+    {
+        for (int column = 0; column < columns; ++column)
+        {
+            UAppendPrimitiveTriangle(data, vertex(row, column), vertex(row + 1, column), vertex(row, column + 1));
+            UAppendPrimitiveTriangle(data, vertex(row + 1, column), vertex(row + 1, column + 1), vertex(row, column + 1));
+        }
+    }
+
+    // Bottom and top faces between the poles of the four quadrants
+    const int top = rows - 1;
+    UAppendPrimitiveTriangle(data, vertex(0, 0), vertex(0, perQuadrant), vertex(0, 2 * perQuadrant));
+    UAppendPrimitiveTriangle(data, vertex(0, 0), vertex(0, 2 * perQuadrant), vertex(0, 3 * perQuadrant));
+    UAppendPrimitiveTriangle(data, vertex(top, 0), vertex(top, 2 * perQuadrant), vertex(top, perQuadrant));
+    UAppendPrimitiveTriangle(data, vertex(top, 0), vertex(top, 3 * perQuadrant), vertex(top, 2 * perQuadrant));
+}
+
+
+// Cylinder along y with hard edges between the side and the caps
+static void UAppendCylinder(MeshData& data, float radius, float halfHeight, int segments, const glm::mat4& placement, GLuint material)
+{
+    const GLuint first = (GLuint)data.vertices.size();
+
+    // Side: a bottom and a top vertex per segment, the seam is duplicated for the UVs
+    for (int segment = 0; segment <= segments; ++segment)
+    {
+        const float angle = glm::radians(360.0f * segment / segments);
+        const glm::vec3 normal(cos(angle), 0.0f, sin(angle));
+        const float u = (float)segment / segments;
+        UAppendPrimitiveVertex(data, placement, normal * radius - glm::vec3(0.0f, halfHeight, 0.0f), normal, glm::vec2(u, 0.0f), material);
+        UAppendPrimitiveVertex(data, placement, normal * radius + glm::vec3(0.0f, halfHeight, 0.0f), normal, glm::vec2(u, 1.0f), material);
+    }
+    for (int segment = 0; segment < segments; ++segment)
+    {
+        const GLuint bottom = first + segment * 2;
+        UAppendPrimitiveTriangle(data, bottom, bottom + 1, bottom + 2);
+        UAppendPrimitiveTriangle(data, bottom + 1, bottom + 3, bottom + 2);
+    }
+
+    // Caps: a fan around the center
+    for (int cap = 0; cap < 2; ++cap)
+    {
+        const glm::vec3 normal(0.0f, cap ? 1.0f : -1.0f, 0.0f);
+        const GLuint center = UAppendPrimitiveVertex(data, placement, normal * halfHeight, normal, glm::vec2(0.5f), material);
+        for (int segment = 0; segment <= segments; ++segment)
+        {
+            const float angle = glm::radians(360.0f * segment / segments);
+            const glm::vec3 rim(cos(angle), 0.0f, sin(angle));
+            UAppendPrimitiveVertex(data, placement, rim * radius + normal * halfHeight, normal, glm::vec2(0.5f + 0.5f * rim.x, 0.5f + 0.5f * rim.z), material);
+        }
+        for (int segment = 0; segment < segments; ++segment)
+        {
+            if (cap)
+                UAppendPrimitiveTriangle(data, center, center + segment + 2, center + segment + 1);
+            else
+                UAppendPrimitiveTriangle(data, center, center + segment + 1, center + segment + 2);
+        }
+    }
+}
+
+
+// Generates a primitive as a chain of submeshes, one per level of detail (boxes have a single level)
+void UAppendPrimitive(MeshData& data, const PrimitiveDesc& primitive)
+{
+    const bool curved = primitive.shape != PRIMITIVE_BOX;
+    const int levels = curved ? PRIMITIVE_LOD_COUNT : 1;
+    const glm::vec3 halfSize = primitive.size * 0.5f;
+
+    for (int level = 0; level < levels; ++level)
+    {
+        const int segments = PRIMITIVE_SEGMENTS[level];
+        GLSubmesh submesh = { level == 0 ? primitive.name : primitive.name + "_lod" + to_string(level), (GLuint)data.indices.size(), 0 };
+        submesh.lodCount = level == 0 ? levels : 0;
+
+        switch (primitive.shape)
+        {
+        case PRIMITIVE_BOX:
+            UAppendRoundedShape(data, halfSize, 0.0f, 1, primitive.placement, primitive.material);
+            break;
+        case PRIMITIVE_ROUNDED_BOX:
+            UAppendRoundedShape(data, halfSize, primitive.radius, max(1, segments / 8), primitive.placement, primitive.material);
+            break;
+        case PRIMITIVE_CAPSULE:
+            UAppendRoundedShape(data, halfSize, halfSize.x, max(1, segments / 4), primitive.placement, primitive.material);
+            break;
+        case PRIMITIVE_SPHERE:
+            UAppendRoundedShape(data, glm::vec3(halfSize.x), halfSize.x, max(1, segments / 4), primitive.placement, primitive.material);
+            break;
+        case PRIMITIVE_CYLINDER:
+            UAppendCylinder(data, halfSize.x, halfSize.y, segments, primitive.placement, primitive.material);
+            break;
+        }
+
+        submesh.indexCount = (GLuint)data.indices.size() - submesh.firstIndex;
+        data.submeshes.push_back(submesh);
+    }
+}
+
+
+// Mesh processing run on every mesh before it is uploaded or exported: normals for faces without them,
+// duplicate vertices merged, lightmap UVs if asked for, then index and vertex order tuned for the post-transform
+// cache, overdraw and fetches. The lightmap charts split vertices, so they come before the orderings.
+void UProcessMesh(MeshData& data, bool lightmapUvs)
+{
+    const size_t inputVertices = data.vertices.size();
+
+    UGenerateNormals(data, MESH_CREASE_ANGLE);
+    UDeduplicateVertices(data);
+    if (lightmapUvs)
+        UGenerateLightmapUvs(data);
+    const float acmrBefore = UComputeAcmr(data.indices.data(), data.indices.size());
+
+    // Triangles are only reordered inside their submesh, the submesh index ranges stay valid
+    for (const GLSubmesh& submesh : data.submeshes)
+    {
+        GLuint* indices = data.indices.data() + submesh.firstIndex;
+        UOptimizeVertexCache(indices, submesh.indexCount);
+        UOptimizeOverdraw(data.vertices, indices, submesh.indexCount);
+    }
+    UOptimizeVertexFetch(data);
+
+    const float acmrAfter = UComputeAcmr(data.indices.data(), data.indices.size());
+    cout << "INFO: Mesh processing: " << inputVertices << " -> " << data.vertices.size() << " vertices, "
+        << data.indices.size() / 3 << " triangles, ACMR " << acmrBefore << " -> " << acmrAfter
+        << " (" << VERTEX_CACHE_SIZE << " entry FIFO)" << endl;
+}
+
+
+// Gives every triangle corner without a normal its own vertex, with the area weighted average of the normals of
+// the faces around that position which lie within the crease angle of its own face (hard edges beyond it).
+// Faces are only smoothed with faces of the same submesh.
+void UGenerateNormals(MeshData& data, float creaseAngle)
+{
+    const float creaseCos = cos(glm::radians(creaseAngle));
+    const size_t triangleCount = data.indices.size() / 3;
+
+    // Cross products, their length is twice the triangle area
+    vector<glm::vec3> faceNormals(triangleCount);
+    for (size_t t = 0; t < triangleCount; ++t)
+    {
+        const glm::vec3 a = glm::make_vec3(data.vertices[data.indices[t * 3]].position);
+        const glm::vec3 b = glm::make_vec3(data.vertices[data.indices[t * 3 + 1]].position);
+        const glm::vec3 c = glm::make_vec3(data.vertices[data.indices[t * 3 + 2]].position);
+        faceNormals[t] = glm::cross(b - a, c - a);
+    }
+    auto unitNormal = [&](size_t t)
+    {
+        const float length = glm::length(faceNormals[t]);
+        return length > 0.0f ? faceNormals[t] / length : glm::vec3(0.0f);
+    };
+
+    // Triangles outside every submesh form one more group
+    vector<GLuint> triangleGroup(triangleCount, (GLuint)data.submeshes.size());
+    for (GLuint s = 0; s < data.submeshes.size(); ++s)
+    {
+        const GLSubmesh& submesh = data.submeshes[s];
+        for (GLuint t = submesh.firstIndex / 3; t < (submesh.firstIndex + submesh.indexCount) / 3 && t < triangleCount; ++t)
+            triangleGroup[t] = s;
+    }
+
+    // Triangles touching each (group, position); adding 0 turns -0 into +0 so both hash alike
+    auto cornerKey = [&](size_t t, int corner)
+    {
+        const GLfloat* position = data.vertices[data.indices[t * 3 + corner]].position;
+        const GLfloat canonical[3] = { position[0] + 0.0f, position[1] + 0.0f, position[2] + 0.0f };
+        string key((const char*)&triangleGroup[t], sizeof(GLuint));
+        key.append((const char*)canonical, sizeof(canonical));
+        return key;
+    };
+    unordered_map<string, vector<GLuint>> trianglesAtPosition;
+    for (size_t t = 0; t < triangleCount; ++t)
+    {
+        for (int corner = 0; corner < 3; ++corner)
+            trianglesAtPosition[cornerKey(t, corner)].push_back((GLuint)t);
+    }
+
+    vector<Vertex> vertices;
+    vertices.reserve(triangleCount * 3);
+    for (size_t t = 0; t < triangleCount; ++t)
+    {
+        const glm::vec3 faceNormal = unitNormal(t);
+        for (int corner = 0; corner < 3; ++corner)
+        {
+            Vertex vertex = data.vertices[data.indices[t * 3 + corner]];
+            if (vertex.normal[0] == 0.0f && vertex.normal[1] == 0.0f && vertex.normal[2] == 0.0f)
+            {
+                // Degenerate faces have no direction of their own and take the plain average
+                const bool degenerate = glm::length(faceNormal) == 0.0f;
+                glm::vec3 normal(0.0f);
+                for (GLuint other : trianglesAtPosition[cornerKey(t, corner)])
+                {
+                    if (degenerate || glm::dot(unitNormal(other), faceNormal) >= creaseCos)
+                        normal += faceNormals[other];
+                }
+                normal = glm::length(normal) > 0.0f ? glm::normalize(normal) : faceNormal;
+
+                vertex.normal[0] = normal.x;
+                vertex.normal[1] = normal.y;
+                vertex.normal[2] = normal.z;
+            }
+            vertices.push_back(vertex);
+        }
+    }
+
+    data.vertices.swap(vertices);
+    data.indices.resize(triangleCount * 3);
+    for (size_t i = 0; i < data.indices.size(); ++i)
+        data.indices[i] = (GLuint)i;
+}
+
+
+// Merges vertices whose attributes are bit-identical
+void UDeduplicateVertices(MeshData& data)
+{
+    unordered_map<string, GLuint> lookup;
+    lookup.reserve(data.vertices.size());
+
+    vector<Vertex> vertices;
+    vector<GLuint> remap(data.vertices.size());
+    for (size_t i = 0; i < data.vertices.size(); ++i)
+    {
+        const auto inserted = lookup.emplace(string((const char*)&data.vertices[i], sizeof(Vertex)), (GLuint)vertices.size());
+        if (inserted.second)
+            vertices.push_back(data.vertices[i]);
+        remap[i] = inserted.first->second;
+    }
+
+    for (GLuint& index : data.indices)
+        index = remap[index];
+    data.vertices.swap(vertices);
+}
+
+
+// Numbers the vertices of an index range from 0, so per-vertex tables only need to cover the range
+static GLuint ULocalVertexIndices(const GLuint* indices, size_t indexCount, vector<GLuint>& local)
+{
+    unordered_map<GLuint, GLuint> lookup;
+    local.resize(indexCount);
+    for (size_t i = 0; i < indexCount; ++i)
+        local[i] = lookup.emplace(indices[i], (GLuint)lookup.size()).first->second;
+    return (GLuint)lookup.size();
+}
+
+
+// Average cache miss ratio: transformed vertices per triangle with a FIFO post-transform cache (0.5 is ideal, 3 is no reuse)
+float UComputeAcmr(const GLuint* indices, size_t indexCount)
+{
+    if (indexCount < 3)
+        return 0.0f;
+
+    vector<GLuint> local;
+    const GLuint vertexCount = ULocalVertexIndices(indices, indexCount, local);
+
+    // A vertex stays cached until VERTEX_CACHE_SIZE other vertices were loaded after it
+    const size_t notLoaded = numeric_limits<size_t>::max();
+    vector<size_t> loadedAt(vertexCount, notLoaded);
+    size_t misses = 0;
+    for (GLuint vertex : local)
+    {
+        if (loadedAt[vertex] == notLoaded || misses - loadedAt[vertex] > VERTEX_CACHE_SIZE)
+            loadedAt[vertex] = misses++;
+    }
+    return (float)misses / (indexCount / 3);
+}
+
+
+/* Forsyth's linear-speed vertex cache optimization: greedily emits the triangle whose vertices score highest.
+ * Vertices score for sitting in the modelled LRU cache (the last triangle's three equally) and for having few
+ * triangles left, so nearly finished vertices are used up before they are evicted.
+ */
+void UOptimizeVertexCache(GLuint* indices, size_t indexCount)
+{
+    const size_t triangleCount = indexCount / 3;
+    if (triangleCount < 2)
+        return;
+
+    vector<GLuint> local;
+    const GLuint vertexCount = ULocalVertexIndices(indices, triangleCount * 3, local);
+
+    auto vertexScore = [](int cachePosition, GLuint trianglesLeft)
+    {
+        if (trianglesLeft == 0)
+            return -1.0f;
+
+        float score = 0.0f;
+        if (cachePosition >= 0)
+            score = cachePosition < 3 ? 0.75f : powf(1.0f - (cachePosition - 3) / float(VERTEX_CACHE_SIZE - 3), 1.5f);
+        return score + 2.0f * powf((float)trianglesLeft, -0.5f);
+    };
+
+    // Triangles of each vertex; the first trianglesLeft entries of its list are the ones not emitted yet
+    vector<GLuint> trianglesLeft(vertexCount, 0), firstTriangle(vertexCount + 1, 0), vertexTriangles(triangleCount * 3);
+    for (GLuint vertex : local)
+        ++trianglesLeft[vertex];
+    for (GLuint v = 0; v < vertexCount; ++v)
+        firstTriangle[v + 1] = firstTriangle[v] + trianglesLeft[v];
+    {
+        vector<GLuint> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+        for (size_t i = 0; i < local.size(); ++i)
+            vertexTriangles[fill[local[i]]++] = (GLuint)(i / 3);
+    }
+
+    vector<int> cachePosition(vertexCount, -1);
+    vector<float> scores(vertexCount);
+    for (GLuint v = 0; v < vertexCount; ++v)
+        scores[v] = vertexScore(-1, trianglesLeft[v]);
+
+    auto triangleScore = [&](size_t t) { return scores[local[t * 3]] + scores[local[t * 3 + 1]] + scores[local[t * 3 + 2]]; };
+
+    // Start from the best triangle overall
+    long best = 0;
+    for (size_t t = 1; t < triangleCount; ++t)
+    {
+        if (triangleScore(t) > triangleScore(best))
+            best = (long)t;
+    }
+
+    vector<bool> emitted(triangleCount, false);
+    vector<GLuint> cache, nextCache;
+    vector<GLuint> output;
+    output.reserve(triangleCount * 3);
+    size_t cursor = 0;  // Where to look for a triangle when none touches the cache
+
+    for (size_t emittedCount = 0; emittedCount < triangleCount; ++emittedCount)
+    {
+        if (best < 0)
+        {
+            while (emitted[cursor])
+                ++cursor;
+            best = (long)cursor;
+        }
+
+        const GLuint* triangle = &local[best * 3];
+        output.insert(output.end(), indices + best * 3, indices + best * 3 + 3);
+        emitted[best] = true;
+
+        // Take the triangle out of its vertices' lists of remaining triangles
+        for (int corner = 0; corner < 3; ++corner)
+        {
+            const GLuint vertex = triangle[corner];
+            GLuint* list = &vertexTriangles[firstTriangle[vertex]];
+            for (GLuint i = 0; i < trianglesLeft[vertex]; ++i)
+            {
+                if (list[i] == (GLuint)best)
+                {
+                    swap(list[i], list[trianglesLeft[vertex] - 1]);
+                    --trianglesLeft[vertex];
+                    break;
+                }
+            }
+        }
+
+        // The triangle's vertices move to the front of the cache
+        nextCache.clear();
+        for (int corner = 0; corner < 3; ++corner)
+        {
+            if (find(nextCache.begin(), nextCache.end(), triangle[corner]) == nextCache.end())
+                nextCache.push_back(triangle[corner]);
+        }
+        for (GLuint vertex : cache)
+        {
+            if (find(nextCache.begin(), nextCache.end(), vertex) == nextCache.end())
+                nextCache.push_back(vertex);
+        }
+
+        // Rescore the cached vertices (those pushed out lose their cache bonus), then the triangles around them
+        for (size_t i = 0; i < nextCache.size(); ++i)
+        {
+            const GLuint vertex = nextCache[i];
+            cachePosition[vertex] = i < VERTEX_CACHE_SIZE ? (int)i : -1;
+            scores[vertex] = vertexScore(cachePosition[vertex], trianglesLeft[vertex]);
+        }
+
+        best = -1;
+        float bestScore = 0.0f;
+        for (GLuint vertex : nextCache)
+        {
+            for (GLuint i = 0; i < trianglesLeft[vertex]; ++i)
+            {
+                const GLuint t = vertexTriangles[firstTriangle[vertex] + i];
+                const float score = triangleScore(t);
+                if (best < 0 || score > bestScore)
+                {
+                    best = (long)t;
+                    bestScore = score;
+                }
+            }
+        }
+
+        if (nextCache.size() > VERTEX_CACHE_SIZE)
+            nextCache.resize(VERTEX_CACHE_SIZE);
+        cache.swap(nextCache);
+    }
+
+    copy(output.begin(), output.end(), indices);
+}
+
+
+/* Reorders clusters of cache-optimized triangles so the ones facing away from the mesh center are drawn first,
+ * they tend to occlude the rest (Sander et al., "Fast triangle reordering"). Clusters only break where all three
+ * vertices miss the cache anyway, so the cache efficiency of UOptimizeVertexCache is kept.
+ */
+void UOptimizeOverdraw(const vector<Vertex>& vertices, GLuint* indices, size_t indexCount)
+{
+    const size_t triangleCount = indexCount / 3;
+    if (triangleCount < 2)
+        return;
+
+    vector<GLuint> local;
+    const GLuint vertexCount = ULocalVertexIndices(indices, triangleCount * 3, local);
+
+    // Cluster boundaries from the same FIFO model as UComputeAcmr
+    const size_t notLoaded = numeric_limits<size_t>::max();
+    vector<size_t> loadedAt(vertexCount, notLoaded);
+    vector<size_t> clusterStarts;
+    size_t misses = 0;
+    for (size_t t = 0; t < triangleCount; ++t)
+    {
+        int triangleMisses = 0;
+        for (int corner = 0; corner < 3; ++corner)
+        {
+            const GLuint vertex = local[t * 3 + corner];
+            if (loadedAt[vertex] == notLoaded || misses - loadedAt[vertex] > VERTEX_CACHE_SIZE)
+            {
+                loadedAt[vertex] = misses++;
+                ++triangleMisses;
+            }
+        }
+        if (t == 0 || triangleMisses == 3)
+            clusterStarts.push_back(t);
+    }
+    if (clusterStarts.size() < 2)
+        return;
+    clusterStarts.push_back(triangleCount);
+
+    // Area weighted centroids and normals
+    vector<glm::vec3> centroids(triangleCount), normals(triangleCount);
+    glm::vec3 meshCenter(0.0f);
+    float meshArea = 0.0f;
+    for (size_t t = 0; t < triangleCount; ++t)
+    {
+        const glm::vec3 a = glm::make_vec3(vertices[indices[t * 3]].position);
+        const glm::vec3 b = glm::make_vec3(vertices[indices[t * 3 + 1]].position);
+        const glm::vec3 c = glm::make_vec3(vertices[indices[t * 3 + 2]].position);
+        centroids[t] = (a + b + c) / 3.0f;
+        normals[t] = glm::cross(b - a, c - a);
+
+        const float area = glm::length(normals[t]);
+        meshCenter += centroids[t] * area;
+        meshArea += area;
+    }
+    if (meshArea > 0.0f)
+        meshCenter /= meshArea;
+
+    struct Cluster
+    {
+        size_t first;
+        size_t count;
+        float outwardness;  // Distance of the cluster's centroid from the mesh center along its normal
+    };
+    vector<Cluster> clusters;
+    for (size_t c = 0; c + 1 < clusterStarts.size(); ++c)
+    {
+        glm::vec3 centroid(0.0f), normal(0.0f);
+        float area = 0.0f;
+        for (size_t t = clusterStarts[c]; t < clusterStarts[c + 1]; ++t)
+        {
+            const float triangleArea = glm::length(normals[t]);
+            centroid += centroids[t] * triangleArea;
+            normal += normals[t];
+            area += triangleArea;
+        }
+
+        float outwardness = 0.0f;
+        if (area > 0.0f && glm::length(normal) > 0.0f)
+            outwardness = glm::dot(centroid / area - meshCenter, glm::normalize(normal));
+        clusters.push_back({ clusterStarts[c], clusterStarts[c + 1] - clusterStarts[c], outwardness });
+    }
+
+    stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) { return a.outwardness > b.outwardness; });
+
+    vector<GLuint> sorted;
+    sorted.reserve(triangleCount * 3);
+    for (const Cluster& cluster : clusters)
+        sorted.insert(sorted.end(), indices + cluster.first * 3, indices + (cluster.first + cluster.count) * 3);
+    copy(sorted.begin(), sorted.end(), indices);
+}
+
+
+// Renumbers the vertices in the order the index buffer first uses them (sequential fetches), dropping unused ones
+void UOptimizeVertexFetch(MeshData& data)
+{
+    const GLuint unused = numeric_limits<GLuint>::max();
+    vector<GLuint> remap(data.vertices.size(), unused);
+    vector<Vertex> vertices;
+    vertices.reserve(data.vertices.size());
+    vector<glm::vec2> lightmapUvs;
+    lightmapUvs.reserve(data.lightmapUvs.size());
+
+    for (GLuint& index : data.indices)
+    {
+        if (remap[index] == unused)
+        {
+            remap[index] = (GLuint)vertices.size();
+            vertices.push_back(data.vertices[index]);
+            if (!data.lightmapUvs.empty())
+                lightmapUvs.push_back(data.lightmapUvs[index]);
+        }
+        index = remap[index];
+    }
+    data.vertices.swap(vertices);
+    data.lightmapUvs.swap(lightmapUvs);
+}
+
+
+// Creates the VAO, vertex and index buffers, packing the vertices into gVertexFormat on the way
+void UUploadMesh(GLMesh& mesh, const Vertex* vertices, GLuint vertexCount, const void* indices, GLuint indexCount, GLenum indexType)
+{
+    mesh.nVertices = vertexCount;
+    mesh.nIndices = indexCount;
+    mesh.indexType = indexType;
+    mesh.vertexFormat = gVertexFormat;
+    mesh.positionScale = glm::vec3(1.0f);
+    mesh.positionOffset = glm::vec3(0.0f);
+
+    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
+    glBindVertexArray(mesh.vao);
+
+    // Create 2 buffers: first one for the vertex data; second one for the indices
+    glGenBuffers(2, mesh.vbos);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the buffer
+
+    const GLsizeiptr vertexSize = mesh.vertexFormat == VERTEX_FORMAT_FLOAT ? sizeof(Vertex) : sizeof(PackedVertex);
+    const GLsizeiptr vertexBytes = vertexSize * (GLsizeiptr)vertexCount;
+    if (mesh.vertexFormat == VERTEX_FORMAT_FLOAT)
+    {
+        glBufferData(GL_ARRAY_BUFFER, vertexBytes, vertices, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    }
+    else
+    {
+        // Quantize positions against the box of the whole vertex buffer, every submesh shares it
+        glm::vec3 boundsMin(0.0f), boundsMax(0.0f);
+        for (GLuint i = 0; i < vertexCount; ++i)
+        {
+            const glm::vec3 position = glm::make_vec3(vertices[i].position);
+            boundsMin = i == 0 ? position : glm::min(boundsMin, position);
+            boundsMax = i == 0 ? position : glm::max(boundsMax, position);
+        }
+        if (mesh.vertexFormat == VERTEX_FORMAT_UNORM16)
+        {
+            mesh.positionScale = boundsMax - boundsMin;
+            mesh.positionOffset = boundsMin;
+        }
+
+        vector<PackedVertex> packed;
+        UPackVertices(vertices, vertexCount, mesh.vertexFormat, boundsMin, boundsMax, packed);
+        glBufferData(GL_ARRAY_BUFFER, vertexBytes, packed.data(), GL_STATIC_DRAW);
+    }
+
+    const GLsizeiptr indexSize = indexType == GL_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexSize * indexCount, indices, GL_STATIC_DRAW);
+
+    USetVertexLayout(mesh.vertexFormat);
+
+    cout << "INFO: Vertex buffer: " << vertexCount << " vertices, " << vertexSize << " bytes each, "
+        << vertexBytes / 1024.0 << " KB" << endl;
+}
+
+
+// Rounds a float to the nearest half float (IEEE 754 binary16)
+GLushort UFloatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    const uint32_t floatExponent = (bits >> 23) & 0xFF;
+    const int32_t exponent = (int32_t)floatExponent - 127 + 15;
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    if (floatExponent == 0xFF)
+        return (GLushort)(sign | 0x7C00 | (mantissa ? 0x200 : 0)); // Inf / NaN
+    if (exponent >= 31)
+        return (GLushort)(sign | 0x7C00); // Too large, becomes Inf
+    if (exponent < -10)
+        return (GLushort)sign; // Too small even for a denormal
+
+    // Denormals shift the implicit leading bit into the mantissa
+    int shift = 13;
+    uint32_t half = ((uint32_t)exponent << 10);
+    if (exponent <= 0)
+    {
+        mantissa |= 0x800000;
+        shift = 14 - exponent;
+        half = 0;
+    }
+    half |= mantissa >> shift;
+
+    // Round to nearest even; a carry into the exponent is still the correct result
+    const uint32_t remainder = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1)))
+        ++half;
+
+    return (GLushort)(sign | half);
+}
+
+
+// Packs a unit normal as signed normalized GL_INT_2_10_10_10_REV (w left at 0)
+GLuint UPackNormal(const GLfloat normal[3])
+{
+    GLuint packed = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        const float clamped = max(-1.0f, min(1.0f, normal[i]));
+        const int value = (int)lround(clamped * 511.0f);
+        packed |= ((GLuint)value & 0x3FF) << (10 * i);
+    }
+    return packed;
+}
+
+
+// Converts vertices to the compact layout; unorm16 positions are relative to the given box
+void UPackVertices(const Vertex* vertices, GLuint vertexCount, VertexFormat format, const glm::vec3& boundsMin, const glm::vec3& boundsMax, vector<PackedVertex>& packed)
+{
+    const glm::vec3 extent = boundsMax - boundsMin;
+
+    packed.resize(vertexCount);
+    for (GLuint i = 0; i < vertexCount; ++i)
+    {
+        const Vertex& vertex = vertices[i];
+        PackedVertex& out = packed[i];
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (format == VERTEX_FORMAT_HALF)
+            {
+                out.position[axis] = UFloatToHalf(vertex.position[axis]);
+            }
+            else
+            {
+                const float normalized = extent[axis] > 0.0f ? (vertex.position[axis] - boundsMin[axis]) / extent[axis] : 0.0f;
+                out.position[axis] = (GLushort)lround(max(0.0f, min(1.0f, normalized)) * 65535.0f);
+            }
+        }
+
+        out.material = (GLushort)min(vertex.material, (GLuint)0xFFFF);
+        out.normal = UPackNormal(vertex.normal);
+        out.uv[0] = UFloatToHalf(vertex.uv[0]);
+        out.uv[1] = UFloatToHalf(vertex.uv[1]);
+    }
+}
+
+
+// Points the vertex attributes of the bound VAO at the bound vertex buffer in the given layout
+void USetVertexLayout(VertexFormat format)
+{
+    if (format == VERTEX_FORMAT_FLOAT)
+    {
+        const GLint stride = sizeof(Vertex);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Vertex, position));
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Vertex, normal));
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(Vertex, uv));
+        // The material index stays an integer in the shader (no float compares)
+        glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, stride, (void*)offsetof(Vertex, material));
+    }
+    else
+    {
+        const GLint stride = sizeof(PackedVertex);
+        if (format == VERTEX_FORMAT_HALF)
+            glVertexAttribPointer(0, 3, GL_HALF_FLOAT, GL_FALSE, stride, (void*)offsetof(PackedVertex, position));
+        else
+            glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*)offsetof(PackedVertex, position));
+        glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (void*)offsetof(PackedVertex, normal));
+        glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void*)offsetof(PackedVertex, uv));
+        glVertexAttribIPointer(3, 1, GL_UNSIGNED_SHORT, stride, (void*)offsetof(PackedVertex, material));
+    }
+
+    for (GLuint attribute = 0; attribute < 4; ++attribute)
+        glEnableVertexAttribArray(attribute);
+}
+
+
+void UDestroyMesh(GLMesh& mesh)
+{
+    glDeleteVertexArrays(1, &mesh.vao);
+    glDeleteBuffers(2, mesh.vbos);
+    glDeleteBuffers(1, &mesh.lightmapVbo);
+}
+
+
+// Object space bounding box and material of every submesh, from the vertices its indices reference
+void UComputeSubmeshBounds(const Vertex* vertices, const void* indices, GLenum indexType, vector<GLSubmesh>& submeshes)
+{
+    for (GLSubmesh& submesh : submeshes)
+    {
+        submesh.boundsMin = glm::vec3(0.0f);
+        submesh.boundsMax = glm::vec3(0.0f);
+        submesh.material = MATERIAL_FROM_VERTEX;
+
+        for (GLuint i = 0; i < submesh.indexCount; ++i)
+        {
+            const GLuint index = indexType == GL_UNSIGNED_INT
+                ? ((const GLuint*)indices)[submesh.firstIndex + i]
+                : ((const GLushort*)indices)[submesh.firstIndex + i];
+            const glm::vec3 position = glm::make_vec3(vertices[index].position);
+
+            submesh.boundsMin = i == 0 ? position : glm::min(submesh.boundsMin, position);
+            submesh.boundsMax = i == 0 ? position : glm::max(submesh.boundsMax, position);
+
+            // One material for the whole submesh lets its draws pick a shader variant by material
+            if (i == 0)
+                submesh.material = vertices[index].material;
+            else if (submesh.material != vertices[index].material)
+                submesh.material = MATERIAL_FROM_VERTEX;
+        }
+    }
+}
+
+
+// World space box enclosing a transformed object space box (center and extents, so no corner loop)
+void UTransformBounds(const glm::mat4& model, const glm::vec3& localMin, const glm::vec3& localMax, glm::vec3& worldMin, glm::vec3& worldMax)
+{
+    const glm::vec3 center = glm::vec3(model * glm::vec4((localMin + localMax) * 0.5f, 1.0f));
+    const glm::vec3 extent = (localMax - localMin) * 0.5f;
+
+    glm::vec3 worldExtent(0.0f);
+    for (int column = 0; column < 3; ++column)
+    {
+        for (int row = 0; row < 3; ++row)
+            worldExtent[row] += fabs(model[column][row]) * extent[column];
+    }
+
+    worldMin = center - worldExtent;
+    worldMax = center + worldExtent;
+}
+
+
+// Places one object per submesh for every desk; desks are laid out in rows receding from the camera
+void UBuildScene(const GLMesh& mesh, int deskCount, vector<SceneObject>& objects)
+{
+    // The desk plane spans 7 x 6.6 units before gCubeScale, leave an aisle between desks
+    const float spacingX = 16.0f;
+    const float spacingZ = 15.0f;
+    const int columns = (int)ceil(sqrt((double)deskCount));
+
+    objects.clear();
+    objects.reserve((size_t)deskCount * mesh.submeshes.size());
+
+    for (int desk = 0; desk < deskCount; ++desk)
+    {
+        const int column = desk % columns;
+        const int row = desk / columns;
+        const glm::vec3 offset((column - (columns - 1) * 0.5f) * spacingX, 0.0f, -row * spacingZ);
+
+        // Model matrix: transformations are applied right-to-left order
+        const glm::mat4 model = glm::translate(gCubePosition + offset) * glm::scale(gCubeScale);
+
+        for (GLuint submesh = 0; submesh < (GLuint)mesh.submeshes.size(); ++submesh)
+        {
+            // Coarser levels are drawn in place of their level 0, they are no objects of their own
+            if (mesh.submeshes[submesh].lodCount == 0)
+                continue;
+
+            SceneObject object;
+            object.submesh = submesh;
+            object.model = model;
+            object.material = MATERIAL_FROM_VERTEX;
+            object.lod = 0;
+            UTransformBounds(model, mesh.submeshes[submesh].boundsMin, mesh.submeshes[submesh].boundsMax, object.boundsMin, object.boundsMax);
+            objects.push_back(object);
+        }
+    }
+}
+
+
+// Moves an object; the hierarchy is refit before the next frame is culled
+void UMoveSceneObject(GLuint objectIndex, const glm::mat4& model)
+{
+    SceneObject& object = gSceneObjects[objectIndex];
+    const GLSubmesh& submesh = gMesh.submeshes[object.submesh];
+
+    object.model = model;
+    UTransformBounds(model, submesh.boundsMin, submesh.boundsMax, object.boundsMin, object.boundsMax);
+    gBvhDirty = true;
+    ++gSceneGeneration;
+
+    // Its bake no longer matches, nor do the bakes of its neighbours which saw it there; they fall back to the
+    // unoccluded ambient of the white block
+    if (objectIndex < gLightmap.rects.size())
+    {
+        const glm::vec4 white(0.0f, 0.0f, LIGHTMAP_WHITE_SIZE * 0.5f / gLightmap.width, LIGHTMAP_WHITE_SIZE * 0.5f / gLightmap.height);
+        gLightmap.rects[objectIndex] = white;
+        for (GLuint neighbour : gLightmap.neighbours[objectIndex])
+            gLightmap.rects[neighbour] = white;
+    }
+}
+
+
+// Slides the mouse of every desk to slide along x from where UBuildScene placed it (--move-objects)
+void UAnimateSceneObjects(float slide)
+{
+    if (gSceneRestModels.size() != gSceneObjects.size())
+    {
+        gSceneRestModels.clear();
+        for (const SceneObject& object : gSceneObjects)
+            gSceneRestModels.push_back(object.model);
+    }
+    if (slide == gAppliedObjectSlide)
+        return;
+    gAppliedObjectSlide = slide;
+
+    const glm::mat4 offset = glm::translate(glm::vec3(slide, 0.0f, 0.0f));
+    for (GLuint i = 0; i < (GLuint)gSceneObjects.size(); ++i)
+    {
+        if (gMesh.submeshes[gSceneObjects[i].submesh].material == MATERIAL_MOUSE)
+            UMoveSceneObject(i, offset * gSceneRestModels[i]);
+    }
+}
+
+
+// Splits objects [begin, end) of the order array at the median centroid of their widest axis
+static GLuint UBuildBvhNode(const vector<SceneObject>& objects, vector<BvhNode>& nodes, vector<GLuint>& order, GLuint begin, GLuint end)
+{
+    const GLuint nodeIndex = (GLuint)nodes.size();
+    nodes.push_back(BvhNode());
+    nodes[nodeIndex].firstObject = begin;
+    nodes[nodeIndex].objectCount = end - begin;
+    nodes[nodeIndex].rightChild = 0;
+
+    if (end - begin <= BVH_LEAF_SIZE)
+        return nodeIndex;
+
+    glm::vec3 centroidMin = (objects[order[begin]].boundsMin + objects[order[begin]].boundsMax) * 0.5f;
+    glm::vec3 centroidMax = centroidMin;
+    for (GLuint i = begin + 1; i < end; ++i)
+    {
+        const glm::vec3 centroid = (objects[order[i]].boundsMin + objects[order[i]].boundsMax) * 0.5f;
+        centroidMin = glm::min(centroidMin, centroid);
+        centroidMax = glm::max(centroidMax, centroid);
+    }
+
+    const glm::vec3 size = centroidMax - centroidMin;
+    const int axis = size.x >= size.y && size.x >= size.z ? 0 : (size.y >= size.z ? 1 : 2);
+
+    const GLuint middle = begin + (end - begin) / 2;
+    nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+        [&objects, axis](GLuint a, GLuint b)
+        {
+            return objects[a].boundsMin[axis] + objects[a].boundsMax[axis] < objects[b].boundsMin[axis] + objects[b].boundsMax[axis];
+        });
+
+    // Depth first layout: the left child directly follows its parent
+    UBuildBvhNode(objects, nodes, order, begin, middle);
+    const GLuint rightChild = UBuildBvhNode(objects, nodes, order, middle, end);
+    nodes[nodeIndex].rightChild = rightChild;
+    return nodeIndex;
+}
+
+
+void UBuildBvh(const vector<SceneObject>& objects, vector<BvhNode>& nodes, vector<GLuint>& order)
+{
+    nodes.clear();
+    order.resize(objects.size());
+    for (GLuint i = 0; i < (GLuint)order.size(); ++i)
+        order[i] = i;
+
+    if (!objects.empty())
+    {
+        nodes.reserve(2 * objects.size() / BVH_LEAF_SIZE + 1);
+        UBuildBvhNode(objects, nodes, order, 0, (GLuint)objects.size());
+    }
+
+    URefitBvh(objects, nodes, order);
+}
+
+
+// Recomputes node bounds from the current object bounds, keeping the tree structure
+void URefitBvh(const vector<SceneObject>& objects, vector<BvhNode>& nodes, const vector<GLuint>& order)
+{
+    // Children are stored after their parent, so a reverse sweep visits them first
+    for (size_t i = nodes.size(); i-- > 0;)
+    {
+        BvhNode& node = nodes[i];
+        if (node.rightChild == 0)
+        {
+            node.boundsMin = objects[order[node.firstObject]].boundsMin;
+            node.boundsMax = objects[order[node.firstObject]].boundsMax;
+            for (GLuint j = 1; j < node.objectCount; ++j)
+            {
+                node.boundsMin = glm::min(node.boundsMin, objects[order[node.firstObject + j]].boundsMin);
+                node.boundsMax = glm::max(node.boundsMax, objects[order[node.firstObject + j]].boundsMax);
+            }
+        }
+        else
+        {
+            const BvhNode& left = nodes[i + 1];
+            const BvhNode& right = nodes[node.rightChild];
+            node.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+            node.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+        }
+    }
+}
+
+
+// Frustum planes of a view projection matrix (Gribb/Hartmann), pointing inwards
+void UExtractFrustumPlanes(const glm::mat4& viewProjection, FrustumPlanes& planes)
+{
+    // Plane = row 3 +/- row 0, 1 or 2 of the matrix
+    for (int i = 0; i < 6; ++i)
+    {
+        const int row = i / 2;
+        const float sign = (i % 2 == 0) ? 1.0f : -1.0f;
+
+        glm::vec4 plane;
+        for (int column = 0; column < 4; ++column)
+            plane[column] = viewProjection[column][3] + sign * viewProjection[column][row];
+
+        const float length = sqrt(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+        planes.nx[i] = plane.x / length;
+        planes.ny[i] = plane.y / length;
+        planes.nz[i] = plane.z / length;
+        planes.d[i] = plane.w / length;
+    }
+
+    // Padding planes every point is in front of
+    for (int i = 6; i < 8; ++i)
+    {
+        planes.nx[i] = planes.ny[i] = planes.nz[i] = 0.0f;
+        planes.d[i] = 1.0f;
+    }
+}
+
+
+// Tests a box against all planes at once: -1 outside, 0 intersecting, 1 fully inside
+int UClassifyBox(const FrustumPlanes& planes, const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+    const glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+    const glm::vec3 extent = (boundsMax - boundsMin) * 0.5f;
+
+#if defined(USE_SSE2)
+    const __m128 cx = _mm_set1_ps(center.x), cy = _mm_set1_ps(center.y), cz = _mm_set1_ps(center.z);
+    const __m128 ex = _mm_set1_ps(extent.x), ey = _mm_set1_ps(extent.y), ez = _mm_set1_ps(extent.z);
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    const __m128 zero = _mm_setzero_ps();
+
+    __m128 outside = zero;
+    __m128 intersecting = zero;
+    for (int i = 0; i < 8; i += 4)
+    {
+        const __m128 nx = _mm_load_ps(planes.nx + i);
+        const __m128 ny = _mm_load_ps(planes.ny + i);
+        const __m128 nz = _mm_load_ps(planes.nz + i);
+
+        // Signed distance of the center and projected radius of the box, four planes per step
+        const __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)),
+            _mm_add_ps(_mm_mul_ps(nz, cz), _mm_load_ps(planes.d + i)));
+        const __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(signMask, nx), ex), _mm_mul_ps(_mm_andnot_ps(signMask, ny), ey)),
+            _mm_mul_ps(_mm_andnot_ps(signMask, nz), ez));
+
+        outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), zero));
+        intersecting = _mm_or_ps(intersecting, _mm_cmplt_ps(_mm_sub_ps(distance, radius), zero));
+    }
+
+    if (_mm_movemask_ps(outside))
+        return -1;
+    return _mm_movemask_ps(intersecting) ? 0 : 1;
+#else
+    int result = 1;
+    for (int i = 0; i < 6; ++i)
+    {
+        const float distance = planes.nx[i] * center.x + planes.ny[i] * center.y + planes.nz[i] * center.z + planes.d[i];
+        const float radius = fabs(planes.nx[i]) * extent.x + fabs(planes.ny[i]) * extent.y + fabs(planes.nz[i]) * extent.z;
+
+        if (distance + radius < 0.0f)
+            return -1;
+        if (distance - radius < 0.0f)
+            result = 0;
+    }
+    return result;
+#endif
+}
+
+
+// Collects the objects inside the frustum; subtrees fully inside are taken without testing their objects
+void UCullScene(const FrustumPlanes& planes, vector<GLuint>& visible)
+{
+    visible.clear();
+    if (gBvhNodes.empty())
+        return;
+
+    GLuint stack[64];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        const BvhNode& node = gBvhNodes[stack[--stackSize]];
+
+        const int classification = UClassifyBox(planes, node.boundsMin, node.boundsMax);
+        if (classification < 0)
+            continue;
+
+        const GLuint* objects = gBvhObjects.data() + node.firstObject;
+        if (classification > 0)
+        {
+            visible.insert(visible.end(), objects, objects + node.objectCount);
+        }
+        else if (node.rightChild == 0)
+        {
+            for (GLuint i = 0; i < node.objectCount; ++i)
+            {
+                const SceneObject& object = gSceneObjects[objects[i]];
+                if (UClassifyBox(planes, object.boundsMin, object.boundsMax) >= 0)
+                    visible.push_back(objects[i]);
+            }
+        }
+        else
+        {
+            // Median splits keep the depth near log2(objects / BVH_LEAF_SIZE), far below the stack size
+            stack[stackSize++] = node.rightChild;
+            stack[stackSize++] = (GLuint)(&node - gBvhNodes.data()) + 1;
+        }
+    }
+}
+
+
+// Picks the level of detail of every visible object from its projected diameter in pixels. An object only
+// changes level once its size is LOD_HYSTERESIS past the threshold, so objects at a threshold do not pop.
+void USelectLods(const GLMesh& mesh, const glm::vec3& cameraPosition, float fieldOfView, int viewportHeight, const vector<GLuint>& visible, vector<SceneObject>& objects)
+{
+    // Pixels covered by one unit at distance one
+    const float pixelsPerUnit = viewportHeight * 0.5f / tan(glm::radians(fieldOfView) * 0.5f);
+
+    for (GLuint objectIndex : visible)
+    {
+        SceneObject& object = objects[objectIndex];
+        const GLuint levels = mesh.submeshes[object.submesh].lodCount;
+        if (levels <= 1)
+            continue;
+
+        const glm::vec3 center = (object.boundsMin + object.boundsMax) * 0.5f;
+        const float radius = glm::length(object.boundsMax - object.boundsMin) * 0.5f;
+        const float distance = glm::length(center - cameraPosition);
+
+        // Inside the bounding sphere the object covers the screen
+        const float screenSize = distance > radius ? 2.0f * radius * pixelsPerUnit / distance : numeric_limits<float>::max();
+
+        GLuint lod = min(object.lod, levels - 1);
+        while (lod > 0 && screenSize > LOD_SCREEN_SIZES[lod - 1] * (1.0f + LOD_HYSTERESIS))
+            --lod;
+        while (lod + 1 < levels && screenSize < LOD_SCREEN_SIZES[lod] * (1.0f - LOD_HYSTERESIS))
+            ++lod;
+        object.lod = lod;
+    }
+}
+
+
+// Creates the storage, command and object index buffers the scene is drawn from
+void UCreateDrawBuffers(const GLMesh& mesh, size_t objectCapacity, GLDrawBuffers& buffers)
+{
+    buffers.commandsOffset = 0;
+
+    // Without gl_DrawIDARB the shader gets its object index from an instanced attribute holding 0, 1, 2, ...
+    // Instanced attributes start at the command's baseInstance, which is the draw's first object.
+    vector<GLuint> objectIndices(objectCapacity);
+    for (GLuint i = 0; i < (GLuint)objectCapacity; ++i)
+        objectIndices[i] = i;
+
+    glBindVertexArray(mesh.vao);
+
+    glGenBuffers(1, &buffers.objectIndices);
+    glBindBuffer(GL_ARRAY_BUFFER, buffers.objectIndices);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLuint) * objectIndices.size(), objectIndices.data(), GL_STATIC_DRAW);
+
+    glVertexAttribIPointer(4, 1, GL_UNSIGNED_INT, sizeof(GLuint), (void*)0);
+    glVertexAttribDivisor(4, 1);
+    glEnableVertexAttribArray(4);
+
+    glBindVertexArray(0);
+}
+
+
+// Features of the lit passes for the current lights: the point light loop when there are any
+GLuint ULightShaderFeatures()
+{
+    return gPointLights.empty() ? 0 : SHADER_POINT_LIGHTS;
+}
+
+
+// Features of the whole frame's scene pass: the point light loop in the forward renderer, the G-buffer output in the
+// deferred renderer (the G-buffer pass reads no lights, the lighting pass does)
+GLuint UFrameShaderFeatures()
+{
+    GLuint features = gRenderer == RENDERER_DEFERRED ? SHADER_GBUFFER : ULightShaderFeatures();
+    if (gLightmap.texture != 0)
+        features |= SHADER_LIGHTMAP;
+    return features;
+}
+
+
+// Features an object is drawn with: those of its material, and the normal matrix when its transform scales unevenly
+GLuint UObjectShaderFeatures(const GLMesh& mesh, const SceneObject& object)
+{
+    const GLuint material = object.material != MATERIAL_FROM_VERTEX ? object.material : mesh.submeshes[object.submesh].material;
+
+    // A submesh mixing materials needs whatever any of them needs
+    GLuint features = 0;
+    if (material < MATERIAL_COUNT)
+        features = gMaterialFeatures[material];
+    else
+    {
+        for (GLuint i = 0; i < MATERIAL_COUNT; ++i)
+            features |= gMaterialFeatures[i];
+    }
+
+    // mat3(model) transforms normals correctly when its columns are orthogonal and of equal length
+    const glm::vec3 x(object.model[0]), y(object.model[1]), z(object.model[2]);
+    const float scale = glm::dot(x, x);
+    const float tolerance = 1e-4f * scale;
+    if (fabs(glm::dot(y, y) - scale) > tolerance || fabs(glm::dot(z, z) - scale) > tolerance
+        || fabs(glm::dot(x, y)) > tolerance || fabs(glm::dot(y, z)) > tolerance || fabs(glm::dot(z, x)) > tolerance)
+        features |= SHADER_NORMAL_MATRIX;
+
+    return features;
+}
+
+
+uint64_t URenderSortKey(GLuint pass, GLuint program, GLuint textures, GLuint vertexArray, GLuint submesh, float depth)
+{
+    // Non-negative floats order like their bit patterns
+    uint32_t depthBits;
+    depth = max(depth, 0.0f);
+    memcpy(&depthBits, &depth, sizeof(depthBits));
+
+    const auto field = [](GLuint value, int bits, int shift) { return ((uint64_t)value & ((1ull << bits) - 1)) << shift; };
+    return field(pass, 64 - SORT_KEY_PASS_SHIFT, SORT_KEY_PASS_SHIFT)
+        | field(program, SORT_KEY_PROGRAM_BITS, SORT_KEY_PROGRAM_SHIFT)
+        | field(textures, SORT_KEY_TEXTURES_BITS, SORT_KEY_TEXTURES_SHIFT)
+        | field(vertexArray, SORT_KEY_VAO_BITS, SORT_KEY_VAO_SHIFT)
+        | field(submesh, SORT_KEY_SUBMESH_BITS, SORT_KEY_SUBMESH_SHIFT)
+        | (depthBits >> (32 - SORT_KEY_DEPTH_BITS));
+}
+
+
+GLuint URenderKeyField(uint64_t key, int shift, int bits)
+{
+    return (GLuint)((key >> shift) & ((1ull << bits) - 1));
+}
+
+
+void UClearRenderQueue(RenderQueue& queue)
+{
+    queue.keys.clear();
+    queue.values.clear();
+}
+
+
+void USubmitDraw(RenderQueue& queue, uint64_t key, GLuint value)
+{
+    queue.keys.push_back(key);
+    queue.values.push_back(value);
+}
+
+
+// Least significant digit radix sort, a byte per pass; bytes every key shares are skipped
+void USortRenderQueue(RenderQueue& queue)
+{
+    const size_t count = queue.keys.size();
+    if (count < 2)
+        return;
+
+    // Digit counts do not depend on the order, one read of the keys counts all eight
+    vector<size_t> histograms(8 * 256, 0);
+    for (uint64_t key : queue.keys)
+    {
+        for (int digit = 0; digit < 8; ++digit)
+            ++histograms[digit * 256 + ((key >> (8 * digit)) & 0xFF)];
+    }
+
+    queue.sortKeys.resize(count);
+    queue.sortValues.resize(count);
+    for (int digit = 0; digit < 8; ++digit)
+    {
+        const int shift = 8 * digit;
+        size_t* offsets = &histograms[digit * 256];
+        if (offsets[(queue.keys[0] >> shift) & 0xFF] == count)
+            continue;
+
+        size_t offset = 0;
+        for (int bucket = 0; bucket < 256; ++bucket)
+        {
+            const size_t bucketCount = offsets[bucket];
+            offsets[bucket] = offset;
+            offset += bucketCount;
+        }
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            const size_t to = offsets[(queue.keys[i] >> shift) & 0xFF]++;
+            queue.sortKeys[to] = queue.keys[i];
+            queue.sortValues[to] = queue.values[i];
+        }
+        queue.keys.swap(queue.sortKeys);
+        queue.values.swap(queue.sortValues);
+    }
+}
+
+
+// Submits every visible object to the scene pass, keyed by its shader variant and submesh, then its distance to the camera
+void UQueueSceneObjects(const GLMesh& mesh, const vector<SceneObject>& objects, const vector<GLuint>& visible, const glm::vec3& cameraPosition, GLuint frameFeatures, RenderQueue& queue)
+{
+    for (GLuint objectIndex : visible)
+    {
+        const SceneObject& object = objects[objectIndex];
+        const glm::vec3 toCenter = 0.5f * (object.boundsMin + object.boundsMax) - cameraPosition;
+        const GLuint features = UObjectShaderFeatures(mesh, object) | frameFeatures;
+        USubmitDraw(queue, URenderSortKey(RENDER_PASS_SCENE, features, RENDER_TEXTURES_MATERIALS, RENDER_VAO_SCENE, object.submesh + object.lod, glm::dot(toCenter, toCenter)), objectIndex);
+    }
+}
+
+
+// Stream bytes UWriteDrawCommands may allocate for a queue: ObjectData for every item, and a Draws entry and a command
+// per command, of which there are no more than queued items or shader variants of the submeshes
+GLsizeiptr UDrawCommandsSpan(const GLStreamBuffer& stream, const GLMesh& mesh, const RenderQueue& queue)
+{
+    const size_t commands = max<size_t>(min<size_t>(queue.keys.size(), SHADER_OBJECT_VARIANTS * mesh.submeshes.size()), 1);
+    return UStreamSpan(stream, sizeof(ObjectData) * max<size_t>(queue.keys.size(), 1))
+        + UStreamSpan(stream, sizeof(GLuint) * commands) + UStreamSpan(stream, sizeof(DrawElementsIndirectCommand) * commands);
+}
+
+
+/* Streams the Objects, Draws and indirect commands of the scene pass at the front of the sorted queue:
+ * a command per run of keys sharing state and submesh, instanced over its objects (front to back),
+ * and a batch per run of commands sharing state. Returns the number of queue items consumed.
+ */
+size_t UWriteDrawCommands(const GLMesh& mesh, const vector<SceneObject>& objects, const RenderQueue& queue, const glm::mat4& viewProjection, GLStreamBuffer& stream, GLDrawBuffers& buffers, vector<DrawElementsIndirectCommand>& commands, vector<DrawBatch>& batches)
+{
+    commands.clear();
+    batches.clear();
+    gDrawFirstObject.clear();
+
+    // ObjectData is written straight into the mapped stream buffer, room for every queued item
+    const GLsizeiptr objectsSize = sizeof(ObjectData) * max<size_t>(queue.keys.size(), 1);
+    GLintptr objectsOffset;
+    ObjectData* objectData = (ObjectData*)UStreamAllocate(stream, objectsSize, objectsOffset);
+    if (!objectData)
+        return 0;
+
+    size_t item = 0;
+    for (; item < queue.keys.size(); ++item)
+    {
+        const uint64_t key = queue.keys[item];
+        if (URenderKeyField(key, SORT_KEY_PASS_SHIFT, 64 - SORT_KEY_PASS_SHIFT) != RENDER_PASS_SCENE)
+            break;
+
+        // Program, textures and vertex array start a batch when they change, the submesh a command
+        const uint64_t previous = item > 0 ? queue.keys[item - 1] : ~key;
+        const GLuint features = URenderKeyField(key, SORT_KEY_PROGRAM_SHIFT, SORT_KEY_PROGRAM_BITS);
+        if ((key >> SORT_KEY_VAO_SHIFT) != (previous >> SORT_KEY_VAO_SHIFT))
+            batches.push_back({ features, (GLuint)commands.size(), 0 });
+        if ((key >> SORT_KEY_SUBMESH_SHIFT) != (previous >> SORT_KEY_SUBMESH_SHIFT))
+        {
+            const GLSubmesh& submesh = mesh.submeshes[URenderKeyField(key, SORT_KEY_SUBMESH_SHIFT, SORT_KEY_SUBMESH_BITS)];
+            DrawElementsIndirectCommand command;
+            command.count = submesh.indexCount;
+            command.instanceCount = 0;
+            command.firstIndex = submesh.firstIndex;
+            command.baseVertex = 0;
+            command.baseInstance = (GLuint)item;
+            commands.push_back(command);
+            gDrawFirstObject.push_back((GLuint)item);
+            ++batches.back().commandCount;
+        }
+        ++commands.back().instanceCount;
+
+        // Matrices are multiplied here once per object instead of once per vertex
+        const SceneObject& object = objects[queue.values[item]];
+        ObjectData& data = objectData[item];
+        const glm::mat4 modelViewProjection = viewProjection * object.model;
+        memcpy(data.model, glm::value_ptr(object.model), sizeof(data.model));
+        memcpy(data.modelViewProjection, glm::value_ptr(modelViewProjection), sizeof(data.modelViewProjection));
+        if (features & SHADER_NORMAL_MATRIX)
+        {
+            const glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(object.model)));
+            for (int column = 0; column < 3; ++column)
+                memcpy(data.normalMatrix + 4 * column, glm::value_ptr(normalMatrix) + 3 * column, sizeof(GLfloat) * 3);
+        }
+        data.material = object.material;
+        const glm::vec4 lightmapRect = queue.values[item] < gLightmap.rects.size() ? gLightmap.rects[queue.values[item]] : glm::vec4(0.0f);
+        memcpy(data.lightmapRect, glm::value_ptr(lightmapRect), sizeof(data.lightmapRect));
+    }
+
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, OBJECT_BUFFER_BINDING, stream.buffer, objectsOffset, objectsSize);
+
+    // Empty ranges cannot be bound, the Draws range keeps at least one element
+    const GLintptr drawsOffset = UStreamWrite(stream, gDrawFirstObject.data(), sizeof(GLuint) * gDrawFirstObject.size(), sizeof(GLuint));
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, DRAW_BUFFER_BINDING, stream.buffer, drawsOffset, sizeof(GLuint) * max<size_t>(gDrawFirstObject.size(), 1));
+
+    buffers.commandsOffset = UStreamWrite(stream, commands.data(), sizeof(DrawElementsIndirectCommand) * commands.size());
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, stream.buffer);
+
+    return item;
+}
+
+
+void UDestroyDrawBuffers(GLDrawBuffers& buffers)
+{
+    glDeleteBuffers(1, &buffers.objectIndices);
+}
+
+
+// Scatters point lights with random colors through the box enclosing the scene (and a little above it).
+// Their radius keeps about POINT_LIGHTS_PER_POINT lights reaching any point, however many there are.
+void UBuildPointLights(int count, vector<PointLight>& lights)
+{
+    lights.clear();
+    if (count <= 0 || gBvhNodes.empty())
+        return;
+
+    const glm::vec3 sceneMin = gBvhNodes[0].boundsMin;
+    const glm::vec3 sceneMax = gBvhNodes[0].boundsMax + glm::vec3(0.0f, 2.0f, 0.0f);
+    const glm::vec3 extent = sceneMax - sceneMin;
+
+    // count * (4/3 pi r^3) / volume = lights per point
+    const float volume = extent.x * extent.y * extent.z;
+    const float radius = min(POINT_LIGHT_MAX_RADIUS, (float)cbrt(3.0 * POINT_LIGHTS_PER_POINT * volume / (4.0 * 3.14159265 * count)));
+
+    // Fixed seed: every run and every sweep step lights the scene the same way
+    mt19937 random(330);
+    uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    lights.resize(count);
+    for (PointLight& light : lights)
+    {
+        const glm::vec3 position = sceneMin + (sceneMax - sceneMin) * glm::vec3(unit(random), unit(random), unit(random));
+        light.positionRadius = glm::vec4(position, radius);
+        light.color = glm::vec4(unit(random), unit(random), unit(random), 0.0f) * POINT_LIGHT_INTENSITY;
+    }
+}
+
+
+/* Bins the point lights into the clusters of the view frustum. Each light only visits the clusters its view space
+ * bounding box projects to, so the cost follows the lights and the clusters they touch, not lights times clusters.
+ * The lights are bounded by chunks of CLUSTER_LIGHT_CHUNK, then every depth slice is counted and filled by one job,
+ * so no two threads write the same cluster; lights stay in index order within a cluster whatever the thread count.
+ * Output: an (first, count) pair per cluster into the list of light indices.
+ */
+void UAssignLights(const glm::mat4& view, const glm::mat4& projection, const vector<PointLight>& lights, vector<GLuint>& clusters, vector<GLuint>& clusterLights)
+{
+    const float sliceScale = CLUSTER_GRID_Z / log(CLUSTER_FAR / CLUSTER_NEAR);
+    auto slice = [&](float depth) { return (GLuint)glm::clamp(floor(log(depth / CLUSTER_NEAR) * sliceScale), 0.0f, CLUSTER_GRID_Z - 1.0f); };
+    auto tile = [](float ndc, GLuint tiles) { return (GLuint)glm::clamp(floor((ndc * 0.5f + 0.5f) * tiles), 0.0f, tiles - 1.0f); };
+
+    struct LightRange
+    {
+        GLuint light;       // outside when the light reaches no cluster
+        GLuint minX, maxX, minY, maxY, minZ, maxZ;
+    };
+    const GLuint outside = ~0u;
+    vector<LightRange> ranges(lights.size());
+
+    const size_t chunks = (lights.size() + CLUSTER_LIGHT_CHUNK - 1) / CLUSTER_LIGHT_CHUNK;
+    URunParallel(chunks, [&](size_t chunk)
+    {
+        const GLuint end = (GLuint)min<size_t>(lights.size(), (chunk + 1) * CLUSTER_LIGHT_CHUNK);
+        for (GLuint i = (GLuint)chunk * CLUSTER_LIGHT_CHUNK; i < end; ++i)
+        {
+            ranges[i].light = outside;
+            const glm::vec3 center = glm::vec3(view * glm::vec4(glm::vec3(lights[i].positionRadius), 1.0f));
+            const float radius = lights[i].positionRadius.w;
+            const float depth = -center.z;
+            if (depth + radius < CLUSTER_NEAR || depth - radius > CLUSTER_FAR)
+                continue;
+
+            // x / depth is monotonic in depth, so the box's screen extent is spanned by its nearest and farthest depths
+            const float nearDepth = max(depth - radius, CLUSTER_NEAR);
+            const float farDepth = min(depth + radius, CLUSTER_FAR);
+            float minNdc[2], maxNdc[2];
+            for (int axis = 0; axis < 2; ++axis)
+            {
+                const float scale = projection[axis][axis];
+                const float low = center[axis] - radius;
+                const float high = center[axis] + radius;
+                minNdc[axis] = scale * min(low / nearDepth, low / farDepth);
+                maxNdc[axis] = scale * max(high / nearDepth, high / farDepth);
+            }
+            if (maxNdc[0] < -1.0f || minNdc[0] > 1.0f || maxNdc[1] < -1.0f || minNdc[1] > 1.0f)
+                continue;
+
+            ranges[i] = { i,
+                tile(minNdc[0], CLUSTER_GRID_X), tile(maxNdc[0], CLUSTER_GRID_X),
+                tile(minNdc[1], CLUSTER_GRID_Y), tile(maxNdc[1], CLUSTER_GRID_Y),
+                slice(nearDepth), slice(farDepth) };
+        }
+    });
+    ranges.erase(remove_if(ranges.begin(), ranges.end(), [&](const LightRange& range) { return range.light == outside; }), ranges.end());
+
+    // The ranges reaching into every depth slice, in light order
+    GLuint sliceStarts[CLUSTER_GRID_Z + 1] = {};
+    for (const LightRange& range : ranges)
+        for (GLuint z = range.minZ; z <= range.maxZ; ++z)
+            ++sliceStarts[z + 1];
+    for (GLuint z = 0; z < CLUSTER_GRID_Z; ++z)
+        sliceStarts[z + 1] += sliceStarts[z];
+    vector<GLuint> sliceRanges(sliceStarts[CLUSTER_GRID_Z]);
+    GLuint sliceCursors[CLUSTER_GRID_Z];
+    copy(sliceStarts, sliceStarts + CLUSTER_GRID_Z, sliceCursors);
+    for (GLuint index = 0; index < (GLuint)ranges.size(); ++index)
+        for (GLuint z = ranges[index].minZ; z <= ranges[index].maxZ; ++z)
+            sliceRanges[sliceCursors[z]++] = index;
+
+    clusters.assign(CLUSTER_COUNT * 2, 0);
+    URunParallel(CLUSTER_GRID_Z, [&](size_t z)
+    {
+        for (GLuint entry = sliceStarts[z]; entry < sliceStarts[z + 1]; ++entry)
+        {
+            const LightRange& range = ranges[sliceRanges[entry]];
+            for (GLuint y = range.minY; y <= range.maxY; ++y)
+                for (GLuint x = range.minX; x <= range.maxX; ++x)
+                    ++clusters[((z * CLUSTER_GRID_Y + y) * CLUSTER_GRID_X + x) * 2 + 1];
+        }
+    });
+
+    // Prefix sum of the counts gives every cluster its range, filled in a second pass
+    GLuint total = 0;
+    for (GLuint cluster = 0; cluster < CLUSTER_COUNT; ++cluster)
+    {
+        clusters[cluster * 2] = total;
+        total += clusters[cluster * 2 + 1];
+        clusters[cluster * 2 + 1] = 0;
+    }
+
+    clusterLights.resize(total);
+    URunParallel(CLUSTER_GRID_Z, [&](size_t z)
+    {
+        for (GLuint entry = sliceStarts[z]; entry < sliceStarts[z + 1]; ++entry)
+        {
+            const LightRange& range = ranges[sliceRanges[entry]];
+            for (GLuint y = range.minY; y <= range.maxY; ++y)
+                for (GLuint x = range.minX; x <= range.maxX; ++x)
+                {
+                    GLuint* cluster = &clusters[((z * CLUSTER_GRID_Y + y) * CLUSTER_GRID_X + x) * 2];
+                    clusterLights[cluster[0] + cluster[1]++] = range.light;
+                }
+        }
+    });
+}
+
+
+// Bytes of the lights, clusters and cluster lights ranges UWriteClusterBuffers binds. Empty ranges cannot be bound,
+// each keeps at least one element.
+void UClusterBufferSizes(const vector<PointLight>& lights, const vector<GLuint>& clusters, const vector<GLuint>& clusterLights, GLsizeiptr sizes[3])
+{
+    sizes[0] = sizeof(PointLight) * max<size_t>(lights.size(), 1);
+    sizes[1] = sizeof(GLuint) * max<size_t>(clusters.size(), 1);
+    sizes[2] = sizeof(GLuint) * max<size_t>(clusterLights.size(), 1);
+}
+
+
+// Stream bytes UWriteClusterBuffers allocates
+GLsizeiptr UClusterBuffersSpan(const GLStreamBuffer& stream, const vector<PointLight>& lights, const vector<GLuint>& clusters, const vector<GLuint>& clusterLights)
+{
+    GLsizeiptr sizes[3];
+    UClusterBufferSizes(lights, clusters, clusterLights, sizes);
+    return UStreamSpan(stream, sizes[0]) + UStreamSpan(stream, sizes[1]) + UStreamSpan(stream, sizes[2]);
+}
+
+
+// Streams the lights and their cluster assignment, and binds the ranges to the storage buffer bindings
+void UWriteClusterBuffers(GLStreamBuffer& stream, const vector<PointLight>& lights, const vector<GLuint>& clusters, const vector<GLuint>& clusterLights)
+{
+    GLsizeiptr sizes[3];
+    UClusterBufferSizes(lights, clusters, clusterLights, sizes);
+
+    const GLintptr lightsOffset = UStreamWrite(stream, lights.data(), sizeof(PointLight) * lights.size(), sizes[0]);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, LIGHT_BUFFER_BINDING, stream.buffer, lightsOffset, sizes[0]);
+
+    const GLintptr clustersOffset = UStreamWrite(stream, clusters.data(), sizeof(GLuint) * clusters.size(), sizes[1]);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, CLUSTER_BUFFER_BINDING, stream.buffer, clustersOffset, sizes[1]);
+
+    const GLintptr clusterLightsOffset = UStreamWrite(stream, clusterLights.data(), sizeof(GLuint) * clusterLights.size(), sizes[2]);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, CLUSTER_LIGHT_BUFFER_BINDING, stream.buffer, clusterLightsOffset, sizes[2]);
+}
+
+
+// Creates the deferred renderer's G-buffer: albedo and normal color targets over a sampled depth texture
+bool UCreateGBuffer(int width, int height, GLGBuffer& gbuffer)
+{
+    gbuffer.width = width;
+    gbuffer.height = height;
+
+    glGenFramebuffers(1, &gbuffer.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.fbo);
+
+    const GLenum formats[3] = { GL_RGBA8, GL_RGBA16F, GL_DEPTH24_STENCIL8 };
+    const GLenum attachments[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_DEPTH_STENCIL_ATTACHMENT };
+    GLuint* textures[3] = { &gbuffer.albedo, &gbuffer.normal, &gbuffer.depth };
+
+    for (int i = 0; i < 3; ++i)
+    {
+        // Read with texelFetch only, one texel per pixel
+        glGenTextures(1, textures[i]);
+        UStateEditTexture(GL_TEXTURE_2D, *textures[i]);
+        glTexStorage2D(GL_TEXTURE_2D, 1, formats[i], width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, attachments[i], GL_TEXTURE_2D, *textures[i], 0);
+    }
+
+    const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, drawBuffers);
+
+    const bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, gHeadless ? gOffscreenFbo : 0);
+    if (!complete)
+    {
+        cerr << "G-buffer framebuffer is incomplete" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+void UDestroyGBuffer(GLGBuffer& gbuffer)
+{
+    glDeleteFramebuffers(1, &gbuffer.fbo);
+    glDeleteTextures(1, &gbuffer.albedo);
+    glDeleteTextures(1, &gbuffer.normal);
+    glDeleteTextures(1, &gbuffer.depth);
+    gbuffer = GLGBuffer();
+}
+
+
+// Sized format of a framebuffer's depth buffer (with its stencil bits), 0 when it has none or one a texture cannot copy
+GLenum UQueryDepthFormat(GLuint fbo)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    const GLenum depthAttachment = fbo == 0 ? GL_DEPTH : GL_DEPTH_ATTACHMENT;
+    const GLenum stencilAttachment = fbo == 0 ? GL_STENCIL : GL_STENCIL_ATTACHMENT;
+
+    GLint depthObject = GL_NONE, stencilObject = GL_NONE;
+    glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, depthAttachment, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_TYPE, &depthObject);
+    glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, stencilAttachment, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_TYPE, &stencilObject);
+    if (depthObject == GL_NONE)
+        return 0;
+
+    GLint depthBits = 0, stencilBits = 0, componentType = GL_NONE;
+    glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, depthAttachment, GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE, &depthBits);
+    glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, depthAttachment, GL_FRAMEBUFFER_ATTACHMENT_COMPONENT_TYPE, &componentType);
+    if (stencilObject != GL_NONE)
+        glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, stencilAttachment, GL_FRAMEBUFFER_ATTACHMENT_STENCIL_SIZE, &stencilBits);
+
+    if (componentType == GL_FLOAT)
+        return stencilBits > 0 ? GL_DEPTH32F_STENCIL8 : GL_DEPTH_COMPONENT32F;
+    if (stencilBits > 0)
+        return depthBits == 24 ? GL_DEPTH24_STENCIL8 : 0;
+    switch (depthBits)
+    {
+    case 16: return GL_DEPTH_COMPONENT16;
+    case 24: return GL_DEPTH_COMPONENT24;
+    case 32: return GL_DEPTH_COMPONENT32;
+    default: return 0;
+    }
+}
+
+
+// Creates the targets the scene depth is reduced in and the buffers it is read back through
+bool UCreateHiZ(int width, int height, GLHiZ& hiz)
+{
+    hiz.width = width;
+    hiz.height = height;
+    hiz.baseWidth = (width + HIZ_FOOTPRINT - 1) / HIZ_FOOTPRINT;
+    hiz.baseHeight = (height + HIZ_FOOTPRINT - 1) / HIZ_FOOTPRINT;
+
+    // Same format as the depth buffer drawn to, which blits require; the window's depends on the pixel format
+    const GLenum depthFormat = UQueryDepthFormat(gHeadless ? gOffscreenFbo : 0);
+    if (depthFormat == 0)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, gHeadless ? gOffscreenFbo : 0);
+        cerr << "Hi-Z: the depth buffer has no format the copy can match" << endl;
+        return false;
+    }
+    const bool stencil = depthFormat == GL_DEPTH24_STENCIL8 || depthFormat == GL_DEPTH32F_STENCIL8;
+
+    glGenTextures(1, &hiz.depth);
+    UStateEditTexture(GL_TEXTURE_2D, hiz.depth);
+    glTexStorage2D(GL_TEXTURE_2D, 1, depthFormat, width, height);
+    glGenFramebuffers(1, &hiz.depthFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, hiz.depthFbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, stencil ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, hiz.depth, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+    glGenTextures(1, &hiz.reduced);
+    UStateEditTexture(GL_TEXTURE_2D, hiz.reduced);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32F, hiz.baseWidth, hiz.baseHeight);
+    glGenFramebuffers(1, &hiz.reduceFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, hiz.reduceFbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, hiz.reduced, 0);
+    complete = complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, gHeadless ? gOffscreenFbo : 0);
+
+    glGenBuffers(HIZ_READBACK_SLOTS, hiz.pbos);
+    for (int slot = 0; slot < HIZ_READBACK_SLOTS; ++slot)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, hiz.pbos[slot]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(float) * hiz.baseWidth * hiz.baseHeight, NULL, GL_STREAM_READ);
+        hiz.fences[slot] = 0;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    if (!complete)
+    {
+        cerr << "Hi-Z framebuffer is incomplete" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+/* Reduces the depth of the frame just drawn to the farthest depth of every HIZ_FOOTPRINT square and starts
+ * reading it back. sourceDepth is sampled directly when it is a texture (the G-buffer), otherwise the depth
+ * buffer of sourceFbo is copied first. Skipped while the slot's previous readback is still in flight.
+ */
+void UCaptureHiZ(GLHiZ& hiz, GLuint sourceFbo, GLuint sourceDepth, const glm::mat4& viewProjection, const glm::vec3& cameraPosition)
+{
+    const int slot = hiz.frame++ % HIZ_READBACK_SLOTS;
+    if (hiz.fences[slot] != 0)
+        return;
+
+    if (sourceDepth == 0)
+    {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, sourceFbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, hiz.depthFbo);
+        glBlitFramebuffer(0, 0, hiz.width, hiz.height, 0, 0, hiz.width, hiz.height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        gStateCache.framebuffer = STATE_UNKNOWN; // Read and draw bindings now differ
+        sourceDepth = hiz.depth;
+    }
+
+    UStateBindFramebuffer(hiz.reduceFbo);
+    glViewport(0, 0, hiz.baseWidth, hiz.baseHeight);
+    UStateUseProgram(gHiZProgramId);
+    UStateBindTexture(HIZ_DEPTH_UNIT, GL_TEXTURE_2D, sourceDepth);
+    UStateBindVertexArray(gFullscreenVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    // Lands in the pixel pack buffer; UCollectHiZ maps it once the fence says the copy is done
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, hiz.pbos[slot]);
+    glReadPixels(0, 0, hiz.baseWidth, hiz.baseHeight, GL_RED, GL_FLOAT, NULL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    hiz.fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    hiz.viewProjections[slot] = viewProjection;
+    hiz.cameraPositions[slot] = cameraPosition;
+    hiz.generations[slot] = gSceneGeneration;
+
+    UStateBindFramebuffer(sourceFbo);
+    glViewport(0, 0, hiz.width, hiz.height);
+}
+
+
+// Builds the CPU pyramid from the newest finished readback, without waiting for the GPU
+void UCollectHiZ(GLHiZ& hiz, HiZPyramid& pyramid)
+{
+    // Oldest slot first, so the newest finished readback is the one kept
+    for (int i = 0; i < HIZ_READBACK_SLOTS; ++i)
+    {
+        const int slot = (hiz.frame + i) % HIZ_READBACK_SLOTS;
+        if (hiz.fences[slot] == 0)
+            continue;
+
+        const GLenum status = glClientWaitSync(hiz.fences[slot], 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            continue;
+        glDeleteSync(hiz.fences[slot]);
+        hiz.fences[slot] = 0;
+
+        // Objects moved since the frame was drawn, its depth no longer matches the scene
+        if (hiz.generations[slot] != gSceneGeneration)
+        {
+            pyramid.valid = false;
+            continue;
+        }
+
+        // Level 0 is the readback, every further level keeps the farthest of up to 2x2 texels of the one below
+        pyramid.levels.clear();
+        size_t size = 0;
+        for (int width = hiz.baseWidth, height = hiz.baseHeight; ; width = (width + 1) / 2, height = (height + 1) / 2)
+        {
+            pyramid.levels.push_back({ width, height, size });
+            size += (size_t)width * height;
+            if (width == 1 && height == 1)
+                break;
+        }
+        pyramid.depths.resize(size);
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, hiz.pbos[slot]);
+        const void* base = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sizeof(float) * hiz.baseWidth * hiz.baseHeight, GL_MAP_READ_BIT);
+        if (base)
+            memcpy(pyramid.depths.data(), base, sizeof(float) * hiz.baseWidth * hiz.baseHeight);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        if (!base)
+        {
+            pyramid.valid = false;
+            continue;
+        }
+
+        for (size_t level = 1; level < pyramid.levels.size(); ++level)
+        {
+            const HiZLevel& fine = pyramid.levels[level - 1];
+            const HiZLevel& coarse = pyramid.levels[level];
+            const float* src = pyramid.depths.data() + fine.offset;
+            float* dst = pyramid.depths.data() + coarse.offset;
+
+            for (int y = 0; y < coarse.height; ++y)
+            {
+                const float* row0 = src + (size_t)(2 * y) * fine.width;
+                const float* row1 = src + (size_t)min(2 * y + 1, fine.height - 1) * fine.width;
+                for (int x = 0; x < coarse.width; ++x)
+                {
+                    const int x0 = 2 * x, x1 = min(2 * x + 1, fine.width - 1);
+                    dst[(size_t)y * coarse.width + x] = max(max(row0[x0], row0[x1]), max(row1[x0], row1[x1]));
+                }
+            }
+        }
+
+        pyramid.viewProjection = hiz.viewProjections[slot];
+        pyramid.cameraPosition = hiz.cameraPositions[slot];
+        pyramid.width = hiz.width;
+        pyramid.height = hiz.height;
+        pyramid.valid = true;
+    }
+}
+
+
+/* True when a world space box lies entirely behind the depth stored in the pyramid. The box is projected with the
+ * camera the pyramid was drawn with, after growing it by how far the camera has moved since, a guard against what
+ * the move uncovered. Boxes reaching past the edge of that view are kept, the pyramid never saw their outer part.
+ */
+bool UIsOccluded(const HiZPyramid& pyramid, const glm::vec3& cameraPosition, const glm::vec3& objectMin, const glm::vec3& objectMax)
+{
+    const float moved = glm::length(cameraPosition - pyramid.cameraPosition);
+    const glm::vec3 boundsMin = objectMin - glm::vec3(moved);
+    const glm::vec3 boundsMax = objectMax + glm::vec3(moved);
+
+    // Project the eight corners with the camera the pyramid was rendered with: screen rectangle and nearest depth in NDC
+    const float* m = glm::value_ptr(pyramid.viewProjection);
+    const float nearW = 1e-4f;
+    float minX, minY, maxX, maxY, minZ;
+
+#if defined(USE_SSE2)
+    const __m128 x = _mm_setr_ps(boundsMin.x, boundsMax.x, boundsMin.x, boundsMax.x);
+    const __m128 y = _mm_setr_ps(boundsMin.y, boundsMin.y, boundsMax.y, boundsMax.y);
+    __m128 lowX = _mm_set1_ps(numeric_limits<float>::max()), lowY = lowX, lowZ = lowX;
+    __m128 highX = _mm_set1_ps(-numeric_limits<float>::max()), highY = highX;
+
+    for (int i = 0; i < 2; ++i)
+    {
+        const __m128 z = _mm_set1_ps(i == 0 ? boundsMin.z : boundsMax.z);
+        const __m128 clipX = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0]), x), _mm_mul_ps(_mm_set1_ps(m[4]), y)), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[8]), z), _mm_set1_ps(m[12])));
+        const __m128 clipY = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[1]), x), _mm_mul_ps(_mm_set1_ps(m[5]), y)), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[9]), z), _mm_set1_ps(m[13])));
+        const __m128 clipZ = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[2]), x), _mm_mul_ps(_mm_set1_ps(m[6]), y)), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[10]), z), _mm_set1_ps(m[14])));
+        const __m128 clipW = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[3]), x), _mm_mul_ps(_mm_set1_ps(m[7]), y)), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[11]), z), _mm_set1_ps(m[15])));
+
+        // A corner behind the camera: the box reaches the viewer, nothing can hide it
+        if (_mm_movemask_ps(_mm_cmplt_ps(clipW, _mm_set1_ps(nearW))))
+            return false;
+
+        const __m128 invW = _mm_div_ps(_mm_set1_ps(1.0f), clipW);
+        const __m128 ndcX = _mm_mul_ps(clipX, invW), ndcY = _mm_mul_ps(clipY, invW);
+        lowX = _mm_min_ps(lowX, ndcX);
+        highX = _mm_max_ps(highX, ndcX);
+        lowY = _mm_min_ps(lowY, ndcY);
+        highY = _mm_max_ps(highY, ndcY);
+        lowZ = _mm_min_ps(lowZ, _mm_mul_ps(clipZ, invW));
+    }
+
+    alignas(16) float lanes[5][4];
+    _mm_store_ps(lanes[0], lowX);
+    _mm_store_ps(lanes[1], lowY);
+    _mm_store_ps(lanes[2], highX);
+    _mm_store_ps(lanes[3], highY);
+    _mm_store_ps(lanes[4], lowZ);
+    minX = min(min(lanes[0][0], lanes[0][1]), min(lanes[0][2], lanes[0][3]));
+    minY = min(min(lanes[1][0], lanes[1][1]), min(lanes[1][2], lanes[1][3]));
+    maxX = max(max(lanes[2][0], lanes[2][1]), max(lanes[2][2], lanes[2][3]));
+    maxY = max(max(lanes[3][0], lanes[3][1]), max(lanes[3][2], lanes[3][3]));
+    minZ = min(min(lanes[4][0], lanes[4][1]), min(lanes[4][2], lanes[4][3]));
+#else
+    minX = minY = minZ = numeric_limits<float>::max();
+    maxX = maxY = -numeric_limits<float>::max();
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        const glm::vec4 clip = pyramid.viewProjection * glm::vec4(corner & 1 ? boundsMax.x : boundsMin.x,
+            corner & 2 ? boundsMax.y : boundsMin.y, corner & 4 ? boundsMax.z : boundsMin.z, 1.0f);
+        if (clip.w < nearW)
+            return false;
+
+        minX = min(minX, clip.x / clip.w);
+        maxX = max(maxX, clip.x / clip.w);
+        minY = min(minY, clip.y / clip.w);
+        maxY = max(maxY, clip.y / clip.w);
+        minZ = min(minZ, clip.z / clip.w);
+    }
+#endif
+
+    if (minX < -1.0f || minY < -1.0f || maxX > 1.0f || maxY > 1.0f)
+        return false;
+
+    // Rectangle in level 0 texels, clamped to the screen
+    const HiZLevel& base = pyramid.levels[0];
+    const float texelsX = 0.5f * pyramid.width / HIZ_FOOTPRINT;
+    const float texelsY = 0.5f * pyramid.height / HIZ_FOOTPRINT;
+    const int x0 = max((int)((minX + 1.0f) * texelsX), 0);
+    const int y0 = max((int)((minY + 1.0f) * texelsY), 0);
+    const int x1 = min((int)((maxX + 1.0f) * texelsX), base.width - 1);
+    const int y1 = min((int)((maxY + 1.0f) * texelsY), base.height - 1);
+    if (x0 > x1 || y0 > y1)
+        return false; // Off screen, left to the frustum test
+
+    // Coarsest level at which the rectangle still covers at most 2x2 texels
+    size_t level = 0;
+    while (level + 1 < pyramid.levels.size() && max(x1 - x0, y1 - y0) >> level > 1)
+        ++level;
+
+    const HiZLevel& coarse = pyramid.levels[level];
+    const float* depths = pyramid.depths.data() + coarse.offset;
+    float farthest = 0.0f;
+    for (int y = y0 >> level; y <= y1 >> level; ++y)
+        for (int x = x0 >> level; x <= x1 >> level; ++x)
+            farthest = max(farthest, depths[(size_t)y * coarse.width + x]);
+
+    // Window depth of the nearest corner against the farthest depth drawn over the rectangle
+    return minZ * 0.5f + 0.5f > farthest;
+}
+
+
+// Removes the objects the pyramid proves hidden from the visible list, returns how many were removed
+GLuint UOcclusionCull(const HiZPyramid& pyramid, const glm::vec3& cameraPosition, vector<GLuint>& visible)
+{
+    if (!pyramid.valid)
+        return 0;
+
+    size_t kept = 0;
+    for (GLuint objectIndex : visible)
+    {
+        const SceneObject& object = gSceneObjects[objectIndex];
+        if (!UIsOccluded(pyramid, cameraPosition, object.boundsMin, object.boundsMax))
+            visible[kept++] = objectIndex;
+    }
+
+    const GLuint culled = (GLuint)(visible.size() - kept);
+    visible.resize(kept);
+    return culled;
+}
+
+
+void UDestroyHiZ(GLHiZ& hiz)
+{
+    for (int slot = 0; slot < HIZ_READBACK_SLOTS; ++slot)
+    {
+        if (hiz.fences[slot] != 0)
+            glDeleteSync(hiz.fences[slot]);
+    }
+    glDeleteBuffers(HIZ_READBACK_SLOTS, hiz.pbos);
+    glDeleteFramebuffers(1, &hiz.depthFbo);
+    glDeleteFramebuffers(1, &hiz.reduceFbo);
+    glDeleteTextures(1, &hiz.depth);
+    glDeleteTextures(1, &hiz.reduced);
+    hiz = GLHiZ();
+}
+
+
+// Maps a whole file read-only into memory
+bool UMapFile(const char* filename, MappedFile& file)
+{
+#ifdef _WIN32
+    file.file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file.file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(file.file, &size);
+    file.size = (size_t)size.QuadPart;
+
+    file.mapping = CreateFileMappingA(file.file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (file.mapping != NULL)
+        file.data = (const unsigned char*)MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        file.size = (size_t)info.st_size;
+        void* view = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED)
+        {
+            // The whole file is uploaded front to back right away
+            madvise(view, file.size, MADV_SEQUENTIAL | MADV_WILLNEED);
+            file.data = (const unsigned char*)view;
+        }
+    }
+    close(fd); // The mapping stays valid after the descriptor is closed
+#endif
+
+    if (!file.data)
+    {
+        UUnmapFile(file);
+        return false;
+    }
+    return true;
+}
+
+
+void UUnmapFile(MappedFile& file)
+{
+#ifdef _WIN32
+    if (file.data)
+        UnmapViewOfFile(file.data);
+    if (file.mapping != NULL)
+        CloseHandle(file.mapping);
+    if (file.file != INVALID_HANDLE_VALUE)
+        CloseHandle(file.file);
+    file.mapping = NULL;
+    file.file = INVALID_HANDLE_VALUE;
+#else
+    if (file.data)
+        munmap((void*)file.data, file.size);
+#endif
+    file.data = nullptr;
+    file.size = 0;
+}
+
+
+// Maps a .umsh file and uploads its vertex and index sections straight from the mapping
+bool ULoadMeshFile(const char* filename, GLMesh& mesh)
+{
+    MappedFile file;
+    if (!UMapFile(filename, file))
+    {
+        cout << "Failed to open mesh file " << filename << endl;
+        return false;
+    }
+
+    const MeshFileHeader* header = (const MeshFileHeader*)file.data;
+    const uint32_t expectedStride = sizeof(Vertex);
+
+    bool valid = file.size >= sizeof(MeshFileHeader)
+        && memcmp(header->magic, MESH_FILE_MAGIC, sizeof(MESH_FILE_MAGIC)) == 0
+        && header->version == MESH_FILE_VERSION
+        && header->vertexStride == expectedStride
+        && (header->indexSize == 2 || header->indexSize == 4)
+        && header->vertexCount > 0 && header->indexCount > 0;
+
+    // Every section has to lie inside the file
+    valid = valid
+        && header->submeshOffset + (uint64_t)header->submeshCount * sizeof(MeshFileSubmesh) <= file.size
+        && header->vertexOffset + (uint64_t)header->vertexCount * header->vertexStride <= file.size
+        && header->indexOffset + (uint64_t)header->indexCount * header->indexSize <= file.size;
+
+    if (!valid)
+    {
+        cout << "Invalid or incompatible mesh file " << filename << endl;
+        UUnmapFile(file);
+        return false;
+    }
+
+    // Out of range indices would read past the vertices when computing bounds
+    const unsigned char* indices = file.data + header->indexOffset;
+    for (uint32_t i = 0; i < header->indexCount; ++i)
+    {
+        const uint32_t index = header->indexSize == 4 ? ((const uint32_t*)indices)[i] : ((const uint16_t*)indices)[i];
+        if (index >= header->vertexCount)
+        {
+            cout << "Mesh file " << filename << " has out of range indices" << endl;
+            UUnmapFile(file);
+            return false;
+        }
+    }
+
+    // A dropped submesh would shift the levels of the chains after it, so one out of range rejects the file
+    const MeshFileSubmesh* submeshes = (const MeshFileSubmesh*)(file.data + header->submeshOffset);
+    for (uint32_t i = 0; i < header->submeshCount; ++i)
+    {
+        if ((uint64_t)submeshes[i].firstIndex + submeshes[i].indexCount > header->indexCount)
+        {
+            cout << "Mesh file " << filename << " has out of range submeshes" << endl;
+            UUnmapFile(file);
+            return false;
+        }
+    }
+
+    UUploadMesh(mesh, (const Vertex*)(file.data + header->vertexOffset), header->vertexCount,
+        indices, header->indexCount,
+        header->indexSize == 4 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT);
+
+    mesh.submeshes.clear();
+    for (uint32_t i = 0; i < header->submeshCount; ++i)
+    {
+        const MeshFileSubmesh& submesh = submeshes[i];
+        mesh.submeshes.push_back({ string(submesh.name, strnlen(submesh.name, sizeof(submesh.name))), submesh.firstIndex, submesh.indexCount });
+        mesh.submeshes.back().lodCount = submesh.lodCount;
+    }
+
+    // A level chain must not run past the last submesh, nor have more levels than LOD_SCREEN_SIZES has thresholds for
+    for (size_t i = 0; i < mesh.submeshes.size(); ++i)
+        mesh.submeshes[i].lodCount = (GLuint)min<size_t>(min<size_t>(mesh.submeshes[i].lodCount, mesh.submeshes.size() - i), PRIMITIVE_LOD_COUNT);
+
+    // Files without submeshes are placed as a single object
+    if (mesh.submeshes.empty())
+        mesh.submeshes.push_back({ "mesh", 0, header->indexCount });
+
+    UComputeSubmeshBounds((const Vertex*)(file.data + header->vertexOffset), indices, mesh.indexType, mesh.submeshes);
+
+    // glBufferData has copied the data, the mapping is no longer needed
+    UUnmapFile(file);
+    return true;
+}
+
+
+// Writes a mesh in the .umsh format, using 16-bit indices whenever the vertex count allows it
+bool UWriteMeshFile(const char* filename, const MeshData& data)
+{
+    const uint32_t vertexCount = (uint32_t)data.vertices.size();
+    const uint32_t indexSize = vertexCount <= 65536 ? 2 : 4;
+    auto align16 = [](uint64_t offset) { return (offset + 15) & ~(uint64_t)15; };
+
+    MeshFileHeader header = {};
+    memcpy(header.magic, MESH_FILE_MAGIC, sizeof(MESH_FILE_MAGIC));
+    header.version = MESH_FILE_VERSION;
+    header.vertexStride = sizeof(Vertex);
+    header.vertexCount = vertexCount;
+    header.indexSize = indexSize;
+    header.indexCount = (uint32_t)data.indices.size();
+    header.submeshCount = (uint32_t)data.submeshes.size();
+    header.submeshOffset = align16(sizeof(MeshFileHeader));
+    header.vertexOffset = align16(header.submeshOffset + header.submeshCount * sizeof(MeshFileSubmesh));
+    header.indexOffset = align16(header.vertexOffset + (uint64_t)vertexCount * header.vertexStride);
+
+    vector<MeshFileSubmesh> submeshes(data.submeshes.size());
+    for (size_t i = 0; i < data.submeshes.size(); ++i)
+    {
+        memset(&submeshes[i], 0, sizeof(MeshFileSubmesh));
+        strncpy(submeshes[i].name, data.submeshes[i].name.c_str(), sizeof(submeshes[i].name) - 1);
+        submeshes[i].firstIndex = data.submeshes[i].firstIndex;
+        submeshes[i].indexCount = data.submeshes[i].indexCount;
+        submeshes[i].lodCount = data.submeshes[i].lodCount;
+    }
+
+    ofstream out(filename, ios::binary);
+    if (!out)
+    {
+        cout << "Failed to create mesh file " << filename << endl;
+        return false;
+    }
+
+    auto pad = [&out](uint64_t offset) { while ((uint64_t)out.tellp() < offset) out.put(0); };
+
+    out.write((const char*)&header, sizeof(header));
+    pad(header.submeshOffset);
+    out.write((const char*)submeshes.data(), submeshes.size() * sizeof(MeshFileSubmesh));
+    pad(header.vertexOffset);
+    out.write((const char*)data.vertices.data(), data.vertices.size() * sizeof(Vertex));
+    pad(header.indexOffset);
+    if (indexSize == 2)
+    {
+        vector<uint16_t> indices(data.indices.begin(), data.indices.end());
+        out.write((const char*)indices.data(), indices.size() * sizeof(uint16_t));
+    }
+    else
+        out.write((const char*)data.indices.data(), data.indices.size() * sizeof(uint32_t));
+
+    return (bool)out;
+}
+
+
+// Material index for an OBJ material name, unknown materials use the mouse texture
+static GLuint UObjMaterialIndex(const string& material)
+{
+    if (material.find("desk") != string::npos)
+        return MATERIAL_DESK;
+    if (material.find("monitor") != string::npos || material.find("display") != string::npos)
+        return MATERIAL_MONITOR;
+    if (material.find("stand") != string::npos)
+        return MATERIAL_STAND;
+    if (material.find("keyboard") != string::npos)
+        return MATERIAL_KEYBOARD;
+    return MATERIAL_MOUSE;
+}
+
+
+// Reads a Wavefront OBJ file. Every "o"/"g" statement starts a new submesh, polygons are
+// triangulated as fans and identical position/uv/normal triples share a vertex.
+bool ULoadObj(const char* filename, MeshData& data)
+{
+    ifstream in(filename);
+    if (!in)
+    {
+        cout << "Failed to open OBJ file " << filename << endl;
+        return false;
+    }
+
+    vector<glm::vec3> positions, normals;
+    vector<glm::vec2> uvs;
+    unordered_map<string, GLuint> vertexLookup;
+    GLuint materialIndex = MATERIAL_MOUSE;
+    GLSubmesh current = { "default", 0, 0 };
+
+    auto closeSubmesh = [&](const string& nextName)
+    {
+        current.indexCount = (GLuint)data.indices.size() - current.firstIndex;
+        if (current.indexCount > 0)
+            data.submeshes.push_back(current);
+        current = { nextName, (GLuint)data.indices.size(), 0 };
+    };
+
+    // Resolves a 1-based (or negative, relative) OBJ index
+    auto resolve = [](int index, size_t count) { return index < 0 ? (int)count + index : index - 1; };
+
+    string line;
+    while (getline(in, line))
+    {
+        istringstream tokens(line);
+        string keyword;
+        tokens >> keyword;
+
+        if (keyword == "v")
+        {
+            glm::vec3 p;
+            tokens >> p.x >> p.y >> p.z;
+            positions.push_back(p);
+        }
+        else if (keyword == "vt")
+        {
+            glm::vec2 uv;
+            tokens >> uv.x >> uv.y;
+            uvs.push_back(uv);
+        }
+        else if (keyword == "vn")
+        {
+            glm::vec3 n;
+            tokens >> n.x >> n.y >> n.z;
+            normals.push_back(n);
+        }
+        else if (keyword == "o" || keyword == "g")
+        {
+            string name;
+            tokens >> name;
+            closeSubmesh(name);
+        }
+        else if (keyword == "usemtl")
+        {
+            string material;
+            tokens >> material;
+            materialIndex = UObjMaterialIndex(material);
+        }
+        else if (keyword == "f")
+        {
+            vector<GLuint> face;
+            string corner;
+            while (tokens >> corner)
+            {
+                int p = 0, t = 0, n = 0;
+                if (sscanf(corner.c_str(), "%d/%d/%d", &p, &t, &n) != 3 && sscanf(corner.c_str(), "%d//%d", &p, &n) != 2)
+                {
+                    n = 0;
+                    if (sscanf(corner.c_str(), "%d/%d", &p, &t) != 2)
+                        sscanf(corner.c_str(), "%d", &p);
+                }
+
+                p = resolve(p, positions.size());
+                t = t ? resolve(t, uvs.size()) : -1;
+                n = n ? resolve(n, normals.size()) : -1;
+                if (p < 0 || p >= (int)positions.size() || t >= (int)uvs.size() || n >= (int)normals.size())
+                {
+                    cout << "Invalid face in OBJ file " << filename << ": " << line << endl;
+                    return false;
+                }
+
+                // Each distinct position/uv/normal/material combination becomes one vertex
+                const string key = to_string(p) + "/" + to_string(t) + "/" + to_string(n) + "/" + to_string(materialIndex);
+                auto found = vertexLookup.find(key);
+                if (found == vertexLookup.end())
+                {
+                    const GLuint index = (GLuint)data.vertices.size();
+                    const glm::vec3 normal = n >= 0 ? normals[n] : glm::vec3(0.0f);
+                    const glm::vec2 uv = t >= 0 ? uvs[t] : glm::vec2(0.0f);
+                    data.vertices.push_back({ { positions[p].x, positions[p].y, positions[p].z },
+                        { normal.x, normal.y, normal.z }, { uv.x, uv.y }, materialIndex });
+                    found = vertexLookup.emplace(key, index).first;
+                }
+                face.push_back(found->second);
+            }
+
+            // Corners without a normal keep a zero one, UProcessMesh generates it
+            for (size_t i = 2; i < face.size(); ++i)
+            {
+                const GLuint triangle[] = { face[0], face[i - 1], face[i] };
+                data.indices.insert(data.indices.end(), triangle, triangle + 3);
+            }
+        }
+    }
+    closeSubmesh("");
+
+    if (data.indices.empty())
+    {
+        cout << "OBJ file " << filename << " contains no faces" << endl;
+        return false;
+    }
+    return true;
+}
+
+
+// Runs --convert / --export-scene and writes the .umsh file
+bool URunConversion()
+{
+    MeshData data;
+    if (gConvertInput.empty())
+        UBuildDefaultMesh(data);
+    else if (!ULoadObj(gConvertInput.c_str(), data))
+        return false;
+
+    UProcessMesh(data);
+
+    if (!UWriteMeshFile(gConvertOutput.c_str(), data))
+        return false;
+
+    cout << "Wrote " << gConvertOutput << ": " << data.vertices.size() << " vertices, "
+        << data.indices.size() / 3 << " triangles, " << data.submeshes.size() << " submeshes" << endl;
+    return true;
+}
+
+
+// Builds lightmap UVs for every level 0 submesh. Triangles are grown into charts of faces within LIGHTMAP_CHART_ANGLE_COS
+// of the chart's first face, each chart is projected onto the plane of that face, and the charts of a submesh are
+// shelf packed into a rectangle of its own (UVs are in texels of that rectangle). Vertices used by two charts are split.
+// Coarser levels take the UVs of the nearest level 0 vertex facing the same way.
+void UGenerateLightmapUvs(MeshData& data)
+{
+    const size_t sourceVertices = data.vertices.size();
+    data.lightmapUvs.assign(sourceVertices, glm::vec2(0.0f));
+    vector<int> vertexCharts(sourceVertices, -1);   // First chart a source vertex was given a UV in
+    unordered_map<uint64_t, GLuint> splitVertices;  // Copy of a source vertex for another chart, by vertex << 32 | chart
+    int chartCount = 0;
+
+    for (GLSubmesh& submesh : data.submeshes)
+    {
+        if (submesh.lodCount == 0)
+            continue;
+
+        GLuint* indices = data.indices.data() + submesh.firstIndex;
+        const GLuint triangleCount = submesh.indexCount / 3;
+        auto position = [&](GLuint index) { return glm::make_vec3(data.vertices[index].position); };
+
+        // Corners at the same position share an id, so charts also grow across hard edges and UV seams
+        vector<GLuint> corners(submesh.indexCount), positionIds(submesh.indexCount);
+        for (GLuint corner = 0; corner < submesh.indexCount; ++corner)
+            corners[corner] = corner;
+        auto positionLess = [&](GLuint a, GLuint b)
+        {
+            const glm::vec3 pa = position(indices[a]), pb = position(indices[b]);
+            return pa.x != pb.x ? pa.x < pb.x : pa.y != pb.y ? pa.y < pb.y : pa.z < pb.z;
+        };
+        sort(corners.begin(), corners.end(), positionLess);
+        for (GLuint i = 0, id = 0; i < submesh.indexCount; ++i)
+        {
+            if (i > 0 && positionLess(corners[i - 1], corners[i]))
+                ++id;
+            positionIds[corners[i]] = id;
+        }
+
+        // Face normals and the faces across every edge
+        vector<glm::vec3> faceNormals(triangleCount);
+        vector<vector<GLuint>> neighbours(triangleCount);
+        unordered_map<uint64_t, GLuint> edgeFaces;
+        for (GLuint triangle = 0; triangle < triangleCount; ++triangle)
+        {
+            const glm::vec3 p0 = position(indices[triangle * 3]);
+            const glm::vec3 normal = glm::cross(position(indices[triangle * 3 + 1]) - p0, position(indices[triangle * 3 + 2]) - p0);
+            faceNormals[triangle] = glm::length(normal) > 0.0f ? glm::normalize(normal) : glm::vec3(0.0f);
+
+            for (int edge = 0; edge < 3; ++edge)
+            {
+                const GLuint a = positionIds[triangle * 3 + edge];
+                const GLuint b = positionIds[triangle * 3 + (edge + 1) % 3];
+                const uint64_t key = (uint64_t)min(a, b) << 32 | max(a, b);
+                const auto found = edgeFaces.find(key);
+                if (found == edgeFaces.end())
+                    edgeFaces[key] = triangle;
+                else
+                {
+                    neighbours[found->second].push_back(triangle);
+                    neighbours[triangle].push_back(found->second);
+                }
+            }
+        }
+
+        // Flood fill the charts
+        vector<LightmapChart> charts;
+        vector<int> triangleCharts(triangleCount, -1);
+        for (GLuint seed = 0; seed < triangleCount; ++seed)
+        {
+            if (triangleCharts[seed] >= 0)
+                continue;
+
+            LightmapChart chart = {};
+            chart.normal = glm::length(faceNormals[seed]) > 0.0f ? faceNormals[seed] : glm::vec3(0.0f, 1.0f, 0.0f);
+            chart.tangent = glm::normalize(glm::cross(fabs(chart.normal.y) < 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f), chart.normal));
+            chart.bitangent = glm::cross(chart.normal, chart.tangent);
+
+            vector<GLuint> pending(1, seed);
+            triangleCharts[seed] = (int)charts.size();
+            while (!pending.empty())
+            {
+                const GLuint triangle = pending.back();
+                pending.pop_back();
+                chart.triangles.push_back(triangle);
+                for (GLuint neighbour : neighbours[triangle])
+                {
+                    if (triangleCharts[neighbour] < 0 && glm::dot(faceNormals[neighbour], chart.normal) >= LIGHTMAP_CHART_ANGLE_COS)
+                    {
+                        triangleCharts[neighbour] = (int)charts.size();
+                        pending.push_back(neighbour);
+                    }
+                }
+            }
+
+            // Planar projection, measured in texels with a gutter on every side
+            chart.boundsMin = glm::vec2(numeric_limits<float>::max());
+            chart.boundsMax = glm::vec2(-numeric_limits<float>::max());
+            for (GLuint triangle : chart.triangles)
+            {
+                for (int corner = 0; corner < 3; ++corner)
+                {
+                    const glm::vec3 p = position(indices[triangle * 3 + corner]);
+                    const glm::vec2 projected(glm::dot(p, chart.tangent), glm::dot(p, chart.bitangent));
+                    chart.boundsMin = glm::min(chart.boundsMin, projected);
+                    chart.boundsMax = glm::max(chart.boundsMax, projected);
+                }
+            }
+            const glm::vec2 extent = (chart.boundsMax - chart.boundsMin) * LIGHTMAP_TEXELS_PER_UNIT;
+            chart.width = max(1, (int)ceil(extent.x)) + 2 * LIGHTMAP_PADDING;
+            chart.height = max(1, (int)ceil(extent.y)) + 2 * LIGHTMAP_PADDING;
+            charts.push_back(chart);
+        }
+
+        // Shelf packing, tallest charts first, into a roughly square rectangle
+        vector<GLuint> order(charts.size());
+        int area = 0, widest = 0;
+        for (GLuint chart = 0; chart < (GLuint)charts.size(); ++chart)
+        {
+            order[chart] = chart;
+            area += charts[chart].width * charts[chart].height;
+            widest = max(widest, charts[chart].width);
+        }
+        sort(order.begin(), order.end(), [&](GLuint a, GLuint b) { return charts[a].height > charts[b].height; });
+
+        const int width = max(widest, (int)ceil(sqrt((double)area)));
+        int x = 0, y = 0, shelfHeight = 0;
+        for (GLuint chart : order)
+        {
+            if (x + charts[chart].width > width)
+            {
+                y += shelfHeight;
+                x = 0;
+                shelfHeight = 0;
+            }
+            charts[chart].x = x;
+            charts[chart].y = y;
+            x += charts[chart].width;
+            shelfHeight = max(shelfHeight, charts[chart].height);
+        }
+        submesh.lightmapWidth = (GLuint)width;
+        submesh.lightmapHeight = (GLuint)(y + shelfHeight);
+
+        // UVs, splitting the vertices a previous chart already placed
+        for (const LightmapChart& chart : charts)
+        {
+            const int chartId = chartCount++;
+            for (GLuint triangle : chart.triangles)
+            {
+                for (int corner = 0; corner < 3; ++corner)
+                {
+                    GLuint& index = indices[triangle * 3 + corner];
+                    const glm::vec3 p = position(index);
+                    const glm::vec2 projected(glm::dot(p, chart.tangent), glm::dot(p, chart.bitangent));
+                    const glm::vec2 uv = (projected - chart.boundsMin) * LIGHTMAP_TEXELS_PER_UNIT + glm::vec2(chart.x + LIGHTMAP_PADDING, chart.y + LIGHTMAP_PADDING);
+
+                    if (vertexCharts[index] < 0)
+                        vertexCharts[index] = chartId;
+                    else if (vertexCharts[index] != chartId)
+                    {
+                        const uint64_t key = (uint64_t)index << 32 | (uint32_t)chartId;
+                        const auto found = splitVertices.find(key);
+                        if (found != splitVertices.end())
+                            index = found->second;
+                        else
+                        {
+                            const Vertex copy = data.vertices[index];
+                            data.vertices.push_back(copy);
+                            data.lightmapUvs.push_back(uv);
+                            splitVertices[key] = index = (GLuint)data.vertices.size() - 1;
+                        }
+                    }
+                    data.lightmapUvs[index] = uv;
+                }
+            }
+        }
+
+        // The bake depends on the surface and its UVs only
+        uint64_t hash = UHashBytes(&submesh.lightmapWidth, sizeof(submesh.lightmapWidth));
+        hash = UHashBytes(&submesh.lightmapHeight, sizeof(submesh.lightmapHeight), hash);
+        for (GLuint corner = 0; corner < submesh.indexCount; ++corner)
+        {
+            const Vertex& vertex = data.vertices[indices[corner]];
+            hash = UHashBytes(vertex.position, sizeof(vertex.position), hash);
+            hash = UHashBytes(vertex.normal, sizeof(vertex.normal), hash);
+            hash = UHashBytes(&data.lightmapUvs[indices[corner]], sizeof(glm::vec2), hash);
+        }
+        submesh.lightmapHash = hash;
+    }
+
+    // Coarser levels: nearest level 0 vertex, preferring those facing within 60 degrees. The level 0 vertices go
+    // into a grid of about one per cell, searched in growing shells of cells until no closer one can be left.
+    for (size_t first = 0; first < data.submeshes.size(); ++first)
+    {
+        const GLSubmesh& base = data.submeshes[first];
+        if (base.lodCount < 2)
+            continue;
+
+        // Candidates in the order of their first corner, which breaks ties like a scan of the corners would
+        vector<GLuint> candidates;
+        vector<bool> seen(data.vertices.size(), false);
+        glm::vec3 boundsMin(numeric_limits<float>::max()), boundsMax(-numeric_limits<float>::max());
+        for (GLuint corner = 0; corner < base.indexCount; ++corner)
+        {
+            const GLuint index = data.indices[base.firstIndex + corner];
+            if (seen[index])
+                continue;
+            seen[index] = true;
+            candidates.push_back(index);
+            boundsMin = glm::min(boundsMin, glm::make_vec3(data.vertices[index].position));
+            boundsMax = glm::max(boundsMax, glm::make_vec3(data.vertices[index].position));
+        }
+        if (candidates.empty())
+            continue;
+
+        const glm::vec3 extent = boundsMax - boundsMin;
+        const float largest = max(extent.x, max(extent.y, extent.z));
+        const float cellSize = largest > 0.0f ? largest / ceil(cbrt((float)candidates.size())) : 1.0f;
+        int cells[3];
+        for (int axis = 0; axis < 3; ++axis)
+            cells[axis] = max(1, (int)ceil(extent[axis] / cellSize));
+        auto cellOf = [&](const glm::vec3& p, int axis) { return min(max((int)((p[axis] - boundsMin[axis]) / cellSize), 0), cells[axis] - 1); };
+
+        // Counting sort of the candidates by cell
+        vector<GLuint> cellStarts((size_t)cells[0] * cells[1] * cells[2] + 1, 0), cellCandidates(candidates.size());
+        vector<size_t> candidateCells(candidates.size());
+        for (size_t i = 0; i < candidates.size(); ++i)
+        {
+            const glm::vec3 p = glm::make_vec3(data.vertices[candidates[i]].position);
+            candidateCells[i] = ((size_t)cellOf(p, 2) * cells[1] + cellOf(p, 1)) * cells[0] + cellOf(p, 0);
+            ++cellStarts[candidateCells[i] + 1];
+        }
+        for (size_t cell = 1; cell < cellStarts.size(); ++cell)
+            cellStarts[cell] += cellStarts[cell - 1];
+        vector<GLuint> cursors(cellStarts.begin(), cellStarts.end() - 1);
+        for (GLuint i = 0; i < (GLuint)candidates.size(); ++i)
+            cellCandidates[cursors[candidateCells[i]]++] = i;
+
+        for (GLuint level = 1; level < base.lodCount; ++level)
+        {
+            const GLSubmesh& coarse = data.submeshes[first + level];
+            for (GLuint corner = 0; corner < coarse.indexCount; ++corner)
+            {
+                const GLuint index = data.indices[coarse.firstIndex + corner];
+                if (vertexCharts[index] >= 0)
+                    continue;
+
+                const Vertex& vertex = data.vertices[index];
+                const glm::vec3 position = glm::make_vec3(vertex.position);
+                const int center[3] = { cellOf(position, 0), cellOf(position, 1), cellOf(position, 2) };
+                const int shells = max(cells[0], max(cells[1], cells[2]));
+                float bestScore = numeric_limits<float>::max();
+                GLuint best = 0;
+
+                // Everything in shell r is at least (r - 1) cells away, and the facing penalty only adds to the score
+                for (int shell = 0; shell < shells; ++shell)
+                {
+                    const float reach = max(0, shell - 1) * cellSize;
+                    if (reach * reach > bestScore)
+                        break;
+
+                    for (int z = max(0, center[2] - shell); z <= min(cells[2] - 1, center[2] + shell); ++z)
+                        for (int y = max(0, center[1] - shell); y <= min(cells[1] - 1, center[1] + shell); ++y)
+                            for (int x = max(0, center[0] - shell); x <= min(cells[0] - 1, center[0] + shell); ++x)
+                            {
+                                if (max(abs(x - center[0]), max(abs(y - center[1]), abs(z - center[2]))) != shell)
+                                    continue;
+                                const size_t cell = ((size_t)z * cells[1] + y) * cells[0] + x;
+                                for (GLuint entry = cellStarts[cell]; entry < cellStarts[cell + 1]; ++entry)
+                                {
+                                    const GLuint rank = cellCandidates[entry];
+                                    const Vertex& other = data.vertices[candidates[rank]];
+                                    const glm::vec3 offset = glm::make_vec3(other.position) - position;
+                                    const float facing = glm::dot(glm::make_vec3(other.normal), glm::make_vec3(vertex.normal));
+                                    const float score = glm::dot(offset, offset) + (facing < 0.5f ? 1e6f : 0.0f);
+                                    if (score < bestScore || (score == bestScore && rank < best))
+                                    {
+                                        bestScore = score;
+                                        best = rank;
+                                    }
+                                }
+                            }
+                }
+                data.lightmapUvs[index] = data.lightmapUvs[candidates[best]];
+                vertexCharts[index] = 0;  // Placed, another level sharing it keeps this UV
+            }
+        }
+    }
+
+    cout << "INFO: Lightmap UVs: " << chartCount << " charts, " << data.vertices.size() - sourceVertices << " vertices split" << endl;
+}
+
+
+// Lightmap UVs as a vertex stream of their own, next to the mesh's vertex buffer
+void UUploadLightmapUvs(GLMesh& mesh, const vector<glm::vec2>& uvs)
+{
+    glBindVertexArray(mesh.vao);
+    glGenBuffers(1, &mesh.lightmapVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.lightmapVbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec2) * uvs.size(), uvs.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(LIGHTMAP_UV_ATTRIBUTE, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), nullptr);
+    glEnableVertexAttribArray(LIGHTMAP_UV_ATTRIBUTE);
+}
+
+
+// Builds one BVH level over triangles[first, first + count): leaves of up to four triangles become a packet,
+// larger ranges are split in four by two median splits along the longest centroid axis.
+// Returns the node index, or ~packet for a leaf.
+static int32_t UBuildBakeBvh(vector<BakeTriangle>& triangles, size_t first, size_t count, BakeScene& scene)
+{
+    if (count <= 4)
+    {
+        BakeTrianglePacket packet = {};
+        for (size_t lane = 0; lane < count; ++lane)
+        {
+            const BakeTriangle& triangle = triangles[first + lane];
+            const glm::vec3 e1 = triangle.vertices[1] - triangle.vertices[0];
+            const glm::vec3 e2 = triangle.vertices[2] - triangle.vertices[0];
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                packet.v0[axis][lane] = triangle.vertices[0][axis];
+                packet.e1[axis][lane] = e1[axis];
+                packet.e2[axis][lane] = e2[axis];
+            }
+        }
+        scene.packets.push_back(packet);
+        return ~(int32_t)(scene.packets.size() - 1);
+    }
+
+    auto split = [&](size_t begin, size_t size)
+    {
+        glm::vec3 boundsMin = triangles[begin].centroid, boundsMax = boundsMin;
+        for (size_t i = begin; i < begin + size; ++i)
+        {
+            boundsMin = glm::min(boundsMin, triangles[i].centroid);
+            boundsMax = glm::max(boundsMax, triangles[i].centroid);
+        }
+        const glm::vec3 extent = boundsMax - boundsMin;
+        const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        const size_t middle = begin + size / 2;
+        nth_element(triangles.begin() + begin, triangles.begin() + middle, triangles.begin() + begin + size,
+            [axis](const BakeTriangle& a, const BakeTriangle& b) { return a.centroid[axis] < b.centroid[axis]; });
+        return middle;
+    };
+    const size_t middle = split(first, count);
+    const size_t bounds[5] = { first, split(first, middle - first), middle, split(middle, first + count - middle), first + count };
+
+    const size_t nodeIndex = scene.nodes.size();
+    scene.nodes.push_back(BakeBvhNode());
+    for (int child = 0; child < 4; ++child)
+    {
+        glm::vec3 boundsMin(numeric_limits<float>::max()), boundsMax(-numeric_limits<float>::max());
+        int32_t childIndex = BAKE_BVH_EMPTY;
+        if (bounds[child + 1] > bounds[child])
+        {
+            for (size_t i = bounds[child]; i < bounds[child + 1]; ++i)
+            {
+                for (const glm::vec3& vertex : triangles[i].vertices)
+                {
+                    boundsMin = glm::min(boundsMin, vertex);
+                    boundsMax = glm::max(boundsMax, vertex);
+                }
+            }
+            childIndex = UBuildBakeBvh(triangles, bounds[child], bounds[child + 1] - bounds[child], scene);
+        }
+
+        // The recursion grew the node array, look the node up again
+        BakeBvhNode& node = scene.nodes[nodeIndex];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            node.boundsMin[axis][child] = boundsMin[axis];
+            node.boundsMax[axis][child] = boundsMax[axis];
+        }
+        node.children[child] = childIndex;
+    }
+    return (int32_t)nodeIndex;
+}
+
+
+// World space triangles of the objects' level 0 submeshes, and the BVH over them
+void UBuildBakeScene(const MeshData& data, const vector<SceneObject>& objects, BakeScene& scene)
+{
+    vector<BakeTriangle> triangles;
+    for (const SceneObject& object : objects)
+    {
+        const GLSubmesh& submesh = data.submeshes[object.submesh];
+        for (GLuint corner = 0; corner + 2 < submesh.indexCount; corner += 3)
+        {
+            BakeTriangle triangle;
+            for (int i = 0; i < 3; ++i)
+                triangle.vertices[i] = glm::vec3(object.model * glm::vec4(glm::make_vec3(data.vertices[data.indices[submesh.firstIndex + corner + i]].position), 1.0f));
+            triangle.centroid = (triangle.vertices[0] + triangle.vertices[1] + triangle.vertices[2]) / 3.0f;
+            triangles.push_back(triangle);
+        }
+    }
+
+    scene.nodes.clear();
+    scene.packets.clear();
+    scene.root = triangles.empty() ? BAKE_BVH_EMPTY : UBuildBakeBvh(triangles, 0, triangles.size(), scene);
+}
+
+
+// Slab test of a ray against the four child boxes of a node; bit i is set when child i is entered before tMax
+static int UIntersectBakeBoxes(const BakeBvhNode& node, const glm::vec3& origin, const glm::vec3& inverseDirection, float tMax)
+{
+#ifdef USE_SSE2
+    __m128 tNear = _mm_setzero_ps();
+    __m128 tFar = _mm_set1_ps(tMax);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const __m128 o = _mm_set1_ps(origin[axis]);
+        const __m128 inverse = _mm_set1_ps(inverseDirection[axis]);
+        const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.boundsMin[axis]), o), inverse);
+        const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.boundsMax[axis]), o), inverse);
+        tNear = _mm_max_ps(tNear, _mm_min_ps(t0, t1));
+        tFar = _mm_min_ps(tFar, _mm_max_ps(t0, t1));
+    }
+    return _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+#else
+    int mask = 0;
+    for (int child = 0; child < 4; ++child)
+    {
+        float tNear = 0.0f, tFar = tMax;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const float t0 = (node.boundsMin[axis][child] - origin[axis]) * inverseDirection[axis];
+            const float t1 = (node.boundsMax[axis][child] - origin[axis]) * inverseDirection[axis];
+            tNear = max(tNear, min(t0, t1));
+            tFar = min(tFar, max(t0, t1));
+        }
+        if (tNear <= tFar)
+            mask |= 1 << child;
+    }
+    return mask;
+#endif
+}
+
+
+// Moller-Trumbore test of a ray against the four triangles of a packet; bit i is set when triangle i is hit
+// between BAKE_RAY_EPSILON and tMax, at distances[i]. The operations are those of the SSE version, in the same
+// order, so both find the same hits at the same distances (UCheckBakePacketKernel).
+static int UIntersectBakePacketScalar(const BakeTrianglePacket& packet, const glm::vec3& origin, const glm::vec3& direction, float tMax, float distances[4])
+{
+    int mask = 0;
+    for (int lane = 0; lane < 4; ++lane)
+    {
+        const float e1x = packet.e1[0][lane], e1y = packet.e1[1][lane], e1z = packet.e1[2][lane];
+        const float e2x = packet.e2[0][lane], e2y = packet.e2[1][lane], e2z = packet.e2[2][lane];
+
+        // p = direction x e2, det = e1 . p
+        const float px = direction.y * e2z - direction.z * e2y;
+        const float py = direction.z * e2x - direction.x * e2z;
+        const float pz = direction.x * e2y - direction.y * e2x;
+        const float det = e1x * px + e1y * py + e1z * pz;
+        if (!(fabs(det) > 1e-12f))
+            continue;
+        const float inverseDet = 1.0f / det;
+
+        // s = origin - v0, u = (s . p) / det
+        const float sx = origin.x - packet.v0[0][lane], sy = origin.y - packet.v0[1][lane], sz = origin.z - packet.v0[2][lane];
+        const float u = (sx * px + sy * py + sz * pz) * inverseDet;
+
+        // q = s x e1, v = (direction . q) / det, t = (e2 . q) / det
+        const float qx = sy * e1z - sz * e1y;
+        const float qy = sz * e1x - sx * e1z;
+        const float qz = sx * e1y - sy * e1x;
+        const float v = (direction.x * qx + direction.y * qy + direction.z * qz) * inverseDet;
+        distances[lane] = (e2x * qx + e2y * qy + e2z * qz) * inverseDet;
+        if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && distances[lane] > BAKE_RAY_EPSILON && distances[lane] < tMax)
+            mask |= 1 << lane;
+    }
+    return mask;
+}
+
+
+// The same test on the four lanes at once
+static int UIntersectBakePacket(const BakeTrianglePacket& packet, const glm::vec3& origin, const glm::vec3& direction, float tMax, float distances[4])
+{
+#ifdef USE_SSE2
+    const __m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+    const __m128 e1x = _mm_loadu_ps(packet.e1[0]), e1y = _mm_loadu_ps(packet.e1[1]), e1z = _mm_loadu_ps(packet.e1[2]);
+    const __m128 e2x = _mm_loadu_ps(packet.e2[0]), e2y = _mm_loadu_ps(packet.e2[1]), e2z = _mm_loadu_ps(packet.e2[2]);
+
+    // p = direction x e2, det = e1 . p
+    const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    const __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+    const __m128 inverseDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    // s = origin - v0, u = (s . p) / det
+    const __m128 sx = _mm_sub_ps(_mm_set1_ps(origin.x), _mm_loadu_ps(packet.v0[0]));
+    const __m128 sy = _mm_sub_ps(_mm_set1_ps(origin.y), _mm_loadu_ps(packet.v0[1]));
+    const __m128 sz = _mm_sub_ps(_mm_set1_ps(origin.z), _mm_loadu_ps(packet.v0[2]));
+    const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inverseDet);
+
+    // q = s x e1, v = (direction . q) / det, t = (e2 . q) / det
+    const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inverseDet);
+    const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inverseDet);
+
+    // Degenerate lanes (the unused ones) have a zero determinant
+    const __m128 zero = _mm_setzero_ps();
+    __m128 hit = _mm_cmpgt_ps(absDet, _mm_set1_ps(1e-12f));
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(u, zero));
+    hit = _mm_and_ps(hit, _mm_cmpge_ps(v, zero));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+    hit = _mm_and_ps(hit, _mm_cmpgt_ps(t, _mm_set1_ps(BAKE_RAY_EPSILON)));
+    hit = _mm_and_ps(hit, _mm_cmplt_ps(t, _mm_set1_ps(tMax)));
+    _mm_storeu_ps(distances, t);
+    return _mm_movemask_ps(hit);
+#else
+    return UIntersectBakePacketScalar(packet, origin, direction, tMax, distances);
+#endif
+}
+
+
+// Runs the packet test and its scalar reference on random rays and triangles around the origin, and counts the rays
+// whose hits or hit distances differ
+bool UCheckBakePacketKernel()
+{
+    const int rays = 1 << 16;
+    uint32_t seed = 12345;
+    auto next = [&seed]() { seed = seed * 1664525u + 1013904223u; return (float)(seed >> 8) / (float)(1 << 24) * 2.0f - 1.0f; };
+
+    int differ = 0, hits = 0;
+    for (int ray = 0; ray < rays; ++ray)
+    {
+        BakeTrianglePacket packet;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            for (int lane = 0; lane < 4; ++lane)
+            {
+                packet.v0[axis][lane] = next();
+                packet.e1[axis][lane] = next();
+                packet.e2[axis][lane] = next();
+            }
+        }
+        const glm::vec3 origin(next() * 2.0f, next() * 2.0f, next() * 2.0f);
+        const glm::vec3 direction = glm::normalize(glm::vec3(next(), next(), next()) - origin * 0.5f);
+
+        float distances[4], reference[4];
+        const int mask = UIntersectBakePacket(packet, origin, direction, 4.0f, distances);
+        const int referenceMask = UIntersectBakePacketScalar(packet, origin, direction, 4.0f, reference);
+        bool same = mask == referenceMask;
+        for (int lane = 0; lane < 4; ++lane)
+            same = same && (!(mask & (1 << lane)) || memcmp(&distances[lane], &reference[lane], sizeof(float)) == 0);
+        differ += same ? 0 : 1;
+        hits += mask != 0 ? 1 : 0;
+    }
+
+    cout << "IMAGE: bake ray packets: " << rays << " rays, " << hits << " hitting, " << differ << " differ from the scalar reference" << endl;
+    return differ == 0;
+}
+
+
+// Traces a ray through the bake scene up to tMax. With anyHit the first hit found ends the walk (visibility rays),
+// otherwise the closest hit's distance and geometric normal are returned.
+bool UTraceBakeRay(const BakeScene& scene, const glm::vec3& origin, const glm::vec3& direction, float tMax, bool anyHit, float& distance, glm::vec3& normal)
+{
+    if (scene.root == BAKE_BVH_EMPTY)
+        return false;
+
+    // Axis-parallel directions get a huge finite inverse instead of infinity, 0 * infinity would poison the slab test
+    glm::vec3 inverseDirection;
+    for (int axis = 0; axis < 3; ++axis)
+        inverseDirection[axis] = 1.0f / (fabs(direction[axis]) > 1e-12f ? direction[axis] : copysign(1e-12f, direction[axis]));
+
+    int32_t stack[BAKE_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = scene.root;
+
+    bool found = false;
+    int32_t hitPacket = 0;
+    int hitLane = 0;
+    while (stackSize > 0)
+    {
+        const int32_t entry = stack[--stackSize];
+        if (entry >= 0)
+        {
+            const BakeBvhNode& node = scene.nodes[entry];
+            const int mask = UIntersectBakeBoxes(node, origin, inverseDirection, tMax);
+            for (int child = 0; child < 4; ++child)
+            {
+                if ((mask & (1 << child)) && node.children[child] != BAKE_BVH_EMPTY && stackSize < BAKE_STACK_SIZE)
+                    stack[stackSize++] = node.children[child];
+            }
+            continue;
+        }
+
+        float distances[4];
+        const int mask = UIntersectBakePacket(scene.packets[~entry], origin, direction, tMax, distances);
+        if (mask == 0)
+            continue;
+        if (anyHit)
+            return true;
+
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            if ((mask & (1 << lane)) && distances[lane] < tMax)
+            {
+                tMax = distances[lane];
+                hitPacket = ~entry;
+                hitLane = lane;
+                found = true;
+            }
+        }
+    }
+
+    if (found)
+    {
+        const BakeTrianglePacket& packet = scene.packets[hitPacket];
+        distance = tMax;
+        normal = glm::normalize(glm::cross(glm::vec3(packet.e1[0][hitLane], packet.e1[1][hitLane], packet.e1[2][hitLane]),
+            glm::vec3(packet.e2[0][hitLane], packet.e2[1][hitLane], packet.e2[2][hitLane])));
+    }
+    return found;
+}
+
+
+// Objects close enough to block or bounce each other's rays, found by a sweep over the bounds sorted along x.
+// Every list is in object order.
+void ULightmapNeighbours(const vector<SceneObject>& objects, vector<vector<GLuint>>& neighbours)
+{
+    const float reach = 2.0f * LIGHTMAP_RAY_DISTANCE;   // A ray and its bounce
+    neighbours.assign(objects.size(), vector<GLuint>());
+
+    vector<GLuint> order(objects.size());
+    for (GLuint i = 0; i < (GLuint)objects.size(); ++i)
+        order[i] = i;
+    sort(order.begin(), order.end(), [&](GLuint a, GLuint b) { return objects[a].boundsMin.x < objects[b].boundsMin.x; });
+
+    for (size_t a = 0; a < order.size(); ++a)
+    {
+        const SceneObject& object = objects[order[a]];
+        for (size_t b = a + 1; b < order.size() && objects[order[b]].boundsMin.x <= object.boundsMax.x + reach; ++b)
+        {
+            const SceneObject& other = objects[order[b]];
+            const bool apart = other.boundsMax.y < object.boundsMin.y - reach || other.boundsMax.z < object.boundsMin.z - reach
+                || other.boundsMin.y > object.boundsMax.y + reach || other.boundsMin.z > object.boundsMax.z + reach;
+            if (apart)
+                continue;
+            neighbours[order[a]].push_back(order[b]);
+            neighbours[order[b]].push_back(order[a]);
+        }
+    }
+    for (vector<GLuint>& list : neighbours)
+        sort(list.begin(), list.end());
+}
+
+
+// Cache key of every object's lightmap: its surface, transform and lightmap size, and the same for its
+// ULightmapNeighbours, which are returned too (left empty when no object has a lightmap). Objects without a lightmap get 0.
+void ULightmapKeys(const vector<GLSubmesh>& submeshes, const vector<SceneObject>& objects, vector<uint64_t>& keys, vector<vector<GLuint>>& neighbours)
+{
+    keys.assign(objects.size(), 0);
+    neighbours.clear();
+    if (none_of(objects.begin(), objects.end(), [&](const SceneObject& object) { return submeshes[object.submesh].lightmapWidth != 0; }))
+        return;
+
+    ULightmapNeighbours(objects, neighbours);
+
+    for (size_t i = 0; i < objects.size(); ++i)
+    {
+        const GLSubmesh& submesh = submeshes[objects[i].submesh];
+        if (submesh.lightmapWidth == 0)
+            continue;
+
+        uint64_t key = UHashBytes(&submesh.lightmapHash, sizeof(submesh.lightmapHash));
+        key = UHashBytes(glm::value_ptr(objects[i].model), sizeof(glm::mat4), key);
+        for (GLuint j : neighbours[i])
+        {
+            key = UHashBytes(&submeshes[objects[j].submesh].lightmapHash, sizeof(uint64_t), key);
+            key = UHashBytes(glm::value_ptr(objects[j].model), sizeof(glm::mat4), key);
+        }
+        keys[i] = key;
+    }
+}
+
+
+// Path of the cache entry for a lightmap with the given key
+string ULightmapCachePath(uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.ulm", (unsigned long long)key);
+    return string(LIGHTMAP_CACHE_DIR) + "/" + name;
+}
+
+
+bool UReadLightmapCache(uint64_t key, GLuint width, GLuint height, vector<unsigned char>& texels)
+{
+    ifstream in(ULightmapCachePath(key), ios::binary);
+    if (!in)
+        return false;
+
+    LightmapCacheHeader header;
+    in.read((char*)&header, sizeof(header));
+    const bool valid = in
+        && memcmp(header.magic, LIGHTMAP_CACHE_MAGIC, sizeof(LIGHTMAP_CACHE_MAGIC)) == 0
+        && header.version == LIGHTMAP_CACHE_VERSION
+        && header.width == width
+        && header.height == height
+        && header.key == key;
+    if (!valid)
+        return false;
+
+    texels.resize((size_t)width * height);
+    in.read((char*)texels.data(), texels.size());
+    return (bool)in;
+}
+
+
+// Stores a baked lightmap; written to a temporary file first so readers never see partial entries
+void UWriteLightmapCache(uint64_t key, GLuint width, GLuint height, const vector<unsigned char>& texels)
+{
+    UMakeDirectory(LIGHTMAP_CACHE_DIR);
+
+    LightmapCacheHeader header = {};
+    memcpy(header.magic, LIGHTMAP_CACHE_MAGIC, sizeof(LIGHTMAP_CACHE_MAGIC));
+    header.version = LIGHTMAP_CACHE_VERSION;
+    header.width = width;
+    header.height = height;
+    header.key = key;
+
+    const string path = ULightmapCachePath(key);
+    const string temporaryPath = UTemporaryPath(path);
+    {
+        ofstream out(temporaryPath, ios::binary);
+        out.write((const char*)&header, sizeof(header));
+        out.write((const char*)texels.data(), texels.size());
+        if (!out)
+        {
+            out.close();
+            remove(temporaryPath.c_str());
+            return;
+        }
+    }
+    remove(path.c_str());
+    rename(temporaryPath.c_str(), path.c_str());
+}
+
+
+// Cosine weighted direction around a normal, from a point of the unit square
+static glm::vec3 UCosineDirection(const glm::vec3& normal, float sx, float sy)
+{
+    const glm::vec3 tangent = glm::normalize(glm::cross(fabs(normal.y) < 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f), normal));
+    const glm::vec3 bitangent = glm::cross(normal, tangent);
+    const float radius = sqrt(sx);
+    const float angle = 6.2831853f * sy;
+    return tangent * (radius * cos(angle)) + bitangent * (radius * sin(angle)) + normal * sqrt(max(0.0f, 1.0f - sx));
+}
+
+
+/* Bakes the lightmap of every object whose cache entry is missing or stale; the others are left alone.
+ * A texel stores how much sky its surface point sees, plus the sky light reaching it after one bounce off a
+ * LIGHTMAP_BOUNCE_ALBEDO gray surface. The texels of all objects are traced in chunks by one thread per core.
+ */
+bool UBakeLightmaps(const MeshData& data, const vector<SceneObject>& objects)
+{
+    vector<uint64_t> keys;
+    vector<vector<GLuint>> neighbours;
+    ULightmapKeys(data.submeshes, objects, keys, neighbours);
+
+    vector<GLuint> stale;
+    size_t withLightmaps = 0;
+    for (GLuint object = 0; object < (GLuint)objects.size(); ++object)
+    {
+        const GLSubmesh& submesh = data.submeshes[objects[object].submesh];
+        if (keys[object] == 0)
+            continue;
+        ++withLightmaps;
+
+        vector<unsigned char> texels;
+        if (!UReadLightmapCache(keys[object], submesh.lightmapWidth, submesh.lightmapHeight, texels))
+            stale.push_back(object);
+    }
+    cout << "Lightmaps: " << withLightmaps - stale.size() << " of " << withLightmaps << " objects up to date" << endl;
+    if (stale.empty())
+        return true;
+
+    const auto start = chrono::steady_clock::now();
+    BakeScene scene;
+    UBuildBakeScene(data, objects, scene);
+
+    // Texel centers covered by a triangle of a stale object, with their world position and normal
+    vector<vector<float>> values(stale.size());
+    vector<vector<unsigned char>> covered(stale.size());
+    vector<LightmapTexel> texels;
+    for (GLuint slot = 0; slot < (GLuint)stale.size(); ++slot)
+    {
+        const SceneObject& object = objects[stale[slot]];
+        const GLSubmesh& submesh = data.submeshes[object.submesh];
+        const GLuint width = submesh.lightmapWidth;
+        const GLuint height = submesh.lightmapHeight;
+        const glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(object.model)));
+        values[slot].assign((size_t)width * height, 1.0f);
+        covered[slot].assign((size_t)width * height, 0);
+
+        for (GLuint corner = 0; corner + 2 < submesh.indexCount; corner += 3)
+        {
+            glm::vec2 uvs[3];
+            glm::vec3 positions[3], normals[3];
+            for (int i = 0; i < 3; ++i)
+            {
+                const GLuint index = data.indices[submesh.firstIndex + corner + i];
+                uvs[i] = data.lightmapUvs[index];
+                positions[i] = glm::vec3(object.model * glm::vec4(glm::make_vec3(data.vertices[index].position), 1.0f));
+                normals[i] = normalMatrix * glm::make_vec3(data.vertices[index].normal);
+            }
+
+            const float area = (uvs[1].x - uvs[0].x) * (uvs[2].y - uvs[0].y) - (uvs[2].x - uvs[0].x) * (uvs[1].y - uvs[0].y);
+            if (fabs(area) < 1e-12f)
+                continue;
+
+            const glm::vec2 uvMin = glm::min(uvs[0], glm::min(uvs[1], uvs[2]));
+            const glm::vec2 uvMax = glm::max(uvs[0], glm::max(uvs[1], uvs[2]));
+            const int x0 = max(0, (int)floor(uvMin.x)), x1 = min((int)width - 1, (int)ceil(uvMax.x));
+            const int y0 = max(0, (int)floor(uvMin.y)), y1 = min((int)height - 1, (int)ceil(uvMax.y));
+            for (int y = y0; y <= y1; ++y)
+            {
+                for (int x = x0; x <= x1; ++x)
+                {
+                    const size_t texel = (size_t)y * width + x;
+                    if (covered[slot][texel])
+                        continue;
+
+                    // Barycentric coordinates of the texel center
+                    const glm::vec2 p(x + 0.5f, y + 0.5f);
+                    const float b1 = ((p.x - uvs[0].x) * (uvs[2].y - uvs[0].y) - (uvs[2].x - uvs[0].x) * (p.y - uvs[0].y)) / area;
+                    const float b2 = ((uvs[1].x - uvs[0].x) * (p.y - uvs[0].y) - (p.x - uvs[0].x) * (uvs[1].y - uvs[0].y)) / area;
+                    const float b0 = 1.0f - b1 - b2;
+                    if (b0 < -1e-4f || b1 < -1e-4f || b2 < -1e-4f)
+                        continue;
+
+                    covered[slot][texel] = 1;
+                    LightmapTexel sample;
+                    sample.slot = slot;
+                    sample.texel = (GLuint)texel;
+                    sample.position = positions[0] * b0 + positions[1] * b1 + positions[2] * b2;
+                    sample.normal = glm::normalize(normals[0] * b0 + normals[1] * b1 + normals[2] * b2);
+                    texels.push_back(sample);
+                }
+            }
+        }
+    }
+
+    cout << "Baking " << stale.size() << " lightmaps: " << texels.size() << " texels, " << scene.packets.size() * 4
+        << " triangle slots, " << UWorkerThreadCount() << " threads" << endl;
+
+    // Chunks of texels spread over the worker threads
+    const size_t chunkCount = (texels.size() + LIGHTMAP_BAKE_CHUNK - 1) / LIGHTMAP_BAKE_CHUNK;
+    URunParallel(chunkCount, [&](size_t chunk)
+    {
+        const size_t begin = chunk * LIGHTMAP_BAKE_CHUNK;
+        const size_t end = min(texels.size(), begin + LIGHTMAP_BAKE_CHUNK);
+        for (size_t i = begin; i < end; ++i)
+        {
+            const LightmapTexel& sample = texels[i];
+            const glm::vec3 origin = sample.position + sample.normal * BAKE_RAY_OFFSET;
+
+            // Stratified over a LIGHTMAP_SAMPLE_GRID square, jittered per texel; the seed depends on the texel only
+            // so a re-bake gives the same result
+            uint32_t state = (uint32_t)(i * 2654435761u) ^ 0x9E3779B9u;
+            auto random = [&state]()
+            {
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                return (state >> 8) * (1.0f / 16777216.0f);
+            };
+
+            float light = 0.0f;
+            for (int s = 0; s < LIGHTMAP_SAMPLE_GRID * LIGHTMAP_SAMPLE_GRID; ++s)
+            {
+                const float sx = (s % LIGHTMAP_SAMPLE_GRID + random()) / LIGHTMAP_SAMPLE_GRID;
+                const float sy = (s / LIGHTMAP_SAMPLE_GRID + random()) / LIGHTMAP_SAMPLE_GRID;
+                const glm::vec3 direction = UCosineDirection(sample.normal, sx, sy);
+
+                float distance;
+                glm::vec3 hitNormal;
+                if (!UTraceBakeRay(scene, origin, direction, LIGHTMAP_RAY_DISTANCE, false, distance, hitNormal))
+                {
+                    light += 1.0f;
+                    continue;
+                }
+
+                // One bounce: sky seen from the surface that was hit, on the side the ray came from
+                if (glm::dot(hitNormal, direction) > 0.0f)
+                    hitNormal = -hitNormal;
+                const glm::vec3 bounceOrigin = origin + direction * distance + hitNormal * BAKE_RAY_OFFSET;
+                const glm::vec3 bounceDirection = UCosineDirection(hitNormal, random(), random());
+                if (!UTraceBakeRay(scene, bounceOrigin, bounceDirection, LIGHTMAP_RAY_DISTANCE, true, distance, hitNormal))
+                    light += LIGHTMAP_BOUNCE_ALBEDO;
+            }
+            values[sample.slot][sample.texel] = light / (LIGHTMAP_SAMPLE_GRID * LIGHTMAP_SAMPLE_GRID);
+        }
+    });
+
+    // Grow the charts into their gutters so bilinear filtering never reads an unbaked texel, then store the results
+    for (GLuint slot = 0; slot < (GLuint)stale.size(); ++slot)
+    {
+        const GLSubmesh& submesh = data.submeshes[objects[stale[slot]].submesh];
+        const int width = (int)submesh.lightmapWidth;
+        const int height = (int)submesh.lightmapHeight;
+        vector<float>& value = values[slot];
+
+        for (int pass = 0; pass < LIGHTMAP_PADDING; ++pass)
+        {
+            vector<unsigned char> grown = covered[slot];
+            for (int y = 0; y < height; ++y)
+            {
+                for (int x = 0; x < width; ++x)
+                {
+                    if (covered[slot][(size_t)y * width + x])
+                        continue;
+
+                    float sum = 0.0f;
+                    int count = 0;
+                    for (int ny = max(0, y - 1); ny <= min(height - 1, y + 1); ++ny)
+                    {
+                        for (int nx = max(0, x - 1); nx <= min(width - 1, x + 1); ++nx)
+                        {
+                            if (covered[slot][(size_t)ny * width + nx])
+                            {
+                                sum += value[(size_t)ny * width + nx];
+                                ++count;
+                            }
+                        }
+                    }
+                    if (count > 0)
+                    {
+                        value[(size_t)y * width + x] = sum / count;
+                        grown[(size_t)y * width + x] = 1;
+                    }
+                }
+            }
+            covered[slot].swap(grown);
+        }
+
+        vector<unsigned char> bytes(value.size());
+        for (size_t texel = 0; texel < value.size(); ++texel)
+            bytes[texel] = (unsigned char)(glm::clamp(value[texel], 0.0f, 1.0f) * 255.0f + 0.5f);
+        UWriteLightmapCache(keys[stale[slot]], submesh.lightmapWidth, submesh.lightmapHeight, bytes);
+    }
+
+    const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Baked " << stale.size() << " lightmaps in " << seconds << " s" << endl;
+    return true;
+}
+
+
+// Offline lightmap baking (--bake-lightmaps): the built-in scene, placed as at runtime, without a GL context
+bool URunLightmapBake()
+{
+    if (!gSceneFile.empty())
+    {
+        cout << "Lightmaps are only generated for the built-in scene" << endl;
+        return false;
+    }
+
+    MeshData data;
+    UBuildDefaultMesh(data);
+    UProcessMesh(data, true);
+
+    // UBuildScene only reads the submeshes and their bounds
+    GLMesh mesh = {};
+    mesh.submeshes = data.submeshes;
+    UComputeSubmeshBounds(data.vertices.data(), data.indices.data(), GL_UNSIGNED_INT, mesh.submeshes);
+
+    vector<SceneObject> objects;
+    UBuildScene(mesh, gDeskCount, objects);
+    return UBakeLightmaps(data, objects);
+}
+
+
+/* Packs the cached lightmaps of the objects into one R8 atlas. Objects without an up to date bake point at the white
+ * block in the atlas corner and keep the full ambient term. No texture is made when nothing is baked.
+ */
+void UCreateLightmapAtlas(const GLMesh& mesh, const vector<SceneObject>& objects, GLLightmap& lightmap)
+{
+    vector<uint64_t> keys;
+    ULightmapKeys(mesh.submeshes, objects, keys, lightmap.neighbours);
+
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    const int width = min(LIGHTMAP_ATLAS_WIDTH, (int)maxSize);
+
+    // Shelf packing in object order, after the white block
+    struct Placement { GLuint object; int x; int y; vector<unsigned char> texels; };
+    vector<Placement> placements;
+    size_t withLightmaps = 0;
+    int x = LIGHTMAP_WHITE_SIZE, y = 0, shelfHeight = LIGHTMAP_WHITE_SIZE;
+    for (GLuint object = 0; object < (GLuint)objects.size(); ++object)
+    {
+        const GLSubmesh& submesh = mesh.submeshes[objects[object].submesh];
+        if (keys[object] == 0)
+            continue;
+        ++withLightmaps;
+
+        Placement placement;
+        if (!UReadLightmapCache(keys[object], submesh.lightmapWidth, submesh.lightmapHeight, placement.texels))
+            continue;
+
+        if (x + (int)submesh.lightmapWidth > width)
+        {
+            y += shelfHeight;
+            x = 0;
+            shelfHeight = 0;
+        }
+        if ((int)submesh.lightmapWidth > width || y + (int)submesh.lightmapHeight > maxSize)
+            continue;
+
+        placement.object = object;
+        placement.x = x;
+        placement.y = y;
+        placements.push_back(move(placement));
+        x += submesh.lightmapWidth;
+        shelfHeight = max(shelfHeight, (int)submesh.lightmapHeight);
+    }
+
+    cout << "INFO: Lightmaps: " << placements.size() << " of " << withLightmaps << " objects baked" << endl;
+    if (placements.empty())
+        return;
+
+    lightmap.width = width;
+    lightmap.height = y + shelfHeight;
+    vector<unsigned char> atlas((size_t)lightmap.width * lightmap.height, 255);
+
+    // Texel UV * scale + offset gives the atlas coordinate; the white block's center samples as 1 with bilinear filtering
+    const glm::vec2 texelSize(1.0f / lightmap.width, 1.0f / lightmap.height);
+    lightmap.rects.assign(objects.size(), glm::vec4(0.0f, 0.0f, LIGHTMAP_WHITE_SIZE * 0.5f * texelSize.x, LIGHTMAP_WHITE_SIZE * 0.5f * texelSize.y));
+    for (const Placement& placement : placements)
+    {
+        const GLSubmesh& submesh = mesh.submeshes[objects[placement.object].submesh];
+        for (GLuint row = 0; row < submesh.lightmapHeight; ++row)
+            memcpy(&atlas[(size_t)(placement.y + row) * lightmap.width + placement.x], &placement.texels[(size_t)row * submesh.lightmapWidth], submesh.lightmapWidth);
+        lightmap.rects[placement.object] = glm::vec4(texelSize.x, texelSize.y, placement.x * texelSize.x, placement.y * texelSize.y);
+    }
+
+    glGenTextures(1, &lightmap.texture);
+    UStateEditTexture(GL_TEXTURE_2D, lightmap.texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, lightmap.width, lightmap.height, 0, GL_RED, GL_UNSIGNED_BYTE, atlas.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    cout << "INFO: Lightmap atlas: " << lightmap.width << "x" << lightmap.height << ", " << atlas.size() / 1024.0 << " KB" << endl;
+}
+
+
+void UDestroyLightmap(GLLightmap& lightmap)
+{
+    glDeleteTextures(1, &lightmap.texture);
+    lightmap = GLLightmap();
+}
+
+
+unsigned UWorkerThreadCount()
+{
+    return gWorkerThreads > 0 ? gWorkerThreads : max(1u, thread::hardware_concurrency());
+}
+
+
+// Worker side of the pool: runs the job indices it can take of every generation, until the pool stops
+static void UWorkerLoop()
+{
+    WorkerPool& pool = gWorkerPool;
+    uint64_t generation = 0;
+    for (;;)
+    {
+        const function<void(size_t)>* job;
+        size_t count;
+        {
+            unique_lock<mutex> lock(pool.access);
+            pool.wake.wait(lock, [&]() { return pool.stopping || pool.generation != generation; });
+            if (pool.stopping)
+                return;
+            generation = pool.generation;
+            job = pool.job;
+            count = pool.count;
+        }
+
+        for (size_t index = pool.next.fetch_add(1); index < count; index = pool.next.fetch_add(1))
+            (*job)(index);
+
+        lock_guard<mutex> lock(pool.access);
+        if (--pool.busy == 0)
+            pool.finished.notify_one();
+    }
+}
+
+
+void UStopWorkerPool()
+{
+    WorkerPool& pool = gWorkerPool;
+    {
+        lock_guard<mutex> lock(pool.access);
+        pool.stopping = true;
+    }
+    pool.wake.notify_all();
+    for (thread& t : pool.threads)
+        t.join();
+    pool.threads.clear();
+    pool.stopping = false;
+}
+
+
+// Runs job(0) .. job(count - 1) on UWorkerThreadCount() threads, the calling thread being one of them.
+// Every thread takes the next index until none are left, so uneven jobs still balance. The pool threads
+// stay up between calls, so a frame pays for waking them only.
+void URunParallel(size_t count, const function<void(size_t)>& job)
+{
+    WorkerPool& pool = gWorkerPool;
+    const unsigned workerCount = UWorkerThreadCount() - 1;
+    if (pool.threads.size() != workerCount)
+    {
+        UStopWorkerPool();
+        for (unsigned i = 0; i < workerCount; ++i)
+            pool.threads.emplace_back(UWorkerLoop);
+    }
+
+    if (count <= 1 || pool.threads.empty())
+    {
+        for (size_t index = 0; index < count; ++index)
+            job(index);
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(pool.access);
+        pool.job = &job;
+        pool.count = count;
+        pool.next = 0;
+        pool.busy = (unsigned)pool.threads.size();
+        ++pool.generation;
+    }
+    pool.wake.notify_all();
+
+    for (size_t index = pool.next.fetch_add(1); index < count; index = pool.next.fetch_add(1))
+        job(index);
+
+    // Every worker has seen this generation before the job goes out of scope
+    unique_lock<mutex> lock(pool.access);
+    pool.finished.wait(lock, [&]() { return pool.busy == 0; });
+}
+
+
+// Writes an RGBA8 image stored bottom row first (as glReadPixels returns it) as a binary PPM
+bool UWriteImagePpm(const string& filename, int width, int height, const uint32_t* pixels)
+{
+    ofstream out(filename, ios::binary);
+    if (!out)
+    {
+        cout << "Failed to open " << filename << " for writing" << endl;
+        return false;
+    }
+
+    out << "P6\n" << width << " " << height << "\n255\n";
+    vector<unsigned char> row((size_t)width * 3);
+    for (int y = height - 1; y >= 0; --y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            const uint32_t pixel = pixels[(size_t)y * width + x];
+            row[x * 3 + 0] = (unsigned char)(pixel & 0xFF);
+            row[x * 3 + 1] = (unsigned char)((pixel >> 8) & 0xFF);
+            row[x * 3 + 2] = (unsigned char)((pixel >> 16) & 0xFF);
+        }
+        out.write((const char*)row.data(), row.size());
+    }
+    return (bool)out;
+}
+
+
+// Headless GL frame to disk (--frame-output), for comparison with the software renderer
+bool USaveFrame(const string& filename)
+{
+    vector<uint32_t> pixels((size_t)gWindowWidth * gWindowHeight);
+    UStateBindFramebuffer(gOffscreenFbo);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, gWindowWidth, gWindowHeight, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    if (!UWriteImagePpm(filename, gWindowWidth, gWindowHeight, pixels.data()))
+        return false;
+    cout << "Wrote " << filename << endl;
+    return true;
+}
+
+
+// Material textures for the software renderer, decoded like the uncompressed GL path; a texture that fails to load
+// leaves its material untextured
+void ULoadSoftwareTextures(SoftwareRenderer& renderer)
+{
+    const size_t layerTexels = (size_t)TEXTURE_ARRAY_SIZE * TEXTURE_ARRAY_SIZE;
+    renderer.textures.assign(layerTexels * MATERIAL_COUNT, 0xFFFFFFFFu);
+
+    URunParallel(MATERIAL_COUNT, [&](size_t layer)
+    {
+        int width, height, channels;
+        unsigned char* image = stbi_load(MATERIAL_TEXTURE_FILES[layer], &width, &height, &channels, 0);
+        vector<unsigned char> rgba;
+        if (!image || !UPrepareTextureLayer(image, width, height, channels, rgba))
+        {
+            ULOG_WARNING("Failed to load texture %s", MATERIAL_TEXTURE_FILES[layer]);
+            gMaterialFeatures[layer] &= ~SHADER_TEXTURED;
+            return;
+        }
+        memcpy(&renderer.textures[layerTexels * layer], rgba.data(), rgba.size());
+    });
+}
+
+
+// Screen space triangle from three clip space vertices; false when it covers no pixel center
+static bool USetupSoftwareTriangle(const SoftwareVertex* const vertices[3], int width, int height, GLuint material, GLuint features, SoftwareTriangle& triangle)
+{
+    float x[3], y[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        const glm::vec4& clip = vertices[i]->clip;
+        const float inverseW = 1.0f / clip.w;
+        x[i] = (clip.x * inverseW * 0.5f + 0.5f) * width;
+        y[i] = (clip.y * inverseW * 0.5f + 0.5f) * height;
+        triangle.z[i] = clip.z * inverseW * 0.5f + 0.5f;
+        triangle.inverseW[i] = inverseW;
+        for (int attribute = 0; attribute < SOFTWARE_ATTRIBUTES; ++attribute)
+            triangle.attributes[attribute][i] = vertices[i]->attributes[attribute] * inverseW;
+    }
+
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (!(fabs(area) > 0.0f) || !isfinite(area))
+        return false;
+
+    // Edge i runs between the other two vertices. A shared edge gets exactly negated coefficients in its two
+    // triangles, so no pixel center between them is missed
+    for (int i = 0; i < 3; ++i)
+    {
+        const int a = (i + 1) % 3, b = (i + 2) % 3;
+        triangle.edgeA[i] = y[a] - y[b];
+        triangle.edgeB[i] = x[b] - x[a];
+        triangle.edgeC[i] = x[a] * y[b] - x[b] * y[a];
+    }
+    if (area < 0.0f)
+    {
+        // Both windings are drawn, like the GL path without face culling
+        for (int i = 0; i < 3; ++i)
+        {
+            triangle.edgeA[i] = -triangle.edgeA[i];
+            triangle.edgeB[i] = -triangle.edgeB[i];
+            triangle.edgeC[i] = -triangle.edgeC[i];
+        }
+        area = -area;
+    }
+    triangle.inverseArea = 1.0f / area;
+
+    // Pixels whose centers can be inside
+    triangle.minX = max(0, (int)ceil(min(x[0], min(x[1], x[2])) - 0.5f));
+    triangle.maxX = min(width - 1, (int)floor(max(x[0], max(x[1], x[2])) - 0.5f));
+    triangle.minY = max(0, (int)ceil(min(y[0], min(y[1], y[2])) - 0.5f));
+    triangle.maxY = min(height - 1, (int)floor(max(y[0], max(y[1], y[2])) - 0.5f));
+    triangle.material = material;
+    triangle.features = features;
+    return triangle.minX <= triangle.maxX && triangle.minY <= triangle.maxY;
+}
+
+
+// Transforms, clips and sets up triangles [first, first + count) of the frame, which may span several draws,
+// then groups them by the tiles they touch
+void USetupSoftwareTriangles(const SoftwareRenderer& renderer, GLuint first, GLuint count, const glm::mat4& viewProjection, SoftwareBin& bin)
+{
+    bin.triangles.clear();
+
+    // Last draw starting at or before the first triangle
+    const vector<SoftwareDraw>& draws = renderer.draws;
+    size_t drawIndex = upper_bound(draws.begin(), draws.end(), first, [](GLuint triangle, const SoftwareDraw& draw) { return triangle < draw.frameTriangle; }) - draws.begin() - 1;
+
+    for (GLuint frameTriangle = first; frameTriangle < first + count; ++frameTriangle)
+    {
+        while (frameTriangle >= draws[drawIndex].frameTriangle + draws[drawIndex].triangleCount)
+            ++drawIndex;
+        const SoftwareDraw& draw = draws[drawIndex];
+        const GLuint triangle = frameTriangle - draw.frameTriangle;
+
+        SoftwareVertex corners[3];
+        GLuint material = draw.material;
+        for (int corner = 0; corner < 3; ++corner)
+        {
+            const Vertex& vertex = draw.mesh->vertices[draw.mesh->indices[draw.firstIndex + triangle * 3 + corner]];
+            const glm::vec4 world = draw.model * glm::vec4(glm::make_vec3(vertex.position), 1.0f);
+            const glm::vec3 normal = draw.normalMatrix * glm::make_vec3(vertex.normal);
+            corners[corner].clip = viewProjection * world;
+            const float attributes[SOFTWARE_ATTRIBUTES] = { world.x, world.y, world.z, normal.x, normal.y, normal.z, vertex.uv[0], vertex.uv[1] };
+            memcpy(corners[corner].attributes, attributes, sizeof(attributes));
+
+            // The material is flat, taken from the provoking (last) vertex like GL does
+            if (draw.material == MATERIAL_FROM_VERTEX)
+                material = min(vertex.material, (GLuint)MATERIAL_COUNT - 1);
+        }
+
+        // Clip against the near plane and the guard band; each plane adds at most one vertex
+        auto distance = [](const glm::vec4& clip, int plane)
+        {
+            switch (plane)
+            {
+            case 0: return clip.z + clip.w;
+            case 1: return SOFTWARE_GUARD_BAND * clip.w - clip.x;
+            case 2: return SOFTWARE_GUARD_BAND * clip.w + clip.x;
+            case 3: return SOFTWARE_GUARD_BAND * clip.w - clip.y;
+            default: return SOFTWARE_GUARD_BAND * clip.w + clip.y;
+            }
+        };
+
+        SoftwareVertex polygons[2][3 + SOFTWARE_CLIP_PLANES];
+        int vertexCount = 3;
+        SoftwareVertex* polygon = polygons[0];
+        memcpy(polygon, corners, sizeof(corners));
+        for (int plane = 0; plane < SOFTWARE_CLIP_PLANES && vertexCount >= 3; ++plane)
+        {
+            bool inside = true;
+            for (int i = 0; i < vertexCount; ++i)
+                inside = inside && distance(polygon[i].clip, plane) >= 0.0f;
+            if (inside)
+                continue;
+
+            SoftwareVertex* clipped = polygon == polygons[0] ? polygons[1] : polygons[0];
+            int clippedCount = 0;
+            for (int i = 0; i < vertexCount; ++i)
+            {
+                const SoftwareVertex& a = polygon[i];
+                const SoftwareVertex& b = polygon[(i + 1) % vertexCount];
+                const float da = distance(a.clip, plane), db = distance(b.clip, plane);
+                if (da >= 0.0f)
+                    clipped[clippedCount++] = a;
+                if ((da >= 0.0f) != (db >= 0.0f))
+                {
+                    const float t = da / (da - db);
+                    SoftwareVertex& out = clipped[clippedCount++];
+                    out.clip = a.clip + (b.clip - a.clip) * t;
+                    for (int attribute = 0; attribute < SOFTWARE_ATTRIBUTES; ++attribute)
+                        out.attributes[attribute] = a.attributes[attribute] + (b.attributes[attribute] - a.attributes[attribute]) * t;
+                }
+            }
+            polygon = clipped;
+            vertexCount = clippedCount;
+        }
+
+        // Fan of the clipped polygon
+        for (int i = 1; i + 1 < vertexCount; ++i)
+        {
+            const SoftwareVertex* const fan[3] = { &polygon[0], &polygon[i], &polygon[i + 1] };
+            SoftwareTriangle setup;
+            if (USetupSoftwareTriangle(fan, renderer.width, renderer.height, material, draw.features, setup))
+                bin.triangles.push_back(setup);
+        }
+    }
+
+    // Triangle lists per tile: count, prefix sum, fill
+    const size_t tileCount = (size_t)renderer.tilesX * renderer.tilesY;
+    bin.tileStarts.assign(tileCount + 1, 0);
+    for (const SoftwareTriangle& triangle : bin.triangles)
+        for (int tileY = triangle.minY / SOFTWARE_TILE_SIZE; tileY <= triangle.maxY / SOFTWARE_TILE_SIZE; ++tileY)
+            for (int tileX = triangle.minX / SOFTWARE_TILE_SIZE; tileX <= triangle.maxX / SOFTWARE_TILE_SIZE; ++tileX)
+                ++bin.tileStarts[(size_t)tileY * renderer.tilesX + tileX + 1];
+    for (size_t tile = 0; tile < tileCount; ++tile)
+        bin.tileStarts[tile + 1] += bin.tileStarts[tile];
+
+    bin.tileTriangles.resize(bin.tileStarts[tileCount]);
+    bin.cursors.assign(bin.tileStarts.begin(), bin.tileStarts.end() - 1);
+    for (GLuint index = 0; index < (GLuint)bin.triangles.size(); ++index)
+    {
+        const SoftwareTriangle& triangle = bin.triangles[index];
+        for (int tileY = triangle.minY / SOFTWARE_TILE_SIZE; tileY <= triangle.maxY / SOFTWARE_TILE_SIZE; ++tileY)
+            for (int tileX = triangle.minX / SOFTWARE_TILE_SIZE; tileX <= triangle.maxX / SOFTWARE_TILE_SIZE; ++tileX)
+                bin.tileTriangles[bin.cursors[(size_t)tileY * renderer.tilesX + tileX]++] = index;
+    }
+}
+
+
+// Bilinear sample of a material texture with repeat wrapping, like GL_LINEAR on the texture array
+static void USampleSoftwareTexture(const uint32_t* layer, float u, float v, float rgb[3])
 {
-    // GLFW: initialize and configure
-    // ------------------------------
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    const int mask = TEXTURE_ARRAY_SIZE - 1;
+    const float tx = u * TEXTURE_ARRAY_SIZE - 0.5f, ty = v * TEXTURE_ARRAY_SIZE - 0.5f;
+    const float fx = floor(tx), fy = floor(ty);
+    const float wx = tx - fx, wy = ty - fy;
+    const int x0 = (int)fx & mask, y0 = (int)fy & mask;
+    const int x1 = (x0 + 1) & mask, y1 = (y0 + 1) & mask;
+    const uint32_t texels[4] = { layer[y0 * TEXTURE_ARRAY_SIZE + x0], layer[y0 * TEXTURE_ARRAY_SIZE + x1], layer[y1 * TEXTURE_ARRAY_SIZE + x0], layer[y1 * TEXTURE_ARRAY_SIZE + x1] };
+    for (int c = 0; c < 3; ++c)
+    {
+        const float c00 = (float)((texels[0] >> (8 * c)) & 0xFF), c10 = (float)((texels[1] >> (8 * c)) & 0xFF);
+        const float c01 = (float)((texels[2] >> (8 * c)) & 0xFF), c11 = (float)((texels[3] >> (8 * c)) & 0xFF);
+        const float top = c00 + (c10 - c00) * wx;
+        const float bottom = c01 + (c11 - c01) * wx;
+        rgb[c] = (top + (bottom - top) * wy) * (1.0f / 255.0f);
+    }
+}
 
-#ifdef __APPLE__
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+
+// shade() of the cube fragment shader for one pixel: Phong lighting by the lamp
+static uint32_t UShadeSoftwarePixel(const SoftwareTriangle& triangle, const SoftwareFrame& frame, const uint32_t* textures, const float attributes[SOFTWARE_ATTRIBUTES])
+{
+    if (triangle.features & SOFTWARE_UNLIT)
+        return 0xFFFFFFFFu;
+
+    float albedo[3] = { frame.objectColor.r, frame.objectColor.g, frame.objectColor.b };
+    if (triangle.features & SHADER_TEXTURED)
+        USampleSoftwareTexture(textures + (size_t)triangle.material * TEXTURE_ARRAY_SIZE * TEXTURE_ARRAY_SIZE,
+            attributes[6] * frame.uvScale.x, attributes[7] * frame.uvScale.y, albedo);
+
+    const glm::vec3 position(attributes[0], attributes[1], attributes[2]);
+    const glm::vec3 norm = glm::normalize(glm::vec3(attributes[3], attributes[4], attributes[5]));
+    const glm::vec3 lightDirection = glm::normalize(frame.lightPosition - position);
+    const float impact = max(glm::dot(norm, lightDirection), 0.0f);
+
+    // Ambient, diffuse and specular all scale the light color
+    float lighting = SOFTWARE_AMBIENT_STRENGTH + impact;
+    if (triangle.features & SHADER_SPECULAR)
+    {
+        const glm::vec3 viewDirection = glm::normalize(frame.viewPosition - position);
+        const glm::vec3 reflectDirection = norm * (2.0f * glm::dot(norm, lightDirection)) - lightDirection;
+        const float s = max(glm::dot(viewDirection, reflectDirection), 0.0f);
+        const float s2 = s * s, s8 = s2 * s2 * s2 * s2;
+        lighting += s8 * s2;    // pow(s, 10), the highlight size
+    }
+
+    uint32_t pixel = 0xFF000000u;
+    for (int c = 0; c < 3; ++c)
+    {
+        const float value = glm::clamp(lighting * frame.lightColor[c] * albedo[c], 0.0f, 1.0f);
+        pixel |= (uint32_t)lrintf(value * 255.0f) << (8 * c);
+    }
+    return pixel;
+}
+
+
+// Covered pixels of one row of a triangle between x0 and x1: depth test, perspective correct attributes and shading
+static void URasterizeSoftwareSpan(const SoftwareTriangle& triangle, const SoftwareFrame& frame, const uint32_t* textures, const float rowEdges[3], int x0, int x1, float* depthRow, uint32_t* colorRow)
+{
+    for (int x = x0; x <= x1; ++x)
+    {
+        const float px = x + 0.5f;
+        float barycentrics[3];
+        bool covered = true;
+        for (int i = 0; i < 3; ++i)
+        {
+            const float edge = triangle.edgeA[i] * px + rowEdges[i];
+            covered = covered && edge >= 0.0f;
+            barycentrics[i] = edge * triangle.inverseArea;
+        }
+        if (!covered)
+            continue;
+
+        auto interpolate = [&](const float values[3]) { return barycentrics[0] * values[0] + barycentrics[1] * values[1] + barycentrics[2] * values[2]; };
+        const float z = interpolate(triangle.z);
+        if (!(z < depthRow[x]))
+            continue;
+        depthRow[x] = z;
+
+        const float w = 1.0f / interpolate(triangle.inverseW);
+        float attributes[SOFTWARE_ATTRIBUTES];
+        for (int attribute = 0; attribute < SOFTWARE_ATTRIBUTES; ++attribute)
+            attributes[attribute] = interpolate(triangle.attributes[attribute]) * w;
+        colorRow[x] = UShadeSoftwarePixel(triangle, frame, textures, attributes);
+    }
+}
+
+
+#if defined(USE_AVX2_KERNELS)
+static inline AVX2_TARGET __m256 UDot3Avx2(const __m256 a[3], const __m256 b[3])
+{
+    return _mm256_fmadd_ps(a[0], b[0], _mm256_fmadd_ps(a[1], b[1], _mm256_mul_ps(a[2], b[2])));
+}
+
+
+static inline AVX2_TARGET void UNormalizeAvx2(__m256 v[3])
+{
+    const __m256 inverseLength = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(UDot3Avx2(v, v)));
+    for (int i = 0; i < 3; ++i)
+        v[i] = _mm256_mul_ps(v[i], inverseLength);
+}
+
+
+// USampleSoftwareTexture for eight pixels, the four texels of each gathered at once
+static inline AVX2_TARGET __m256 UTexelChannelAvx2(__m256i texels, int channel)
+{
+    return _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texels, 8 * channel), _mm256_set1_epi32(0xFF)));
+}
+
+
+static AVX2_TARGET void USampleSoftwareTextureAvx2(const uint32_t* layer, __m256 u, __m256 v, __m256 rgb[3])
+{
+    const __m256i mask = _mm256_set1_epi32(TEXTURE_ARRAY_SIZE - 1);
+    const __m256 size = _mm256_set1_ps((float)TEXTURE_ARRAY_SIZE);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 tx = _mm256_fmsub_ps(u, size, half), ty = _mm256_fmsub_ps(v, size, half);
+    const __m256 fx = _mm256_floor_ps(tx), fy = _mm256_floor_ps(ty);
+    const __m256 wx = _mm256_sub_ps(tx, fx), wy = _mm256_sub_ps(ty, fy);
+    const __m256i x0 = _mm256_and_si256(_mm256_cvttps_epi32(fx), mask), y0 = _mm256_and_si256(_mm256_cvttps_epi32(fy), mask);
+    const __m256i x1 = _mm256_and_si256(_mm256_add_epi32(x0, _mm256_set1_epi32(1)), mask);
+    const __m256i y1 = _mm256_and_si256(_mm256_add_epi32(y0, _mm256_set1_epi32(1)), mask);
+    const __m256i row0 = _mm256_slli_epi32(y0, TEXTURE_ARRAY_SIZE_LOG2), row1 = _mm256_slli_epi32(y1, TEXTURE_ARRAY_SIZE_LOG2);
+
+    const int* base = (const int*)layer;
+    const __m256i t00 = _mm256_i32gather_epi32(base, _mm256_add_epi32(row0, x0), 4);
+    const __m256i t10 = _mm256_i32gather_epi32(base, _mm256_add_epi32(row0, x1), 4);
+    const __m256i t01 = _mm256_i32gather_epi32(base, _mm256_add_epi32(row1, x0), 4);
+    const __m256i t11 = _mm256_i32gather_epi32(base, _mm256_add_epi32(row1, x1), 4);
+
+    for (int c = 0; c < 3; ++c)
+    {
+        const __m256 c00 = UTexelChannelAvx2(t00, c), c10 = UTexelChannelAvx2(t10, c);
+        const __m256 c01 = UTexelChannelAvx2(t01, c), c11 = UTexelChannelAvx2(t11, c);
+        const __m256 top = _mm256_fmadd_ps(_mm256_sub_ps(c10, c00), wx, c00);
+        const __m256 bottom = _mm256_fmadd_ps(_mm256_sub_ps(c11, c01), wx, c01);
+        rgb[c] = _mm256_mul_ps(_mm256_fmadd_ps(_mm256_sub_ps(bottom, top), wy, top), _mm256_set1_ps(1.0f / 255.0f));
+    }
+}
+
+
+// UShadeSoftwarePixel for eight pixels of one triangle, returned as packed RGBA8
+static AVX2_TARGET __m256i UShadeSoftwareAvx2(const SoftwareTriangle& triangle, const SoftwareFrame& frame, const uint32_t* textures, const __m256 attributes[SOFTWARE_ATTRIBUTES])
+{
+    if (triangle.features & SOFTWARE_UNLIT)
+        return _mm256_set1_epi32(-1);
+
+    __m256 albedo[3] = { _mm256_set1_ps(frame.objectColor.r), _mm256_set1_ps(frame.objectColor.g), _mm256_set1_ps(frame.objectColor.b) };
+    if (triangle.features & SHADER_TEXTURED)
+        USampleSoftwareTextureAvx2(textures + (size_t)triangle.material * TEXTURE_ARRAY_SIZE * TEXTURE_ARRAY_SIZE,
+            _mm256_mul_ps(attributes[6], _mm256_set1_ps(frame.uvScale.x)), _mm256_mul_ps(attributes[7], _mm256_set1_ps(frame.uvScale.y)), albedo);
+
+    __m256 norm[3] = { attributes[3], attributes[4], attributes[5] };
+    UNormalizeAvx2(norm);
+    __m256 lightDirection[3];
+    for (int i = 0; i < 3; ++i)
+        lightDirection[i] = _mm256_sub_ps(_mm256_set1_ps(frame.lightPosition[i]), attributes[i]);
+    UNormalizeAvx2(lightDirection);
+    const __m256 normalDotLight = UDot3Avx2(norm, lightDirection);
+    __m256 lighting = _mm256_add_ps(_mm256_set1_ps(SOFTWARE_AMBIENT_STRENGTH), _mm256_max_ps(normalDotLight, _mm256_setzero_ps()));
+
+    if (triangle.features & SHADER_SPECULAR)
+    {
+        __m256 viewDirection[3], reflectDirection[3];
+        const __m256 twiceDot = _mm256_add_ps(normalDotLight, normalDotLight);
+        for (int i = 0; i < 3; ++i)
+        {
+            viewDirection[i] = _mm256_sub_ps(_mm256_set1_ps(frame.viewPosition[i]), attributes[i]);
+            reflectDirection[i] = _mm256_fmsub_ps(norm[i], twiceDot, lightDirection[i]);
+        }
+        UNormalizeAvx2(viewDirection);
+        const __m256 s = _mm256_max_ps(UDot3Avx2(viewDirection, reflectDirection), _mm256_setzero_ps());
+        const __m256 s2 = _mm256_mul_ps(s, s);
+        const __m256 s4 = _mm256_mul_ps(s2, s2);
+        lighting = _mm256_add_ps(lighting, _mm256_mul_ps(_mm256_mul_ps(s4, s4), s2));   // pow(s, 10)
+    }
+
+    __m256i pixel = _mm256_set1_epi32((int)0xFF000000u);
+    for (int c = 0; c < 3; ++c)
+    {
+        __m256 value = _mm256_mul_ps(_mm256_mul_ps(lighting, _mm256_set1_ps(frame.lightColor[c])), albedo[c]);
+        value = _mm256_min_ps(_mm256_max_ps(value, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+        const __m256i channel = _mm256_cvtps_epi32(_mm256_mul_ps(value, _mm256_set1_ps(255.0f)));
+        pixel = _mm256_or_si256(pixel, _mm256_slli_epi32(channel, 8 * c));
+    }
+    return pixel;
+}
+
+
+static inline AVX2_TARGET __m256 UInterpolateAvx2(const __m256 barycentrics[3], const float values[3])
+{
+    return _mm256_fmadd_ps(barycentrics[0], _mm256_set1_ps(values[0]),
+        _mm256_fmadd_ps(barycentrics[1], _mm256_set1_ps(values[1]), _mm256_mul_ps(barycentrics[2], _mm256_set1_ps(values[2]))));
+}
+
+
+// URasterizeSoftwareSpan eight pixels at a time; lanes past x1 are masked out of every load and store
+static AVX2_TARGET void URasterizeSoftwareSpanAvx2(const SoftwareTriangle& triangle, const SoftwareFrame& frame, const uint32_t* textures, const float rowEdges[3], int x0, int x1, float* depthRow, uint32_t* colorRow)
+{
+    const __m256 laneOffsets = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+    const __m256i laneIndices = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (int x = x0; x <= x1; x += 8)
+    {
+        const __m256 px = _mm256_add_ps(_mm256_set1_ps((float)x), laneOffsets);
+        const __m256i inRange = _mm256_cmpgt_epi32(_mm256_set1_epi32(x1 - x + 1), laneIndices);
+
+        __m256 barycentrics[3];
+        __m256 covered = _mm256_castsi256_ps(inRange);
+        for (int i = 0; i < 3; ++i)
+        {
+            const __m256 edge = _mm256_fmadd_ps(_mm256_set1_ps(triangle.edgeA[i]), px, _mm256_set1_ps(rowEdges[i]));
+            covered = _mm256_and_ps(covered, _mm256_cmp_ps(edge, _mm256_setzero_ps(), _CMP_GE_OQ));
+            barycentrics[i] = _mm256_mul_ps(edge, _mm256_set1_ps(triangle.inverseArea));
+        }
+        if (_mm256_movemask_ps(covered) == 0)
+            continue;
+
+        const __m256 z = UInterpolateAvx2(barycentrics, triangle.z);
+        const __m256i laneMask = _mm256_castps_si256(covered);
+        const __m256 storedDepth = _mm256_maskload_ps(depthRow + x, laneMask);
+        const __m256 passed = _mm256_and_ps(covered, _mm256_cmp_ps(z, storedDepth, _CMP_LT_OQ));
+        if (_mm256_movemask_ps(passed) == 0)
+            continue;
+        const __m256i passedMask = _mm256_castps_si256(passed);
+        _mm256_maskstore_ps(depthRow + x, passedMask, z);
+
+        const __m256 w = _mm256_div_ps(_mm256_set1_ps(1.0f), UInterpolateAvx2(barycentrics, triangle.inverseW));
+        __m256 attributes[SOFTWARE_ATTRIBUTES];
+        for (int attribute = 0; attribute < SOFTWARE_ATTRIBUTES; ++attribute)
+            attributes[attribute] = _mm256_mul_ps(UInterpolateAvx2(barycentrics, triangle.attributes[attribute]), w);
+
+        _mm256_maskstore_epi32((int*)(colorRow + x), passedMask, UShadeSoftwareAvx2(triangle, frame, textures, attributes));
+    }
+}
 #endif
 
-    // GLFW: window creation
-    // ---------------------
-    * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
-    if (*window == NULL)
+
+// Rasterizes and shades the triangles binned into one tile, in submission order, then copies the tile to the framebuffer
+void URasterizeSoftwareTile(SoftwareRenderer& renderer, size_t tile, const SoftwareFrame& frame)
+{
+    const int tileX = (int)(tile % renderer.tilesX) * SOFTWARE_TILE_SIZE;
+    const int tileY = (int)(tile / renderer.tilesX) * SOFTWARE_TILE_SIZE;
+    const int tileWidth = min(SOFTWARE_TILE_SIZE, renderer.width - tileX);
+    const int tileHeight = min(SOFTWARE_TILE_SIZE, renderer.height - tileY);
+    const uint32_t* textures = renderer.textures.data();
+
+    // Cleared like the GL frame: black, far depth
+    alignas(32) uint32_t color[SOFTWARE_TILE_SIZE * SOFTWARE_TILE_SIZE];
+    alignas(32) float depth[SOFTWARE_TILE_SIZE * SOFTWARE_TILE_SIZE];
+    fill(color, color + SOFTWARE_TILE_SIZE * SOFTWARE_TILE_SIZE, 0xFF000000u);
+    fill(depth, depth + SOFTWARE_TILE_SIZE * SOFTWARE_TILE_SIZE, 1.0f);
+
+    for (const SoftwareBin& bin : renderer.bins)
     {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
+        for (GLuint entry = bin.tileStarts[tile]; entry < bin.tileStarts[tile + 1]; ++entry)
+        {
+            const SoftwareTriangle& triangle = bin.triangles[bin.tileTriangles[entry]];
+            const int x0 = max(triangle.minX, tileX), x1 = min(triangle.maxX, tileX + tileWidth - 1);
+            const int y0 = max(triangle.minY, tileY), y1 = min(triangle.maxY, tileY + tileHeight - 1);
+
+            for (int y = y0; y <= y1; ++y)
+            {
+                const float py = y + 0.5f;
+                float rowEdges[3];
+                for (int i = 0; i < 3; ++i)
+                    rowEdges[i] = triangle.edgeB[i] * py + triangle.edgeC[i];
+                float* depthRow = depth + (y - tileY) * SOFTWARE_TILE_SIZE - tileX;
+                uint32_t* colorRow = color + (y - tileY) * SOFTWARE_TILE_SIZE - tileX;
+
+#if defined(USE_AVX2_KERNELS)
+                if (renderer.avx2)
+                {
+                    URasterizeSoftwareSpanAvx2(triangle, frame, textures, rowEdges, x0, x1, depthRow, colorRow);
+                    continue;
+                }
+#endif
+                URasterizeSoftwareSpan(triangle, frame, textures, rowEdges, x0, x1, depthRow, colorRow);
+            }
+        }
+    }
+
+    for (int row = 0; row < tileHeight; ++row)
+        memcpy(&renderer.color[(size_t)(tileY + row) * renderer.width + tileX], color + row * SOFTWARE_TILE_SIZE, sizeof(uint32_t) * tileWidth);
+}
+
+
+// Whether the AVX2 raster kernel can run on this CPU
+static bool UCpuSupportsAvx2()
+{
+#if defined(USE_AVX2_KERNELS) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#elif defined(USE_AVX2_KERNELS)
+    return true;    // Compiled for AVX2
+#else
+    return false;
+#endif
+}
+
+
+void UCreateSoftwareRenderer(int width, int height, SoftwareRenderer& renderer)
+{
+    renderer.width = width;
+    renderer.height = height;
+    renderer.tilesX = (width + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+    renderer.tilesY = (height + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+    renderer.color.assign((size_t)width * height, 0xFF000000u);
+    renderer.avx2 = UCpuSupportsAvx2();
+}
+
+
+/* One frame of the software renderer, from the same simulation pose, culling and LOD selection as URender:
+ * the visible objects are transformed, clipped, set up and binned into tiles by chunks of triangles in parallel,
+ * then every tile is rasterized and shaded by one worker. Bins are read in chunk order, so the result does not
+ * depend on the thread count.
+ */
+void URenderSoftware(SoftwareRenderer& renderer)
+{
+    ProfileScope renderScope("render");
+
+    const SimulationPose pose = UAcquirePose(numeric_limits<double>::max());
+    const glm::mat4 view = glm::lookAt(pose.cameraPosition, pose.cameraPosition + pose.cameraFront, pose.cameraUp);
+    const glm::mat4 projection = glm::perspective(glm::radians(pose.cameraZoom), (GLfloat)renderer.width / (GLfloat)renderer.height, NEAR_PLANE, FAR_PLANE);
+    const glm::mat4 viewProjection = projection * view;
+
+    if (gMoveObjects)
+        UAnimateSceneObjects(pose.objectSlide);
+
+    UProfileBegin("cull");
+    if (gBvhDirty)
+    {
+        URefitBvh(gSceneObjects, gBvhNodes, gBvhObjects);
+        gBvhDirty = false;
+    }
+    if (gFrustumCulling)
+    {
+        FrustumPlanes planes;
+        UExtractFrustumPlanes(viewProjection, planes);
+        UCullScene(planes, gVisibleObjects);
+    }
+    else
+        gVisibleObjects = gBvhObjects;
+    USelectLods(gMesh, pose.cameraPosition, pose.cameraZoom, renderer.height, gVisibleObjects, gSceneObjects);
+    UProfileEnd();
+
+    // Front to back, so the depth test rejects most hidden pixels before they are shaded; the lamp goes last as in the GL queue
+    UProfileBegin("setup");
+    vector<SoftwareDraw>& draws = renderer.draws;
+    draws.clear();
+    for (GLuint objectIndex : gVisibleObjects)
+    {
+        const SceneObject& object = gSceneObjects[objectIndex];
+        const GLSubmesh& submesh = gMesh.submeshes[object.submesh + object.lod];
+        const glm::vec3 toCenter = (object.boundsMin + object.boundsMax) * 0.5f - pose.cameraPosition;
+
+        SoftwareDraw draw;
+        draw.mesh = &renderer.mesh;
+        draw.firstIndex = submesh.firstIndex;
+        draw.triangleCount = submesh.indexCount / 3;
+        draw.model = object.model;
+        draw.normalMatrix = glm::transpose(glm::inverse(glm::mat3(object.model)));
+        draw.material = object.material;
+        draw.features = UObjectShaderFeatures(gMesh, object) & (SHADER_TEXTURED | SHADER_SPECULAR);
+        draw.depth = glm::dot(toCenter, toCenter);
+        draws.push_back(draw);
+    }
+    sort(draws.begin(), draws.end(), [](const SoftwareDraw& a, const SoftwareDraw& b) { return a.depth < b.depth; });
+
+    SoftwareDraw lamp;
+    lamp.mesh = &renderer.lamp;
+    lamp.firstIndex = renderer.lamp.submeshes[0].firstIndex;
+    lamp.triangleCount = renderer.lamp.submeshes[0].indexCount / 3;
+    lamp.model = glm::translate(pose.lightPosition) * glm::scale(gLightScale);
+    lamp.normalMatrix = glm::mat3(1.0f);
+    lamp.material = 0;
+    lamp.features = SOFTWARE_UNLIT;
+    lamp.depth = 0.0f;
+    draws.push_back(lamp);
+
+    // Chunks of SOFTWARE_SETUP_CHUNK triangles of the frame, each binned on its own; small draws share a chunk
+    GLuint frameTriangles = 0;
+    for (SoftwareDraw& draw : draws)
+    {
+        draw.frameTriangle = frameTriangles;
+        frameTriangles += draw.triangleCount;
+    }
+    const size_t chunkCount = (frameTriangles + SOFTWARE_SETUP_CHUNK - 1) / SOFTWARE_SETUP_CHUNK;
+
+    renderer.bins.resize(chunkCount);
+    URunParallel(chunkCount, [&](size_t chunk)
+    {
+        const GLuint first = (GLuint)chunk * SOFTWARE_SETUP_CHUNK;
+        USetupSoftwareTriangles(renderer, first, min(SOFTWARE_SETUP_CHUNK, frameTriangles - first), viewProjection, renderer.bins[chunk]);
+    });
+
+    renderer.triangles = 0;
+    for (size_t chunk = 0; chunk < chunkCount; ++chunk)
+        renderer.triangles += renderer.bins[chunk].triangles.size();
+    UProfileEnd();
+
+    UProfileBegin("raster");
+    SoftwareFrame frame;
+    frame.lightPosition = pose.lightPosition;
+    frame.lightColor = gLightColor;
+    frame.viewPosition = pose.cameraPosition;
+    frame.objectColor = gObjectColor;
+    frame.uvScale = gUVScale;
+    URunParallel((size_t)renderer.tilesX * renderer.tilesY, [&](size_t tile) { URasterizeSoftwareTile(renderer, tile, frame); });
+    UProfileEnd();
+}
+
+
+// Headless benchmark of the software renderer (--renderer software): the built-in scene without a GL context,
+// timed like URunBenchmark
+bool URunSoftwareRenderer()
+{
+    if (!gSceneFile.empty())
+    {
+        cout << "The software renderer draws the built-in scene only" << endl;
         return false;
     }
-    glfwMakeContextCurrent(*window);
-    glfwSetFramebufferSizeCallback(*window, UResizeWindow);
-    glfwSetCursorPosCallback(*window, UMousePositionCallback);
-    glfwSetScrollCallback(*window, UMouseScrollCallback);
-    glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+    if (gPointLightCount > 0)
+        cout << "INFO: The software renderer shades the lamp light only, --lights is ignored" << endl;
 
-    // tell GLFW to capture our mouse
-    glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    SoftwareRenderer& renderer = gSoftware;
+
+    // The same mesh and objects as the GL path; gMesh only carries the submeshes, for culling and LOD selection
+    UBuildDefaultMesh(renderer.mesh);
+    UProcessMesh(renderer.mesh);
+    gMesh.submeshes = renderer.mesh.submeshes;
+    UComputeSubmeshBounds(renderer.mesh.vertices.data(), renderer.mesh.indices.data(), GL_UNSIGNED_INT, gMesh.submeshes);
+    UBuildScene(gMesh, gDeskCount, gSceneObjects);
+    UBuildBvh(gSceneObjects, gBvhNodes, gBvhObjects);
+    cout << "INFO: Scene: " << gSceneObjects.size() << " objects, " << gBvhNodes.size() << " BVH nodes" << endl;
+
+    UAppendPrimitive(renderer.lamp, { "lamp", PRIMITIVE_SPHERE, glm::vec3(1.0f), 0.0f, glm::mat4(1.0f), 0 });
+    ULoadSoftwareTextures(renderer);
+    UCreateSoftwareRenderer(gWindowWidth, gWindowHeight, renderer);
+
+    UStartSimulation(false);
+
+    for (int i = 0; i < gBenchmarkWarmup; ++i)
+    {
+        USimulationStep();
+        UPublishSnapshot(USimulationNow());
+        URenderSoftware(renderer);
+    }
+    UProfileReset();
+
+    vector<double> frameTimes;
+    frameTimes.reserve(gBenchmarkFrames);
+    for (int i = 0; i < gBenchmarkFrames; ++i)
+    {
+        const auto start = chrono::steady_clock::now();
+        UProfileBegin("frame");
+
+        UProfileBegin("update");
+        USimulationStep();
+        UPublishSnapshot(USimulationNow());
+        UProfileEnd();
+
+        URenderSoftware(renderer);
+
+        UProfileEnd();
+        UProfileFrameEnd();
+        frameTimes.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    }
+    UStopSimulation();
+
+    if (!frameTimes.empty())
+    {
+        double total = 0.0;
+        for (double t : frameTimes)
+            total += t;
+        sort(frameTimes.begin(), frameTimes.end());
+        const double mean = total / frameTimes.size();
+        const size_t p99Index = (size_t)ceil(0.99 * frameTimes.size()) - 1;
+
+        const char* const kernel = renderer.avx2 ? "AVX2" : "scalar";
+        cout << "BENCHMARK: " << renderer.width << "x" << renderer.height << ", " << RENDERER_NAMES[gRenderer] << " renderer (" << kernel << "), "
+            << UWorkerThreadCount() << " threads, " << frameTimes.size() << " frames" << endl;
+        cout << "BENCHMARK: min " << frameTimes.front() << " ms, mean " << mean << " ms, p99 " << frameTimes[p99Index] << " ms" << endl;
+        cout << "BENCHMARK: " << 1000.0 / mean << " fps" << endl;
+        cout << "BENCHMARK: " << gSceneObjects.size() << " objects, " << gVisibleObjects.size() << " visible, "
+            << renderer.triangles << " triangles binned into " << renderer.tilesX * renderer.tilesY << " tiles of " << SOFTWARE_TILE_SIZE << "x" << SOFTWARE_TILE_SIZE << endl;
+        UPrintProfile();
+    }
+
+    if (!gFrameOutput.empty())
+    {
+        if (!UWriteImagePpm(gFrameOutput, renderer.width, renderer.height, renderer.color.data()))
+            return false;
+        cout << "Wrote " << gFrameOutput << endl;
+    }
+    return true;
+}
+
+
+// Bilinear resampling of an 8-bit image, used to bring every material texture to TEXTURE_ARRAY_SIZE
+void UResampleImage(const unsigned char* src, int srcWidth, int srcHeight, int channels, unsigned char* dst, int dstWidth, int dstHeight)
+{
+    const float scaleX = (float)srcWidth / dstWidth;
+    const float scaleY = (float)srcHeight / dstHeight;
+
+    for (int y = 0; y < dstHeight; ++y)
+    {
+        // Sample at pixel centers
+        const float sy = max(0.0f, (y + 0.5f) * scaleY - 0.5f);
+        const int y0 = min((int)sy, srcHeight - 1);
+        const int y1 = min(y0 + 1, srcHeight - 1);
+        const float fy = sy - y0;
+
+        for (int x = 0; x < dstWidth; ++x)
+        {
+            const float sx = max(0.0f, (x + 0.5f) * scaleX - 0.5f);
+            const int x0 = min((int)sx, srcWidth - 1);
+            const int x1 = min(x0 + 1, srcWidth - 1);
+            const float fx = sx - x0;
+
+            const unsigned char* p00 = src + ((size_t)y0 * srcWidth + x0) * channels;
+            const unsigned char* p01 = src + ((size_t)y0 * srcWidth + x1) * channels;
+            const unsigned char* p10 = src + ((size_t)y1 * srcWidth + x0) * channels;
+            const unsigned char* p11 = src + ((size_t)y1 * srcWidth + x1) * channels;
+            unsigned char* out = dst + ((size_t)y * dstWidth + x) * channels;
+
+            for (int c = 0; c < channels; ++c)
+            {
+                const float top = p00[c] + (p01[c] - p00[c]) * fx;
+                const float bottom = p10[c] + (p11[c] - p10[c]) * fx;
+                out[c] = (unsigned char)(top + (bottom - top) * fy + 0.5f);
+            }
+        }
+    }
+}
+
+
+/*Create the material texture array, layers are filled in by the texture loader*/
+void UCreateTextureArray(GLuint& textureId, GLsizei layers)
+{
+    gTextureLevels = 1;
+    while ((TEXTURE_ARRAY_SIZE >> gTextureLevels) > 0)
+        ++gTextureLevels;
+
+    glGenTextures(1, &textureId);
+    UStateEditTexture(GL_TEXTURE_2D_ARRAY, textureId);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, gTextureLevels, gCompressTextures ? COMPRESSED_TEXTURE_FORMAT : GL_RGBA8,
+        TEXTURE_ARRAY_SIZE, TEXTURE_ARRAY_SIZE, layers);
+
+    // set the texture wrapping parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    // set texture filtering parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
+
+// 64-bit FNV-1a hash, used as content key for the on-disk caches
+uint64_t UHashBytes(const void* data, size_t size, uint64_t hash)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+
+// Reads a whole file into memory
+bool UReadFile(const string& filename, vector<unsigned char>& bytes)
+{
+    ifstream in(filename, ios::binary | ios::ate);
+    if (!in)
+        return false;
+
+    bytes.resize((size_t)in.tellg());
+    in.seekg(0);
+    in.read((char*)bytes.data(), bytes.size());
+    return (bool)in;
+}
+
+
+// Bytes of one BC1 compressed mip level of a square texture
+size_t UCompressedLevelSize(GLsizei size, GLint level)
+{
+    const size_t blocks = (size_t)max(1, ((size >> level) + 3) / 4);
+    return blocks * blocks * 8;
+}
+
+
+// Bytes of a full BC1 compressed mip chain of one texture array layer
+size_t UCompressedLayerSize()
+{
+    size_t total = 0;
+    for (GLint level = 0; level < gTextureLevels; ++level)
+        total += UCompressedLevelSize(TEXTURE_ARRAY_SIZE, level);
+    return total;
+}
+
+
+// Bytes of a full RGBA8 mip chain of one texture array layer
+size_t UUncompressedLayerSize()
+{
+    size_t total = 0;
+    for (GLint level = 0; level < gTextureLevels; ++level)
+    {
+        const size_t size = (size_t)max(1, TEXTURE_ARRAY_SIZE >> level);
+        total += size * size * 4;
+    }
+    return total;
+}
+
+
+// Packs an 8-bit RGB color to 5:6:5
+static uint16_t UPackRgb565(const float* color)
+{
+    const int r = (int)glm::clamp(color[0] * 31.0f / 255.0f + 0.5f, 0.0f, 31.0f);
+    const int g = (int)glm::clamp(color[1] * 63.0f / 255.0f + 0.5f, 0.0f, 63.0f);
+    const int b = (int)glm::clamp(color[2] * 31.0f / 255.0f + 0.5f, 0.0f, 31.0f);
+    return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+
+static void UUnpackRgb565(uint16_t packed, float* color)
+{
+    color[0] = ((packed >> 11) & 31) * 255.0f / 31.0f;
+    color[1] = ((packed >> 5) & 63) * 255.0f / 63.0f;
+    color[2] = (packed & 31) * 255.0f / 31.0f;
+}
+
+
+// Encodes a 4x4 block of RGB texels as BC1. The endpoints are the extreme texels along
+// the block's principal color axis, which keeps gradients and edges reasonably intact.
+void UCompressBC1Block(const float texels[16][3], unsigned char* out)
+{
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    for (int i = 0; i < 16; ++i)
+        for (int c = 0; c < 3; ++c)
+            mean[c] += texels[i][c] / 16.0f;
+
+    float covariance[6] = { 0.0f };
+    for (int i = 0; i < 16; ++i)
+    {
+        const float r = texels[i][0] - mean[0], g = texels[i][1] - mean[1], b = texels[i][2] - mean[2];
+        covariance[0] += r * r; covariance[1] += r * g; covariance[2] += r * b;
+        covariance[3] += g * g; covariance[4] += g * b; covariance[5] += b * b;
+    }
+
+    // Power iteration for the principal axis
+    float axis[3] = { 1.0f, 1.0f, 1.0f };
+    for (int iteration = 0; iteration < 4; ++iteration)
+    {
+        const float x = covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2];
+        const float y = covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2];
+        const float z = covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2];
+        const float length = max(fabs(x), max(fabs(y), fabs(z)));
+        if (length == 0.0f)
+            break;
+        axis[0] = x / length; axis[1] = y / length; axis[2] = z / length;
+    }
+
+    int minIndex = 0, maxIndex = 0;
+    float minProjection = 1e30f, maxProjection = -1e30f;
+    for (int i = 0; i < 16; ++i)
+    {
+        const float projection = texels[i][0] * axis[0] + texels[i][1] * axis[1] + texels[i][2] * axis[2];
+        if (projection < minProjection) { minProjection = projection; minIndex = i; }
+        if (projection > maxProjection) { maxProjection = projection; maxIndex = i; }
+    }
+
+    uint16_t color0 = UPackRgb565(texels[maxIndex]);
+    uint16_t color1 = UPackRgb565(texels[minIndex]);
+    if (color0 < color1)
+        swap(color0, color1);   // color0 > color1 selects the opaque four color mode
+
+    float palette[4][3];
+    UUnpackRgb565(color0, palette[0]);
+    UUnpackRgb565(color1, palette[1]);
+    for (int c = 0; c < 3; ++c)
+    {
+        palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+        palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+    }
+
+    uint32_t indices = 0;
+    if (color0 != color1)
+    {
+        for (int i = 0; i < 16; ++i)
+        {
+            int best = 0;
+            float bestDistance = 1e30f;
+            for (int p = 0; p < 4; ++p)
+            {
+                const float dr = texels[i][0] - palette[p][0], dg = texels[i][1] - palette[p][1], db = texels[i][2] - palette[p][2];
+                const float distance = dr * dr + dg * dg + db * db;
+                if (distance < bestDistance) { bestDistance = distance; best = p; }
+            }
+            indices |= (uint32_t)best << (2 * i);
+        }
+    }
+
+    out[0] = (unsigned char)(color0 & 0xFF); out[1] = (unsigned char)(color0 >> 8);
+    out[2] = (unsigned char)(color1 & 0xFF); out[3] = (unsigned char)(color1 >> 8);
+    out[4] = (unsigned char)(indices & 0xFF); out[5] = (unsigned char)((indices >> 8) & 0xFF);
+    out[6] = (unsigned char)((indices >> 16) & 0xFF); out[7] = (unsigned char)(indices >> 24);
+}
+
+
+// Compresses a square RGBA image and all of its mip levels to BC1, level after level
+void UCompressTextureLayer(const unsigned char* image, unsigned char* out)
+{
+    vector<unsigned char> level(image, image + (size_t)TEXTURE_ARRAY_SIZE * TEXTURE_ARRAY_SIZE * 4);
+    vector<unsigned char> next;
+    int size = TEXTURE_ARRAY_SIZE;
+
+    for (GLint mip = 0; mip < gTextureLevels; ++mip)
+    {
+        const int blocks = max(1, (size + 3) / 4);
+        for (int by = 0; by < blocks; ++by)
+        {
+            for (int bx = 0; bx < blocks; ++bx)
+            {
+                // Levels smaller than a block repeat their edge texels
+                float texels[16][3];
+                for (int i = 0; i < 16; ++i)
+                {
+                    const int x = min(bx * 4 + i % 4, size - 1);
+                    const int y = min(by * 4 + i / 4, size - 1);
+                    const unsigned char* texel = &level[((size_t)y * size + x) * 4];
+                    texels[i][0] = texel[0]; texels[i][1] = texel[1]; texels[i][2] = texel[2];
+                }
+                UCompressBC1Block(texels, out);
+                out += 8;
+            }
+        }
+
+        if (size > 1)
+        {
+            next.resize((size_t)(size / 2) * (size / 2) * 4);
+            UDownsampleRgbaSrgb(level.data(), size, size, next.data());
+            level.swap(next);
+            size /= 2;
+        }
+    }
+}
+
+
+// Path of the cache entry for a source image with the given content hash
+string UTextureCachePath(uint64_t sourceHash)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.utex", (unsigned long long)sourceHash);
+    return string(TEXTURE_CACHE_DIR) + "/" + name;
+}
+
+
+// Reads a cached compressed mip chain straight into the job's pixel buffer
+bool UReadTextureCache(TextureLoadJob& job, uint64_t sourceHash)
+{
+    ifstream in(UTextureCachePath(sourceHash), ios::binary);
+    if (!in)
+        return false;
+
+    TextureCacheHeader header;
+    in.read((char*)&header, sizeof(header));
+    const bool valid = in
+        && memcmp(header.magic, TEXTURE_CACHE_MAGIC, sizeof(TEXTURE_CACHE_MAGIC)) == 0
+        && header.version == TEXTURE_CACHE_VERSION
+        && header.format == COMPRESSED_TEXTURE_FORMAT
+        && header.size == (uint32_t)TEXTURE_ARRAY_SIZE
+        && header.levels == (uint32_t)gTextureLevels
+        && header.sourceHash == sourceHash
+        && header.dataSize == UCompressedLayerSize();
+    if (!valid)
+        return false;
+
+    in.read((char*)job.pixels, header.dataSize);
+    return (bool)in;
+}
+
+
+// Stores a compressed mip chain; written to a temporary file first so readers never see partial entries
+void UWriteTextureCache(const vector<unsigned char>& data, uint64_t sourceHash)
+{
+    UMakeDirectory(TEXTURE_CACHE_DIR);
+
+    TextureCacheHeader header = {};
+    memcpy(header.magic, TEXTURE_CACHE_MAGIC, sizeof(TEXTURE_CACHE_MAGIC));
+    header.version = TEXTURE_CACHE_VERSION;
+    header.format = COMPRESSED_TEXTURE_FORMAT;
+    header.size = TEXTURE_ARRAY_SIZE;
+    header.levels = gTextureLevels;
+    header.sourceHash = sourceHash;
+    header.dataSize = data.size();
+
+    const string path = UTextureCachePath(sourceHash);
+    const string temporaryPath = UTemporaryPath(path);
+    {
+        ofstream out(temporaryPath, ios::binary);
+        out.write((const char*)&header, sizeof(header));
+        out.write((const char*)data.data(), data.size());
+        if (!out)
+        {
+            out.close();
+            remove(temporaryPath.c_str());
+            return;
+        }
+    }
+    remove(path.c_str());
+    rename(temporaryPath.c_str(), path.c_str());
+}
 
-    // GLEW: initialize
-    // ----------------
-    // Note: if using GLEW version 1.13 or earlier
-    glewExperimental = GL_TRUE;
-    GLenum GlewInitResult = glewInit();
 
-    if (GLEW_OK != GlewInitResult)
+// Turns a decoded image into a texture array layer: RGBA, bottom row first, TEXTURE_ARRAY_SIZE squared.
+// Frees the image.
+bool UPrepareTextureLayer(unsigned char* image, int width, int height, int channels, vector<unsigned char>& rgba)
+{
+    // Everything from here on works on RGBA, whatever the source layout was
+    rgba.resize((size_t)width * height * 4);
+    const bool converted = UConvertToRgba(image, channels, (size_t)width * height, rgba.data());
+    stbi_image_free(image);
+    if (!converted)
     {
-        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
+        ULOG_WARNING("Not implemented to handle image with %d channels", channels);
         return false;
     }
 
-    // Displays GPU OpenGL version
-    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
+    flipImageVertically(rgba.data(), width, height, 4);
 
+    if (width != TEXTURE_ARRAY_SIZE || height != TEXTURE_ARRAY_SIZE)
+    {
+        vector<unsigned char> resampled((size_t)TEXTURE_ARRAY_SIZE * TEXTURE_ARRAY_SIZE * 4);
+        UResampleImage(rgba.data(), width, height, 4, resampled.data(), TEXTURE_ARRAY_SIZE, TEXTURE_ARRAY_SIZE);
+        rgba.swap(resampled);
+    }
     return true;
 }
 
 
-// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
-void UProcessInput(GLFWwindow* window)
+/*Decode an image into the mapped pixel buffer of its job (runs on a texture loader thread)*/
+void UDecodeTextureJob(TextureLoadJob& job)
 {
-    static const float cameraSpeed = 2.5f;
+    int width, height, channels;
+    unsigned char* image = nullptr;
+    uint64_t sourceHash = 0;
 
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
+    if (gCompressTextures)
+    {
+        // Warm start: the cache is keyed by the source file's content
+        vector<unsigned char> source;
+        if (!UReadFile(job.filename, source))
+            return; // Error loading the image
+
+        sourceHash = UHashBytes(source.data(), source.size());
+        if (UReadTextureCache(job, sourceHash))
+        {
+            job.succeeded = true;
+            return;
+        }
 
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(BACKWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(LEFT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(RIGHT, gDeltaTime);
+        image = stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &channels, 0);
+    }
+    else
+        image = stbi_load(job.filename.c_str(), &width, &height, &channels, 0);
 
-    if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS && gTexWrapMode != GL_REPEAT)
-    {
-        glBindTexture(GL_TEXTURE_2D, gTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glBindTexture(GL_TEXTURE_2D, 0);
+    if (!image)
+        return; // Error loading the image
 
-        gTexWrapMode = GL_REPEAT;
+    vector<unsigned char> rgba;
+    if (!UPrepareTextureLayer(image, width, height, channels, rgba))
+        return;
 
-        cout << "Current Texture Wrapping Mode: REPEAT" << endl;
+    if (gCompressTextures)
+    {
+        // Cache miss: build the compressed mip chain once and keep it for the next launch
+        vector<unsigned char> compressed(UCompressedLayerSize());
+        UCompressTextureLayer(rgba.data(), compressed.data());
+        UWriteTextureCache(compressed, sourceHash);
+        memcpy(job.pixels, compressed.data(), compressed.size());
     }
-    else if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS && gTexWrapMode != GL_MIRRORED_REPEAT)
+    else
     {
-        glBindTexture(GL_TEXTURE_2D, gTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        // Build the mip chain here instead of with glGenerateMipmap on the GL thread.
+        // Levels are filtered from a CPU copy, the PBO memory is only ever written.
+        unsigned char* out = job.pixels;
+        vector<unsigned char> next;
+        int size = TEXTURE_ARRAY_SIZE;
+        for (GLint level = 0; level < gTextureLevels; ++level)
+        {
+            memcpy(out, rgba.data(), (size_t)size * size * 4);
+            out += (size_t)size * size * 4;
+
+            if (size > 1)
+            {
+                next.resize((size_t)(size / 2) * (size / 2) * 4);
+                UDownsampleRgbaSrgb(rgba.data(), size, size, next.data());
+                rgba.swap(next);
+                size /= 2;
+            }
+        }
+    }
+
+    job.succeeded = true;
+}
 
-        gTexWrapMode = GL_MIRRORED_REPEAT;
 
-        cout << "Current Texture Wrapping Mode: MIRRORED REPEAT" << endl;
+/*Start decoding the material textures on worker threads; layers show a placeholder until they are uploaded*/
+void UStartTextureLoads(const char* const* filenames, GLint count, GLuint textureId)
+{
+    TextureLoader& loader = gTextureLoader;
+    loader.start = chrono::steady_clock::now();
+    loader.nextJob = 0;
+    loader.uploaded = 0;
+    loader.jobs.resize(count);
+
+    // Neutral gray until the real image arrives
+    if (gCompressTextures)
+    {
+        // Compressed textures can't be cleared, upload gray BC1 blocks instead
+        const GLubyte grayBlock[] = { 0x10, 0x84, 0x10, 0x84, 0, 0, 0, 0 };
+        const size_t levelSize = UCompressedLevelSize(TEXTURE_ARRAY_SIZE, 0);
+        vector<GLubyte> placeholder(levelSize);
+        for (size_t offset = 0; offset < levelSize; offset += sizeof(grayBlock))
+            memcpy(&placeholder[offset], grayBlock, sizeof(grayBlock));
+
+        UStateEditTexture(GL_TEXTURE_2D_ARRAY, textureId);
+        for (GLint layer = 0; layer < count; ++layer)
+            glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, TEXTURE_ARRAY_SIZE, TEXTURE_ARRAY_SIZE, 1,
+                COMPRESSED_TEXTURE_FORMAT, (GLsizei)levelSize, placeholder.data());
     }
-    else if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_EDGE)
+    else
     {
-        glBindTexture(GL_TEXTURE_2D, gTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glBindTexture(GL_TEXTURE_2D, 0);
-
-        gTexWrapMode = GL_CLAMP_TO_EDGE;
+        const GLubyte placeholder[] = { 128, 128, 128, 255 };
+        glClearTexImage(textureId, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+    }
 
-        cout << "Current Texture Wrapping Mode: CLAMP TO EDGE" << endl;
+    // One pixel buffer per layer, mapped up front so workers can decode directly into it
+    const GLsizeiptr layerBytes = (GLsizeiptr)(gCompressTextures ? UCompressedLayerSize() : UUncompressedLayerSize());
+    for (GLint i = 0; i < count; ++i)
+    {
+        TextureLoadJob& job = loader.jobs[i];
+        job.filename = filenames[i];
+        job.layer = i;
+        job.succeeded = false;
+
+        glGenBuffers(1, &job.pbo);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, job.pbo);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, layerBytes, NULL, GL_STREAM_DRAW);
+        job.pixels = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, layerBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
     }
-    else if (glfwGetKey(window, GLFW_KEY_4) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_BORDER)
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    auto worker = [&loader]()
     {
-        float color[] = { 1.0f, 0.0f, 1.0f, 1.0f };
-        glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, color);
+        for (size_t i = loader.nextJob++; i < loader.jobs.size(); i = loader.nextJob++)
+        {
+            if (loader.jobs[i].pixels)
+                UDecodeTextureJob(loader.jobs[i]);
+
+            lock_guard<mutex> lock(loader.doneMutex);
+            loader.done.push_back(i);
+        }
+    };
 
-        glBindTexture(GL_TEXTURE_2D, gTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-        glBindTexture(GL_TEXTURE_2D, 0);
+    const unsigned int threadCount = max(1u, min(thread::hardware_concurrency(), (unsigned int)count));
+    for (unsigned int i = 0; i < threadCount; ++i)
+        loader.workers.emplace_back(worker);
+}
 
-        gTexWrapMode = GL_CLAMP_TO_BORDER;
 
-        cout << "Current Texture Wrapping Mode: CLAMP TO BORDER" << endl;
-    }
+/*Upload the layers decoded since the last call. Returns true once every texture has been handled.*/
+bool UPollTextureLoads(GLuint textureId)
+{
+    TextureLoader& loader = gTextureLoader;
+    if (loader.uploaded == loader.jobs.size())
+        return true;
 
-    if (glfwGetKey(window, GLFW_KEY_RIGHT_BRACKET) == GLFW_PRESS)
+    vector<size_t> done;
     {
-        gUVScale += 0.1f;
-        cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << endl;
+        lock_guard<mutex> lock(loader.doneMutex);
+        done.swap(loader.done);
     }
-    else if (glfwGetKey(window, GLFW_KEY_LEFT_BRACKET) == GLFW_PRESS)
+
+    UStateEditTexture(GL_TEXTURE_2D_ARRAY, textureId);
+    for (size_t i : done)
     {
-        gUVScale -= 0.1f;
-        cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << endl;
-    }
+        TextureLoadJob& job = loader.jobs[i];
 
-    // Pause and resume lamp orbiting
-    static bool isLKeyDown = false;
-    if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS && !gIsLampOrbiting)
-        gIsLampOrbiting = true;
-    else if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS && gIsLampOrbiting)
-        gIsLampOrbiting = false;
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, job.pbo);
+        const bool intact = job.pixels && glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+
+        if (job.succeeded && intact && gCompressTextures)
+        {
+            // Every mip level comes precomputed from the cache, no glGenerateMipmap needed
+            size_t offset = 0;
+            for (GLint level = 0; level < gTextureLevels; ++level)
+            {
+                const GLsizei size = max(1, TEXTURE_ARRAY_SIZE >> level);
+                const size_t levelSize = UCompressedLevelSize(TEXTURE_ARRAY_SIZE, level);
+                glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, job.layer, size, size, 1,
+                    COMPRESSED_TEXTURE_FORMAT, (GLsizei)levelSize, (const void*)offset);
+                offset += levelSize;
+            }
+        }
+        else if (job.succeeded && intact)
+        {
+            // Sourced from the bound PBO, the copies into the texture do not block the CPU.
+            // The mip levels were built by the loader thread.
+            size_t offset = 0;
+            for (GLint level = 0; level < gTextureLevels; ++level)
+            {
+                const GLsizei size = max(1, TEXTURE_ARRAY_SIZE >> level);
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, job.layer, size, size, 1, GL_RGBA, GL_UNSIGNED_BYTE, (const void*)offset);
+                offset += (size_t)size * size * 4;
+            }
+        }
+        else
+        {
+            // Shade the material with its flat color instead of the placeholder
+            ULOG_WARNING("Failed to load texture %s", job.filename.c_str());
+            gMaterialFeatures[job.layer] &= ~SHADER_TEXTURED;
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &job.pbo); // Deletion is deferred by the driver until the upload is done
+        job.pixels = nullptr;
+        ++loader.uploaded;
+    }
 
-    // Handle upward movement using Q key
-    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(UPWARD, gDeltaTime);
+    const bool complete = loader.uploaded == loader.jobs.size();
+    if (complete)
+    {
+        for (thread& worker : loader.workers)
+            worker.join();
+        loader.workers.clear();
 
-    // Handle downward movement using E key
-    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(DOWNWARD, gDeltaTime);
+        const double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - loader.start).count();
+        ULOG_INFO("Texture loading finished in %.1f ms", ms);
+    }
 
+    return complete;
 }
 
 
-// glfw: whenever the window size changed (by OS or user resize) this callback function executes
-void UResizeWindow(GLFWwindow* window, int width, int height)
+/*Wait for the texture loader to finish*/
+void UFinishTextureLoads(GLuint textureId)
 {
-    glViewport(0, 0, width, height);
+    while (!UPollTextureLoads(textureId))
+        this_thread::sleep_for(chrono::milliseconds(1));
 }
 
 
-// glfw: whenever the mouse moves, this callback is called
-// -------------------------------------------------------
-void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+void UDestroyTexture(GLuint textureId)
 {
-    if (gFirstMouse)
-    {
-        gLastX = xpos;
-        gLastY = ypos;
-        gFirstMouse = false;
-    }
+    glDeleteTextures(1, &textureId);
+}
 
-    float xoffset = xpos - gLastX;
-    float yoffset = gLastY - ypos; // reversed since y-coordinates go from bottom to top
 
-    gLastX = xpos;
-    gLastY = ypos;
+// Creates a directory if it does not exist yet
+void UMakeDirectory(const char* path)
+{
+#ifdef _WIN32
+    _mkdir(path);
+#else
+    mkdir(path, 0755);
+#endif
+}
 
-    gCamera.ProcessMouseMovement(xoffset, yoffset);
+
+bool UDirectoryExists(const char* path)
+{
+#ifdef _WIN32
+    const DWORD attributes = GetFileAttributesA(path);
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat info;
+    return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+#endif
 }
 
 
-// glfw: whenever the mouse scroll wheel scrolls, this callback is called
-// ----------------------------------------------------------------------
-void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
+// Where a cache file is written before being renamed into place. The process id keeps two instances sharing a cache
+// from writing the same file, the counter two threads of one instance.
+string UTemporaryPath(const string& path)
 {
-    gCamera.ProcessMouseScroll(yoffset);
+    static atomic<unsigned> sequence(0);
+#ifdef _WIN32
+    const unsigned long processId = GetCurrentProcessId();
+#else
+    const unsigned long processId = (unsigned long)getpid();
+#endif
+    return path + "." + to_string(processId) + "." + to_string(sequence++) + ".tmp";
 }
 
-// glfw: handle mouse button events
-// --------------------------------
-void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+
+// Program binaries are only valid for the driver that produced them, so its strings are part of the key
+uint64_t UShaderCacheKey(const char* vtxShaderSource, const char* fragShaderSource)
 {
-    switch (button)
-    {
-    case GLFW_MOUSE_BUTTON_LEFT:
-    {
-        if (action == GLFW_PRESS)
-            cout << "Left mouse button pressed" << endl;
-        else
-            cout << "Left mouse button released" << endl;
-    }
-    break;
+    const char* parts[] = {
+        vtxShaderSource,
+        fragShaderSource,
+        (const char*)glGetString(GL_VENDOR),
+        (const char*)glGetString(GL_RENDERER),
+        (const char*)glGetString(GL_VERSION),
+    };
 
-    case GLFW_MOUSE_BUTTON_MIDDLE:
+    uint64_t key = HASH_SEED;
+    for (const char* part : parts)
     {
-        if (action == GLFW_PRESS)
-            cout << "Middle mouse button pressed" << endl;
-        else
-            cout << "Middle mouse button released" << endl;
+        // The terminating zero separates the parts
+        if (part)
+            key = UHashBytes(part, strlen(part) + 1, key);
     }
-    break;
+    return key;
+}
 
-    case GLFW_MOUSE_BUTTON_RIGHT:
-    {
-        if (action == GLFW_PRESS)
-            cout << "Right mouse button pressed" << endl;
-        else
-            cout << "Right mouse button released" << endl;
-    }
-    break;
 
-    default:
-        cout << "Unhandled mouse button event" << endl;
-        break;
-    }
+string UShaderCachePath(uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.ubin", (unsigned long long)key);
+    return string(SHADER_CACHE_DIR) + "/" + name;
 }
 
 
-// Functioned called to render a frame
-void URender()
+// Loads a cached program binary; false when there is none or the driver rejects it
+bool ULoadProgramBinary(GLuint programId, uint64_t key)
 {
-    // Lamp orbits around the origin
-    const float angularVelocity = glm::radians(45.0f);
-    if (gIsLampOrbiting)
+    vector<unsigned char> bytes;
+    if (!UReadFile(UShaderCachePath(key), bytes) || bytes.size() < sizeof(ShaderCacheHeader))
+        return false;
+
+    ShaderCacheHeader header;
+    memcpy(&header, bytes.data(), sizeof(header));
+    const bool valid = memcmp(header.magic, SHADER_CACHE_MAGIC, sizeof(SHADER_CACHE_MAGIC)) == 0
+        && header.version == SHADER_CACHE_VERSION
+        && header.key == key
+        && header.binarySize == bytes.size() - sizeof(header);
+    if (!valid)
+        return false;
+
+    glProgramBinary(programId, header.binaryFormat, bytes.data() + sizeof(header), header.binarySize);
+
+    GLint success = 0;
+    glGetProgramiv(programId, GL_LINK_STATUS, &success);
+    return success != 0;
+}
+
+
+// Stores the binary of a freshly linked program; written to a temporary file first so readers never see partial entries
+void USaveProgramBinary(GLuint programId, uint64_t key)
+{
+    GLint length = 0;
+    glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return; // The driver does not support any binary format
+
+    ShaderCacheHeader header = {};
+    vector<unsigned char> binary(length);
+    GLsizei written = 0;
+    glGetProgramBinary(programId, length, &written, &header.binaryFormat, binary.data());
+    if (written <= 0)
+        return;
+
+    UMakeDirectory(SHADER_CACHE_DIR);
+
+    memcpy(header.magic, SHADER_CACHE_MAGIC, sizeof(SHADER_CACHE_MAGIC));
+    header.version = SHADER_CACHE_VERSION;
+    header.binarySize = written;
+    header.key = key;
+
+    const string path = UShaderCachePath(key);
+    const string temporaryPath = UTemporaryPath(path);
     {
-        glm::vec4 newPosition = glm::rotate(angularVelocity * gDeltaTime, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(gLightPosition, 3.0f);
-        gLightPosition.x = newPosition.x;
-        gLightPosition.y = newPosition.y;
-        gLightPosition.z = newPosition.z;
+        ofstream out(temporaryPath, ios::binary);
+        out.write((const char*)&header, sizeof(header));
+        out.write((const char*)binary.data(), written);
+        if (!out)
+        {
+            out.close();
+            remove(temporaryPath.c_str());
+            return;
+        }
     }
+    remove(path.c_str());
+    rename(temporaryPath.c_str(), path.c_str());
+}
 
-    // Enable z-depth
-    glEnable(GL_DEPTH_TEST);
 
-    // Clear the frame and z buffers
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+/* Starts building a shader program. Either loads the cached binary or issues the compile and link
+ * without asking for their status, so several programs can be compiled by the driver at the same time.
+ */
+void UBeginShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLShaderBuild& build)
+{
+    build = GLShaderBuild();
 
-    // Activate the cube VAO (used by cube and lamp)
-    glBindVertexArray(gMesh.vao);
+    // Create a Shader program object.
+    build.programId = glCreateProgram();
+    build.cacheKey = UShaderCacheKey(vtxShaderSource, fragShaderSource);
 
-    // CUBE: draw cube
-    //----------------
-    // Set the shader to be used
-    glUseProgram(gCubeProgramId);
+    if (gUseShaderCache && ULoadProgramBinary(build.programId, build.cacheKey))
+        return;
 
-    // Model matrix: transformations are applied right-to-left order
-    glm::mat4 model = glm::translate(gCubePosition) * glm::scale(gCubeScale);
+    // Create the vertex and fragment shader objects
+    build.vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
+    build.fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
 
-    // camera/view transformation
-    glm::mat4 view = gCamera.GetViewMatrix();
+    // Retrive the shader source
+    glShaderSource(build.vertexShaderId, 1, &vtxShaderSource, NULL);
+    glShaderSource(build.fragmentShaderId, 1, &fragShaderSource, NULL);
 
-    // Creates a perspective projection
-    glm::mat4 projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
-
-    // Retrieves and passes transform matrices to the Shader program
-    GLint modelLoc = glGetUniformLocation(gCubeProgramId, "model");
-    GLint viewLoc = glGetUniformLocation(gCubeProgramId, "view");
-    GLint projLoc = glGetUniformLocation(gCubeProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Cube Shader program for the cub color, light color, light position, and camera position
-    GLint objectColorLoc = glGetUniformLocation(gCubeProgramId, "objectColor");
-    GLint lightColorLoc = glGetUniformLocation(gCubeProgramId, "lightColor");
-    GLint lightPositionLoc = glGetUniformLocation(gCubeProgramId, "lightPos");
-    GLint viewPositionLoc = glGetUniformLocation(gCubeProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Cube Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    GLint UVScaleLoc = glGetUniformLocation(gCubeProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gMesh.vao);
-
-    // bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdDesk);
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdMonitor);
-    glActiveTexture(GL_TEXTURE3);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdStand);
-    glActiveTexture(GL_TEXTURE4);
-    glBindTexture(GL_TEXTURE_2D, gTextureIdKeyboard);
-
-    // Draws the triangle
-    glDrawElements(GL_TRIANGLES, gMesh.nIndices, GL_UNSIGNED_SHORT, NULL); // Draws the triangle
-
-    // Deactivate the Vertex Array Object
-    glBindVertexArray(0);
+    glCompileShader(build.vertexShaderId);
+    glCompileShader(build.fragmentShaderId);
 
-    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-    glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
+    // Attached compiled shaders to the shader program
+    glAttachShader(build.programId, build.vertexShaderId);
+    glAttachShader(build.programId, build.fragmentShaderId);
+
+    // Ask the driver to keep the binary around for the cache
+    glProgramParameteri(build.programId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
+    glLinkProgram(build.programId);   // links the shader program
 }
 
 
-// Implements the UCreateMesh function
-void UCreateMesh(GLMesh& mesh)
-{
-    // Calculate normals for the cube vertices
-    glm::vec3 cubeFrontNormal = glm::cross(glm::vec3(0.5f, 0.2f, -0.3f) - glm::vec3(-0.5f, -0.2f, -0.3f), glm::vec3(-0.5f, 0.2f, -0.3f) - glm::vec3(-0.5f, -0.2f, -0.3f));
-    glm::vec3 cubeBackNormal = glm::cross(glm::vec3(-0.5f, -0.2f, 0.3f) - glm::vec3(0.5f, 0.2f, 0.3f), glm::vec3(0.5f, -0.2f, 0.3f) - glm::vec3(0.5f, 0.2f, 0.3f));
-
-    // Calculate normals for the cylinder vertices
-    glm::vec3 cylinderTopNormal = glm::cross(glm::vec3(0.1f, 0.15f, 0.1f) - glm::vec3(0.3f, 0.25f, 0.0f), glm::vec3(0.5f, 0.15f, 0.1f) - glm::vec3(0.3f, 0.25f, 0.0f));
-    glm::vec3 cylinderBottomNormal = glm::cross(glm::vec3(0.3f, 0.25f, 0.0f) - glm::vec3(0.1f, 0.15f, 0.1f), glm::vec3(0.5f, 0.15f, 0.1f) - glm::vec3(0.1f, 0.15f, 0.1f));
-
-    // Calculate normals for the plane vertices
-    glm::vec3 planeNormal = glm::cross(glm::vec3(1.5f, -0.25f, -1.3f) - glm::vec3(-1.5f, -0.25f, -1.3f), glm::vec3(-1.5f, -0.25f, 1.3f) - glm::vec3(-1.5f, -0.25f, -1.3f));
-
-    // Normalize the normals
-    cubeFrontNormal = glm::normalize(cubeFrontNormal);
-    cubeBackNormal = glm::normalize(cubeBackNormal);
-    cylinderTopNormal = glm::normalize(cylinderTopNormal);
-    cylinderBottomNormal = glm::normalize(cylinderBottomNormal);
-    planeNormal = glm::normalize(planeNormal);
-
-    GLfloat verts[] = {
-        // Cube vertices (Mouse Body)
-        -0.5f, -0.2f, -0.3f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 0.0f, 2.0f, // Vertex 0
-        0.5f, -0.2f, -0.3f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 0.0f, 2.0f, // Vertex 1
-        0.5f, 0.2f, -0.3f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 1.0f, 2.0f, // Vertex 2
-        -0.5f, 0.2f, -0.3f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 1.0f, 2.0f, // Vertex 3
-
-        -0.5f, -0.2f, 0.3f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 0.0f, 2.0f, // Vertex 4
-        0.5f, -0.2f, 0.3f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 0.0f, 2.0f, // Vertex 5
-        0.5f, 0.2f, 0.3f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 1.0f, 2.0f, // Vertex 6
-        -0.5f, 0.2f, 0.3f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 1.0f, 2.0f, // Vertex 7
-
-        // Cylinder vertices (Scroll Wheel)
-        0.3f, 0.25f, 0.0f, planeNormal.x, planeNormal.y, planeNormal.z, 0.5f, 1.0f, 2.0f, // Vertex 8 (Top)
-        0.1f, 0.15f, 0.1f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 0.0f, 2.0f, // Vertex 9 (Bottom Left)
-        0.5f, 0.15f, 0.1f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 0.0f, 2.0f, // Vertex 10 (Bottom Right)
-
-        // Cube vertices (Left Button)
-        0.05f, 0.15f, 0.35f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 0.0f, 2.0f, // Vertex 11
-        -0.15f, 0.15f, 0.35f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 0.0f, 2.0f, // Vertex 12
-        -0.15f, 0.0f, 0.35f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 1.0f, 2.0f, // Vertex 13
-        0.05f, 0.0f, 0.35f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 1.0f, 2.0f, // Vertex 14
-
-        // Cube vertices (Right Button)
-        0.1f, 0.15f, 0.35f,planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 0.0f, 2.0f, // Vertex 15
-        0.3f, 0.15f, 0.35f,planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 0.0f, 2.0f, // Vertex 16
-        0.3f, 0.0f, 0.35f, planeNormal.x, planeNormal.y, planeNormal.z,  1.0f, 1.0f, 2.0f, // Vertex 17
-        0.1f, 0.0f, 0.35f, planeNormal.x, planeNormal.y, planeNormal.z,  0.0f, 1.0f, 2.0f, // Vertex 18
-
-        //Plane
-        -3.5f, -0.25f, -3.3f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, -0.01f, 0.0f, // Vertex 19
-        3.5f, -0.25f, -3.3f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, -0.01f, 0.0f, // Vertex 20
-        -3.5f, -0.25f, 3.3f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, -1.0f, 0.0f, // Vertex 21
-        3.5f, -0.25f, 3.3f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, -1.0f, 0.0f, // Vertex 22
-
-        //Monitor
-        -2.5f, 0.3f, -1.5f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 0.0f, 0.1f, // Vertex 23
-        2.5f, 0.3f, -1.5f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 1.0f, 0.1f, // Vertex 24
-        2.5f, 2.6f, -1.5f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 0.0f, 0.1f, // Vertex 25
-        -2.5f, 2.6f, -1.5f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 1.0f, 0.1f, // Vertex 26
-
-        -2.5f, 0.3f, -1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 0.0, 0.1f, // Vertex 27
-        2.5f, 0.3f, -1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 1.0f, 0.1f, // Vertex 28
-        2.5f, 2.6f, -1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 0.0f, 0.1f, // Vertex 29
-        -2.5f, 2.6f, -1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 1.0f, 0.1f, // Vertex 30
-
-        //Stand
-        -0.5f, -0.3f, -1.5f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, -2.5f, 0.2f, // Vertex 31
-        0.5f, -0.3f, -1.5f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, -2.5f, 0.2f, // Vertex 32
-        0.5f, 0.3f, -1.5f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, -2.5f, 0.2f, // Vertex 33
-        -0.5f, 0.3f, -1.5f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, -2.5f, 0.2f, // Vertex 34
-
-        -0.5f, -0.3f, -1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, -2.5f, 0.2f, // Vertex 35
-        0.5f, -0.3f, -1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, -2.5f, 0.2f, // Vertex 36
-        0.5f, 0.3f, -1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, -2.5f, 0.2f, // Vertex 37
-        -0.5f, 0.3f, -1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, -2.5f, 0.2f, // Vertex 38
-
-        //Keyboard
-        -1.0f, -0.3f, 2.0f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 0.0f, 0.3f, // Vertex 39
-        1.0f, -0.3f, 2.0f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 1.0f, 0.3f, // Vertex 40
-        1.0f, 0.0f, 2.0f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 0.0f, 0.3f, // Vertex 41
-        -1.0f, 0.0f, 2.0f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 0.0f, 0.3f, // Vertex 42
-
-        -1.0f, -0.3f, 1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 0.0f, 0.3f, // Vertex 43
-        1.0f, -0.3f, 1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 0.0f, 0.3f, // Vertex 44
-        1.0f, 0.0f, 1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 1.0f, 0.3f, // Vertex 45
-        -1.0f, 0.0f, 1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 0.0f, 0.3f, // Vertex 46
-
-        // Lightbar
-        -1.8f, 2.5f, -1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, -2.5f, 0.2f, // Vertex 47
-        1.8f, 2.5f, -1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 3.5f, 0.2f, // Vertex 48
-        1.8f, 2.7f, -1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 3.5f, 0.2f, // Vertex 49
-        -1.8f, 2.7f, -1.0f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 3.5f, 0.2f, // Vertex 50
-
-        -1.8f, 2.5f, -0.8f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 3.5f, 0.2f, // Vertex 51
-        1.8f, 2.5f, -0.8f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 3.5f, 0.2f, // Vertex 52
-        1.8f, 2.7f, -0.8f, planeNormal.x, planeNormal.y, planeNormal.z, 1.0f, 3.5f, 0.2f, // Vertex 53
-        -1.8f, 2.7f, -0.8f, planeNormal.x, planeNormal.y, planeNormal.z, 0.0f, 3.5f, 0.2f, // Vertex 54
-    };
-
-
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
-    const GLuint floatsPerTextureType = 1;
-
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV + floatsPerTextureType));
+// Waits for a program started by UBeginShaderProgram, reports errors and caches the binary
+bool UFinishShaderProgram(GLShaderBuild& build, GLuint& programId, GLProgramUniforms& uniforms)
+{
+    // Compilation and linkage error reporting
+    int success = 0;
+    char infoLog[512];
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+    programId = build.programId;
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
-
-    // Data for the indices
-    // Index data to share position data
-    GLushort indices[] = {
-        // Mouse Body (Cube) indices
-        0, 1, 2,  // Front Face
-        0, 2, 3,  // Front Face
-        4, 5, 6,  // Back Face
-        4, 6, 7,  // Back Face
-        0, 4, 5,  // Left Face
-        0, 5, 1,  // Left Face
-        3, 7, 6,  // Right Face
-        3, 6, 2,  // Right Face
-        0, 3, 7,  // Top Face
-        0, 7, 4,  // Top Face
-        1, 2, 6,  // Bottom Face
-        1, 6, 5,  // Bottom Face
-
-        // Scroll Wheel (Cylinder) indices
-        8, 9, 10, // Scroll Wheel Body
-
-        // Left Button (Cube) indices
-        11, 12, 13,  // Front Face
-        11, 13, 14,  // Front Face
-
-        // Right Button (Cube) indices
-        15, 16, 17,  // Front Face
-        15, 17, 18,  // Front Face
-
-        //Plane
-        19,20,21,
-        20,21,22,
-
-        //monitor
-        23, 24, 25, // Front Face
-        23, 25, 26, // Front Face
-        27, 28, 29, // Back Face
-        27, 29, 30, // Back Face
-        23, 27, 28, // Left Face
-        23, 28, 24, // Left Face
-        26, 30, 29, // Right Face
-        26, 29, 25, // Right Face
-        23, 26, 30, // Top Face
-        23, 30, 27, // Top Face
-        24, 25, 29, // Bottom Face
-        24, 29, 28, // Bottom Face
-
-        //stand
-        31, 32, 33,  // Front Face
-        31, 33, 34,  // Front Face
-        35, 36, 37,  // Back Face
-        35, 37, 38,  // Back Face
-        31, 35, 36,  // Left Face
-        31, 36, 32,  // Left Face
-        34, 38, 37,  // Right Face
-        34, 37, 33,  // Right Face
-        31, 34, 38,  // Top Face
-        31, 38, 35,  // Top Face
-        32, 33, 37,  // Bottom Face
-        32, 37, 36,  // Bottom Face
-
-        //Keyboard
-        39, 40, 41,  // Front Face
-        39, 41, 42,  // Front Face
-        43, 44, 45,  // Back Face
-        43, 45, 46,  // Back Face
-        39, 43, 44,  // Left Face
-        39, 44, 40,  // Left Face
-        42, 46, 45,  // Right Face
-        42, 45, 41,  // Right Face
-        39, 42, 46,  // Top Face
-        39, 46, 43,  // Top Face
-        40, 41, 45,  // Bottom Face
-        40, 45, 44,   // Bottom Face
-
-        // Lightbar
-        47, 48, 49, // Front Face
-        47, 49, 50, // Front Face
-        51, 52, 53, // Back Face
-        51, 53, 54, // Back Face
-        47, 51, 52, // Left Face
-        47, 52, 48, // Left Face
-        50, 54, 53, // Right Face
-        50, 53, 49, // Right Face
-        47, 50, 54, // Top Face
-        47, 54, 51, // Top Face
-        48, 49, 53, // Bottom Face
-        48, 53, 52 // Bottom Face
-    };
-
-    mesh.nIndices = sizeof(indices) / sizeof(indices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+    if (build.vertexShaderId != 0)
+    {
+        // First status query, this is where we wait for the driver
+        glGetProgramiv(programId, GL_LINK_STATUS, &success);
+        const bool linked = success != 0;
+        if (!linked)
+        {
+            // Find out which step failed
+            glGetShaderiv(build.vertexShaderId, GL_COMPILE_STATUS, &success);
+            if (!success)
+            {
+                glGetShaderInfoLog(build.vertexShaderId, sizeof(infoLog), NULL, infoLog);
+                std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+            }
+            glGetShaderiv(build.fragmentShaderId, GL_COMPILE_STATUS, &success);
+            if (!success)
+            {
+                glGetShaderInfoLog(build.fragmentShaderId, sizeof(infoLog), NULL, infoLog);
+                std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+            }
+            glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
+            std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        }
 
-    // Strides between vertex coordinates
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV + floatsPerTextureType);
+        // The linked program keeps its own copy of the code
+        glDetachShader(programId, build.vertexShaderId);
+        glDetachShader(programId, build.fragmentShaderId);
+        glDeleteShader(build.vertexShaderId);
+        glDeleteShader(build.fragmentShaderId);
+        build.vertexShaderId = build.fragmentShaderId = 0;
+
+        if (!linked)
+            return false;
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+        if (gUseShaderCache)
+            USaveProgramBinary(programId, build.cacheKey);
+    }
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerNormal));
-    glEnableVertexAttribArray(1);
+    glUseProgram(programId);    // Uses the shader program
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    // Resolve uniform locations once; unused uniforms come back as -1 and are ignored by glUniform*
+    uniforms.modelViewProjection = glGetUniformLocation(programId, "modelViewProjection");
+    uniforms.objectColor = glGetUniformLocation(programId, "objectColor");
+    uniforms.uvScale = glGetUniformLocation(programId, "uvScale");
+    uniforms.positionScale = glGetUniformLocation(programId, "positionScale");
+    uniforms.positionOffset = glGetUniformLocation(programId, "positionOffset");
+    uniforms.inverseViewProjection = glGetUniformLocation(programId, "inverseViewProjection");
+    uniforms.firstDraw = glGetUniformLocation(programId, "firstDraw");
 
-    glVertexAttribPointer(3, floatsPerTextureType, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV)));
-    glEnableVertexAttribArray(3);
+    return true;
 }
 
 
-void UDestroyMesh(GLMesh& mesh)
+void UDestroyShaderProgram(GLuint programId)
 {
-    glDeleteVertexArrays(1, &mesh.vao);
-    glDeleteBuffers(1, &mesh.vbo);
+    glDeleteProgram(programId);
 }
 
 
-/*Generate and load the texture*/
-bool UCreateTexture(const char* filename, GLuint& textureId)
+// Sources of a shader variant: the version, a #define per feature set to 0 or 1, then the bodies the features select
+void UBuildShaderSources(GLuint features, string& vertexSource, string& fragmentSource)
 {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
+    const struct { GLuint feature; const char* name; } defines[] = {
+        { SHADER_TEXTURED, "TEXTURED" },
+        { SHADER_SPECULAR, "SPECULAR" },
+        { SHADER_NORMAL_MATRIX, "NORMAL_MATRIX" },
+        { SHADER_POINT_LIGHTS, "POINT_LIGHTS" },
+        { SHADER_LIGHTMAP, "LIGHTMAP" },
+    };
+
+    string header = shaderVersionHeader;
+    for (const auto& define : defines)
+        header += string("#define ") + define.name + ((features & define.feature) ? " 1\n" : " 0\n");
+
+    if (features & SHADER_DEFERRED_LIGHTING)
     {
-        flipImageVertically(image, width, height, channels);
+        vertexSource = fullscreenVertexShaderSource;
+        fragmentSource = header + lightingShaderBody + deferredFragmentShaderBody;
+        return;
+    }
+
+    vertexSource = header + (gUseDrawParameters ? cubeVertexHeaderDrawId : cubeVertexHeaderAttribute) + cubeVertexShaderBody;
+    if (features & SHADER_GBUFFER)
+        fragmentSource = header + gBufferFragmentShaderBody;
+    else
+        fragmentSource = header + lightingShaderBody + cubeFragmentShaderBody;
+}
 
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
 
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+// Builds the variants not built yet; all of them are started before waiting on any, so the driver can compile them in parallel
+bool UBuildShaderVariants(const vector<GLuint>& featureSets)
+{
+    vector<GLuint> pending;
+    vector<GLShaderBuild> builds;
+    for (GLuint features : featureSets)
+    {
+        if (gShaderVariants.count(features) || find(pending.begin(), pending.end(), features) != pending.end())
+            continue;
+
+        string vertexSource, fragmentSource;
+        UBuildShaderSources(features, vertexSource, fragmentSource);
+        builds.emplace_back();
+        UBeginShaderProgram(vertexSource.c_str(), fragmentSource.c_str(), builds.back());
+        pending.push_back(features);
+    }
 
-        if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+    bool succeeded = true;
+    for (size_t i = 0; i < pending.size(); ++i)
+    {
+        // A failed variant is kept with program 0, so it is reported once instead of rebuilt every frame
+        ShaderVariant variant = {};
+        if (UFinishShaderProgram(builds[i], variant.programId, variant.uniforms))
+        {
+            // Texture units never change, the samplers are set once (UFinishShaderProgram leaves the program in use)
+            glUniform1i(glGetUniformLocation(variant.programId, "uTextures"), 0);
+            glUniform1i(glGetUniformLocation(variant.programId, "gAlbedo"), GBUFFER_ALBEDO_UNIT);
+            glUniform1i(glGetUniformLocation(variant.programId, "gNormal"), GBUFFER_NORMAL_UNIT);
+            glUniform1i(glGetUniformLocation(variant.programId, "gDepth"), GBUFFER_DEPTH_UNIT);
+            glUniform1i(glGetUniformLocation(variant.programId, "uLightmap"), LIGHTMAP_UNIT);
+        }
         else
         {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
+            cout << "ERROR: Shader variant 0x" << hex << pending[i] << dec << " failed to build" << endl;
+            UDestroyShaderProgram(variant.programId);
+            variant.programId = 0;
+            succeeded = false;
         }
+        gShaderVariants[pending[i]] = variant;
+    }
 
-        glGenerateMipmap(GL_TEXTURE_2D);
+    // UFinishShaderProgram switched programs behind the state cache
+    gStateCache.program = STATE_UNKNOWN;
 
-        stbi_image_free(image);
-        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
+    return succeeded;
+}
 
-        return true;
+
+// The variant with the given features, built on first use; null when it does not build
+const ShaderVariant* UShaderVariant(GLuint features)
+{
+    auto found = gShaderVariants.find(features);
+    if (found == gShaderVariants.end())
+    {
+        ULOG_INFO("Building shader variant 0x%x on first use", features);
+        UBuildShaderVariants({ features });
+        found = gShaderVariants.find(features);
     }
 
-    // Error loading the image
-    return false;
+    return found->second.programId != 0 ? &found->second : nullptr;
 }
 
 
-void UDestroyTexture(GLuint textureId)
+void UDestroyShaderVariants()
 {
-    glGenTextures(1, &textureId);
+    for (const auto& variant : gShaderVariants)
+        UDestroyShaderProgram(variant.second.programId);
+    gShaderVariants.clear();
 }
 
 
-// Implements the UCreateShaders function
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+// Creates the stream buffer with STREAM_REGIONS regions of regionSize bytes and maps it for good
+bool UCreateStreamBuffer(GLsizeiptr regionSize, GLStreamBuffer& stream)
 {
-    // Compilation and linkage error reporting
-    int success = 0;
-    char infoLog[512];
-
-    // Create a Shader program object.
-    programId = glCreateProgram();
+    GLint uniformAlignment = 0, storageAlignment = 0;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &storageAlignment);
+    stream.alignment = max<GLsizeiptr>(max(uniformAlignment, storageAlignment), 16);
+    stream.regionSize = (regionSize + stream.alignment - 1) / stream.alignment * stream.alignment;
+
+    // Immutable storage can stay mapped while the GPU reads it; coherent writes need no explicit flush
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &stream.buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, stream.buffer);
+    glBufferStorage(GL_COPY_WRITE_BUFFER, stream.regionSize * STREAM_REGIONS, NULL, flags);
+    stream.mapped = (GLubyte*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, stream.regionSize * STREAM_REGIONS, flags);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    if (!stream.mapped)
+    {
+        cout << "ERROR: Failed to map the stream buffer persistently" << endl;
+        glDeleteBuffers(1, &stream.buffer);
+        stream.buffer = 0;
+        return false;
+    }
 
-    // Create the vertex and fragment shader objects
-    GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
-    GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
+    for (GLsync& fence : stream.fences)
+        fence = 0;
+    stream.region = 0;
+    stream.used = 0;
+    return true;
+}
 
-    // Retrive the shader source
-    glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
-    glShaderSource(fragmentShaderId, 1, &fragShaderSource, NULL);
 
-    // Compile the vertex shader, and print compilation errors (if any)
-    glCompileShader(vertexShaderId); // compile the vertex shader
-    // check for shader compile errors
-    glGetShaderiv(vertexShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
+/* Moves on to the next region and waits until the GPU is done with what was written to it STREAM_REGIONS frames ago.
+ * bytes is all the frame will allocate, the sum of the UStreamSpan of every allocation.
+ */
+void UBeginStreamFrame(GLStreamBuffer& stream, GLsizeiptr bytes)
+{
+    if (bytes > stream.regionSize)
     {
-        glGetShaderInfoLog(vertexShaderId, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
-
-        return false;
+        // Grow by doubling; the old buffer may still be read, so wait for the GPU once before replacing it
+        GLsizeiptr regionSize = stream.regionSize;
+        while (regionSize < bytes)
+            regionSize *= 2;
+        ULOG_INFO("Growing the stream buffer regions to %lld bytes", (long long)regionSize);
+
+        glFinish();
+        UDestroyStreamBuffer(stream);
+        UCreateStreamBuffer(regionSize, stream);
     }
 
-    glCompileShader(fragmentShaderId); // compile the fragment shader
-    // check for shader compile errors
-    glGetShaderiv(fragmentShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
-    {
-        glGetShaderInfoLog(fragmentShaderId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+    stream.region = (stream.region + 1) % STREAM_REGIONS;
+    stream.used = 0;
+    stream.reserved = bytes;
 
-        return false;
+    GLsync& fence = stream.fences[stream.region];
+    if (fence == 0)
+        return;
+
+    // Usually signaled long ago; when it is not, the CPU is STREAM_REGIONS frames ahead and has to wait
+    GLenum status = glClientWaitSync(fence, 0, 0);
+    if (status == GL_TIMEOUT_EXPIRED)
+    {
+        ++stream.stalls;
+        do
+            status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        while (status == GL_TIMEOUT_EXPIRED);
     }
+    glDeleteSync(fence);
+    fence = 0;
+}
 
-    // Attached compiled shaders to the shader program
-    glAttachShader(programId, vertexShaderId);
-    glAttachShader(programId, fragmentShaderId);
 
-    glLinkProgram(programId);   // links the shader program
-    // check for linking errors
-    glGetProgramiv(programId, GL_LINK_STATUS, &success);
-    if (!success)
-    {
-        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+// Bytes an allocation of size can take from a region, with the padding that aligns its start
+GLsizeiptr UStreamSpan(const GLStreamBuffer& stream, GLsizeiptr size)
+{
+    return stream.alignment - 1 + max<GLsizeiptr>(size, 1);
+}
 
-        return false;
+
+// Allocates size bytes from the current region; returns where to write them, offset is their place in the buffer
+void* UStreamAllocate(GLStreamBuffer& stream, GLsizeiptr size, GLintptr& offset)
+{
+    const GLsizeiptr start = (stream.used + stream.alignment - 1) / stream.alignment * stream.alignment;
+    if (!stream.mapped || start + size > stream.regionSize)
+    {
+        // UBeginStreamFrame was told less than the frame allocates, or could not grow the buffer
+        ULOG_WARNING("Stream buffer region overflow: %lld bytes requested, %lld free", (long long)size, (long long)(stream.regionSize - start));
+        offset = stream.region * stream.regionSize;
+        return nullptr;
     }
 
-    glUseProgram(programId);    // Uses the shader program
+    stream.used = start + size;
+    offset = stream.region * stream.regionSize + start;
+    return stream.mapped + offset;
+}
 
-    return true;
+
+// Copies data into the current region, returns its offset in the buffer. The allocation is at least allocationSize
+// bytes, for ranges bound larger than what is written, and never empty.
+GLintptr UStreamWrite(GLStreamBuffer& stream, const void* data, GLsizeiptr size, GLsizeiptr allocationSize)
+{
+    GLintptr offset;
+    void* destination = UStreamAllocate(stream, max<GLsizeiptr>(max(size, allocationSize), 1), offset);
+    if (destination && size > 0)
+        memcpy(destination, data, size);
+    return offset;
 }
 
 
-void UDestroyShaderProgram(GLuint programId)
+// Fences the current region after the frame's last command reading it
+void UEndStreamFrame(GLStreamBuffer& stream)
 {
-    glDeleteProgram(programId);
+    assert(stream.used <= stream.reserved);
+    stream.fences[stream.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+
+void UDestroyStreamBuffer(GLStreamBuffer& stream)
+{
+    for (GLsync& fence : stream.fences)
+    {
+        if (fence != 0)
+            glDeleteSync(fence);
+        fence = 0;
+    }
+
+    if (stream.buffer != 0)
+    {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, stream.buffer);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        glDeleteBuffers(1, &stream.buffer);
+    }
+    stream.buffer = 0;
+    stream.mapped = nullptr;
 }